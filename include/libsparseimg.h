@@ -0,0 +1,217 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Sparse images.
+ *
+ * Flash images are made of eraseblocks which are often only partially used,
+ * the rest of each eraseblock being erased (0xFF) space. A sparse image only
+ * stores the used part of each block. It starts with a header and a table of
+ * the used length of every block, and block N is stored at offset
+ * 'data_offs + N * blk_size' of the image file. Whatever follows the used
+ * part of a block in the file is not part of the image, the reader fills it
+ * in with the fill byte instead. On file systems which support holes, the
+ * unused parts do not take any space.
+ *
+ * Packed sparse images (format version 2) store the used parts of the blocks
+ * back to back instead, so the image file is small wherever it is copied to.
+ * Their blocks have to be written in order.
+ */
+
+#ifndef __LIBSPARSEIMG_H__
+#define __LIBSPARSEIMG_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sparse image magic ("SPIM") */
+#define SPARSE_IMG_MAGIC 0x5350494D
+
+/* Sparse image format version */
+#define SPARSE_IMG_VERSION 1
+
+/* Packed sparse image format version */
+#define SPARSE_IMG_PACKED_VERSION 2
+
+/* Blocks are stored in the image file at offsets aligned to this */
+#define SPARSE_IMG_ALIGN 4096
+
+/**
+ * struct sparse_img_hdr - sparse image header.
+ * @magic: sparse image magic (%SPARSE_IMG_MAGIC)
+ * @version: format version (%SPARSE_IMG_VERSION or %SPARSE_IMG_PACKED_VERSION)
+ * @blk_size: block size
+ * @blk_cnt: count of blocks in the image
+ * @data_offs: offset of the first block in the image file
+ * @fill: the byte the unused part of each block consists of
+ * @padding: reserved for future, zeroes
+ * @hdr_crc: CRC32 checksum of the header and the block length table
+ *
+ * The header is followed by the block length table which contains @blk_cnt
+ * 32-bit big endian numbers, one for each block. All fields are big endian.
+ */
+struct sparse_img_hdr {
+	__be32 magic;
+	__be32 version;
+	__be32 blk_size;
+	__be32 blk_cnt;
+	__be64 data_offs;
+	uint8_t fill;
+	uint8_t padding[3];
+	__be32 hdr_crc;
+} __attribute__((packed));
+
+/**
+ * struct sparse_img - sparse image description object.
+ * @fd: image file descriptor
+ * @blk_size: block size
+ * @blk_cnt: count of blocks in the image
+ * @max_blk_cnt: maximum count of blocks the image may contain
+ * @data_offs: offset of the first block in the image file
+ * @fill: the byte the unused part of each block consists of
+ * @packed: non-zero if this is a packed sparse image
+ * @lens: used length of each block
+ * @offs: offset of each block in the image file (packed images opened for
+ *        reading only)
+ * @pos: current position in the image file (packed images which are written
+ *       and images which are read as a stream only)
+ * @next_blk: next block to read (images which are read as a stream only)
+ */
+struct sparse_img {
+	int fd;
+	int blk_size;
+	int blk_cnt;
+	int max_blk_cnt;
+	off_t data_offs;
+	int fill;
+	int packed;
+	uint32_t *lens;
+	off_t *offs;
+	off_t pos;
+	int next_blk;
+};
+
+/**
+ * sparse_img_create - start writing a sparse image.
+ * @si: sparse image description object to initialize
+ * @fd: file descriptor of the (empty) image file
+ * @blk_size: block size
+ * @max_blk_cnt: maximum count of blocks which will be written
+ * @fill: the byte the unused part of each block consists of
+ * @packed: create a packed sparse image
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int sparse_img_create(struct sparse_img *si, int fd, int blk_size,
+		      int max_blk_cnt, int fill, int packed);
+
+/**
+ * sparse_img_write - write a block to a sparse image.
+ * @si: sparse image description object
+ * @blk: block number
+ * @buf: block contents
+ * @len: length of the data in @buf, the rest of the block is the fill byte
+ *
+ * Trailing fill bytes within @len are not stored either. Blocks may be
+ * written in any order and more than once, except in packed images, where
+ * each block has to come after the previously written one. Returns %0 in case
+ * of success and %-1 in case of failure.
+ */
+int sparse_img_write(struct sparse_img *si, int blk, const void *buf, int len);
+
+/**
+ * sparse_img_finish - finish writing a sparse image.
+ * @si: sparse image description object
+ *
+ * This function writes the header and the block length table, and frees the
+ * resources of @si. The image contains all blocks up to the last one which
+ * was written. Returns %0 in case of success and %-1 in case of failure.
+ */
+int sparse_img_finish(struct sparse_img *si);
+
+/**
+ * sparse_img_open - open a sparse image for reading.
+ * @si: sparse image description object to initialize
+ * @fd: image file descriptor
+ *
+ * Returns %1 if @fd is a sparse image, %0 if it is not, and %-1 in case of
+ * failure. The file offset of @fd is not changed.
+ */
+int sparse_img_open(struct sparse_img *si, int fd);
+
+/**
+ * sparse_img_open_stream - open a sparse image for reading it sequentially.
+ * @si: sparse image description object to initialize
+ * @fd: image file descriptor, e.g. a pipe
+ * @hdr: the header, which was already read from @fd
+ *
+ * This function is for images which cannot be read at random offsets. The
+ * caller reads the header to find out whether @fd is a sparse image at all,
+ * and this function reads the block length table which follows it. The
+ * blocks are then read with 'sparse_img_read_blk()'. Returns %0 in case of
+ * success and %-1 in case of failure.
+ */
+int sparse_img_open_stream(struct sparse_img *si, int fd,
+			   const struct sparse_img_hdr *hdr);
+
+/**
+ * sparse_img_read_blk - read the next block of a sparse image stream.
+ * @si: sparse image description object
+ * @blk: block number, greater than the one which was read before
+ * @buf: buffer of the block size to read to
+ *
+ * The unused part of the block is filled with the fill byte. Returns the used
+ * length of the block in case of success and %-1 in case of failure.
+ */
+int sparse_img_read_blk(struct sparse_img *si, int blk, void *buf);
+
+/**
+ * sparse_img_size - get the size of the data in a sparse image.
+ * @si: sparse image description object
+ */
+static inline long long sparse_img_size(const struct sparse_img *si)
+{
+	return (long long)si->blk_cnt * si->blk_size;
+}
+
+/**
+ * sparse_img_read - read data from a sparse image.
+ * @si: sparse image description object
+ * @buf: buffer to read to
+ * @len: how many bytes to read
+ * @offs: offset of the data in the image (not in the image file)
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int sparse_img_read(const struct sparse_img *si, void *buf, int len,
+		    long long offs);
+
+/**
+ * sparse_img_close - free the resources of a sparse image opened for reading.
+ * @si: sparse image description object
+ */
+void sparse_img_close(struct sparse_img *si);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !__LIBSPARSEIMG_H__ */
@@ -25,7 +25,10 @@
 #ifndef __LIBUBIGEN_H__
 #define __LIBUBIGEN_H__
 
+#include <sys/types.h>
 #include <stdint.h>
+#include <libsparseimg.h>
+#include <libiniparser.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -89,6 +92,23 @@ struct ubigen_vol_info
 	uint8_t flags;
 };
 
+/**
+ * struct ubigen_fm_vol - where a volume was written, for the fastmap.
+ * @vi: volume information
+ * @peb: physical eraseblock the first LEB of the volume was written to
+ * @bytes: size of the volume contents written in bytes
+ *
+ * The LEBs holding the @bytes of volume contents are written to consecutive
+ * physical eraseblocks starting at @peb, the rest of the LEBs reserved for the
+ * volume are unmapped.
+ */
+struct ubigen_fm_vol
+{
+	const struct ubigen_vol_info *vi;
+	int peb;
+	long long bytes;
+};
+
 /**
  * ubigen_info_init - initialize libubigen.
  * @ui: libubigen information
@@ -163,13 +183,55 @@ int ubigen_add_volume(const struct ubigen_info *ui,
  * @out: output file descriptor
  *
  * This function reads the contents of the volume from the input file @in and
- * writes the UBI volume to the output file @out. Returns zero on success and
- * %-1 on failure.
+ * writes the UBI volume to the output file @out. @in may be a pipe. If both
+ * files are regular files, the contents of dynamic volumes are copied with
+ * 'copy_file_range()' where the file-systems support it. Returns zero on
+ * success and %-1 on failure.
  */
 int ubigen_write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
 			long long bytes, int in, int out);
 
+/**
+ * ubigen_write_sparse_volume - write UBI volume from a sparse image.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @ec: erase counter value to put to EC headers
+ * @si: sparse image to read the volume contents from
+ * @out: output file descriptor
+ *
+ * This function is the same as 'ubigen_write_volume()', except that the
+ * contents of the volume are read from the sparse image @si, and the volume
+ * size is the size of the data in @si.
+ */
+int ubigen_write_sparse_volume(const struct ubigen_info *ui,
+			       const struct ubigen_vol_info *vi, long long ec,
+			       const struct sparse_img *si, int out);
+
+/**
+ * ubigen_write_volume_part - write a part of a UBI volume.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @ec: erase counter value to put to EC headers
+ * @lnum: first logical eraseblock to write
+ * @bytes: how many bytes of the volume contents to write
+ * @in: input file descriptor, not used if @si is not %NULL
+ * @si: sparse image to read the volume contents from, or %NULL
+ * @out: output file descriptor
+ * @offs: offset in @out to write the physical eraseblock of @lnum to
+ *
+ * This function writes @bytes of volume contents, starting with LEB @lnum,
+ * to the physical eraseblocks at offset @offs of @out. The contents are read
+ * at offset @lnum * @vi->usable_leb_size of @in, or of @si. The file positions
+ * of @in and @out are not used, so several parts of the same or of different
+ * volumes may be written at the same time by different threads. Returns zero
+ * on success and %-1 on failure.
+ */
+int ubigen_write_volume_part(const struct ubigen_info *ui,
+			     const struct ubigen_vol_info *vi, long long ec,
+			     int lnum, long long bytes, int in,
+			     const struct sparse_img *si, int out, off_t offs);
+
 /**
  * ubigen_write_layout_vol - write UBI layout volume
  * @ui: libubigen information
@@ -187,6 +249,81 @@ int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 			    long long ec1, long long ec2,
 			    struct ubi_vtbl_record *vtbl, int fd);
 
+/**
+ * ubigen_fastmap_pebs - calculate the size of the fastmap.
+ * @ui: libubigen information
+ * @peb_count: count of physical eraseblocks of the flash
+ *
+ * Returns the count of physical eraseblocks UBI uses for the fastmap of a
+ * flash with @peb_count physical eraseblocks, or %-1 if the fastmap does not
+ * fit %UBI_FM_MAX_BLOCKS eraseblocks.
+ */
+int ubigen_fastmap_pebs(const struct ubigen_info *ui, int peb_count);
+
+/**
+ * ubigen_write_fastmap - write UBI fastmap
+ * @ui: libubigen information
+ * @peb_count: count of physical eraseblocks of the flash
+ * @fm_peb: physical eraseblock number to write the fastmap to
+ * @peb1: physical eraseblock number of the first volume table copy
+ * @peb2: physical eraseblock number of the second volume table copy
+ * @ec: erase counter value for all physical eraseblocks
+ * @vols: the volumes of the image
+ * @vol_cnt: count of volumes in @vols
+ * @fd: output file descriptor
+ *
+ * This function writes a fastmap describing the layout volume at @peb1 and
+ * @peb2 and the volumes in @vols to the 'ubigen_fastmap_pebs()' physical
+ * eraseblocks starting at @fm_peb. All other physical eraseblocks up to
+ * @peb_count are recorded as free, so the rest of the flash has to be
+ * formatted, for example by ubiformat when it flashes the image. Returns zero
+ * in case of success and %-1 in case of failure.
+ */
+int ubigen_write_fastmap(const struct ubigen_info *ui, int peb_count,
+			 int fm_peb, int peb1, int peb2, long long ec,
+			 const struct ubigen_fm_vol *vols, int vol_cnt, int fd);
+
+/**
+ * ubigen_read_ini_section - read a volume description from a ubinize
+ *                           configuration file.
+ * @prog: name of the calling program, which prefixes the messages
+ * @ui: libubigen information
+ * @dict: the configuration file loaded with 'iniparser_load()'
+ * @sname: name of the section to read
+ * @vi: volume information is returned here
+ * @img: name of the volume image file is returned here, %NULL if the section
+ *       has no image
+ * @img_size: size of the data in the image file is returned here
+ * @img_sparse: whether the image file is a sparse image (the section has the
+ *              "image_type=sparse" key) is returned here
+ * @verbose: print the volume properties as they are read
+ *
+ * If @img is %NULL, the "image" key is not looked at, because the caller
+ * provides the contents of the volume. In this case @vi->bytes is zero if the
+ * section has no "vol_size" key.
+ *
+ * Returns zero if the section describes an UBI volume, %1 if it has to be
+ * skipped because it does not, and %-1 in case of failure.
+ */
+int ubigen_read_ini_section(const char *prog, const struct ubigen_info *ui,
+			    dictionary *dict, const char *sname,
+			    struct ubigen_vol_info *vi, const char **img,
+			    long long *img_size, int *img_sparse, int verbose);
+
+/**
+ * ubigen_check_ini_volume - check a volume against the preceding ones.
+ * @prog: name of the calling program, which prefixes the messages
+ * @vi: volumes read with 'ubigen_read_ini_section()'
+ * @n: index of the volume to check in @vi
+ * @sname: name of the section the volume was read from
+ *
+ * Makes sure volume IDs and names are unique, only one volume has the
+ * auto-resize flag and only static volumes have the skip-check flag. Returns
+ * zero if the volume is fine and %-1 if not.
+ */
+int ubigen_check_ini_volume(const char *prog, const struct ubigen_vol_info *vi,
+			    int n, const char *sname);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,404 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Reading and writing sparse images.
+ */
+
+#define PROGRAM_NAME "libsparseimg"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <mtd_swab.h>
+#include <libsparseimg.h>
+#include <crc32.h>
+#include "common.h"
+
+#define SPARSE_IMG_CRC32_INIT 0xFFFFFFFFU
+
+int sparse_img_create(struct sparse_img *si, int fd, int blk_size,
+		      int max_blk_cnt, int fill, int packed)
+{
+	if (blk_size <= 0 || max_blk_cnt <= 0) {
+		errno = EINVAL;
+		return errmsg("bad sparse image geometry");
+	}
+
+	si->lens = calloc(max_blk_cnt, sizeof(uint32_t));
+	if (!si->lens)
+		return sys_errmsg("cannot allocate %zu bytes of memory",
+				  max_blk_cnt * sizeof(uint32_t));
+
+	si->fd = fd;
+	si->blk_size = blk_size;
+	si->blk_cnt = 0;
+	si->max_blk_cnt = max_blk_cnt;
+	si->fill = fill;
+	si->packed = packed;
+	si->offs = NULL;
+	si->data_offs = sizeof(struct sparse_img_hdr);
+	si->data_offs += (off_t)max_blk_cnt * sizeof(uint32_t);
+	si->data_offs = round_up(si->data_offs, SPARSE_IMG_ALIGN);
+	si->pos = si->data_offs;
+	return 0;
+}
+
+int sparse_img_write(struct sparse_img *si, int blk, const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	off_t pos;
+
+	if (blk < 0 || blk >= si->max_blk_cnt || len < 0 ||
+	    len > si->blk_size || (si->packed && blk < si->blk_cnt)) {
+		errno = EINVAL;
+		return errmsg("bad block %d length %d", blk, len);
+	}
+
+	while (len && p[len - 1] == si->fill)
+		len -= 1;
+
+	if (si->packed)
+		pos = si->pos;
+	else
+		pos = si->data_offs + (off_t)blk * si->blk_size;
+	if (len && pwrite(si->fd, buf, len, pos) != len)
+		return sys_errmsg("cannot write %d bytes at offset %lld",
+				  len, (long long)pos);
+
+	si->pos = pos + len;
+	si->lens[blk] = len;
+	if (blk >= si->blk_cnt)
+		si->blk_cnt = blk + 1;
+	return 0;
+}
+
+int sparse_img_finish(struct sparse_img *si)
+{
+	struct sparse_img_hdr *hdr;
+	size_t sz = sizeof(struct sparse_img_hdr);
+	uint32_t crc, *tbl;
+	off_t end;
+	int i, err = -1;
+
+	sz += si->blk_cnt * sizeof(uint32_t);
+	hdr = calloc(1, sz);
+	if (!hdr) {
+		sys_errmsg("cannot allocate %zu bytes of memory", sz);
+		goto out;
+	}
+
+	tbl = (void *)(hdr + 1);
+	for (i = 0; i < si->blk_cnt; i++)
+		tbl[i] = cpu_to_be32(si->lens[i]);
+
+	hdr->magic = cpu_to_be32(SPARSE_IMG_MAGIC);
+	if (si->packed)
+		hdr->version = cpu_to_be32(SPARSE_IMG_PACKED_VERSION);
+	else
+		hdr->version = cpu_to_be32(SPARSE_IMG_VERSION);
+	hdr->blk_size = cpu_to_be32(si->blk_size);
+	hdr->blk_cnt = cpu_to_be32(si->blk_cnt);
+	hdr->data_offs = cpu_to_be64(si->data_offs);
+	hdr->fill = si->fill;
+	crc = mtd_crc32(SPARSE_IMG_CRC32_INIT, hdr,
+			offsetof(struct sparse_img_hdr, hdr_crc));
+	crc = mtd_crc32(crc, tbl, si->blk_cnt * sizeof(uint32_t));
+	hdr->hdr_crc = cpu_to_be32(crc);
+
+	if (pwrite(si->fd, hdr, sz, 0) != (ssize_t)sz) {
+		sys_errmsg("cannot write sparse image header");
+		goto out_free;
+	}
+
+	/* Drop anything which was written past the last block */
+	if (si->packed)
+		end = si->pos;
+	else {
+		end = si->data_offs;
+		if (si->blk_cnt)
+			end += (off_t)(si->blk_cnt - 1) * si->blk_size +
+			       si->lens[si->blk_cnt - 1];
+	}
+	if (ftruncate(si->fd, end)) {
+		sys_errmsg("cannot truncate the sparse image");
+		goto out_free;
+	}
+
+	err = 0;
+out_free:
+	free(hdr);
+out:
+	free(si->lens);
+	si->lens = NULL;
+	return err;
+}
+
+/*
+ * Check the header @hdr of a sparse image and initialize @si from it.
+ */
+static int parse_hdr(struct sparse_img *si, int fd,
+		     const struct sparse_img_hdr *hdr)
+{
+	uint32_t version = be32_to_cpu(hdr->version);
+
+	if (version != SPARSE_IMG_VERSION &&
+	    version != SPARSE_IMG_PACKED_VERSION)
+		return errmsg("unsupported sparse image version %u", version);
+
+	si->fd = fd;
+	si->blk_size = be32_to_cpu(hdr->blk_size);
+	si->blk_cnt = be32_to_cpu(hdr->blk_cnt);
+	si->max_blk_cnt = si->blk_cnt;
+	si->data_offs = be64_to_cpu(hdr->data_offs);
+	si->fill = hdr->fill;
+	si->packed = version == SPARSE_IMG_PACKED_VERSION;
+	si->lens = NULL;
+	si->offs = NULL;
+	si->pos = 0;
+	if (si->blk_size <= 0 || si->blk_cnt < 0 ||
+	    si->data_offs < (off_t)(sizeof(struct sparse_img_hdr) +
+				    si->blk_cnt * sizeof(uint32_t)))
+		return errmsg("bad sparse image geometry");
+
+	return 0;
+}
+
+/*
+ * Check the block length table @si->lens, which was read from the image file,
+ * and convert it to the CPU byte order.
+ */
+static int check_table(struct sparse_img *si, const struct sparse_img_hdr *hdr)
+{
+	size_t sz = si->blk_cnt * sizeof(uint32_t);
+	uint32_t crc;
+	int i;
+
+	crc = mtd_crc32(SPARSE_IMG_CRC32_INIT, hdr,
+			offsetof(struct sparse_img_hdr, hdr_crc));
+	crc = mtd_crc32(crc, si->lens, sz);
+	if (crc != be32_to_cpu(hdr->hdr_crc))
+		return errmsg("bad sparse image header CRC %#08x, calculated %#08x",
+			      be32_to_cpu(hdr->hdr_crc), crc);
+
+	for (i = 0; i < si->blk_cnt; i++) {
+		si->lens[i] = be32_to_cpu(si->lens[i]);
+		if (si->lens[i] > (uint32_t)si->blk_size)
+			return errmsg("bad length %u of block %d", si->lens[i], i);
+	}
+
+	return 0;
+}
+
+int sparse_img_open(struct sparse_img *si, int fd)
+{
+	struct sparse_img_hdr hdr;
+	struct stat st;
+	off_t pos;
+	size_t sz;
+	int i;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return 0;
+	if (be32_to_cpu(hdr.magic) != SPARSE_IMG_MAGIC)
+		return 0;
+
+	if (parse_hdr(si, fd, &hdr))
+		return -1;
+
+	/* The block length table has to fit into the file */
+	if (fstat(fd, &st))
+		return sys_errmsg("cannot stat the sparse image");
+	if (S_ISREG(st.st_mode) && si->data_offs > st.st_size)
+		return errmsg("sparse image is truncated, %d blocks do not fit into %lld bytes",
+			      si->blk_cnt, (long long)st.st_size);
+
+	sz = si->blk_cnt * sizeof(uint32_t);
+	si->lens = malloc(sz);
+	if (!si->lens)
+		return sys_errmsg("cannot allocate %zu bytes of memory", sz);
+
+	if (pread(fd, si->lens, sz, sizeof(hdr)) != (ssize_t)sz) {
+		sys_errmsg("cannot read the sparse image block table");
+		goto out_free;
+	}
+
+	if (check_table(si, &hdr))
+		goto out_free;
+
+	if (si->packed) {
+		si->offs = malloc(si->blk_cnt * sizeof(off_t));
+		if (!si->offs) {
+			sys_errmsg("cannot allocate %zu bytes of memory",
+				   si->blk_cnt * sizeof(off_t));
+			goto out_free;
+		}
+
+		pos = si->data_offs;
+		for (i = 0; i < si->blk_cnt; i++) {
+			si->offs[i] = pos;
+			pos += si->lens[i];
+		}
+	}
+
+	return 1;
+
+out_free:
+	sparse_img_close(si);
+	return -1;
+}
+
+/*
+ * Read exactly @len bytes from the sparse image stream, or skip them if @buf
+ * is %NULL.
+ */
+static int read_stream(struct sparse_img *si, void *buf, off_t len)
+{
+	char skip[4096], *p = buf;
+
+	while (len) {
+		size_t l = len;
+		ssize_t rd;
+
+		if (!buf && l > sizeof(skip))
+			l = sizeof(skip);
+		rd = read(si->fd, buf ? p : skip, l);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return sys_errmsg("cannot read the sparse image at offset %lld",
+					  (long long)si->pos);
+		}
+		if (rd == 0)
+			return errmsg("unexpected end of the sparse image at offset %lld",
+				      (long long)si->pos);
+
+		if (buf)
+			p += rd;
+		si->pos += rd;
+		len -= rd;
+	}
+
+	return 0;
+}
+
+int sparse_img_open_stream(struct sparse_img *si, int fd,
+			   const struct sparse_img_hdr *hdr)
+{
+	size_t sz;
+
+	if (parse_hdr(si, fd, hdr))
+		return -1;
+	si->pos = sizeof(*hdr);
+
+	sz = si->blk_cnt * sizeof(uint32_t);
+	si->lens = malloc(sz);
+	if (!si->lens)
+		return sys_errmsg("cannot allocate %zu bytes of memory", sz);
+
+	if (read_stream(si, si->lens, sz) || check_table(si, hdr) ||
+	    read_stream(si, NULL, si->data_offs - si->pos)) {
+		sparse_img_close(si);
+		return -1;
+	}
+
+	si->next_blk = 0;
+	return 0;
+}
+
+int sparse_img_read_blk(struct sparse_img *si, int blk, void *buf)
+{
+	int len;
+	off_t pos;
+
+	if (blk < si->next_blk || blk >= si->blk_cnt) {
+		errno = EINVAL;
+		return errmsg("cannot read block %d of the sparse image", blk);
+	}
+
+	if (si->packed) {
+		pos = si->pos;
+		while (si->next_blk < blk)
+			pos += si->lens[si->next_blk++];
+	} else
+		pos = si->data_offs + (off_t)blk * si->blk_size;
+
+	len = si->lens[blk];
+	if (read_stream(si, NULL, pos - si->pos) || read_stream(si, buf, len))
+		return -1;
+	memset((char *)buf + len, si->fill, si->blk_size - len);
+
+	si->next_blk = blk + 1;
+	return len;
+}
+
+int sparse_img_read(const struct sparse_img *si, void *buf, int len,
+		    long long offs)
+{
+	char *p = buf;
+
+	if (offs < 0 || offs + len > sparse_img_size(si)) {
+		errno = EINVAL;
+		return errmsg("cannot read %d bytes at offset %lld, image size is %lld",
+			      len, offs, sparse_img_size(si));
+	}
+
+	while (len) {
+		int blk = offs / si->blk_size;
+		int blk_offs = offs % si->blk_size;
+		int l = si->blk_size - blk_offs;
+		int stored = 0;
+
+		if (l > len)
+			l = len;
+
+		/* The part of the block which is stored in the file */
+		if ((uint32_t)blk_offs < si->lens[blk]) {
+			off_t pos;
+
+			stored = si->lens[blk] - blk_offs;
+			if (stored > l)
+				stored = l;
+			if (si->offs)
+				pos = si->offs[blk] + blk_offs;
+			else
+				pos = si->data_offs +
+				      (off_t)blk * si->blk_size + blk_offs;
+			if (pread(si->fd, p, stored, pos) != stored)
+				return sys_errmsg("cannot read %d bytes at offset %lld",
+						  stored, (long long)pos);
+		}
+		memset(p + stored, si->fill, l - stored);
+
+		p += l;
+		offs += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+void sparse_img_close(struct sparse_img *si)
+{
+	free(si->lens);
+	free(si->offs);
+	si->lens = NULL;
+	si->offs = NULL;
+}
@@ -30,8 +30,11 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <mtd/ubi-media.h>
+#include <mtd/ubi-user.h>
 #include <mtd_swab.h>
 #include <libubigen.h>
 #include <crc32.h>
@@ -168,12 +171,215 @@ void ubigen_init_vid_hdr(const struct ubigen_info *ui,
 	hdr->hdr_crc = cpu_to_be32(crc);
 }
 
-int ubigen_write_volume(const struct ubigen_info *ui,
+/*
+ * Volumes are written in batches of up to %WRITE_BATCH_PEBS physical
+ * eraseblocks, but not more than %WRITE_BATCH_SIZE bytes, with one 'writev()'
+ * call per batch.
+ */
+#define WRITE_BATCH_PEBS 64
+#define WRITE_BATCH_SIZE (4 * 1024 * 1024)
+
+/*
+ * Read exactly @len bytes from @fd, at offset *@pos if @pos is not %NULL, and
+ * from the current position otherwise. Reads from pipes may return less than
+ * asked for.
+ */
+static int read_all(int fd, char *buf, int len, off_t *pos)
+{
+	while (len) {
+		ssize_t rd;
+
+		if (pos)
+			rd = pread(fd, buf, len, *pos);
+		else
+			rd = read(fd, buf, len);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return sys_errmsg("cannot read %d bytes from the input file",
+					  len);
+		}
+		if (rd == 0)
+			return errmsg("unexpected end of the input file, %d bytes missing",
+				      len);
+
+		if (pos)
+			*pos += rd;
+		buf += rd;
+		len -= rd;
+	}
+
+	return 0;
+}
+
+/*
+ * Write all @cnt buffers of @iov to @fd, at offset *@pos if @pos is not %NULL,
+ * and at the current position otherwise. @iov is modified.
+ */
+static int writev_all(int fd, struct iovec *iov, int cnt, off_t *pos)
+{
+	while (cnt) {
+		ssize_t wr;
+
+		if (pos)
+			wr = pwritev(fd, iov, cnt, *pos);
+		else
+			wr = writev(fd, iov, cnt);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return sys_errmsg("cannot write to the output file");
+		}
+
+		if (pos)
+			*pos += wr;
+		while (cnt && (size_t)wr >= iov->iov_len) {
+			wr -= iov->iov_len;
+			iov += 1;
+			cnt -= 1;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + wr;
+			iov->iov_len -= wr;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * struct vol_part - a part of a volume to write.
+ * @lnum: first LEB to write
+ * @bytes: count of bytes of the volume contents to write
+ * @in: input file descriptor
+ * @in_pos: offset in @in to read the contents from, or %-1 to read them from
+ *          the current position of @in
+ * @si: sparse image to read the contents from instead of @in, if not %NULL
+ * @out: output file descriptor
+ * @out_pos: offset in @out to write the physical eraseblock of @lnum to, or
+ *           %-1 to write it to the current position of @out
+ */
+struct vol_part {
+	int lnum;
+	long long bytes;
+	int in;
+	off_t in_pos;
+	const struct sparse_img *si;
+	int out;
+	off_t out_pos;
+};
+
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Copy the contents of a dynamic volume from the regular file @in to the
+ * regular file @out with 'copy_file_range()', so that the data does not go
+ * through user space and file-systems supporting it may share the data
+ * blocks. Only the headers and the 0xFF padding are written. @peb contains
+ * the EC header, @ffs is a LEB of 0xFF bytes.
+ *
+ * Returns %0 if the volume was written, %1 if 'copy_file_range()' cannot be
+ * used and nothing was written, and %-1 in case of failure.
+ */
+static int copy_volume(const struct ubigen_info *ui,
+		       const struct ubigen_vol_info *vi, char *peb,
+		       const char *ffs, const struct vol_part *part)
+{
+	long long bytes = part->bytes;
+	int lnum = part->lnum, tail = 0, copied = 0;
+	off_t out_pos = part->out_pos;
+	loff_t in_off = part->in_pos, out_off;
+	struct stat st;
+
+	if (fstat(part->in, &st) || !S_ISREG(st.st_mode) ||
+	    fstat(part->out, &st) || !S_ISREG(st.st_mode))
+		return 1;
+
+	while (bytes) {
+		int len = vi->usable_leb_size, cnt = 0;
+		struct iovec iov[2];
+
+		if (bytes < len)
+			len = bytes;
+
+		/* The padding of the previous PEB goes with the headers */
+		if (tail) {
+			iov[cnt].iov_base = (void *)ffs;
+			iov[cnt++].iov_len = tail;
+		}
+		ubigen_init_vid_hdr(ui, vi,
+				    (struct ubi_vid_hdr *)(peb + ui->vid_hdr_offs),
+				    lnum, NULL, 0);
+		iov[cnt].iov_base = peb;
+		iov[cnt++].iov_len = ui->data_offs;
+		if (writev_all(part->out, iov, cnt,
+			       part->out_pos == -1 ? NULL : &out_pos))
+			return -1;
+		tail = ui->leb_size - len;
+		out_off = out_pos;
+
+		while (len) {
+			ssize_t ret;
+
+			ret = copy_file_range(part->in,
+					      part->in_pos == -1 ? NULL : &in_off,
+					      part->out,
+					      part->out_pos == -1 ? NULL : &out_off,
+					      len, 0);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (!copied &&
+				    (errno == EXDEV || errno == EINVAL ||
+				     errno == ENOSYS || errno == EOPNOTSUPP ||
+				     errno == EBADF)) {
+					/* Nothing copied, drop the headers */
+					if (part->out_pos == -1 &&
+					    lseek(part->out, -(off_t)ui->data_offs,
+						  SEEK_CUR) == -1)
+						return sys_errmsg("cannot seek the output file");
+					return 1;
+				}
+				return sys_errmsg("cannot copy %d bytes from the input file",
+						  len);
+			}
+			if (ret == 0)
+				return errmsg("unexpected end of the input file, %d bytes missing",
+					      len);
+			len -= ret;
+			copied = 1;
+		}
+		out_pos = out_off;
+
+		bytes -= vi->usable_leb_size < bytes ? vi->usable_leb_size : bytes;
+		lnum += 1;
+	}
+
+	if (tail) {
+		struct iovec iov = { .iov_base = (void *)ffs, .iov_len = tail };
+
+		if (writev_all(part->out, &iov, 1,
+			       part->out_pos == -1 ? NULL : &out_pos))
+			return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ * Write a part of a volume. The contents of each LEB are read directly into
+ * the PEB buffer behind the headers, and the 0xFF padding after them is
+ * written from a LEB of 0xFF bytes shared by all PEBs.
+ */
+static int write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
-			long long bytes, int in, int out)
+			const struct vol_part *part)
 {
-	int len = vi->usable_leb_size, rd, lnum = 0;
-	char *inbuf, *outbuf;
+	int len = vi->usable_leb_size, lnum = part->lnum, batch, i;
+	long long bytes = part->bytes, lebs;
+	off_t in_pos = part->in_pos, out_pos = part->out_pos;
+	char *bufs, *ffs;
+	struct iovec *iov;
 
 	if (vi->id >= ui->max_volumes) {
 		errmsg("too high volume id %d, max. volumes is %d",
@@ -189,64 +395,152 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 		return -1;
 	}
 
-	inbuf = malloc(ui->leb_size);
-	if (!inbuf)
-		return sys_errmsg("cannot allocate %d bytes of memory",
-				  ui->leb_size);
-	outbuf = malloc(ui->peb_size);
-	if (!outbuf) {
-		sys_errmsg("cannot allocate %d bytes of memory", ui->peb_size);
+	batch = WRITE_BATCH_SIZE / ui->peb_size;
+	if (batch > WRITE_BATCH_PEBS)
+		batch = WRITE_BATCH_PEBS;
+	lebs = (bytes + len - 1) / len;
+	if (batch > lebs)
+		batch = lebs;
+	if (batch < 1)
+		batch = 1;
+
+	bufs = malloc((size_t)batch * ui->peb_size);
+	if (!bufs)
+		return sys_errmsg("cannot allocate %zu bytes of memory",
+				  (size_t)batch * ui->peb_size);
+	ffs = malloc(ui->leb_size);
+	if (!ffs) {
+		sys_errmsg("cannot allocate %d bytes of memory", ui->leb_size);
 		goto out_free;
 	}
+	iov = malloc(2 * batch * sizeof(struct iovec));
+	if (!iov) {
+		sys_errmsg("cannot allocate memory");
+		goto out_free1;
+	}
 
-	memset(outbuf, 0xFF, ui->data_offs);
-	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec);
+	memset(ffs, 0xFF, ui->leb_size);
+	for (i = 0; i < batch; i++) {
+		char *peb = bufs + (size_t)i * ui->peb_size;
 
-	while (bytes) {
-		int l;
-		struct ubi_vid_hdr *vid_hdr;
-
-		if (bytes < len)
-			len = bytes;
-		bytes -= len;
-
-		l = len;
-		do {
-			rd = read(in, inbuf + len - l, l);
-			if (rd != l) {
-				sys_errmsg("cannot read %d bytes from the input file", l);
-				goto out_free1;
-			}
+		memset(peb, 0xFF, ui->data_offs);
+		ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)peb, ec);
+	}
 
-			l -= rd;
-		} while (l);
+#ifdef HAVE_COPY_FILE_RANGE
+	if (!part->si && vi->type == UBI_VID_DYNAMIC && bytes) {
+		int err = copy_volume(ui, vi, bufs, ffs, part);
 
-		vid_hdr = (struct ubi_vid_hdr *)(&outbuf[ui->vid_hdr_offs]);
-		ubigen_init_vid_hdr(ui, vi, vid_hdr, lnum, inbuf, len);
+		if (err != 1) {
+			free(iov);
+			free(ffs);
+			free(bufs);
+			return err;
+		}
+	}
+#endif
 
-		memcpy(outbuf + ui->data_offs, inbuf, len);
-		memset(outbuf + ui->data_offs + len, 0xFF,
-		       ui->peb_size - ui->data_offs - len);
+	while (bytes) {
+		int cnt = 0;
+
+		for (i = 0; i < batch && bytes; i++) {
+			char *peb = bufs + (size_t)i * ui->peb_size;
+			char *data = peb + ui->data_offs;
+			struct ubi_vid_hdr *vid_hdr;
+
+			if (bytes < len)
+				len = bytes;
+			bytes -= len;
+
+			if (part->si) {
+				if (sparse_img_read(part->si, data, len,
+						    (long long)lnum * vi->usable_leb_size))
+					goto out_free2;
+			} else if (read_all(part->in, data, len,
+					    part->in_pos == -1 ? NULL : &in_pos))
+				goto out_free2;
+
+			vid_hdr = (struct ubi_vid_hdr *)(peb + ui->vid_hdr_offs);
+			ubigen_init_vid_hdr(ui, vi, vid_hdr, lnum, data, len);
+
+			iov[cnt].iov_base = peb;
+			iov[cnt++].iov_len = ui->data_offs + len;
+			if (len < ui->leb_size) {
+				iov[cnt].iov_base = ffs;
+				iov[cnt++].iov_len = ui->leb_size - len;
+			}
 
-		if (write(out, outbuf, ui->peb_size) != ui->peb_size) {
-			sys_errmsg("cannot write %d bytes to the output file", ui->peb_size);
-			goto out_free1;
+			lnum += 1;
 		}
 
-		lnum += 1;
+		if (writev_all(part->out, iov, cnt,
+			       part->out_pos == -1 ? NULL : &out_pos))
+			goto out_free2;
 	}
 
-	free(outbuf);
-	free(inbuf);
+	free(iov);
+	free(ffs);
+	free(bufs);
 	return 0;
 
+out_free2:
+	free(iov);
 out_free1:
-	free(outbuf);
+	free(ffs);
 out_free:
-	free(inbuf);
+	free(bufs);
 	return -1;
 }
 
+int ubigen_write_volume(const struct ubigen_info *ui,
+			const struct ubigen_vol_info *vi, long long ec,
+			long long bytes, int in, int out)
+{
+	struct vol_part part = {
+		.bytes = bytes,
+		.in = in,
+		.in_pos = -1,
+		.out = out,
+		.out_pos = -1,
+	};
+
+	return write_volume(ui, vi, ec, &part);
+}
+
+int ubigen_write_sparse_volume(const struct ubigen_info *ui,
+			       const struct ubigen_vol_info *vi, long long ec,
+			       const struct sparse_img *si, int out)
+{
+	struct vol_part part = {
+		.bytes = sparse_img_size(si),
+		.in = -1,
+		.in_pos = -1,
+		.si = si,
+		.out = out,
+		.out_pos = -1,
+	};
+
+	return write_volume(ui, vi, ec, &part);
+}
+
+int ubigen_write_volume_part(const struct ubigen_info *ui,
+			     const struct ubigen_vol_info *vi, long long ec,
+			     int lnum, long long bytes, int in,
+			     const struct sparse_img *si, int out, off_t offs)
+{
+	struct vol_part part = {
+		.lnum = lnum,
+		.bytes = bytes,
+		.in = in,
+		.in_pos = (off_t)lnum * vi->usable_leb_size,
+		.si = si,
+		.out = out,
+		.out_pos = offs,
+	};
+
+	return write_volume(ui, vi, ec, &part);
+}
+
 int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 			    long long ec1, long long ec2,
 			    struct ubi_vtbl_record *vtbl, int fd)
@@ -313,3 +607,303 @@ out_free:
 	free(outbuf);
 	return -1;
 }
+
+/*
+ * UBI refuses to attach from a fastmap unless its size matches the size UBI
+ * calculates for the flash, so use the same formula.
+ */
+int ubigen_fastmap_pebs(const struct ubigen_info *ui, int peb_count)
+{
+	long long size;
+
+	size = sizeof(struct ubi_fm_sb) + sizeof(struct ubi_fm_hdr) +
+	       2 * sizeof(struct ubi_fm_scan_pool) +
+	       (long long)peb_count * sizeof(struct ubi_fm_ec) +
+	       (sizeof(struct ubi_fm_eba) + sizeof(struct ubi_fm_volhdr)) *
+	       (UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT) +
+	       (long long)peb_count * sizeof(__be32);
+	size = (size + ui->leb_size - 1) / ui->leb_size;
+	if (size > UBI_FM_MAX_BLOCKS)
+		return -1;
+	return size;
+}
+
+/* States of physical eraseblocks while the fastmap is created */
+enum {
+	FM_PEB_FREE = 0,
+	FM_PEB_USED,
+	FM_PEB_FASTMAP,
+};
+
+static int fm_mark_peb(char *map, int peb_count, int peb, int state)
+{
+	if (peb < 0 || peb >= peb_count)
+		return errmsg("eraseblock %d is beyond the end of the flash (%d eraseblocks)",
+			      peb, peb_count);
+	if (map[peb] != FM_PEB_FREE)
+		return errmsg("eraseblock %d is used twice", peb);
+	map[peb] = state;
+	return 0;
+}
+
+/*
+ * Add the volume header and the EBA table of a volume to the fastmap data at
+ * @pos and advance @pos. The first @lebs LEBs are mapped to consecutive
+ * physical eraseblocks starting at @peb. Returns the EBA table.
+ */
+static struct ubi_fm_eba *fm_add_volume(char *fm_raw, size_t *pos, int vol_id,
+					int vol_type, int data_pad,
+					int used_ebs, int last_eb_bytes,
+					int reserved_pebs, int peb, int lebs)
+{
+	struct ubi_fm_volhdr *fvh;
+	struct ubi_fm_eba *feba;
+	int i;
+
+	fvh = (struct ubi_fm_volhdr *)(fm_raw + *pos);
+	*pos += sizeof(struct ubi_fm_volhdr);
+	fvh->magic = cpu_to_be32(UBI_FM_VHDR_MAGIC);
+	fvh->vol_id = cpu_to_be32(vol_id);
+	fvh->vol_type = vol_type;
+	fvh->data_pad = cpu_to_be32(data_pad);
+	fvh->used_ebs = cpu_to_be32(used_ebs);
+	fvh->last_eb_bytes = cpu_to_be32(last_eb_bytes);
+
+	feba = (struct ubi_fm_eba *)(fm_raw + *pos);
+	*pos += sizeof(struct ubi_fm_eba) + reserved_pebs * sizeof(__be32);
+	feba->magic = cpu_to_be32(UBI_FM_EBA_MAGIC);
+	feba->reserved_pebs = cpu_to_be32(reserved_pebs);
+	for (i = 0; i < reserved_pebs; i++)
+		feba->pnum[i] = cpu_to_be32(i < lebs ? peb + i : -1);
+
+	return feba;
+}
+
+int ubigen_write_fastmap(const struct ubigen_info *ui, int peb_count,
+			 int fm_peb, int peb1, int peb2, long long ec,
+			 const struct ubigen_fm_vol *vols, int vol_cnt, int fd)
+{
+	int fm_pebs, fm_size, pool_size, reserved, i, j, cnt;
+	struct ubigen_vol_info fm_vi;
+	struct ubi_fm_sb *fmsb;
+	struct ubi_fm_hdr *fmh;
+	struct ubi_fm_scan_pool *fmpl;
+	struct ubi_fm_ec *fec;
+	struct ubi_fm_eba *feba;
+	struct ubi_vid_hdr *vid_hdr;
+	char *map, *fm_raw, *outbuf;
+	size_t pos;
+	uint32_t crc;
+	off_t seek;
+
+	if (peb_count <= UBI_FM_MAX_START) {
+		errmsg("UBI needs more than %d eraseblocks for a fastmap",
+		       UBI_FM_MAX_START);
+		errno = EINVAL;
+		return -1;
+	}
+
+	fm_pebs = ubigen_fastmap_pebs(ui, peb_count);
+	if (fm_pebs < 0) {
+		errmsg("the fastmap of %d eraseblocks does not fit %d eraseblocks",
+		       peb_count, UBI_FM_MAX_BLOCKS);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fm_peb < 0 || fm_peb + fm_pebs > UBI_FM_MAX_START) {
+		errmsg("the fastmap has to be within the first %d eraseblocks",
+		       UBI_FM_MAX_START);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = calloc(1, peb_count);
+	if (!map)
+		return sys_errmsg("cannot allocate %d bytes of memory", peb_count);
+
+	/* Find out which eraseblocks are used and check they all fit */
+	reserved = UBI_LAYOUT_VOLUME_EBS;
+	if (fm_mark_peb(map, peb_count, peb1, FM_PEB_USED) ||
+	    fm_mark_peb(map, peb_count, peb2, FM_PEB_USED))
+		goto out_map;
+	for (i = 0; i < fm_pebs; i++)
+		if (fm_mark_peb(map, peb_count, fm_peb + i, FM_PEB_FASTMAP))
+			goto out_map;
+	for (i = 0; i < vol_cnt; i++) {
+		const struct ubigen_vol_info *vi = vols[i].vi;
+		int lebs = (vols[i].bytes + vi->usable_leb_size - 1) /
+			   vi->usable_leb_size;
+
+		for (j = 0; j < lebs; j++)
+			if (fm_mark_peb(map, peb_count, vols[i].peb + j,
+					FM_PEB_USED))
+				goto out_map;
+		reserved += (vi->bytes + ui->leb_size - 1) / ui->leb_size;
+	}
+
+	if (reserved > peb_count - fm_pebs) {
+		errmsg("volumes reserve %d eraseblocks, but only %d are available",
+		       reserved, peb_count - fm_pebs);
+		errno = EINVAL;
+		goto out_map;
+	}
+
+	fm_size = fm_pebs * ui->leb_size;
+	fm_raw = calloc(1, fm_size);
+	if (!fm_raw) {
+		sys_errmsg("cannot allocate %d bytes of memory", fm_size);
+		goto out_map;
+	}
+
+	fmsb = (struct ubi_fm_sb *)fm_raw;
+	pos = sizeof(struct ubi_fm_sb);
+	fmsb->magic = cpu_to_be32(UBI_FM_SB_MAGIC);
+	fmsb->version = UBI_FM_FMT_VERSION;
+	fmsb->used_blocks = cpu_to_be32(fm_pebs);
+	for (i = 0; i < fm_pebs; i++) {
+		fmsb->block_loc[i] = cpu_to_be32(fm_peb + i);
+		fmsb->block_ec[i] = cpu_to_be32(ec);
+	}
+
+	fmh = (struct ubi_fm_hdr *)(fm_raw + pos);
+	pos += sizeof(struct ubi_fm_hdr);
+	fmh->magic = cpu_to_be32(UBI_FM_HDR_MAGIC);
+	fmh->vol_count = cpu_to_be32(vol_cnt + 1);
+
+	/*
+	 * Nothing is written after the fastmap, so the pools are empty. Their
+	 * maximum sizes are the ones UBI picks for the flash.
+	 */
+	pool_size = peb_count / 100 * 5;
+	if (pool_size > UBI_FM_MAX_POOL_SIZE)
+		pool_size = UBI_FM_MAX_POOL_SIZE;
+	if (pool_size < UBI_FM_MIN_POOL_SIZE)
+		pool_size = UBI_FM_MIN_POOL_SIZE;
+
+	fmpl = (struct ubi_fm_scan_pool *)(fm_raw + pos);
+	pos += sizeof(struct ubi_fm_scan_pool);
+	fmpl->magic = cpu_to_be32(UBI_FM_POOL_MAGIC);
+	fmpl->max_size = cpu_to_be16(pool_size);
+
+	fmpl = (struct ubi_fm_scan_pool *)(fm_raw + pos);
+	pos += sizeof(struct ubi_fm_scan_pool);
+	fmpl->magic = cpu_to_be32(UBI_FM_POOL_MAGIC);
+	fmpl->max_size = cpu_to_be16(pool_size / 2);
+
+	/* The free eraseblocks come first, then the used ones */
+	for (cnt = i = 0; i < peb_count; i++) {
+		if (map[i] != FM_PEB_FREE)
+			continue;
+		fec = (struct ubi_fm_ec *)(fm_raw + pos);
+		pos += sizeof(struct ubi_fm_ec);
+		fec->pnum = cpu_to_be32(i);
+		fec->ec = cpu_to_be32(ec);
+		cnt += 1;
+	}
+	fmh->free_peb_count = cpu_to_be32(cnt);
+
+	for (cnt = i = 0; i < peb_count; i++) {
+		if (map[i] != FM_PEB_USED)
+			continue;
+		fec = (struct ubi_fm_ec *)(fm_raw + pos);
+		pos += sizeof(struct ubi_fm_ec);
+		fec->pnum = cpu_to_be32(i);
+		fec->ec = cpu_to_be32(ec);
+		cnt += 1;
+	}
+	fmh->used_peb_count = cpu_to_be32(cnt);
+
+	/*
+	 * Dynamic volumes use all their LEBs, static volumes only the ones
+	 * holding data.
+	 */
+	for (i = 0; i < vol_cnt; i++) {
+		const struct ubigen_vol_info *vi = vols[i].vi;
+		int lebs = (vols[i].bytes + vi->usable_leb_size - 1) /
+			   vi->usable_leb_size;
+		int reserved_pebs = (vi->bytes + ui->leb_size - 1) / ui->leb_size;
+		int last_eb_bytes = 0;
+
+		if (vi->type == UBI_VID_DYNAMIC)
+			fm_add_volume(fm_raw, &pos, vi->id, UBI_DYNAMIC_VOLUME,
+				      vi->data_pad, reserved_pebs,
+				      vi->usable_leb_size, reserved_pebs,
+				      vols[i].peb, lebs);
+		else {
+			if (lebs)
+				last_eb_bytes = vols[i].bytes -
+					(long long)(lebs - 1) * vi->usable_leb_size;
+			fm_add_volume(fm_raw, &pos, vi->id, UBI_STATIC_VOLUME,
+				      vi->data_pad, lebs, last_eb_bytes,
+				      reserved_pebs, vols[i].peb, lebs);
+		}
+	}
+
+	/*
+	 * UBI records the count of eraseblocks of the layout volume as the
+	 * bytes used in its last eraseblock, do the same.
+	 */
+	feba = fm_add_volume(fm_raw, &pos, UBI_LAYOUT_VOLUME_ID,
+			     UBI_DYNAMIC_VOLUME, 0, UBI_LAYOUT_VOLUME_EBS,
+			     UBI_LAYOUT_VOLUME_EBS, UBI_LAYOUT_VOLUME_EBS,
+			     peb1, 1);
+	feba->pnum[1] = cpu_to_be32(peb2);
+
+	crc = mtd_crc32(UBI_CRC32_INIT, fm_raw, fm_size);
+	fmsb->data_crc = cpu_to_be32(crc);
+
+	outbuf = malloc(ui->peb_size);
+	if (!outbuf) {
+		sys_errmsg("cannot allocate %d bytes of memory", ui->peb_size);
+		goto out_raw;
+	}
+
+	memset(&fm_vi, 0, sizeof(struct ubigen_vol_info));
+	fm_vi.type = UBI_VID_DYNAMIC;
+	fm_vi.compat = UBI_COMPAT_DELETE;
+
+	memset(outbuf, 0xFF, ui->data_offs);
+	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec);
+	vid_hdr = (struct ubi_vid_hdr *)(&outbuf[ui->vid_hdr_offs]);
+
+	for (i = 0; i < fm_pebs; i++) {
+		fm_vi.id = i ? UBI_FM_DATA_VOLUME_ID : UBI_FM_SB_VOLUME_ID;
+		ubigen_init_vid_hdr(ui, &fm_vi, vid_hdr, i, NULL, 0);
+
+		/*
+		 * UBI takes the highest sequence number of the fastmap
+		 * eraseblocks as the highest one on the flash. The volumes
+		 * are written with sequence number 0.
+		 */
+		vid_hdr->sqnum = cpu_to_be64(i + 1);
+		crc = mtd_crc32(UBI_CRC32_INIT, vid_hdr, UBI_VID_HDR_SIZE_CRC);
+		vid_hdr->hdr_crc = cpu_to_be32(crc);
+
+		memcpy(outbuf + ui->data_offs, fm_raw + i * ui->leb_size,
+		       ui->leb_size);
+
+		seek = (off_t)(fm_peb + i) * ui->peb_size;
+		if (lseek(fd, seek, SEEK_SET) != seek) {
+			sys_errmsg("cannot seek output file");
+			goto out_free;
+		}
+		if (write(fd, outbuf, ui->peb_size) != ui->peb_size) {
+			sys_errmsg("cannot write %d bytes", ui->peb_size);
+			goto out_free;
+		}
+	}
+
+	free(outbuf);
+	free(fm_raw);
+	free(map);
+	return 0;
+
+out_free:
+	free(outbuf);
+out_raw:
+	free(fm_raw);
+out_map:
+	free(map);
+	return -1;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2008 Nokia Corporation
+ * Copyright (c) International Business Machines Corp., 2006
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Reading UBI volume descriptions from ubinize configuration files.
+ *
+ * This is kept apart from libubigen.c, so that only the users of these
+ * functions have to link with libiniparser.
+ *
+ * Authors: Artem Bityutskiy
+ *          Oliver Lohmann
+ */
+
+#define PROGRAM_NAME "libubigen"
+
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <mtd/ubi-media.h>
+#include <libubigen.h>
+#include "common.h"
+
+/*
+ * The messages are about the configuration file of the calling program, so
+ * they are prefixed with its name @prog instead of the library name.
+ */
+static void __attribute__((format(printf, 3, 0)))
+vprint_msg(FILE *fp, const char *prog, const char *fmt, va_list ap)
+{
+	fprintf(fp, "%s: ", prog);
+	vfprintf(fp, fmt, ap);
+}
+
+static void __attribute__((format(printf, 2, 3)))
+ini_normsg_cont(const char *prog, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprint_msg(stdout, prog, fmt, ap);
+	va_end(ap);
+}
+
+static void __attribute__((format(printf, 2, 3)))
+ini_normsg(const char *prog, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprint_msg(stdout, prog, fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static void __attribute__((format(printf, 3, 4)))
+ini_verbose(const char *prog, int verbose, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!verbose)
+		return;
+
+	va_start(ap, fmt);
+	vprint_msg(stdout, prog, fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static int __attribute__((format(printf, 2, 3)))
+ini_errmsg(const char *prog, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: error!: ", prog);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	return -1;
+}
+
+static int __attribute__((format(printf, 2, 3)))
+ini_sys_errmsg(const char *prog, const char *fmt, ...)
+{
+	int err = errno;
+	va_list ap;
+
+	fprintf(stderr, "%s: error!: ", prog);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n%*serror %d (%s)\n", (int)strlen(prog) + 2, "",
+		err, strerror(err));
+	return -1;
+}
+
+/*
+ * Like 'stat()', but if @sparse is set, @img has to be a sparse image and the
+ * size of the data in the image is returned in @st->st_size instead of the
+ * size of the file. Errors are reported here, @sname is the section which
+ * refers to @img.
+ */
+static int stat_image(const char *prog, const char *img, int sparse,
+		      const char *sname, struct stat *st)
+{
+	struct sparse_img si;
+	int fd, ret;
+
+	if (stat(img, st))
+		return ini_sys_errmsg(prog, "cannot stat \"%s\" referred from section \"%s\"",
+				      img, sname);
+	if (!sparse)
+		return 0;
+
+	fd = open(img, O_RDONLY);
+	if (fd == -1)
+		return ini_sys_errmsg(prog, "cannot open \"%s\" referred from section \"%s\"",
+				      img, sname);
+
+	ret = sparse_img_open(&si, fd);
+	close(fd);
+	if (ret != 1)
+		return ini_errmsg(prog, "\"%s\" referred from section \"%s\" is not a valid sparse image",
+				  img, sname);
+
+	st->st_size = sparse_img_size(&si);
+	sparse_img_close(&si);
+	return 0;
+}
+
+int ubigen_read_ini_section(const char *prog, const struct ubigen_info *ui,
+			    dictionary *dict, const char *sname,
+			    struct ubigen_vol_info *vi, const char **img,
+			    long long *img_size, int *img_sparse, int verbose)
+{
+	char buf[256];
+	const char *p;
+	struct stat st;
+
+	memset(vi, 0, sizeof(struct ubigen_vol_info));
+	*img_size = 0;
+	if (img) {
+		*img = NULL;
+		*img_sparse = 0;
+	}
+
+	if (strlen(sname) > 128)
+		return ini_errmsg(prog, "too long section name \"%s\"", sname);
+
+	/* Make sure mode is UBI, otherwise ignore this section */
+	sprintf(buf, "%s:mode", sname);
+	p = iniparser_getstring(dict, buf, NULL);
+	if (!p) {
+		ini_errmsg(prog, "\"mode\" key not found in section \"%s\"", sname);
+		ini_errmsg(prog, "the \"mode\" key is mandatory and has to be "
+			   "\"mode=ubi\" if the section describes an UBI volume");
+		return -1;
+	}
+
+	/* If mode is not UBI, skip this section */
+	if (strcmp(p, "ubi")) {
+		ini_verbose(prog, verbose, "skip non-ubi section \"%s\"", sname);
+		return 1;
+	}
+
+	ini_verbose(prog, verbose, "mode=ubi, keep parsing");
+
+	/* Fetch volume type */
+	sprintf(buf, "%s:vol_type", sname);
+	p = iniparser_getstring(dict, buf, NULL);
+	if (!p) {
+		ini_normsg(prog, "volume type was not specified in "
+			   "section \"%s\", assume \"dynamic\"\n", sname);
+		vi->type = UBI_VID_DYNAMIC;
+	} else {
+		if (!strcmp(p, "static"))
+			vi->type = UBI_VID_STATIC;
+		else if (!strcmp(p, "dynamic"))
+			vi->type = UBI_VID_DYNAMIC;
+		else
+			return ini_errmsg(prog, "invalid volume type \"%s\" in section  \"%s\"",
+					  p, sname);
+	}
+
+	ini_verbose(prog, verbose, "volume type: %s",
+		    vi->type == UBI_VID_DYNAMIC ? "dynamic" : "static");
+
+	/* Fetch the name of the volume image file */
+	if (img) {
+		sprintf(buf, "%s:image", sname);
+		p = iniparser_getstring(dict, buf, NULL);
+		if (p) {
+			*img = p;
+
+			sprintf(buf, "%s:image_type", sname);
+			p = iniparser_getstring(dict, buf, NULL);
+			if (p && !strcmp(p, "sparse"))
+				*img_sparse = 1;
+			else if (p && strcmp(p, "raw"))
+				return ini_errmsg(prog, "invalid image type \"%s\" in section \"%s\"",
+						  p, sname);
+
+			p = *img;
+			if (stat_image(prog, p, *img_sparse, sname, &st))
+				return -1;
+			if (st.st_size == 0)
+				return ini_errmsg(prog, "empty file \"%s\" referred from section \"%s\"",
+						  p, sname);
+			*img_size = st.st_size;
+		} else if (vi->type == UBI_VID_STATIC)
+			return ini_errmsg(prog, "image is not specified for static volume in section \"%s\"",
+					  sname);
+	}
+
+	/* Fetch volume id */
+	sprintf(buf, "%s:vol_id", sname);
+	vi->id = iniparser_getint(dict, buf, -1);
+	if (vi->id == -1)
+		return ini_errmsg(prog, "\"vol_id\" key not found in section  \"%s\"", sname);
+	if (vi->id < 0)
+		return ini_errmsg(prog, "negative volume ID %d in section \"%s\"",
+				  vi->id, sname);
+	if (vi->id >= ui->max_volumes)
+		return ini_errmsg(prog, "too high volume ID %d in section \"%s\", max. is %d",
+				  vi->id, sname, ui->max_volumes);
+
+	ini_verbose(prog, verbose, "volume ID: %d", vi->id);
+
+	/* Fetch volume size */
+	sprintf(buf, "%s:vol_size", sname);
+	p = iniparser_getstring(dict, buf, NULL);
+	if (p) {
+		vi->bytes = util_get_bytes(p);
+		if (vi->bytes <= 0)
+			return ini_errmsg(prog, "bad \"vol_size\" key value \"%s\" (section \"%s\")",
+					  p, sname);
+
+		/* Make sure the image size is not larger than volume size */
+		if (*img_size > vi->bytes)
+			return ini_errmsg(prog, "error in section \"%s\": size of the image file "
+					  "\"%s\" is %lld, which is larger than volume size %lld",
+					  sname, *img, *img_size, vi->bytes);
+		ini_verbose(prog, verbose, "volume size: %lld bytes", vi->bytes);
+	} else if (img) {
+		if (!*img)
+			return ini_errmsg(prog, "neither image file (\"image=\") nor volume size "
+					  "(\"vol_size=\") specified in section \"%s\"", sname);
+
+		vi->bytes = *img_size;
+
+		ini_normsg_cont(prog, "volume size was not specified in section \"%s\", assume"
+				" minimum to fit image \"%s\"", sname, *img);
+		util_print_bytes(vi->bytes, 1);
+		printf("\n");
+	}
+
+	/* Fetch volume name */
+	sprintf(buf, "%s:vol_name", sname);
+	p = iniparser_getstring(dict, buf, NULL);
+	if (!p)
+		return ini_errmsg(prog, "\"vol_name\" key not found in section \"%s\"", sname);
+
+	vi->name = p;
+	vi->name_len = strlen(p);
+	if (vi->name_len > UBI_VOL_NAME_MAX)
+		return ini_errmsg(prog, "too long volume name in section \"%s\", max. is %d characters",
+				  vi->name, UBI_VOL_NAME_MAX);
+
+	ini_verbose(prog, verbose, "volume name: %s", p);
+
+	/* Fetch volume alignment */
+	sprintf(buf, "%s:vol_alignment", sname);
+	vi->alignment = iniparser_getint(dict, buf, -1);
+	if (vi->alignment == -1)
+		vi->alignment = 1;
+	else if (vi->id < 0)
+		return ini_errmsg(prog, "negative volume alignement %d in section \"%s\"",
+				  vi->alignment, sname);
+
+	ini_verbose(prog, verbose, "volume alignment: %d", vi->alignment);
+
+	/* Fetch volume flags */
+	sprintf(buf, "%s:vol_flags", sname);
+	p = iniparser_getstring(dict, buf, NULL);
+	if (p) {
+		/*
+		 * For now, the flag can be either autoresize or skip-check, as
+		 * skip-check is reserved for static volumes and autoresize for
+		 * such a volume makes no sense.
+		 * Once we add another flag that isn't incompatible with each
+		 * and every existing flag, we'll have to implement a solution
+		 * that allows multiple flags to be set at the same time in
+		 * vol_flags setting of the section.
+		 */
+		if (!strcmp(p, "autoresize")) {
+			ini_verbose(prog, verbose, "autoresize flags found");
+			vi->flags |= UBI_VTBL_AUTORESIZE_FLG;
+		} else if (!strcmp(p, "skip-check")) {
+			ini_verbose(prog, verbose, "skip-check flag found");
+			vi->flags |= UBI_VTBL_SKIP_CRC_CHECK_FLG;
+		} else {
+			return ini_errmsg(prog, "unknown flags \"%s\" in section \"%s\"",
+					  p, sname);
+		}
+	}
+
+	/* Initialize the rest of the volume information */
+	vi->data_pad = ui->leb_size % vi->alignment;
+	vi->usable_leb_size = ui->leb_size - vi->data_pad;
+	if (vi->type == UBI_VID_DYNAMIC)
+		vi->used_ebs = (vi->bytes + vi->usable_leb_size - 1) / vi->usable_leb_size;
+	else
+		vi->used_ebs = (*img_size + vi->usable_leb_size - 1) / vi->usable_leb_size;
+	vi->compat = 0;
+	return 0;
+}
+
+int ubigen_check_ini_volume(const char *prog, const struct ubigen_vol_info *vi,
+			    int n, const char *sname)
+{
+	int j;
+
+	for (j = 0; j < n; j++) {
+		if (vi[n].id == vi[j].id)
+			return ini_errmsg(prog, "volume IDs must be unique, but ID %d "
+					  "in section \"%s\" is not",
+					  vi[n].id, sname);
+
+		if (!strcmp(vi[n].name, vi[j].name))
+			return ini_errmsg(prog, "volume name must be unique, but name "
+					  "\"%s\" in section \"%s\" is not",
+					  vi[n].name, sname);
+
+		if ((vi[n].flags & UBI_VTBL_AUTORESIZE_FLG) &&
+		    (vi[j].flags & UBI_VTBL_AUTORESIZE_FLG))
+			return ini_errmsg(prog, "only one volume is allowed "
+					  "to have auto-resize flag");
+	}
+
+	if (vi[n].flags & UBI_VTBL_SKIP_CRC_CHECK_FLG &&
+	    vi[n].type != UBI_VID_STATIC)
+		return ini_errmsg(prog, "skip-check is only valid for static volumes");
+
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * Measure how fast mkfs.ubifs creates the LPT of a file system with a given
+ * number of LEBs. The LPT code of mkfs.ubifs is linked in and the LEBs it
+ * writes are kept in memory, then checksummed outside of the timed part, so
+ * that the output of different builds can be compared. With the default LEB
+ * and min. I/O sizes, the checksums are also checked against known-good ones
+ * and the program fails if they differ.
+ */
+
+#include <time.h>
+
+#include "mkfs.ubifs.h"
+
+int verbose;
+int debug_level;
+
+static struct ubifs_info info;
+static uint8_t *lpt_area;
+static int *lpt_len;
+
+#define DEFAULT_LEB_SIZE 126976
+#define DEFAULT_MIN_IO_SIZE 2048
+
+static int leb_size = DEFAULT_LEB_SIZE, min_io_size = DEFAULT_MIN_IO_SIZE;
+static int iterations = 5;
+
+static const long default_counts[] = { 4096, 65536, 262144, 1048576 };
+
+/*
+ * Checksums of the LPT area with the default LEB and min. I/O sizes, as
+ * written by the byte-at-a-time pack_bits() of earlier versions.
+ */
+static const struct {
+	long leb_cnt;
+	uint64_t checksum;
+} known_good[] = {
+	{ 4000,    0x7028cdf3ee1c5bd9ULL },
+	{ 4096,    0x1e97a4d8d9fb74a5ULL },
+	{ 65536,   0x9657b44524631b0cULL },
+	{ 262144,  0xbd46818bd83a5f90ULL },
+	{ 300000,  0x5a03878576732098ULL },
+	{ 1048576, 0xdd6ed3cba7ec1e9eULL },
+};
+
+static const struct option options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "leb-size", required_argument, NULL, 'e' },
+	{ "min-io-size", required_argument, NULL, 'm' },
+	{ "iterations", required_argument, NULL, 'n' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static NORETURN void usage(int status)
+{
+	fputs(
+	"Usage: lpt_speed [OPTIONS] [MAX_LEB_CNT...]\n\n"
+	"Time the creation of the LPT for each number of LEBs given (default:\n"
+	"4096, 65536, 262144 and 1048576), with every LEB in the main area used.\n"
+	"With the default sizes, the LPT is checked against known-good checksums.\n\n"
+	"Options:\n"
+	"  -h, --help              Display this help output\n"
+	"  -e, --leb-size <num>    Logical erase block size (default: 126976)\n"
+	"  -m, --min-io-size <num> Minimum I/O unit size (default: 2048)\n"
+	"  -n, --iterations <num>  Number of runs per LEB count (default: 5)\n",
+	status==EXIT_SUCCESS ? stdout : stderr);
+	exit(status);
+}
+
+static long read_num(int opt, const char *arg)
+{
+	char *end;
+	long num;
+
+	num = strtol(arg, &end, 0);
+	if (!end || *end != '\0' || num <= 0) {
+		fprintf(stderr, "-%c: expected positive integer argument\n", opt);
+		exit(EXIT_FAILURE);
+	}
+	return num;
+}
+
+/*
+ * The LPT code writes through this function of mkfs.ubifs. Keep the LPT area
+ * in memory instead.
+ */
+int write_leb(int lnum, int len, void *buf)
+{
+	struct ubifs_info *c = &info;
+	int i = lnum - c->lpt_first;
+
+	if (i < 0 || i >= c->lpt_lebs || len > c->leb_size)
+		return err_msg("bad LPT write to LEB %d, length %d", lnum, len);
+
+	memcpy(lpt_area + (size_t)i * c->leb_size, buf, len);
+	lpt_len[i] = len;
+	return 0;
+}
+
+/* FNV-1a hash of the LPT area as written */
+static uint64_t lpt_checksum(struct ubifs_info *c, long long *written)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const uint8_t *p;
+	int i, j;
+
+	*written = 0;
+	for (i = 0; i < c->lpt_lebs; i++) {
+		p = lpt_area + (size_t)i * c->leb_size;
+		for (j = 0; j < lpt_len[i]; j++) {
+			hash ^= p[j];
+			hash *= 0x100000001b3ULL;
+		}
+		*written += lpt_len[i];
+	}
+	return hash;
+}
+
+#ifdef WITH_CRYPTO
+void hash_digest_init(void)
+{
+}
+
+void hash_digest_update(__attribute__((unused)) const void *buf,
+			__attribute__((unused)) int len)
+{
+}
+
+void hash_digest_final(__attribute__((unused)) void *hash,
+		       __attribute__((unused)) unsigned int *len)
+{
+}
+#endif
+
+/*
+ * Set up the LPT geometry the way init() in mkfs.ubifs does, and give the
+ * main area LEBs varied properties so that all bit fields are exercised.
+ */
+static int setup(struct ubifs_info *c, long max_leb_cnt)
+{
+	int i, err, main_lebs, big_lpt = 0;
+
+	memset(c, 0, sizeof(*c));
+	c->leb_size = leb_size;
+	c->min_io_size = min_io_size;
+	c->max_leb_cnt = max_leb_cnt;
+	c->log_lebs = UBIFS_MIN_LOG_LEBS;
+	c->orph_lebs = 1;
+	c->lsave_cnt = 256;
+
+	main_lebs = c->max_leb_cnt - UBIFS_SB_LEBS - UBIFS_MST_LEBS;
+	main_lebs -= c->log_lebs + c->orph_lebs;
+
+	err = calc_dflt_lpt_geom(c, &main_lebs, &big_lpt);
+	if (err)
+		return err_msg("bad LPT geometry for %ld LEBs", max_leb_cnt);
+
+	c->main_first = UBIFS_LOG_LNUM + c->log_lebs + c->lpt_lebs +
+			c->orph_lebs;
+	c->lpt_first = UBIFS_LOG_LNUM + c->log_lebs;
+	c->lpt_last = c->lpt_first + c->lpt_lebs - 1;
+
+	c->lpt = xmalloc(c->main_lebs * sizeof(struct ubifs_lprops));
+	c->ltab = xmalloc(c->lpt_lebs * sizeof(struct ubifs_lpt_lprops));
+	lpt_area = xmalloc((size_t)c->lpt_lebs * c->leb_size);
+	lpt_len = xmalloc(c->lpt_lebs * sizeof(int));
+
+	for (i = 0; i < c->main_lebs; i++) {
+		int used = ((unsigned int)i * 2654435761U) % c->leb_size;
+
+		c->lpt[i].free = (c->leb_size - used) & ~7;
+		c->lpt[i].dirty = (used / 3) & ~7;
+		c->lpt[i].flags = i % 5 == 0 ? LPROPS_INDEX : 0;
+	}
+
+	return 0;
+}
+
+static void reset_lpt_area(struct ubifs_info *c)
+{
+	int i;
+
+	for (i = 0; i < c->lpt_lebs; i++) {
+		c->ltab[i].free = c->leb_size;
+		c->ltab[i].dirty = 0;
+		lpt_len[i] = 0;
+	}
+}
+
+/*
+ * Compare @checksum with the known-good checksum for @max_leb_cnt LEBs, if
+ * there is one for the current sizes.
+ */
+static int check_lpt(long max_leb_cnt, uint64_t checksum)
+{
+	int i;
+
+	if (leb_size != DEFAULT_LEB_SIZE || min_io_size != DEFAULT_MIN_IO_SIZE)
+		return 0;
+
+	for (i = 0; i < (int)ARRAY_SIZE(known_good); i++) {
+		if (known_good[i].leb_cnt != max_leb_cnt)
+			continue;
+		if (known_good[i].checksum == checksum)
+			return 0;
+		return err_msg("LPT of %ld LEBs has checksum %016llx, expected %016llx",
+			       max_leb_cnt, (unsigned long long)checksum,
+			       (unsigned long long)known_good[i].checksum);
+	}
+
+	return 0;
+}
+
+static long long elapsed_us(const struct timespec *start,
+			    const struct timespec *finish)
+{
+	return (finish->tv_sec - start->tv_sec) * 1000000LL +
+	       (finish->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static int run(long max_leb_cnt)
+{
+	struct ubifs_info *c = &info;
+	struct timespec start, finish;
+	long long us, best = -1, written;
+	uint64_t checksum;
+	int i, err;
+
+	err = setup(c, max_leb_cnt);
+	if (err)
+		return err;
+
+	for (i = 0; i < iterations; i++) {
+		reset_lpt_area(c);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		err = create_lpt(c);
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+		if (err) {
+			err_msg("create_lpt failed for %ld LEBs", max_leb_cnt);
+			goto out;
+		}
+
+		us = elapsed_us(&start, &finish);
+		if (best < 0 || us < best)
+			best = us;
+	}
+
+	checksum = lpt_checksum(c, &written);
+	printf("%8ld LEBs: %s LPT, %d LPT LEBs, %d pnodes, %lld bytes, "
+	       "%lld.%03lld ms, checksum %016llx\n",
+	       max_leb_cnt, c->big_lpt ? "big" : "small", c->lpt_lebs,
+	       c->pnode_cnt, written, best / 1000, best % 1000,
+	       (unsigned long long)checksum);
+	err = check_lpt(max_leb_cnt, checksum);
+out:
+	free(lpt_len);
+	free(lpt_area);
+	free(c->lpt);
+	free(c->ltab);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, err = 0;
+
+	while ((opt = getopt_long(argc, argv, "he:m:n:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(EXIT_SUCCESS);
+		case 'e':
+			leb_size = read_num(opt, optarg);
+			break;
+		case 'm':
+			min_io_size = read_num(opt, optarg);
+			break;
+		case 'n':
+			iterations = read_num(opt, optarg);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if (leb_size % min_io_size || leb_size % 8)
+		errmsg_die("LEB size must be a multiple of the min. I/O size and of 8");
+
+	if (optind == argc) {
+		for (i = 0; i < (int)ARRAY_SIZE(default_counts) && !err; i++)
+			err = run(default_counts[i]);
+	} else {
+		for (i = optind; i < argc && !err; i++)
+			err = run(read_num('c', argv[i]));
+	}
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <mtd/ubi-media.h>
 #include <libubi.h>
@@ -82,8 +83,10 @@ static const char optionsstr[] =
 "                             physical eraseblock (default is the next\n"
 "                             minimum I/O unit or sub-page after the EC\n"
 "                             header)\n"
-"-f, --flash-image=<file>     flash image file, or '-' for stdin\n"
-"-S, --image-size=<bytes>     bytes in input, if not reading from file\n"
+"-f, --flash-image=<file>     flash image file, or '-' for stdin, which may\n"
+"                             be a sparse image (ubinize --sparse)\n"
+"-S, --image-size=<bytes>     bytes in input, if not reading from file and\n"
+"                             the image is not a sparse image\n"
 "-e, --erase-counter=<value>  use <value> as the erase counter value for all\n"
 "                             eraseblocks\n"
 "-x, --ubi-ver=<num>          UBI version number to put to EC headers\n"
@@ -308,9 +311,6 @@ static int open_file(off_t *sz)
 	int fd;
 
 	if (!strcmp(args.image, "-")) {
-		if (args.image_sz == 0)
-			return errmsg("must use '-S' with non-zero value when reading from stdin");
-
 		*sz = args.image_sz;
 		fd  = dup(STDIN_FILENO);
 		if (fd < 0)
@@ -408,35 +408,345 @@ static int mark_bad(const struct mtd_dev_info *mtd, struct ubi_scan_info *si, in
 	return consecutive_bad_check(eb);
 }
 
+/*
+ * Check whether an eraseblock of the image belongs to a fastmap. The EC header
+ * has to be checked already.
+ */
+static int is_fastmap_eb(const struct mtd_dev_info *mtd, const void *buf)
+{
+	const struct ubi_ec_hdr *ec_hdr = buf;
+	const struct ubi_vid_hdr *vid_hdr;
+	int offs = be32_to_cpu(ec_hdr->vid_hdr_offset), vol_id;
+
+	if (offs < (int)UBI_EC_HDR_SIZE ||
+	    offs > mtd->eb_size - (int)UBI_VID_HDR_SIZE)
+		return 0;
+
+	vid_hdr = (const void *)((const char *)buf + offs);
+	if (be32_to_cpu(vid_hdr->magic) != UBI_VID_HDR_MAGIC)
+		return 0;
+
+	vol_id = be32_to_cpu(vid_hdr->vol_id);
+	return vol_id == UBI_FM_SB_VOLUME_ID || vol_id == UBI_FM_DATA_VOLUME_ID;
+}
+
+/*
+ * Erase the fastmap eraseblocks @ebs written already and leave them with just
+ * an EC header, so that UBI scans the flash when it attaches it.
+ */
+static int drop_fastmap(libmtd_t libmtd, const struct mtd_dev_info *mtd,
+			const struct ubigen_info *ui, const int *ebs,
+			const long long *ecs, int cnt)
+{
+	int i, err, write_size;
+	struct ubi_ec_hdr *hdr;
+
+	write_size = UBI_EC_HDR_SIZE + mtd->subpage_size - 1;
+	write_size /= mtd->subpage_size;
+	write_size *= mtd->subpage_size;
+	hdr = malloc(write_size);
+	if (!hdr)
+		return sys_errmsg("cannot allocate %d bytes of memory", write_size);
+	memset(hdr, 0xFF, write_size);
+
+	for (i = 0; i < cnt; i++) {
+		verbose(args.verbose, "eraseblock %d: drop fastmap", ebs[i]);
+
+		err = mtd_erase(libmtd, mtd, args.node_fd, ebs[i]);
+		if (err) {
+			sys_errmsg("failed to erase eraseblock %d", ebs[i]);
+			goto out_free;
+		}
+
+		ubigen_init_ec_hdr(ui, hdr, ecs[i]);
+		err = mtd_write(libmtd, mtd, args.node_fd, ebs[i], 0, hdr,
+				write_size, NULL, 0, 0);
+		if (err) {
+			sys_errmsg("cannot write EC header to eraseblock %d",
+				   ebs[i]);
+			goto out_free;
+		}
+	}
+
+	free(hdr);
+	return 0;
+
+out_free:
+	free(hdr);
+	return -1;
+}
+
+/*
+ * Find out whether the image is a sparse image. The image is read
+ * sequentially, because it may come from stdin, so the first bytes which are
+ * read have to be kept in @buf if it is not a sparse image. Returns %1 if it
+ * is a sparse image, %0 if it is not, and %-1 in case of failure.
+ */
+static int open_sparse(const struct mtd_dev_info *mtd, int fd,
+		       struct sparse_img *sparse, char *buf)
+{
+	struct sparse_img_hdr *hdr = (struct sparse_img_hdr *)buf;
+
+	if (read_all(fd, buf, sizeof(*hdr)))
+		return sys_errmsg("failed to read the header of \"%s\"",
+				  args.image);
+	if (be32_to_cpu(hdr->magic) != SPARSE_IMG_MAGIC)
+		return 0;
+
+	if (sparse_img_open_stream(sparse, fd, hdr))
+		return errmsg("bad sparse image \"%s\"", args.image);
+
+	if (sparse->blk_size != mtd->eb_size || sparse->fill != 0xFF) {
+		errmsg("sparse image \"%s\" has blocks of %d bytes filled with %#02x, expected %d bytes filled with 0xff",
+		       args.image, sparse->blk_size, sparse->fill, mtd->eb_size);
+		sparse_img_close(sparse);
+		return -1;
+	}
+
+	return 1;
+}
+
+/* How many eraseblocks of the image are read ahead of the flash writes */
+#define READ_AHEAD_EBS 16
+
+/* How many good eraseblocks are erased with one call */
+#define ERASE_BATCH_EBS 16
+
+/*
+ * The image is read by a separate thread, so that the next eraseblocks of
+ * the image are already read while the flash is erased and programmed. This
+ * matters when the image comes from a slow pipe. The thread reads the
+ * eraseblocks of the image in order to a ring of %READ_AHEAD_EBS buffers, and
+ * 'flash_image()' takes them from the ring in the same order.
+ *
+ * @head is the count of eraseblocks which were read, @tail is the count of
+ * eraseblocks which were written to the flash, and the buffer of eraseblock
+ * N is 'N % READ_AHEAD_EBS'. @lens holds the used length of each buffer if
+ * the image is a sparse image.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	struct sparse_img *sparse;
+	int eb_size;
+	int img_ebs;
+	char *bufs;
+	int lens[READ_AHEAD_EBS];
+	int head;
+	int tail;
+	int stop;
+	int err;
+} rd = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static char *rd_buf(int blk)
+{
+	return rd.bufs + (size_t)(blk % READ_AHEAD_EBS) * rd.eb_size;
+}
+
+static void *reader_thread(void *arg)
+{
+	int blk, err, len = -1;
+
+	(void)arg;
+
+	/*
+	 * The thread may only be cancelled while it waits for the image, it
+	 * is stopped with @rd.stop otherwise.
+	 */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (blk = 0; blk < rd.img_ebs; blk++) {
+		char *buf = rd_buf(blk);
+
+		pthread_mutex_lock(&rd.lock);
+		while (blk - rd.tail >= READ_AHEAD_EBS && !rd.stop)
+			pthread_cond_wait(&rd.cond, &rd.lock);
+		err = rd.stop;
+		pthread_mutex_unlock(&rd.lock);
+		if (err)
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (rd.sparse) {
+			len = sparse_img_read_blk(rd.sparse, blk, buf);
+			err = len < 0;
+		} else {
+			/* The first bytes were read to look for a sparse image */
+			int offs = blk ? 0 : sizeof(struct sparse_img_hdr);
+
+			err = read_all(rd.fd, buf + offs, rd.eb_size - offs);
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&rd.lock);
+		if (err)
+			rd.err = 1;
+		else {
+			rd.lens[blk % READ_AHEAD_EBS] = len;
+			rd.head = blk + 1;
+		}
+		pthread_cond_broadcast(&rd.cond);
+		pthread_mutex_unlock(&rd.lock);
+		if (err)
+			break;
+	}
+
+	return NULL;
+}
+
+static int start_reader(int fd, struct sparse_img *sparse, int img_ebs)
+{
+	int err;
+
+	rd.fd = fd;
+	rd.sparse = sparse;
+	rd.img_ebs = img_ebs;
+	rd.head = rd.tail = rd.stop = rd.err = 0;
+
+	err = pthread_create(&rd.thread, NULL, reader_thread, NULL);
+	if (err) {
+		errno = err;
+		return sys_errmsg("cannot create the image reader thread");
+	}
+
+	return 0;
+}
+
+static void stop_reader(void)
+{
+	pthread_mutex_lock(&rd.lock);
+	rd.stop = 1;
+	pthread_cond_broadcast(&rd.cond);
+	pthread_mutex_unlock(&rd.lock);
+
+	/* The reader may be blocked reading a pipe */
+	pthread_cancel(rd.thread);
+	pthread_join(rd.thread, NULL);
+}
+
+/*
+ * Wait until eraseblock @blk of the image was read, and return its buffer, or
+ * %NULL if the image could not be read. The used length of the eraseblock is
+ * returned in @len for sparse images.
+ */
+static char *get_image_eb(int blk, int *len)
+{
+	int ok;
+
+	pthread_mutex_lock(&rd.lock);
+	while (rd.head <= blk && !rd.err)
+		pthread_cond_wait(&rd.cond, &rd.lock);
+	ok = rd.head > blk;
+	pthread_mutex_unlock(&rd.lock);
+
+	if (!ok)
+		return NULL;
+	*len = rd.lens[blk % READ_AHEAD_EBS];
+	return rd_buf(blk);
+}
+
+/*
+ * Hand the buffer of the eraseblock of the image which was written last back
+ * to the reader.
+ */
+static void put_image_eb(void)
+{
+	pthread_mutex_lock(&rd.lock);
+	rd.tail += 1;
+	pthread_cond_broadcast(&rd.cond);
+	pthread_mutex_unlock(&rd.lock);
+}
+
+/*
+ * Erase up to %ERASE_BATCH_EBS consecutive good eraseblocks starting with
+ * @eb, but not more than @max, with one call. Returns the index of the
+ * eraseblock after the erased ones, @eb if there are not enough good
+ * eraseblocks for a batch, and %-1 if they could not be erased at once.
+ */
+static int erase_ahead(libmtd_t libmtd, const struct mtd_dev_info *mtd,
+		       const struct ubi_scan_info *si, int eb, int max)
+{
+	int cnt = 0;
+
+	while (cnt < ERASE_BATCH_EBS && cnt < max && eb + cnt < mtd->eb_cnt &&
+	       si->ec[eb + cnt] != EB_BAD)
+		cnt += 1;
+
+	if (cnt < 2)
+		return eb;
+
+	if (mtd_erase_multi(libmtd, mtd, args.node_fd, eb, cnt)) {
+		verbose(args.verbose, "erase eraseblocks %d-%d one by one",
+			eb, eb + cnt - 1);
+		return -1;
+	}
+
+	return eb + cnt;
+}
+
 static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		       const struct ubigen_info *ui, struct ubi_scan_info *si)
 {
 	int fd, img_ebs, eb, written_ebs = 0, divisor, skip_data_read = 0;
+	int fm_ebs[UBI_FM_MAX_BLOCKS], fm_cnt = 0, fm_dropped = 0;
+	int is_sparse, data_len = -1, erased = 0, single = 0;
+	long long fm_ecs[UBI_FM_MAX_BLOCKS];
+	struct sparse_img sparse;
 	off_t st_size;
+	char *buf = NULL;
 
 	fd = open_file(&st_size);
 	if (fd < 0)
 		return fd;
 
-	img_ebs = st_size / mtd->eb_size;
+	rd.eb_size = mtd->eb_size;
+	rd.bufs = malloc((size_t)READ_AHEAD_EBS * mtd->eb_size);
+	if (!rd.bufs) {
+		sys_errmsg("cannot allocate %zu bytes of memory",
+			   (size_t)READ_AHEAD_EBS * mtd->eb_size);
+		goto out_close;
+	}
+
+	is_sparse = open_sparse(mtd, fd, &sparse, rd_buf(0));
+	if (is_sparse < 0)
+		goto out_free;
+
+	if (is_sparse) {
+		verbose(args.verbose, "\"%s\" is a sparse image", args.image);
+		img_ebs = sparse.blk_cnt;
+		st_size = (off_t)img_ebs * mtd->eb_size;
+	} else {
+		if (st_size == 0) {
+			errmsg("must use '-S' with non-zero value when reading from stdin");
+			goto out_free;
+		}
+		img_ebs = st_size / mtd->eb_size;
+	}
 
 	if (img_ebs > si->good_cnt) {
 		sys_errmsg("file \"%s\" is too large (%lld bytes)",
 			   args.image, (long long)st_size);
-		goto out_close;
+		goto out_free;
 	}
 
 	if (st_size % mtd->eb_size) {
 		sys_errmsg("file \"%s\" (size %lld bytes) is not multiple of ""eraseblock size (%d bytes)",
 			  args.image, (long long)st_size, mtd->eb_size);
-		goto out_close;
+		goto out_free;
 	}
 
+	if (start_reader(fd, is_sparse ? &sparse : NULL, img_ebs))
+		goto out_free;
+
 	verbose(args.verbose, "will write %d eraseblocks", img_ebs);
 	divisor = img_ebs;
 	for (eb = 0; eb < mtd->eb_cnt; eb++) {
 		int err, new_len;
-		char buf[mtd->eb_size];
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
@@ -455,27 +765,43 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			fflush(stdout);
 		}
 
-		err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+		/*
+		 * Eraseblocks before @erased were erased ahead already. If
+		 * that fails, the eraseblocks before @single are erased one by
+		 * one, so that a bad eraseblock is found by 'mtd_erase()'.
+		 */
+		if (eb >= erased && eb >= single) {
+			erased = erase_ahead(libmtd, mtd, si, eb,
+					     img_ebs - written_ebs);
+			if (erased < 0) {
+				erased = 0;
+				single = eb + ERASE_BATCH_EBS;
+			}
+		}
+		if (eb < erased)
+			err = 0;
+		else
+			err = mtd_erase(libmtd, mtd, args.node_fd, eb);
 		if (err) {
 			if (!args.quiet)
 				printf("\n");
 			sys_errmsg("failed to erase eraseblock %d", eb);
 
 			if (errno != EIO)
-				goto out_close;
+				goto out_stop;
 
 			if (mark_bad(mtd, si, eb))
-				goto out_close;
+				goto out_stop;
 
 			continue;
 		}
 
 		if (!skip_data_read) {
-			err = read_all(fd, buf, mtd->eb_size);
-			if (err) {
-				sys_errmsg("failed to read eraseblock %d from \"%s\"",
-					   written_ebs, args.image);
-				goto out_close;
+			buf = get_image_eb(written_ebs, &data_len);
+			if (!buf) {
+				errmsg("failed to read eraseblock %d from \"%s\"",
+				       written_ebs, args.image);
+				goto out_stop;
 			}
 		}
 		skip_data_read = 0;
@@ -496,7 +822,32 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		if (err) {
 			errmsg("bad EC header at eraseblock %d of \"%s\"",
 			       written_ebs, args.image);
-			goto out_close;
+			goto out_stop;
+		}
+
+		/*
+		 * The fastmap records the physical eraseblocks of the image,
+		 * which are only right if no bad eraseblock is skipped while
+		 * the image is flashed. Bad eraseblocks outside of the image
+		 * would be recorded as free, so drop the fastmap if there are
+		 * any bad eraseblocks, and let UBI scan the flash.
+		 */
+		if (is_fastmap_eb(mtd, buf)) {
+			if (si->bad_cnt || eb != written_ebs ||
+			    fm_cnt == UBI_FM_MAX_BLOCKS) {
+				if (!fm_dropped && !args.quiet) {
+					printf("\n");
+					warnmsg("dropping the fastmap of the image because the flash has bad eraseblocks");
+				}
+				fm_dropped = 1;
+				memset(buf + UBI_EC_HDR_SIZE, 0xFF,
+				       mtd->eb_size - UBI_EC_HDR_SIZE);
+				if (is_sparse)
+					data_len = UBI_EC_HDR_SIZE;
+			} else {
+				fm_ebs[fm_cnt] = eb;
+				fm_ecs[fm_cnt++] = ec;
+			}
 		}
 
 		if (args.verbose) {
@@ -504,7 +855,11 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			fflush(stdout);
 		}
 
-		new_len = drop_ffs(mtd, buf, mtd->eb_size);
+		/* Sparse images do not store the 0xFF bytes at the end */
+		if (is_sparse)
+			new_len = round_up(data_len, mtd->min_io_size);
+		else
+			new_len = drop_ffs(mtd, buf, mtd->eb_size);
 
 		err = mtd_write(libmtd, mtd, args.node_fd, eb, 0, buf, new_len,
 				NULL, 0, 0);
@@ -512,12 +867,12 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			sys_errmsg("cannot write eraseblock %d", eb);
 
 			if (errno != EIO)
-				goto out_close;
+				goto out_stop;
 
 			err = mtd_torture(libmtd, mtd, args.node_fd, eb);
 			if (err) {
 				if (mark_bad(mtd, si, eb))
-					goto out_close;
+					goto out_stop;
 			}
 
 			/*
@@ -528,15 +883,34 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			skip_data_read = 1;
 			continue;
 		}
+		put_image_eb();
 		if (++written_ebs >= img_ebs)
 			break;
 	}
+	stop_reader();
 
 	if (!args.quiet && !args.verbose)
 		printf("\n");
+
+	/* Eraseblocks went bad after the fastmap was written */
+	if (fm_cnt && (si->bad_cnt || eb + 1 != written_ebs)) {
+		if (!fm_dropped && !args.quiet)
+			warnmsg("dropping the fastmap of the image because the flash has bad eraseblocks");
+		if (drop_fastmap(libmtd, mtd, ui, fm_ebs, fm_ecs, fm_cnt))
+			goto out_free;
+	}
+	if (is_sparse)
+		sparse_img_close(&sparse);
+	free(rd.bufs);
 	close(fd);
 	return eb + 1;
 
+out_stop:
+	stop_reader();
+out_free:
+	if (is_sparse > 0)
+		sparse_img_close(&sparse);
+	free(rd.bufs);
 out_close:
 	close(fd);
 	return -1;
@@ -31,6 +31,8 @@
 #include <getopt.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <mtd/ubi-media.h>
 #include <libubigen.h>
@@ -60,6 +62,14 @@ static const char optionsstr[] =
 "                             (default is 1)\n"
 "-Q, --image-seq=<num>        32-bit UBI image sequence number to use\n"
 "                             (by default a random number is picked)\n"
+"-F, --fastmap=<bytes>        add a fastmap for a flash of this size in\n"
+"                             bytes, kilobytes (KiB), megabytes (MiB), or\n"
+"                             gigabytes (GiB), so that UBI does not have\n"
+"                             to scan the flash on the first attach\n"
+"-j, --jobs=<num>             number of threads writing the volumes (default\n"
+"                             is the number of online CPUs)\n"
+"-S, --sparse                 write a packed sparse image, which leaves out\n"
+"                             the 0xFF bytes at the end of each eraseblock\n"
 "-v, --verbose                be verbose\n"
 "-h, --help                   print help message\n"
 "-V, --version                print program version\n\n";
@@ -79,6 +89,9 @@ static const struct option long_options[] = {
 	{ .name = "erase-counter",  .has_arg = 1, .flag = NULL, .val = 'e' },
 	{ .name = "ubi-ver",        .has_arg = 1, .flag = NULL, .val = 'x' },
 	{ .name = "image-seq",      .has_arg = 1, .flag = NULL, .val = 'Q' },
+	{ .name = "fastmap",        .has_arg = 1, .flag = NULL, .val = 'F' },
+	{ .name = "jobs",           .has_arg = 1, .flag = NULL, .val = 'j' },
+	{ .name = "sparse",         .has_arg = 0, .flag = NULL, .val = 'S' },
 	{ .name = "verbose",        .has_arg = 0, .flag = NULL, .val = 'v' },
 	{ .name = "help",           .has_arg = 0, .flag = NULL, .val = 'h' },
 	{ .name = "version",        .has_arg = 0, .flag = NULL, .val = 'V' },
@@ -89,6 +102,7 @@ struct args {
 	const char *f_in;
 	const char *f_out;
 	int out_fd;
+	int sparse_fd;
 	int peb_size;
 	int min_io_size;
 	int subpage_size;
@@ -96,6 +110,9 @@ struct args {
 	int ec;
 	int ubi_ver;
 	uint32_t image_seq;
+	long long flash_size;
+	int jobs;
+	int sparse;
 	int verbose;
 	dictionary *dict;
 };
@@ -105,6 +122,7 @@ static struct args args = {
 	.min_io_size  = -1,
 	.subpage_size = -1,
 	.ubi_ver      = 1,
+	.sparse_fd    = -1,
 };
 
 static int parse_opt(int argc, char * const argv[])
@@ -116,7 +134,7 @@ static int parse_opt(int argc, char * const argv[])
 		int key, error = 0;
 		unsigned long int image_seq;
 
-		key = getopt_long(argc, argv, "o:p:m:s:O:e:x:Q:vhV", long_options, NULL);
+		key = getopt_long(argc, argv, "o:p:m:s:O:e:x:Q:F:j:SvhV", long_options, NULL);
 		if (key == -1)
 			break;
 
@@ -176,6 +194,22 @@ static int parse_opt(int argc, char * const argv[])
 			args.image_seq = image_seq;
 			break;
 
+		case 'F':
+			args.flash_size = util_get_bytes(optarg);
+			if (args.flash_size <= 0)
+				return errmsg("bad flash size: \"%s\"", optarg);
+			break;
+
+		case 'j':
+			args.jobs = simple_strtoul(optarg, &error);
+			if (error || args.jobs <= 0)
+				return errmsg("bad number of jobs: \"%s\"", optarg);
+			break;
+
+		case 'S':
+			args.sparse = 1;
+			break;
+
 		case 'v':
 			args.verbose = 1;
 			break;
@@ -206,6 +240,12 @@ static int parse_opt(int argc, char * const argv[])
 
 	args.f_in = argv[optind];
 
+	if (!args.jobs) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		args.jobs = cpus > 0 ? cpus : 1;
+	}
+
 	if (args.peb_size < 0)
 		return errmsg("physical eraseblock size was not specified (use -h for help)");
 
@@ -230,6 +270,9 @@ static int parse_opt(int argc, char * const argv[])
 	if (!args.f_out)
 		return errmsg("output file was not specified (use -h for help)");
 
+	if (args.flash_size % args.peb_size)
+		return errmsg("flash size should be multiple of physical eraseblocks");
+
 	if (args.vid_hdr_offs) {
 		if (args.vid_hdr_offs + (int)UBI_VID_HDR_SIZE >= args.peb_size)
 			return errmsg("bad VID header position");
@@ -240,190 +283,260 @@ static int parse_opt(int argc, char * const argv[])
 	return 0;
 }
 
-static int read_section(const struct ubigen_info *ui, const char *sname,
-			struct ubigen_vol_info *vi, const char **img,
-			struct stat *st)
+/*
+ * Volumes are split into parts of this many LEBs, so that a single large
+ * volume is written by several threads as well.
+ */
+#define PART_LEBS 256
+
+/**
+ * struct vol_image - the image file of a volume.
+ * @sname: name of the ini-file section of the volume
+ * @fd: file descriptor of the image file, or %-1 if there is none
+ * @sparse: non-zero if the image file is a sparse image
+ * @si: the sparse image if @sparse is set
+ * @bytes: size of the volume contents in bytes
+ * @peb: first physical eraseblock of the volume in the UBI image
+ */
+struct vol_image {
+	const char *sname;
+	int fd;
+	int sparse;
+	struct sparse_img si;
+	long long bytes;
+	int peb;
+};
+
+/**
+ * struct vol_part - a part of a volume to write.
+ * @vol: index of the volume
+ * @lnum: first LEB of the part
+ * @bytes: size of the part in bytes
+ */
+struct vol_part {
+	int vol;
+	int lnum;
+	long long bytes;
+};
+
+/*
+ * The parts of the volumes are written by @args.jobs threads, each of which
+ * picks the next part to write from @parts. Each part has its own place in the
+ * UBI image, which is known in advance, so they may be written in any order.
+ * @err is set by any thread which fails, so it is accessed atomically.
+ */
+static struct {
+	const struct ubigen_info *ui;
+	const struct ubigen_vol_info *vi;
+	const struct vol_image *imgs;
+	struct vol_part *parts;
+	int part_cnt;
+	int next;
+	int err;
+} wr;
+
+static void *write_thread(void *arg)
 {
-	char buf[256];
-	const char *p;
+	int i;
 
-	*img = NULL;
+	(void)arg;
+	while (!__atomic_load_n(&wr.err, __ATOMIC_RELAXED)) {
+		const struct vol_part *part;
+		const struct vol_image *img;
+		off_t offs;
+		int err;
 
-	if (strlen(sname) > 128)
-		return errmsg("too long section name \"%s\"", sname);
+		i = __sync_fetch_and_add(&wr.next, 1);
+		if (i >= wr.part_cnt)
+			break;
 
-	/* Make sure mode is UBI, otherwise ignore this section */
-	sprintf(buf, "%s:mode", sname);
-	p = iniparser_getstring(args.dict, buf, NULL);
-	if (!p) {
-		errmsg("\"mode\" key not found in section \"%s\"", sname);
-		errmsg("the \"mode\" key is mandatory and has to be "
-		       "\"mode=ubi\" if the section describes an UBI volume");
-		return -1;
+		part = &wr.parts[i];
+		img = &wr.imgs[part->vol];
+		offs = (off_t)(img->peb + part->lnum) * wr.ui->peb_size;
+		err = ubigen_write_volume_part(wr.ui, &wr.vi[part->vol], args.ec,
+					       part->lnum, part->bytes, img->fd,
+					       img->sparse ? &img->si : NULL,
+					       args.out_fd, offs);
+		if (err) {
+			errmsg("cannot write volume for section \"%s\"",
+			       img->sname);
+			__atomic_store_n(&wr.err, -1, __ATOMIC_RELAXED);
+		}
 	}
 
-	/* If mode is not UBI, skip this section */
-	if (strcmp(p, "ubi")) {
-		verbose(args.verbose, "skip non-ubi section \"%s\"", sname);
-		return 1;
+	return NULL;
+}
+
+/*
+ * Split the volumes into parts and write them with @args.jobs threads.
+ */
+static int write_volumes(const struct ubigen_info *ui,
+			 const struct ubigen_vol_info *vi,
+			 const struct vol_image *imgs, int vol_cnt)
+{
+	int i, jobs, started, err;
+	pthread_t *threads;
+
+	wr.ui = ui;
+	wr.vi = vi;
+	wr.imgs = imgs;
+	wr.part_cnt = wr.next = wr.err = 0;
+
+	for (i = 0; i < vol_cnt; i++) {
+		long long part_size = (long long)PART_LEBS * vi[i].usable_leb_size;
+
+		wr.part_cnt += (imgs[i].bytes + part_size - 1) / part_size;
 	}
+	if (!wr.part_cnt)
+		return 0;
+
+	wr.parts = calloc(sizeof(struct vol_part), wr.part_cnt);
+	if (!wr.parts)
+		return errmsg("cannot allocate memory");
+
+	wr.part_cnt = 0;
+	for (i = 0; i < vol_cnt; i++) {
+		long long part_size = (long long)PART_LEBS * vi[i].usable_leb_size;
+		long long bytes = imgs[i].bytes;
+		int lnum = 0;
+
+		while (bytes) {
+			struct vol_part *part = &wr.parts[wr.part_cnt++];
+
+			part->vol = i;
+			part->lnum = lnum;
+			part->bytes = bytes < part_size ? bytes : part_size;
+			bytes -= part->bytes;
+			lnum += PART_LEBS;
+		}
+	}
+
+	jobs = args.jobs < wr.part_cnt ? args.jobs : wr.part_cnt;
+	verbose(args.verbose, "writing %d volume parts with %d jobs",
+		wr.part_cnt, jobs);
 
-	verbose(args.verbose, "mode=ubi, keep parsing");
-
-	/* Fetch volume type */
-	sprintf(buf, "%s:vol_type", sname);
-	p = iniparser_getstring(args.dict, buf, NULL);
-	if (!p) {
-		normsg("volume type was not specified in "
-		       "section \"%s\", assume \"dynamic\"\n", sname);
-		vi->type = UBI_VID_DYNAMIC;
-	} else {
-		if (!strcmp(p, "static"))
-			vi->type = UBI_VID_STATIC;
-		else if (!strcmp(p, "dynamic"))
-			vi->type = UBI_VID_DYNAMIC;
-		else
-			return errmsg("invalid volume type \"%s\" in section  \"%s\"",
-				      p, sname);
+	if (jobs == 1) {
+		write_thread(NULL);
+		free(wr.parts);
+		return wr.err;
 	}
 
-	verbose(args.verbose, "volume type: %s",
-		vi->type == UBI_VID_DYNAMIC ? "dynamic" : "static");
-
-	/* Fetch the name of the volume image file */
-	sprintf(buf, "%s:image", sname);
-	p = iniparser_getstring(args.dict, buf, NULL);
-	if (p) {
-		*img = p;
-		if (stat(p, st))
-			return sys_errmsg("cannot stat \"%s\" referred from section \"%s\"",
-					  p, sname);
-		if (st->st_size == 0)
-			return errmsg("empty file \"%s\" referred from section \"%s\"",
-				       p, sname);
-	} else if (vi->type == UBI_VID_STATIC)
-		return errmsg("image is not specified for static volume in section \"%s\"",
-			      sname);
-
-	/* Fetch volume id */
-	sprintf(buf, "%s:vol_id", sname);
-	vi->id = iniparser_getint(args.dict, buf, -1);
-	if (vi->id == -1)
-		return errmsg("\"vol_id\" key not found in section  \"%s\"", sname);
-	if (vi->id < 0)
-		return errmsg("negative volume ID %d in section \"%s\"",
-			      vi->id, sname);
-	if (vi->id >= ui->max_volumes)
-		return errmsg("too high volume ID %d in section \"%s\", max. is %d",
-			      vi->id, sname, ui->max_volumes);
-
-	verbose(args.verbose, "volume ID: %d", vi->id);
-
-	/* Fetch volume size */
-	sprintf(buf, "%s:vol_size", sname);
-	p = iniparser_getstring(args.dict, buf, NULL);
-	if (p) {
-		vi->bytes = util_get_bytes(p);
-		if (vi->bytes <= 0)
-			return errmsg("bad \"vol_size\" key value \"%s\" (section \"%s\")",
-				      p, sname);
-
-		/* Make sure the image size is not larger than volume size */
-		if (*img && st->st_size > vi->bytes)
-			return errmsg("error in section \"%s\": size of the image file "
-				      "\"%s\" is %lld, which is larger than volume size %lld",
-				      sname, *img, (long long)st->st_size, vi->bytes);
-		verbose(args.verbose, "volume size: %lld bytes", vi->bytes);
-	} else {
-		struct stat st;
-
-		if (!*img)
-			return errmsg("neither image file (\"image=\") nor volume size "
-				      "(\"vol_size=\") specified in section \"%s\"", sname);
-
-		if (stat(*img, &st))
-			return sys_errmsg("cannot stat \"%s\"", *img);
-
-		vi->bytes = st.st_size;
-
-		if (vi->bytes == 0)
-			return errmsg("file \"%s\" referred from section \"%s\" is empty",
-				      *img, sname);
-
-		normsg_cont("volume size was not specified in section \"%s\", assume"
-			    " minimum to fit image \"%s\"", sname, *img);
-		util_print_bytes(vi->bytes, 1);
-		printf("\n");
+	threads = calloc(sizeof(pthread_t), jobs);
+	if (!threads) {
+		free(wr.parts);
+		return errmsg("cannot allocate memory");
 	}
 
-	/* Fetch volume name */
-	sprintf(buf, "%s:vol_name", sname);
-	p = iniparser_getstring(args.dict, buf, NULL);
-	if (!p)
-		return errmsg("\"vol_name\" key not found in section \"%s\"", sname);
-
-	vi->name = p;
-	vi->name_len = strlen(p);
-	if (vi->name_len > UBI_VOL_NAME_MAX)
-		return errmsg("too long volume name in section \"%s\", max. is %d characters",
-			      vi->name, UBI_VOL_NAME_MAX);
-
-	verbose(args.verbose, "volume name: %s", p);
-
-	/* Fetch volume alignment */
-	sprintf(buf, "%s:vol_alignment", sname);
-	vi->alignment = iniparser_getint(args.dict, buf, -1);
-	if (vi->alignment == -1)
-		vi->alignment = 1;
-	else if (vi->id < 0)
-		return errmsg("negative volume alignement %d in section \"%s\"",
-			      vi->alignment, sname);
-
-	verbose(args.verbose, "volume alignment: %d", vi->alignment);
-
-	/* Fetch volume flags */
-	sprintf(buf, "%s:vol_flags", sname);
-	p = iniparser_getstring(args.dict, buf, NULL);
-	if (p) {
-		/*
-		 * For now, the flag can be either autoresize or skip-check, as
-		 * skip-check is reserved for static volumes and autoresize for
-		 * such a volume makes no sense.
-		 * Once we add another flag that isn't incompatible with each
-		 * and every existing flag, we'll have to implement a solution
-		 * that allows multiple flags to be set at the same time in
-		 * vol_flags setting of the section.
-		 */
-		if (!strcmp(p, "autoresize")) {
-			verbose(args.verbose, "autoresize flags found");
-			vi->flags |= UBI_VTBL_AUTORESIZE_FLG;
-		} else if (!strcmp(p, "skip-check")) {
-			verbose(args.verbose, "skip-check flag found");
-			vi->flags |= UBI_VTBL_SKIP_CRC_CHECK_FLG;
-		} else {
-			return errmsg("unknown flags \"%s\" in section \"%s\"",
-				      p, sname);
+	for (started = 0; started < jobs; started++) {
+		err = pthread_create(&threads[started], NULL, write_thread, NULL);
+		if (err) {
+			errno = err;
+			sys_errmsg("cannot create thread");
+			__atomic_store_n(&wr.err, -1, __ATOMIC_RELAXED);
+			break;
 		}
 	}
 
-	/* Initialize the rest of the volume information */
-	vi->data_pad = ui->leb_size % vi->alignment;
-	vi->usable_leb_size = ui->leb_size - vi->data_pad;
-	if (vi->type == UBI_VID_DYNAMIC)
-		vi->used_ebs = (vi->bytes + vi->usable_leb_size - 1) / vi->usable_leb_size;
-	else
-		vi->used_ebs = (st->st_size + vi->usable_leb_size - 1) / vi->usable_leb_size;
-	vi->compat = 0;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	free(wr.parts);
+	return wr.err;
+}
+
+static void close_images(struct vol_image *imgs, int vol_cnt)
+{
+	int i;
+
+	for (i = 0; i < vol_cnt; i++) {
+		if (imgs[i].sparse)
+			sparse_img_close(&imgs[i].si);
+		if (imgs[i].fd != -1)
+			close(imgs[i].fd);
+	}
+}
+
+/*
+ * Sparse images are written in two steps. The UBI image is first written to
+ * an unlinked temporary file next to the output file, because the volumes are
+ * written to their places in the image in any order, and the packed sparse
+ * image needs its blocks in order. Then each eraseblock of the UBI image is
+ * copied to the sparse image without the 0xFF bytes at its end.
+ */
+static int open_tmp(void)
+{
+	char *tmp;
+	int fd;
+
+	tmp = malloc(strlen(args.f_out) + 8);
+	if (!tmp)
+		return errmsg("cannot allocate memory");
+	sprintf(tmp, "%s.XXXXXX", args.f_out);
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		sys_errmsg("cannot create temporary file \"%s\"", tmp);
+		free(tmp);
+		return -1;
+	}
+	unlink(tmp);
+	free(tmp);
+
+	args.sparse_fd = args.out_fd;
+	args.out_fd = fd;
 	return 0;
 }
 
+static int write_sparse(const struct ubigen_info *ui)
+{
+	struct sparse_img si;
+	struct stat st;
+	int i, blk_cnt;
+	char *buf;
+
+	if (fstat(args.out_fd, &st))
+		return sys_errmsg("cannot stat the temporary file");
+	blk_cnt = st.st_size / ui->peb_size;
+
+	buf = malloc(ui->peb_size);
+	if (!buf)
+		return errmsg("cannot allocate memory");
+
+	if (sparse_img_create(&si, args.sparse_fd, ui->peb_size, blk_cnt,
+			      0xFF, 1))
+		goto out_free;
+
+	for (i = 0; i < blk_cnt; i++) {
+		off_t pos = (off_t)i * ui->peb_size;
+
+		if (pread(args.out_fd, buf, ui->peb_size, pos) != ui->peb_size) {
+			sys_errmsg("cannot read eraseblock %d of the temporary file",
+				   i);
+			goto out_sparse;
+		}
+		if (sparse_img_write(&si, i, buf, ui->peb_size))
+			goto out_sparse;
+	}
+
+	free(buf);
+	return sparse_img_finish(&si);
+
+out_sparse:
+	sparse_img_finish(&si);
+out_free:
+	free(buf);
+	return -1;
+}
+
 int main(int argc, char * const argv[])
 {
-	int err = -1, sects, i, autoresize_was_already = 0;
+	int err = -1, sects, i, peb_count = 0, fm_pebs = 0, peb;
 	struct ubigen_info ui;
 	struct ubi_vtbl_record *vtbl;
 	struct ubigen_vol_info *vi;
-	off_t seek;
+	struct ubigen_fm_vol *fm_vols = NULL;
+	struct vol_image *imgs;
 
 	err = parse_opt(argc, argv);
 	if (err)
@@ -441,6 +554,24 @@ int main(int argc, char * const argv[])
 	verbose(args.verbose, "data offset:               %d", ui.data_offs);
 	verbose(args.verbose, "UBI image sequence number: %u", ui.image_seq);
 
+	if (args.sparse) {
+		err = open_tmp();
+		if (err)
+			goto out;
+	}
+
+	if (args.flash_size) {
+		peb_count = args.flash_size / ui.peb_size;
+		fm_pebs = ubigen_fastmap_pebs(&ui, peb_count);
+		if (fm_pebs < 0) {
+			err = -1;
+			errmsg("flash of %d eraseblocks is too large for a fastmap",
+			       peb_count);
+			goto out;
+		}
+		verbose(args.verbose, "fastmap eraseblocks:       %d", fm_pebs);
+	}
+
 	vtbl = ubigen_create_empty_vtbl(&ui);
 	if (!vtbl) {
 		err = -1;
@@ -487,101 +618,114 @@ int main(int argc, char * const argv[])
 		goto out_dict;
 	}
 
-	/*
-	 * Skip 2 PEBs at the beginning of the file for the volume table which
-	 * will be written later.
-	 */
-	seek = ui.peb_size * 2;
-	if (lseek(args.out_fd, seek, SEEK_SET) != seek) {
+	imgs = calloc(sizeof(struct vol_image), sects);
+	if (!imgs) {
 		err = -1;
-		sys_errmsg("cannot seek file \"%s\"", args.f_out);
+		errmsg("cannot allocate memory");
 		goto out_free;
 	}
+	for (i = 0; i < sects; i++)
+		imgs[i].fd = -1;
+
+	if (args.flash_size) {
+		fm_vols = calloc(sizeof(struct ubigen_fm_vol), sects);
+		if (!fm_vols) {
+			err = -1;
+			errmsg("cannot allocate memory");
+			goto out_close;
+		}
+	}
+
+	/*
+	 * Skip 2 PEBs at the beginning of the file for the volume table, and
+	 * the PEBs of the fastmap, which will be written later.
+	 */
+	peb = 2 + fm_pebs;
 
 	for (i = 0; i < sects; i++) {
 		const char *sname = iniparser_getsecname(args.dict, i);
 		const char *img = NULL;
-		struct stat st;
-		int fd, j;
+		long long img_size;
+		int fd, img_sparse;
 
 		if (!sname) {
 			err = -1;
 			errmsg("ini-file parsing error (iniparser_getsecname)");
-			goto out_free;
+			goto out_close;
 		}
 
 		if (args.verbose)
 			printf("\n");
 		verbose(args.verbose, "parsing section \"%s\"", sname);
 
-		err = read_section(&ui, sname, &vi[i], &img, &st);
+		err = ubigen_read_ini_section(PROGRAM_NAME, &ui, args.dict,
+					      sname, &vi[i], &img, &img_size,
+					      &img_sparse, args.verbose);
 		if (err == -1)
-			goto out_free;
+			goto out_close;
 
 		verbose(args.verbose, "adding volume %d", vi[i].id);
 
-		/*
-		 * Make sure that volume ID and name is unique and that only
-		 * one volume has auto-resize flag
-		 */
-		for (j = 0; j < i; j++) {
-			if (vi[i].id == vi[j].id) {
-				err = -1;
-				errmsg("volume IDs must be unique, but ID %d "
-				       "in section \"%s\" is not",
-				       vi[i].id, sname);
-				goto out_free;
-			}
-
-			if (!strcmp(vi[i].name, vi[j].name)) {
-				err = -1;
-				errmsg("volume name must be unique, but name "
-				       "\"%s\" in section \"%s\" is not",
-				       vi[i].name, sname);
-				goto out_free;
-			}
-		}
-
-		if (vi[i].flags & UBI_VTBL_SKIP_CRC_CHECK_FLG &&
-		    vi[i].type != UBI_VID_STATIC)
-			return errmsg("skip-check is only valid for static volumes");
-
-		if (vi[i].flags & UBI_VTBL_AUTORESIZE_FLG) {
-			if (autoresize_was_already)
-				return errmsg("only one volume is allowed "
-					      "to have auto-resize flag");
-			autoresize_was_already = 1;
-		}
+		err = ubigen_check_ini_volume(PROGRAM_NAME, vi, i, sname);
+		if (err)
+			goto out_close;
 
 		err = ubigen_add_volume(&ui, &vi[i], vtbl);
 		if (err) {
 			errmsg("cannot add volume for section \"%s\"", sname);
-			goto out_free;
+			goto out_close;
 		}
 
+		if (fm_vols) {
+			fm_vols[i].vi = &vi[i];
+			fm_vols[i].peb = peb;
+		}
+
+		imgs[i].sname = sname;
+		imgs[i].peb = peb;
+
 		if (img) {
 			fd = open(img, O_RDONLY);
 			if (fd == -1) {
 				err = fd;
 				sys_errmsg("cannot open \"%s\"", img);
-				goto out_free;
+				goto out_close;
 			}
+			imgs[i].fd = fd;
 
 			verbose(args.verbose, "writing volume %d", vi[i].id);
 			verbose(args.verbose, "image file: %s", img);
 
-			err = ubigen_write_volume(&ui, &vi[i], args.ec, st.st_size, fd, args.out_fd);
-			close(fd);
-			if (err) {
-				errmsg("cannot write volume for section \"%s\"", sname);
-				goto out_free;
+			if (img_sparse) {
+				err = sparse_img_open(&imgs[i].si, fd);
+				if (err != 1) {
+					err = -1;
+					errmsg("cannot write volume for section \"%s\"",
+					       sname);
+					goto out_close;
+				}
+				verbose(args.verbose, "image file is sparse");
+				imgs[i].sparse = 1;
 			}
+			imgs[i].bytes = img_size;
+
+			if (fm_vols)
+				fm_vols[i].bytes = img_size;
+			peb += (img_size + vi[i].usable_leb_size - 1) /
+			       vi[i].usable_leb_size;
 		}
 
 		if (args.verbose)
 			printf("\n");
 	}
 
+	err = write_volumes(&ui, vi, imgs, sects);
+	close_images(imgs, sects);
+	free(imgs);
+	imgs = NULL;
+	if (err)
+		goto out_free;
+
 	verbose(args.verbose, "writing layout volume");
 
 	err = ubigen_write_layout_vol(&ui, 0, 1, args.ec, args.ec, vtbl, args.out_fd);
@@ -590,15 +734,44 @@ int main(int argc, char * const argv[])
 		goto out_free;
 	}
 
+	if (fm_vols) {
+		verbose(args.verbose, "writing fastmap");
+
+		err = ubigen_write_fastmap(&ui, peb_count, 2, 0, 1, args.ec,
+					   fm_vols, sects, args.out_fd);
+		if (err) {
+			errmsg("cannot write fastmap");
+			goto out_free;
+		}
+	}
+
+	if (args.sparse) {
+		verbose(args.verbose, "writing sparse image");
+
+		err = write_sparse(&ui);
+		if (err) {
+			errmsg("cannot write sparse image \"%s\"", args.f_out);
+			goto out_free;
+		}
+		close(args.sparse_fd);
+	}
+
 	verbose(args.verbose, "done");
 
+	free(fm_vols);
 	free(vi);
 	iniparser_freedict(args.dict);
 	free(vtbl);
 	close(args.out_fd);
 	return 0;
 
+out_close:
+	if (imgs) {
+		close_images(imgs, sects);
+		free(imgs);
+	}
 out_free:
+	free(fm_vols);
 	free(vi);
 out_dict:
 	iniparser_freedict(args.dict);
@@ -606,6 +779,8 @@ out_vtbl:
 	free(vtbl);
 out:
 	close(args.out_fd);
+	if (args.sparse_fd != -1)
+		close(args.sparse_fd);
 	remove(args.f_out);
 	return err;
 }
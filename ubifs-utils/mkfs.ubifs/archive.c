@@ -0,0 +1,992 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements reading the file system contents from a tar or cpio
+ * archive instead of a directory on the host.
+ *
+ * The archive is read once, from the beginning to the end, so it may be a
+ * pipe. Members may come in any order, so the directory tree is collected in
+ * memory and written by mkfs.ubifs when the whole archive has been read. File
+ * data is not kept in memory, it is handed over to mkfs.ubifs as soon as the
+ * member is read, which makes data nodes from it right away.
+ *
+ * Supported formats are POSIX ustar and pax (including extended attributes in
+ * "SCHILY.xattr." records), GNU tar long names, and the "newc" and "crc"
+ * cpio formats.
+ */
+
+#include "mkfs.ubifs.h"
+#include "hashtable/hashtable.h"
+
+#define TAR_BLOCK_SIZE 512
+#define CPIO_HDR_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define PAX_XATTR_PREFIX "SCHILY.xattr."
+
+/**
+ * struct archive_member - an archive member being read.
+ * @path: path name
+ * @link: link target of a symbolic or hard link
+ * @hardlink: @link is the target of a hard link
+ * @st: attributes (@st_dev and @st_ino are only used by cpio for hard links)
+ * @xattrs: extended attributes
+ */
+struct archive_member {
+	char *path;
+	char *link;
+	int hardlink;
+	struct stat st;
+	struct archive_xattr *xattrs;
+};
+
+/**
+ * struct pax_header - values from a pax extended header.
+ * @path: path name, or %NULL
+ * @link: link target, or %NULL
+ * @size: file size, or %-1
+ * @uid: user ID, or %-1
+ * @gid: group ID, or %-1
+ * @mtime: modification time, or %-1
+ * @atime: access time, or %-1
+ * @ctime: change time, or %-1
+ * @xattrs: extended attributes
+ */
+struct pax_header {
+	char *path;
+	char *link;
+	long long size;
+	long long uid;
+	long long gid;
+	long long mtime;
+	long long atime;
+	long long ctime;
+	struct archive_xattr *xattrs;
+};
+
+static struct ubifs_info *c = &info_;
+
+/* The archive file descriptor and the read buffer */
+static int arc_fd = -1;
+static const char *arc_name;
+static char arc_buf[64 * 1024];
+static size_t arc_pos;
+static size_t arc_len;
+
+/* Data bytes left in the current member and the padding after them */
+static long long data_left;
+static size_t data_pad;
+
+/* Path name to inode map of all the members read so far */
+static struct hashtable *path_htbl;
+/* Inode number to inode map of multiply linked cpio members */
+static struct hashtable *ino_htbl;
+
+static unsigned int path_hash(void *s)
+{
+	return key_r5_hash(s, strlen(s));
+}
+
+static int path_equal(void *k1, void *k2)
+{
+	return !strcmp(k1, k2);
+}
+
+/*
+ * Read exactly @len bytes from the archive. Returns %0 in case of success,
+ * %1 if the archive ended before the first byte and %-1 in case of failure.
+ */
+static int arc_read(void *buf, size_t len)
+{
+	char *p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		size_t l;
+
+		if (arc_pos == arc_len) {
+			ssize_t ret = read(arc_fd, arc_buf, sizeof(arc_buf));
+
+			if (ret < 0)
+				return sys_err_msg("cannot read archive '%s'",
+						   arc_name);
+			if (ret == 0) {
+				if (done == 0)
+					return 1;
+				return err_msg("archive '%s' is truncated",
+					       arc_name);
+			}
+			arc_pos = 0;
+			arc_len = ret;
+		}
+
+		l = min_t(size_t, len - done, arc_len - arc_pos);
+		memcpy(p + done, arc_buf + arc_pos, l);
+		arc_pos += l;
+		done += l;
+	}
+
+	return 0;
+}
+
+static int arc_read_all(void *buf, size_t len)
+{
+	int ret = arc_read(buf, len);
+
+	if (ret > 0)
+		return err_msg("archive '%s' is truncated", arc_name);
+	return ret;
+}
+
+static int arc_skip(long long len)
+{
+	char buf[TAR_BLOCK_SIZE];
+
+	while (len > 0) {
+		size_t l = min_t(long long, len, sizeof(buf));
+
+		if (arc_read_all(buf, l))
+			return -1;
+		len -= l;
+	}
+
+	return 0;
+}
+
+/* Read a whole member into a zero-terminated string */
+static char *arc_read_string(long long len, size_t pad)
+{
+	char *s;
+
+	if (len < 0 || len > 1024 * 1024) {
+		err_msg("bad string length %lld in archive '%s'", len,
+			arc_name);
+		return NULL;
+	}
+
+	s = xmalloc(len + 1);
+	if (arc_read_all(s, len) || arc_skip(pad)) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+/**
+ * read_archive_data - read data of the current archive member.
+ * @buf: buffer to read to
+ * @len: how many bytes to read
+ *
+ * Reads @len bytes, or less if the member has less data left. Returns the
+ * number of bytes read, %0 at the end of the member data and %-1 in case of
+ * failure.
+ */
+ssize_t read_archive_data(void *buf, size_t len)
+{
+	if ((long long)len > data_left)
+		len = data_left;
+	if (len == 0)
+		return 0;
+	if (arc_read_all(buf, len))
+		return -1;
+	data_left -= len;
+	return len;
+}
+
+static void free_xattrs(struct archive_xattr *xa)
+{
+	while (xa) {
+		struct archive_xattr *next = xa->next;
+
+		free(xa->name);
+		free(xa->value);
+		free(xa);
+		xa = next;
+	}
+}
+
+static void add_xattr_to_list(struct archive_xattr **list, char *name,
+			      void *value, unsigned int len)
+{
+	struct archive_xattr *xa = xzalloc(sizeof(*xa));
+
+	xa->name = name;
+	xa->value = value;
+	xa->len = len;
+	while (*list)
+		list = &(*list)->next;
+	*list = xa;
+}
+
+/*
+ * Convert an archive path name to the path name in the file system, without
+ * the leading '/' and without '.' components. The root directory is "".
+ * Returns %NULL if the path name goes outside of the file system root.
+ */
+static char *normalize_path(const char *path)
+{
+	char *res = xmalloc(strlen(path) + 1);
+	size_t len = 0;
+
+	while (*path) {
+		const char *end = strchrnul(path, '/');
+		size_t l = end - path;
+
+		if (l == 2 && !memcmp(path, "..", 2)) {
+			free(res);
+			return NULL;
+		}
+		if (l && !(l == 1 && *path == '.')) {
+			if (len)
+				res[len++] = '/';
+			memcpy(res + len, path, l);
+			len += l;
+		}
+		path = *end ? end + 1 : end;
+	}
+
+	res[len] = '\0';
+	return res;
+}
+
+static struct archive_inode *new_inode(const struct stat *st, ino_t inum)
+{
+	struct archive_inode *ai = xzalloc(sizeof(*ai));
+
+	ai->st = *st;
+	ai->st.st_nlink = 0;
+	ai->st.st_size = S_ISREG(st->st_mode) ? st->st_size : 0;
+	ai->inum = inum;
+	ai->creat_sqnum = ++c->max_sqnum;
+	return ai;
+}
+
+static void add_child(struct archive_inode *dir, const char *name,
+		      struct archive_inode *ai)
+{
+	struct archive_dent *de = xzalloc(sizeof(*de));
+
+	de->name = xstrdup(name);
+	de->inode = ai;
+	if (dir->last_child)
+		dir->last_child->next = de;
+	else
+		dir->children = de;
+	dir->last_child = de;
+	ai->st.st_nlink += 1;
+}
+
+/*
+ * Find the directory @path, creating it and its parents if the archive did
+ * not contain them (yet). Such directories get the attributes of the root
+ * directory. @path is modified temporarily.
+ */
+static struct archive_inode *lookup_dir(struct archive_inode *root,
+					char *path)
+{
+	struct archive_inode *dir, *parent;
+	char *name;
+
+	if (!*path)
+		return root;
+
+	dir = hashtable_search(path_htbl, path);
+	if (dir) {
+		if (!S_ISDIR(dir->st.st_mode)) {
+			err_msg("'%s' in archive '%s' is not a directory",
+				path, arc_name);
+			return NULL;
+		}
+		return dir;
+	}
+
+	name = strrchr(path, '/');
+	if (name) {
+		*name = '\0';
+		parent = lookup_dir(root, path);
+		*name++ = '/';
+	} else {
+		parent = root;
+		name = path;
+	}
+	if (!parent)
+		return NULL;
+
+	dir = new_inode(&root->st, ++c->highest_inum);
+	if (!hashtable_insert(path_htbl, xstrdup(path), dir)) {
+		free(dir);
+		err_msg("out of memory");
+		return NULL;
+	}
+	add_child(parent, name, dir);
+	return dir;
+}
+
+/* Make the hash table key for a cpio inode */
+static char *ino_key(const struct stat *st)
+{
+	char *key;
+
+	xasprintf(&key, "%llx:%llx", (unsigned long long)st->st_dev,
+		  (unsigned long long)st->st_ino);
+	return key;
+}
+
+/*
+ * Add an archive member to the directory tree, and read its data if it is a
+ * regular file. The member is consumed.
+ */
+static int add_member(struct archive_inode *root, struct archive_member *m,
+		      int (*add_file_data)(struct archive_inode *ai,
+					   const char *path),
+		      int cpio)
+{
+	struct archive_inode *ai = NULL, *dir;
+	char *path, *name;
+	int err = -1;
+
+	path = normalize_path(m->path);
+	if (!path) {
+		err_msg("member '%s' of archive '%s' is outside of the root directory",
+			m->path, arc_name);
+		goto out;
+	}
+
+	dbg_msg(2, "%s", path);
+
+	if (!*path) {
+		/* The root directory itself */
+		if (!S_ISDIR(m->st.st_mode)) {
+			err_msg("root of archive '%s' is not a directory",
+				arc_name);
+			goto out;
+		}
+		root->st = m->st;
+		free_xattrs(root->xattrs);
+		root->xattrs = m->xattrs;
+		m->xattrs = NULL;
+		err = 0;
+		goto out;
+	}
+
+	name = strrchr(path, '/');
+	if (name) {
+		*name = '\0';
+		dir = lookup_dir(root, path);
+		*name++ = '/';
+	} else {
+		dir = root;
+		name = path;
+	}
+	if (!dir)
+		goto out;
+
+	if (strlen(name) > UBIFS_MAX_NLEN) {
+		err_msg("name '%s' in archive '%s' is too long", name, arc_name);
+		goto out;
+	}
+
+	ai = hashtable_search(path_htbl, path);
+	if (ai) {
+		/* Directories may be listed again, after their contents */
+		if (S_ISDIR(ai->st.st_mode) && S_ISDIR(m->st.st_mode)) {
+			ai->st = m->st;
+			free_xattrs(ai->xattrs);
+			ai->xattrs = m->xattrs;
+			m->xattrs = NULL;
+			err = 0;
+			goto out;
+		}
+		err_msg("archive '%s' contains '%s' more than once", arc_name,
+			path);
+		goto out;
+	}
+
+	if (m->hardlink) {
+		char *target = normalize_path(m->link);
+
+		if (target)
+			ai = hashtable_search(path_htbl, target);
+		free(target);
+		if (!ai || S_ISDIR(ai->st.st_mode)) {
+			err_msg("bad hard link target '%s' of '%s' in archive '%s'",
+				m->link, path, arc_name);
+			goto out;
+		}
+	} else if (cpio && !S_ISDIR(m->st.st_mode) && m->st.st_nlink > 1) {
+		/*
+		 * The links of a multiply linked cpio inode all have the same
+		 * inode number, and only one of them (usually the last one)
+		 * carries the data.
+		 */
+		char *key = ino_key(&m->st);
+
+		ai = hashtable_search(ino_htbl, key);
+		if (ai) {
+			free(key);
+			if (m->st.st_size && !ai->st.st_size &&
+			    S_ISREG(ai->st.st_mode)) {
+				ai->st.st_size = m->st.st_size;
+				if (add_file_data(ai, path))
+					goto out;
+			}
+		} else {
+			ai = new_inode(&m->st, ++c->highest_inum);
+			if (!hashtable_insert(ino_htbl, key, ai)) {
+				free(ai);
+				err_msg("out of memory");
+				goto out;
+			}
+			ai->xattrs = m->xattrs;
+			m->xattrs = NULL;
+			if (S_ISLNK(m->st.st_mode))
+				ai->target = xstrdup(m->link);
+			if (S_ISREG(m->st.st_mode) && m->st.st_size &&
+			    add_file_data(ai, path))
+				goto out;
+		}
+	} else {
+		ai = new_inode(&m->st, ++c->highest_inum);
+		ai->xattrs = m->xattrs;
+		m->xattrs = NULL;
+		if (S_ISLNK(m->st.st_mode)) {
+			if (strlen(m->link) > UBIFS_MAX_INO_DATA) {
+				free(ai);
+				err_msg("symlink too long for '%s'", path);
+				goto out;
+			}
+			ai->target = xstrdup(m->link);
+		}
+		if (S_ISREG(m->st.st_mode) && m->st.st_size &&
+		    add_file_data(ai, path)) {
+			free(ai);
+			goto out;
+		}
+	}
+
+	if (!hashtable_insert(path_htbl, path, ai)) {
+		err_msg("out of memory");
+		goto out;
+	}
+	add_child(dir, name, ai);
+	path = NULL;
+	err = 0;
+
+out:
+	free(path);
+	return err;
+}
+
+/* Parse a number in a tar header field (octal or GNU base-256) */
+static long long tar_number(const char *p, int len)
+{
+	long long v = 0;
+
+	if (*p & 0x80) {
+		v = *p++ & 0x3f;
+		while (--len)
+			v = (v << 8) | (unsigned char)*p++;
+		return v;
+	}
+
+	while (len && (*p == ' ' || *p == '\0')) {
+		p++;
+		len--;
+	}
+	while (len && *p >= '0' && *p <= '7') {
+		v = v * 8 + *p++ - '0';
+		len--;
+	}
+	return v;
+}
+
+static int tar_checksum_ok(const char *blk)
+{
+	long long chksum = tar_number(blk + 148, 8);
+	unsigned long usum = 0;
+	long ssum = 0;
+	int i;
+
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+		int ch = (i >= 148 && i < 156) ? ' ' : blk[i];
+
+		usum += (unsigned char)ch;
+		ssum += (signed char)ch;
+	}
+
+	return chksum == (long long)usum || chksum == (long long)ssum;
+}
+
+/* Copy a tar header string field, which may not be zero-terminated */
+static char *tar_string(const char *p, int len)
+{
+	char *s;
+
+	len = strnlen(p, len);
+	s = xmalloc(len + 1);
+	memcpy(s, p, len);
+	s[len] = '\0';
+	return s;
+}
+
+static int parse_pax(char *data, long long len, struct pax_header *pax)
+{
+	char *p = data, *end = data + len;
+
+	while (p < end) {
+		char *rec, *key, *val, *eq;
+		long long rlen, vlen;
+
+		rlen = strtoll(p, &rec, 10);
+		if (rec == p || *rec != ' ' || rlen <= rec - p ||
+		    rlen > end - p || p[rlen - 1] != '\n')
+			return err_msg("bad pax header in archive '%s'",
+				       arc_name);
+
+		key = rec + 1;
+		eq = memchr(key, '=', p + rlen - key);
+		if (!eq)
+			return err_msg("bad pax header in archive '%s'",
+				       arc_name);
+		*eq = '\0';
+		val = eq + 1;
+		vlen = p + rlen - 1 - val;
+		val[vlen] = '\0';
+
+		if (!strcmp(key, "path")) {
+			free(pax->path);
+			pax->path = xstrdup(val);
+		} else if (!strcmp(key, "linkpath")) {
+			free(pax->link);
+			pax->link = xstrdup(val);
+		} else if (!strcmp(key, "size")) {
+			pax->size = strtoll(val, NULL, 10);
+		} else if (!strcmp(key, "uid")) {
+			pax->uid = strtoll(val, NULL, 10);
+		} else if (!strcmp(key, "gid")) {
+			pax->gid = strtoll(val, NULL, 10);
+		} else if (!strcmp(key, "mtime")) {
+			pax->mtime = strtoll(val, NULL, 10);
+		} else if (!strcmp(key, "atime")) {
+			pax->atime = strtoll(val, NULL, 10);
+		} else if (!strcmp(key, "ctime")) {
+			pax->ctime = strtoll(val, NULL, 10);
+		} else if (!strncmp(key, PAX_XATTR_PREFIX,
+				    strlen(PAX_XATTR_PREFIX))) {
+			void *v;
+
+			if (vlen > UBIFS_MAX_INO_DATA)
+				return err_msg("extended attribute '%s' is too big",
+					       key + strlen(PAX_XATTR_PREFIX));
+			v = xmalloc(vlen + 1);
+			memcpy(v, val, vlen);
+			add_xattr_to_list(&pax->xattrs,
+					  xstrdup(key + strlen(PAX_XATTR_PREFIX)),
+					  v, vlen);
+		} else if (!strncmp(key, "GNU.sparse.", 11)) {
+			return err_msg("sparse files in archive '%s' are not supported",
+				       arc_name);
+		}
+
+		p += rlen;
+	}
+
+	return 0;
+}
+
+static void free_pax(struct pax_header *pax)
+{
+	free(pax->path);
+	free(pax->link);
+	free_xattrs(pax->xattrs);
+	memset(pax, 0, sizeof(*pax));
+	pax->size = pax->uid = pax->gid = -1;
+	pax->mtime = pax->atime = pax->ctime = -1;
+}
+
+static int read_tar(struct archive_inode *root,
+		    int (*add_file_data)(struct archive_inode *ai,
+					 const char *path))
+{
+	char blk[TAR_BLOCK_SIZE];
+	struct pax_header pax = { .path = NULL };
+	char *long_name = NULL, *long_link = NULL;
+	int err = -1;
+
+	free_pax(&pax);
+
+	while (1) {
+		struct archive_member m;
+		long long size;
+		char type;
+		int ret;
+
+		ret = arc_read(blk, TAR_BLOCK_SIZE);
+		if (ret < 0)
+			goto out;
+		if (ret > 0 || !blk[0]) {
+			/* The end of archive marker, or just the end */
+			err = 0;
+			goto out;
+		}
+
+		if (!tar_checksum_ok(blk)) {
+			err_msg("bad tar header checksum in archive '%s'",
+				arc_name);
+			goto out;
+		}
+
+		type = blk[156];
+		size = tar_number(blk + 124, 12);
+		data_pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) %
+			   TAR_BLOCK_SIZE;
+
+		switch (type) {
+		case 'L':
+			free(long_name);
+			long_name = arc_read_string(size, data_pad);
+			if (!long_name)
+				goto out;
+			continue;
+		case 'K':
+			free(long_link);
+			long_link = arc_read_string(size, data_pad);
+			if (!long_link)
+				goto out;
+			continue;
+		case 'x': {
+			char *data = arc_read_string(size, data_pad);
+
+			if (!data)
+				goto out;
+			ret = parse_pax(data, size, &pax);
+			free(data);
+			if (ret)
+				goto out;
+			continue;
+		}
+		case 'g':
+		case 'V':
+			if (arc_skip(size + data_pad))
+				goto out;
+			continue;
+		}
+
+		if (pax.size >= 0) {
+			size = pax.size;
+			data_pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) %
+				   TAR_BLOCK_SIZE;
+		}
+		data_left = size;
+
+		memset(&m, 0, sizeof(m));
+		m.st.st_mode = tar_number(blk + 100, 8) & 07777;
+		m.st.st_uid = tar_number(blk + 108, 8);
+		m.st.st_gid = tar_number(blk + 116, 8);
+		m.st.st_size = size;
+		m.st.st_mtime = tar_number(blk + 136, 12);
+		m.st.st_rdev = makedev(tar_number(blk + 329, 8),
+				       tar_number(blk + 337, 8));
+
+		switch (type) {
+		case '0':
+		case '\0':
+		case '7':
+			m.st.st_mode |= S_IFREG;
+			break;
+		case '1':
+			m.hardlink = 1;
+			break;
+		case '2':
+			m.st.st_mode |= S_IFLNK;
+			break;
+		case '3':
+			m.st.st_mode |= S_IFCHR;
+			break;
+		case '4':
+			m.st.st_mode |= S_IFBLK;
+			break;
+		case '5':
+			m.st.st_mode |= S_IFDIR;
+			break;
+		case '6':
+			m.st.st_mode |= S_IFIFO;
+			break;
+		default:
+			err_msg("unsupported tar member type '%c' in archive '%s'",
+				type, arc_name);
+			goto out;
+		}
+
+		if (pax.path)
+			m.path = xstrdup(pax.path);
+		else if (long_name)
+			m.path = xstrdup(long_name);
+		else if (!memcmp(blk + 257, "ustar", 6) && blk[345]) {
+			char *prefix = tar_string(blk + 345, 155);
+			char *name = tar_string(blk, 100);
+
+			xasprintf(&m.path, "%s/%s", prefix, name);
+			free(prefix);
+			free(name);
+		} else
+			m.path = tar_string(blk, 100);
+
+		if (pax.link)
+			m.link = xstrdup(pax.link);
+		else if (long_link)
+			m.link = xstrdup(long_link);
+		else
+			m.link = tar_string(blk + 157, 100);
+
+		if (pax.uid >= 0)
+			m.st.st_uid = pax.uid;
+		if (pax.gid >= 0)
+			m.st.st_gid = pax.gid;
+		if (pax.mtime >= 0)
+			m.st.st_mtime = pax.mtime;
+		m.st.st_atime = pax.atime >= 0 ? pax.atime : m.st.st_mtime;
+		m.st.st_ctime = pax.ctime >= 0 ? pax.ctime : m.st.st_mtime;
+		m.xattrs = pax.xattrs;
+		pax.xattrs = NULL;
+
+		if (!S_ISREG(m.st.st_mode))
+			m.st.st_size = 0;
+
+		ret = add_member(root, &m, add_file_data, 0);
+		free(m.path);
+		free(m.link);
+		free_xattrs(m.xattrs);
+		if (ret)
+			goto out;
+
+		/* Skip whatever has not been read of the member data */
+		if (arc_skip(data_left + data_pad))
+			goto out;
+		data_left = 0;
+
+		free_pax(&pax);
+		free(long_name);
+		free(long_link);
+		long_name = long_link = NULL;
+	}
+
+out:
+	free_pax(&pax);
+	free(long_name);
+	free(long_link);
+	return err;
+}
+
+static int cpio_field(const char *hdr, int n, unsigned long *val)
+{
+	char buf[9], *endp;
+
+	memcpy(buf, hdr + 6 + n * 8, 8);
+	buf[8] = '\0';
+	*val = strtoul(buf, &endp, 16);
+	if (*endp)
+		return err_msg("bad cpio header in archive '%s'", arc_name);
+	return 0;
+}
+
+static int read_cpio(struct archive_inode *root,
+		     int (*add_file_data)(struct archive_inode *ai,
+					  const char *path))
+{
+	char hdr[CPIO_HDR_SIZE];
+
+	while (1) {
+		struct archive_member m;
+		unsigned long f[13];
+		size_t pad;
+		int i, ret;
+
+		ret = arc_read(hdr, CPIO_HDR_SIZE);
+		if (ret)
+			return ret > 0 ?
+			       err_msg("archive '%s' has no trailer", arc_name) :
+			       -1;
+
+		if (memcmp(hdr, "070701", 6) && memcmp(hdr, "070702", 6))
+			return err_msg("archive '%s' is not a newc or crc cpio archive",
+				       arc_name);
+
+		/*
+		 * ino, mode, uid, gid, nlink, mtime, filesize, devmajor,
+		 * devminor, rdevmajor, rdevminor, namesize, check
+		 */
+		for (i = 0; i < 13; i++)
+			if (cpio_field(hdr, i, &f[i]))
+				return -1;
+
+		if (f[11] == 0 || f[11] > PATH_MAX)
+			return err_msg("bad name size in archive '%s'", arc_name);
+
+		memset(&m, 0, sizeof(m));
+		pad = (4 - (CPIO_HDR_SIZE + f[11]) % 4) % 4;
+		m.path = arc_read_string(f[11], pad);
+		if (!m.path)
+			return -1;
+
+		data_left = f[6];
+		data_pad = (4 - f[6] % 4) % 4;
+
+		if (!strcmp(m.path, CPIO_TRAILER)) {
+			free(m.path);
+			return 0;
+		}
+
+		m.st.st_ino = f[0];
+		m.st.st_mode = f[1];
+		m.st.st_uid = f[2];
+		m.st.st_gid = f[3];
+		m.st.st_nlink = f[4];
+		m.st.st_mtime = f[5];
+		m.st.st_atime = m.st.st_ctime = m.st.st_mtime;
+		m.st.st_size = f[6];
+		m.st.st_dev = makedev(f[7], f[8]);
+		m.st.st_rdev = makedev(f[9], f[10]);
+
+		switch (m.st.st_mode & S_IFMT) {
+		case S_IFREG:
+		case S_IFDIR:
+		case S_IFLNK:
+		case S_IFCHR:
+		case S_IFBLK:
+		case S_IFIFO:
+		case S_IFSOCK:
+			break;
+		default:
+			err_msg("'%s' in archive '%s' has unknown inode type",
+				m.path, arc_name);
+			free(m.path);
+			return -1;
+		}
+
+		if (S_ISLNK(m.st.st_mode)) {
+			if (f[6] > UBIFS_MAX_INO_DATA) {
+				err_msg("symlink too long for '%s'", m.path);
+				free(m.path);
+				return -1;
+			}
+			m.link = arc_read_string(f[6], data_pad);
+			if (!m.link) {
+				free(m.path);
+				return -1;
+			}
+			data_left = data_pad = 0;
+		}
+
+		if (!S_ISREG(m.st.st_mode))
+			m.st.st_size = 0;
+
+		ret = add_member(root, &m, add_file_data, 1);
+		free(m.path);
+		free(m.link);
+		free_xattrs(m.xattrs);
+		if (ret)
+			return -1;
+
+		if (arc_skip(data_left + data_pad))
+			return -1;
+		data_left = 0;
+	}
+}
+
+/**
+ * read_archive - read the directory tree from an archive.
+ * @file: archive file name, "-" for the standard input
+ * @format: %ARCHIVE_TAR or %ARCHIVE_CPIO
+ * @root: the root directory, its attributes are replaced if the archive
+ *        contains the root directory
+ * @add_file_data: called for each regular file which has data, with its path
+ *                 name relative to the root directory, it has to read the
+ *                 data with 'read_archive_data()'
+ *
+ * All inodes get target inode numbers and creation sequence numbers assigned
+ * as they are read, so that they are older than the data nodes. Returns
+ * zero in case of success and %-1 in case of failure.
+ */
+int read_archive(const char *file, int format, struct archive_inode *root,
+		 int (*add_file_data)(struct archive_inode *ai,
+				      const char *path))
+{
+	int err;
+
+	arc_name = file;
+	if (!strcmp(file, "-"))
+		arc_fd = STDIN_FILENO;
+	else
+		arc_fd = open(file, O_RDONLY | O_LARGEFILE);
+	if (arc_fd == -1)
+		return sys_err_msg("cannot open archive '%s'", file);
+
+	path_htbl = create_hashtable(1024, &path_hash, &path_equal);
+	ino_htbl = create_hashtable(128, &path_hash, &path_equal);
+	if (!path_htbl || !ino_htbl) {
+		err = err_msg("out of memory");
+		goto out;
+	}
+
+	if (format == ARCHIVE_TAR)
+		err = read_tar(root, add_file_data);
+	else
+		err = read_cpio(root, add_file_data);
+
+out:
+	if (path_htbl)
+		hashtable_destroy(path_htbl, 0);
+	if (ino_htbl)
+		hashtable_destroy(ino_htbl, 0);
+	path_htbl = ino_htbl = NULL;
+	if (arc_fd != STDIN_FILENO)
+		close(arc_fd);
+	arc_fd = -1;
+	return err;
+}
+
+/**
+ * free_archive - free a directory tree read from an archive.
+ * @dir: the root directory of the tree
+ *
+ * The root directory itself is not freed. Multiply linked inodes are freed
+ * when their last directory entry is.
+ */
+void free_archive(struct archive_inode *dir)
+{
+	struct archive_dent *de = dir->children;
+
+	while (de) {
+		struct archive_dent *next = de->next;
+		struct archive_inode *ai = de->inode;
+
+		if (S_ISDIR(ai->st.st_mode))
+			free_archive(ai);
+		if (S_ISDIR(ai->st.st_mode) || --ai->st.st_nlink == 0) {
+			free(ai->target);
+			free_xattrs(ai->xattrs);
+			free(ai);
+		}
+		free(de->name);
+		free(de);
+		de = next;
+	}
+
+	free_xattrs(dir->xattrs);
+	dir->children = dir->last_child = NULL;
+	dir->xattrs = NULL;
+}
@@ -0,0 +1,591 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements the build cache, which keeps compressed data blocks
+ * from earlier runs of mkfs.ubifs, so that blocks which did not change do not
+ * have to be compressed again.
+ *
+ * The cache is a directory with three files:
+ *   data  - the compressed blocks, one after the other
+ *   index - a header followed by one 'struct cache_rec' per block in 'data'
+ *   lock  - locked while mkfs.ubifs uses the cache
+ *
+ * Blocks are looked up by the SHA-256 digest of their uncompressed contents,
+ * the requested compressor and the compression settings. Both files are in
+ * host byte order, the cache is not meant to be moved between machines.
+ *
+ * New blocks are appended to 'data' while there is room for them. When the
+ * cache has grown over its size limit, only the blocks used by the current
+ * run are kept when it is closed.
+ */
+
+#include <pthread.h>
+#include <sys/file.h>
+#include <openssl/evp.h>
+#ifndef WITHOUT_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifndef WITHOUT_ZSTD
+#include <zstd.h>
+#endif
+
+#define crc32 __zlib_crc32
+#include <zlib.h>
+#undef crc32
+
+#include "mkfs.ubifs.h"
+#include "cache.h"
+#include "stats.h"
+#include <crc32.h>
+
+#define CACHE_MAGIC "UBIFSBC1"
+#define CACHE_DIGEST_LEN 32
+
+/**
+ * struct cache_hdr - build cache index header.
+ * @magic: %CACHE_MAGIC
+ * @cnt: number of records following the header
+ * @padding: reserved, zeroes
+ */
+struct cache_hdr {
+	char magic[8];
+	uint32_t cnt;
+	uint32_t padding;
+};
+
+/**
+ * struct cache_rec - build cache index record.
+ * @digest: SHA-256 digest of the uncompressed block
+ * @offs: offset of the compressed block in the data file
+ * @len: length of the compressed block
+ * @crc: CRC32 checksum of the compressed block
+ * @settings: checksum of the compression settings
+ * @type: requested compressor
+ * @compr_type: compressor which was actually used
+ */
+struct cache_rec {
+	uint8_t digest[CACHE_DIGEST_LEN];
+	uint64_t offs;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t settings;
+	uint16_t type;
+	uint16_t compr_type;
+};
+
+/**
+ * struct build_cache - the build cache.
+ * @lock: protects everything below
+ * @dir: cache directory
+ * @lock_fd: file descriptor of the lock file
+ * @data_fd: file descriptor of the data file
+ * @data_size: size of the data file
+ * @used_size: size of the blocks used by this run
+ * @max_size: maximum size of the data file
+ * @settings: checksum of the compression settings of this run
+ * @recs: index records
+ * @used: whether the block of each record was used by this run
+ * @cnt: number of index records
+ * @max: number of index records there is room for
+ * @slots: hash table of record numbers plus one (zero if the slot is empty)
+ * @slot_cnt: number of hash table slots (a power of 2)
+ * @hits: blocks found in the cache
+ * @misses: blocks not found in the cache
+ * @full: blocks not stored because the cache was full
+ * @bad: cached blocks which could not be read back
+ */
+struct build_cache {
+	pthread_mutex_t lock;
+	char *dir;
+	int lock_fd;
+	int data_fd;
+	long long data_size;
+	long long used_size;
+	long long max_size;
+	uint32_t settings;
+	struct cache_rec *recs;
+	uint8_t *used;
+	size_t cnt;
+	size_t max;
+	uint32_t *slots;
+	size_t slot_cnt;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long full;
+	unsigned long long bad;
+};
+
+static struct ubifs_info *c = &info_;
+static struct build_cache bc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock_fd = -1,
+	.data_fd = -1,
+};
+
+static size_t slot_of(const uint8_t *digest, int type)
+{
+	uint32_t h;
+
+	memcpy(&h, digest, sizeof(h));
+	return (h ^ (type * 0x9E3779B9U) ^ bc.settings) & (bc.slot_cnt - 1);
+}
+
+static struct cache_rec *find_rec(const uint8_t *digest, int type,
+				  size_t *n)
+{
+	size_t i;
+
+	if (!bc.cnt)
+		return NULL;
+
+	for (i = slot_of(digest, type); bc.slots[i];
+	     i = (i + 1) & (bc.slot_cnt - 1)) {
+		struct cache_rec *rec = &bc.recs[bc.slots[i] - 1];
+
+		if (rec->type == type && rec->settings == bc.settings &&
+		    !memcmp(rec->digest, digest, CACHE_DIGEST_LEN)) {
+			*n = bc.slots[i] - 1;
+			return rec;
+		}
+	}
+
+	return NULL;
+}
+
+static void hash_rec(size_t n)
+{
+	size_t i;
+
+	i = slot_of(bc.recs[n].digest, bc.recs[n].type);
+	while (bc.slots[i])
+		i = (i + 1) & (bc.slot_cnt - 1);
+	bc.slots[i] = n + 1;
+}
+
+/*
+ * Records with other settings are hashed too, they simply never match. The
+ * hash table is kept at most half full.
+ */
+static void add_rec(const struct cache_rec *rec, int used)
+{
+	size_t i;
+
+	if (bc.cnt == bc.max) {
+		bc.max = bc.max ? bc.max * 2 : 4096;
+		bc.recs = xrealloc(bc.recs, bc.max * sizeof(struct cache_rec));
+		bc.used = xrealloc(bc.used, bc.max);
+	}
+
+	if (2 * (bc.cnt + 1) > bc.slot_cnt) {
+		bc.slot_cnt = bc.slot_cnt ? bc.slot_cnt * 2 : 8192;
+		free(bc.slots);
+		bc.slots = xzalloc(bc.slot_cnt * sizeof(uint32_t));
+		for (i = 0; i < bc.cnt; i++)
+			hash_rec(i);
+	}
+
+	bc.recs[bc.cnt] = *rec;
+	bc.used[bc.cnt] = used;
+	hash_rec(bc.cnt);
+	bc.cnt += 1;
+}
+
+static char *cache_path(const char *name)
+{
+	char *path;
+
+	xasprintf(&path, "%s/%s", bc.dir, name);
+	return path;
+}
+
+/*
+ * The compressed blocks depend on the compressor library versions as well,
+ * and images built from the cache have to be the same as images built
+ * without it.
+ */
+static uint32_t settings_checksum(void)
+{
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "favor_lzo %d favor_percent %d "
+		       "precheck %d zlib %s lzo %s zstd %u", c->favor_lzo,
+		       c->favor_percent, c->compr_precheck, zlibVersion(),
+#ifndef WITHOUT_LZO
+		       lzo_version_string(),
+#else
+		       "none",
+#endif
+#ifndef WITHOUT_ZSTD
+		       ZSTD_versionNumber()
+#else
+		       0
+#endif
+		       );
+
+	return mtd_crc32(0, buf, len);
+}
+
+/*
+ * Without a valid index, the data file is of no use either.
+ */
+static int drop_cache(void)
+{
+	if (verbose)
+		printf("build cache: bad or missing index, dropping cached data\n");
+	if (ftruncate(bc.data_fd, 0) == -1)
+		return sys_err_msg("cannot truncate the build cache data file");
+	bc.data_size = 0;
+	return 0;
+}
+
+static int load_index(void)
+{
+	struct cache_hdr hdr;
+	struct cache_rec *recs;
+	struct stat st;
+	char *path;
+	size_t i;
+	ssize_t sz;
+	int fd;
+
+	path = cache_path("index");
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			return sys_err_msg("cannot open the build cache index");
+		return bc.data_size ? drop_cache() : 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		sys_err_msg("cannot stat the build cache index");
+		close(fd);
+		return -1;
+	}
+
+	/* The record count must match the size of the index file */
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    st.st_size != (off_t)(sizeof(hdr) +
+				  (size_t)hdr.cnt * sizeof(struct cache_rec))) {
+		close(fd);
+		return drop_cache();
+	}
+
+	sz = (size_t)hdr.cnt * sizeof(struct cache_rec);
+	recs = xmalloc(sz);
+	if (read(fd, recs, sz) != sz) {
+		free(recs);
+		close(fd);
+		return drop_cache();
+	}
+	close(fd);
+
+	for (i = 0; i < hdr.cnt; i++)
+		if (recs[i].offs + recs[i].len <= (uint64_t)bc.data_size &&
+		    recs[i].len <= UBIFS_BLOCK_SIZE)
+			add_rec(&recs[i], 0);
+
+	free(recs);
+	return 0;
+}
+
+/**
+ * open_build_cache - open the build cache.
+ * @dir: cache directory, created if it does not exist
+ * @max_size: size limit of the cached data
+ *
+ * Returns zero in case of success and %-1 in case of failure.
+ */
+int open_build_cache(const char *dir, long long max_size)
+{
+	struct stat st;
+	char *path;
+
+	bc.dir = xstrdup(dir);
+	bc.max_size = max_size;
+	bc.settings = settings_checksum();
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		return sys_err_msg("cannot create build cache directory '%s'",
+				   dir);
+
+	path = cache_path("lock");
+	bc.lock_fd = open(path, O_RDWR | O_CREAT, 0644);
+	free(path);
+	if (bc.lock_fd == -1)
+		return sys_err_msg("cannot open the build cache lock file");
+	if (flock(bc.lock_fd, LOCK_EX) == -1)
+		return sys_err_msg("cannot lock the build cache");
+
+	path = cache_path("data");
+	bc.data_fd = open(path, O_RDWR | O_CREAT, 0644);
+	free(path);
+	if (bc.data_fd == -1)
+		return sys_err_msg("cannot open the build cache data file");
+	if (fstat(bc.data_fd, &st) == -1)
+		return sys_err_msg("cannot stat the build cache data file");
+	bc.data_size = st.st_size;
+
+	return load_index();
+}
+
+/**
+ * cached_compress_data - compress data using the build cache.
+ * @in_buf: data to compress
+ * @in_len: length of the data to compress
+ * @out_buf: output buffer where compressed data should be stored
+ * @out_len: output buffer length is returned here
+ * @type: type of compression
+ *
+ * The same as 'compress_data()', except that the result is taken from the
+ * build cache if the block has been compressed before, and stored in the
+ * build cache otherwise. This function may be called by several threads at
+ * the same time.
+ */
+int cached_compress_data(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len, int type)
+{
+	uint8_t digest[CACHE_DIGEST_LEN];
+	struct cache_rec rec, *r;
+	size_t n;
+	int compr_type;
+
+	if (bc.data_fd == -1 || in_len < UBIFS_MIN_COMPR_LEN)
+		return compress_data(in_buf, in_len, out_buf, out_len, type);
+
+	if (!EVP_Digest(in_buf, in_len, digest, NULL, EVP_sha256(), NULL))
+		return compress_data(in_buf, in_len, out_buf, out_len, type);
+
+	pthread_mutex_lock(&bc.lock);
+	r = find_rec(digest, type, &n);
+	if (r) {
+		rec = *r;
+		if (!bc.used[n]) {
+			bc.used[n] = 1;
+			bc.used_size += rec.len;
+		}
+	}
+	pthread_mutex_unlock(&bc.lock);
+
+	if (r && rec.len <= *out_len &&
+	    pread(bc.data_fd, out_buf, rec.len, rec.offs) == rec.len &&
+	    mtd_crc32(0, out_buf, rec.len) == rec.crc) {
+		pthread_mutex_lock(&bc.lock);
+		bc.hits += 1;
+		pthread_mutex_unlock(&bc.lock);
+		*out_len = rec.len;
+		return rec.compr_type;
+	}
+
+	compr_type = compress_data(in_buf, in_len, out_buf, out_len, type);
+
+	pthread_mutex_lock(&bc.lock);
+	bc.misses += 1;
+	if (r) {
+		/*
+		 * The cached block is damaged, store it again, unless another
+		 * thread has already stored it again or dropped it.
+		 */
+		if (!bc.used[n] || bc.recs[n].offs != rec.offs)
+			goto out_unlock;
+		bc.bad += 1;
+		bc.used[n] = 0;
+		bc.used_size -= rec.len;
+	} else if (find_rec(digest, type, &n)) {
+		/* Another thread has just stored the same block */
+		goto out_unlock;
+	}
+
+	/*
+	 * Only the blocks of this run count against the limit. If the data
+	 * file grows over it, the unused blocks from earlier runs are dropped
+	 * when the cache is closed, which brings it back under the limit.
+	 */
+	if (bc.used_size + (long long)*out_len > bc.max_size) {
+		bc.full += 1;
+	} else if (pwrite(bc.data_fd, out_buf, *out_len, bc.data_size) ==
+		   (ssize_t)*out_len) {
+		memcpy(rec.digest, digest, CACHE_DIGEST_LEN);
+		rec.offs = bc.data_size;
+		rec.len = *out_len;
+		rec.crc = mtd_crc32(0, out_buf, *out_len);
+		rec.settings = bc.settings;
+		rec.type = type;
+		rec.compr_type = compr_type;
+		if (r) {
+			bc.recs[n] = rec;
+			bc.used[n] = 1;
+		} else {
+			add_rec(&rec, 1);
+		}
+		bc.data_size += *out_len;
+		bc.used_size += *out_len;
+	}
+
+out_unlock:
+	pthread_mutex_unlock(&bc.lock);
+
+	return compr_type;
+}
+
+/*
+ * Rewrite the data file with only the blocks which were used by this run,
+ * as many of them as fit into the size limit. The index records are only
+ * replaced once the new data file is in place.
+ */
+static int compact_data(void)
+{
+	char *path, *tmp;
+	void *buf;
+	struct cache_rec *recs;
+	size_t i, cnt = 0;
+	long long size = 0;
+	int fd, err = -1;
+
+	path = cache_path("data");
+	tmp = cache_path("data.tmp");
+	buf = xmalloc(UBIFS_BLOCK_SIZE);
+	recs = xmalloc(bc.max * sizeof(struct cache_rec));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		sys_err_msg("cannot create '%s'", tmp);
+		goto out;
+	}
+
+	for (i = 0; i < bc.cnt; i++) {
+		struct cache_rec *rec = &bc.recs[i];
+
+		if (!bc.used[i] || size + rec->len > bc.max_size)
+			continue;
+		if (pread(bc.data_fd, buf, rec->len, rec->offs) != rec->len ||
+		    write(fd, buf, rec->len) != rec->len) {
+			sys_err_msg("cannot copy build cache data");
+			close(fd);
+			unlink(tmp);
+			goto out;
+		}
+		recs[cnt] = *rec;
+		recs[cnt++].offs = size;
+		size += rec->len;
+	}
+
+	if (close(fd) == -1 || rename(tmp, path) == -1) {
+		sys_err_msg("cannot replace '%s'", path);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (verbose)
+		printf("build cache: dropped %zu unused blocks\n",
+		       bc.cnt - cnt);
+	free(bc.recs);
+	bc.recs = recs;
+	recs = NULL;
+	memset(bc.used, 1, cnt);
+	bc.cnt = cnt;
+	bc.data_size = size;
+	err = 0;
+out:
+	free(recs);
+	free(buf);
+	free(tmp);
+	free(path);
+	return err;
+}
+
+static int save_index(void)
+{
+	struct cache_hdr hdr;
+	char *path, *tmp;
+	ssize_t sz = bc.cnt * sizeof(struct cache_rec);
+	int fd, err = -1;
+
+	path = cache_path("index");
+	tmp = cache_path("index.tmp");
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.cnt = bc.cnt;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		sys_err_msg("cannot create '%s'", tmp);
+		goto out;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, bc.recs, sz) != sz) {
+		sys_err_msg("cannot write '%s'", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (close(fd) == -1 || rename(tmp, path) == -1) {
+		sys_err_msg("cannot replace '%s'", path);
+		unlink(tmp);
+		goto out;
+	}
+
+	err = 0;
+out:
+	free(tmp);
+	free(path);
+	return err;
+}
+
+/**
+ * close_build_cache - save the build cache index and close the build cache.
+ *
+ * A build cache which cannot be saved is not an error for mkfs.ubifs, the
+ * blocks will just be compressed again next time.
+ */
+void close_build_cache(void)
+{
+	if (bc.data_fd == -1)
+		goto out;
+
+	/* If compaction fails, the old index still matches the data file */
+	if (bc.data_size <= bc.max_size || !compact_data())
+		save_index();
+
+	stats_add_count(STATS_CACHE_HITS, bc.hits);
+	stats_add_count(STATS_CACHE_MISSES, bc.misses);
+	stats_add_count(STATS_CACHE_FULL, bc.full);
+	stats_add_count(STATS_CACHE_BAD, bc.bad);
+	if (verbose) {
+		printf("build cache: %llu hits, %llu misses, %llu blocks not stored (cache full), %llu bad blocks\n",
+		       bc.hits, bc.misses, bc.full, bc.bad);
+		printf("build cache: %zu blocks, %lld bytes\n", bc.cnt,
+		       bc.data_size);
+	}
+
+	close(bc.data_fd);
+	bc.data_fd = -1;
+out:
+	if (bc.lock_fd != -1)
+		close(bc.lock_fd);
+	bc.lock_fd = -1;
+	free(bc.recs);
+	free(bc.used);
+	free(bc.slots);
+	free(bc.dir);
+	bc.recs = NULL;
+	bc.used = NULL;
+	bc.slots = NULL;
+	bc.dir = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __UBIFS_CACHE_H__
+#define __UBIFS_CACHE_H__
+
+#include "compr.h"
+
+#ifdef WITH_CRYPTO
+
+int open_build_cache(const char *dir, long long max_size);
+int cached_compress_data(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len, int type);
+void close_build_cache(void);
+
+#else
+
+static inline int open_build_cache(__attribute__((unused)) const char *dir,
+				   __attribute__((unused)) long long max_size)
+{
+	return -1;
+}
+
+static inline int cached_compress_data(void *in_buf, size_t in_len,
+				       void *out_buf, size_t *out_len,
+				       int type)
+{
+	return compress_data(in_buf, in_len, out_buf, out_len, type);
+}
+
+static inline void close_build_cache(void)
+{
+}
+
+#endif
+
+#endif /* __UBIFS_CACHE_H__ */
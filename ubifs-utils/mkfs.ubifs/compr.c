@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #ifndef WITHOUT_LZO
 #include <lzo/lzo1x.h>
 #endif
@@ -38,56 +39,113 @@
 
 #include "compr.h"
 #include "mkfs.ubifs.h"
+#include "stats.h"
 
-static void *lzo_mem;
+/*
+ * Compressor work memory is per-thread, so that several threads may compress
+ * data at the same time (see the --jobs option of mkfs.ubifs).
+ */
+static __thread void *lzo_mem;
 static unsigned long long errcnt = 0;
-#ifndef WITHOUT_LZO
 static struct ubifs_info *c = &info_;
-#endif
+
+/*
+ * Blocks with a byte entropy of at least this many bits per byte are assumed
+ * to be incompressible by the compression pre-check.
+ */
+#define PRECHECK_ENTROPY_BITS 7.5
+
+/*
+ * Every PRECHECK_VERIFY_INTERVAL-th block skipped by the pre-check is still
+ * compressed (and the result thrown away) to find out whether skipping it was
+ * right.
+ */
+#define PRECHECK_VERIFY_INTERVAL 16
+
+/* Pre-check statistics */
+static unsigned long long precheck_skipped;
+static unsigned long long precheck_verified;
+static unsigned long long precheck_verified_right;
+static unsigned long long precheck_passed;
+static unsigned long long precheck_passed_wrong;
 
 #define DEFLATE_DEF_LEVEL     Z_DEFAULT_COMPRESSION
 #define DEFLATE_DEF_WINBITS   11
 #define DEFLATE_DEF_MEMLEVEL  8
 
-static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
-			size_t *out_len)
-{
-	z_stream strm;
+/*
+ * The deflate stream is set up once per thread and only reset between blocks,
+ * because initializing it costs about as much as compressing a 4KiB block.
+ */
+static __thread z_stream *zstrm;
+static __thread int zlevel;
 
-	strm.zalloc = NULL;
-	strm.zfree = NULL;
+static int zlib_init(void)
+{
+	zstrm = calloc(1, sizeof(z_stream));
+	if (!zstrm)
+		return -1;
 
 	/*
 	 * Match exactly the zlib parameters used by the Linux kernel crypto
 	 * API.
 	 */
-        if (deflateInit2(&strm, DEFLATE_DEF_LEVEL, Z_DEFLATED,
+	if (deflateInit2(zstrm, DEFLATE_DEF_LEVEL, Z_DEFLATED,
 			 -DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
 			 Z_DEFAULT_STRATEGY)) {
-		errcnt += 1;
+		free(zstrm);
+		zstrm = NULL;
 		return -1;
 	}
+	zlevel = DEFLATE_DEF_LEVEL;
+
+	return 0;
+}
+
+static void zlib_exit(void)
+{
+	if (!zstrm)
+		return;
+	deflateEnd(zstrm);
+	free(zstrm);
+	zstrm = NULL;
+}
 
-	strm.next_in = in_buf;
-	strm.avail_in = in_len;
-	strm.total_in = 0;
+static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
+			size_t *out_len, int level)
+{
+	int ret;
 
-	strm.next_out = out_buf;
-	strm.avail_out = *out_len;
-	strm.total_out = 0;
+	if (!level)
+		level = DEFLATE_DEF_LEVEL;
 
-	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
-		deflateEnd(&strm);
-		errcnt += 1;
+	if (deflateReset(zstrm) != Z_OK) {
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
-	if (deflateEnd(&strm) != Z_OK) {
-		errcnt += 1;
+	if (level != zlevel) {
+		if (deflateParams(zstrm, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			__sync_fetch_and_add(&errcnt, 1);
+			return -1;
+		}
+		zlevel = level;
+	}
+
+	zstrm->next_in = in_buf;
+	zstrm->avail_in = in_len;
+	zstrm->next_out = out_buf;
+	zstrm->avail_out = *out_len;
+
+	ret = deflate(zstrm, Z_FINISH);
+	if (ret != Z_STREAM_END) {
+		/* Running out of output space is not an error */
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
-	*out_len = strm.total_out;
+	*out_len = zstrm->total_out;
 
 	return 0;
 }
@@ -104,7 +162,7 @@ static int lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 	*out_len = len;
 
 	if (ret != LZO_E_OK) {
-		errcnt += 1;
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
@@ -113,16 +171,17 @@ static int lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 #endif
 
 #ifndef WITHOUT_ZSTD
-static ZSTD_CCtx *zctx;
+static __thread ZSTD_CCtx *zctx;
 
 static int zstd_compress(void *in_buf, size_t in_len, void *out_buf,
-			 size_t *out_len)
+			 size_t *out_len, int level)
 {
 	size_t ret;
 
-	ret = ZSTD_compressCCtx(zctx, out_buf, *out_len, in_buf, in_len, 0);
+	ret = ZSTD_compressCCtx(zctx, out_buf, *out_len, in_buf, in_len,
+				level);
 	if (ZSTD_isError(ret)) {
-		errcnt += 1;
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 	*out_len = ret;
@@ -138,9 +197,26 @@ static int no_compress(void *in_buf, size_t in_len, void *out_buf,
 	return 0;
 }
 
-static char *zlib_buf;
+static __thread char *zlib_buf;
 
 #ifndef WITHOUT_LZO
+/*
+ * zlib_preferred - whether zlib compressed enough better than LZO.
+ * @zlib_len: length of zlib compressed data
+ * @lzo_len: length of LZO compressed data
+ */
+static int zlib_preferred(size_t zlib_len, size_t lzo_len)
+{
+	double percent;
+
+	if (lzo_len <= zlib_len)
+		return 0;
+
+	percent = (double)zlib_len / (double)lzo_len;
+	percent *= 100;
+	return percent <= 100 - c->favor_percent;
+}
+
 static int favor_lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 			       size_t *out_len, int *type)
 {
@@ -149,32 +225,37 @@ static int favor_lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 
 	lzo_len = zlib_len = *out_len;
 	lzo_ret = lzo_compress(in_buf, in_len, out_buf, &lzo_len);
-	zlib_ret = zlib_deflate(in_buf, in_len, zlib_buf, &zlib_len);
+
+	if (!lzo_ret) {
+		/*
+		 * Only give zlib as much output space as it may use and still
+		 * be preferred over LZO. If it runs out of space, LZO wins
+		 * and zlib may stop early. Note, deflate() does not report
+		 * the end of stream when the output fills the buffer exactly,
+		 * hence the extra byte.
+		 */
+		zlib_len = lzo_len * (100 - c->favor_percent) / 100;
+		while (zlib_len < lzo_len && zlib_preferred(zlib_len + 1, lzo_len))
+			zlib_len += 1;
+		while (zlib_len && !zlib_preferred(zlib_len, lzo_len))
+			zlib_len -= 1;
+		if (!zlib_len)
+			goto select_lzo;
+		zlib_len += 1;
+	}
+	zlib_ret = zlib_deflate(in_buf, in_len, zlib_buf, &zlib_len, 0);
 
 	if (lzo_ret && zlib_ret)
 		/* Both compressors failed */
 		return -1;
 
-	if (!lzo_ret && !zlib_ret) {
-		double percent;
-
-		/* Both compressors succeeded */
-		if (lzo_len <= zlib_len )
-			goto select_lzo;
-
-		percent = (double)zlib_len / (double)lzo_len;
-		percent *= 100;
-		if (percent > 100 - c->favor_percent)
-			goto select_lzo;
-		goto select_zlib;
-	}
+	if (zlib_ret)
+		/* LZO compressor succeeded, zlib failed or was not good enough */
+		goto select_lzo;
 
-	if (lzo_ret)
-		/* Only zlib compressor succeeded */
+	if (lzo_ret || zlib_preferred(zlib_len, lzo_len))
 		goto select_zlib;
 
-	/* Only LZO compressor succeeded */
-
 select_lzo:
 	*out_len = lzo_len;
 	*type = MKFS_UBIFS_COMPR_LZO;
@@ -188,45 +269,123 @@ select_zlib:
 }
 #endif
 
-int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
-		  int type)
+/**
+ * looks_incompressible - cheap guess whether a block is worth compressing.
+ * @buf: data to check
+ * @len: length of @buf
+ *
+ * Estimates the order-0 entropy of @buf from a byte histogram. Already
+ * compressed or encrypted data is close to 8 bits per byte, so the expensive
+ * compressors would not be able to shrink it. Returns %1 if @buf looks
+ * incompressible and %0 otherwise.
+ */
+static int looks_incompressible(const void *buf, size_t len)
 {
-	int ret;
+	unsigned int hist[256] = { 0 };
+	const uint8_t *p = buf;
+	double bits = 0;
+	size_t i;
 
-	if (in_len < UBIFS_MIN_COMPR_LEN) {
-		no_compress(in_buf, in_len, out_buf, out_len);
-		return MKFS_UBIFS_COMPR_NONE;
-	}
+	for (i = 0; i < len; i++)
+		hist[p[i]] += 1;
+
+	for (i = 0; i < 256; i++)
+		if (hist[i])
+			bits -= hist[i] * log2((double)hist[i] / len);
+
+	return bits >= PRECHECK_ENTROPY_BITS * len;
+}
+
+/*
+ * do_compress - compress data with a compressor.
+ *
+ * The compression level and flags are stripped from @type, and if favor LZO
+ * compression is requested, @type is set to the compressor which won.
+ */
+static int do_compress(void *in_buf, size_t in_len, void *out_buf,
+		       size_t *out_len, int *type)
+{
+	int ret, level = MKFS_UBIFS_COMPR_LEVEL(*type);
+	int favor_lzo = *type & MKFS_UBIFS_COMPR_FAVOR_LZO;
+
+	*type &= MKFS_UBIFS_COMPR_TYPE_MASK;
 
 #ifdef WITHOUT_LZO
+	(void)favor_lzo;
 	{
-		switch (type) {
+		switch (*type) {
 #else
-	if (c->favor_lzo)
-		ret = favor_lzo_compress(in_buf, in_len, out_buf, out_len, &type);
+	if (favor_lzo)
+		ret = favor_lzo_compress(in_buf, in_len, out_buf, out_len, type);
 	else {
-		switch (type) {
+		switch (*type) {
 		case MKFS_UBIFS_COMPR_LZO:
 			ret = lzo_compress(in_buf, in_len, out_buf, out_len);
 			break;
 #endif
 		case MKFS_UBIFS_COMPR_ZLIB:
-			ret = zlib_deflate(in_buf, in_len, out_buf, out_len);
+			ret = zlib_deflate(in_buf, in_len, out_buf, out_len,
+					   level);
 			break;
 #ifndef WITHOUT_ZSTD
 		case MKFS_UBIFS_COMPR_ZSTD:
-			ret = zstd_compress(in_buf, in_len, out_buf, out_len);
+			ret = zstd_compress(in_buf, in_len, out_buf, out_len,
+					    level);
 			break;
 #endif
 		case MKFS_UBIFS_COMPR_NONE:
 			ret = 1;
 			break;
 		default:
-			errcnt += 1;
+			__sync_fetch_and_add(&errcnt, 1);
 			ret = 1;
 			break;
 		}
 	}
+
+	return ret;
+}
+
+int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
+		  int type)
+{
+	int ret;
+
+	if (in_len < UBIFS_MIN_COMPR_LEN) {
+		no_compress(in_buf, in_len, out_buf, out_len);
+		return MKFS_UBIFS_COMPR_NONE;
+	}
+
+	if (c->compr_precheck &&
+	    (type & MKFS_UBIFS_COMPR_TYPE_MASK) != MKFS_UBIFS_COMPR_NONE) {
+		if (looks_incompressible(in_buf, in_len)) {
+			unsigned long long n;
+
+			n = __sync_add_and_fetch(&precheck_skipped, 1);
+			if (n % PRECHECK_VERIFY_INTERVAL == 0) {
+				size_t len = *out_len;
+				int t = type;
+
+				/* The result is thrown away either way */
+				ret = do_compress(in_buf, in_len, out_buf,
+						  &len, &t);
+				__sync_fetch_and_add(&precheck_verified, 1);
+				if (ret || len >= in_len)
+					__sync_fetch_and_add(&precheck_verified_right, 1);
+			}
+			no_compress(in_buf, in_len, out_buf, out_len);
+			return MKFS_UBIFS_COMPR_NONE;
+		}
+	}
+
+	ret = do_compress(in_buf, in_len, out_buf, out_len, &type);
+
+	if (c->compr_precheck && type != MKFS_UBIFS_COMPR_NONE) {
+		__sync_fetch_and_add(&precheck_passed, 1);
+		if (ret || *out_len >= in_len)
+			__sync_fetch_and_add(&precheck_passed_wrong, 1);
+	}
+
 	if (ret || *out_len >= in_len) {
 		no_compress(in_buf, in_len, out_buf, out_len);
 		return MKFS_UBIFS_COMPR_NONE;
@@ -234,7 +393,149 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 	return type;
 }
 
-int init_compression(void)
+/*
+ * Decompressors, only used to measure how fast the data mkfs.ubifs produces
+ * can be read back (see the --stats option). They are set up per thread on
+ * demand.
+ */
+static __thread z_stream *istrm;
+#ifndef WITHOUT_ZSTD
+static __thread ZSTD_DCtx *dctx;
+#endif
+
+/**
+ * init_decompression_thread - set up the decompressors of this thread.
+ *
+ * Returns zero in case of success and %-1 in case of failure. Calling it
+ * again is cheap.
+ */
+int init_decompression_thread(void)
+{
+	if (!istrm) {
+		istrm = calloc(1, sizeof(z_stream));
+		if (!istrm)
+			return -1;
+		if (inflateInit2(istrm, -DEFLATE_DEF_WINBITS) != Z_OK) {
+			free(istrm);
+			istrm = NULL;
+			return -1;
+		}
+	}
+
+#ifndef WITHOUT_ZSTD
+	if (!dctx) {
+		dctx = ZSTD_createDCtx();
+		if (!dctx)
+			return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static void destroy_decompression_thread(void)
+{
+	if (istrm) {
+		inflateEnd(istrm);
+		free(istrm);
+		istrm = NULL;
+	}
+#ifndef WITHOUT_ZSTD
+	ZSTD_freeDCtx(dctx);
+	dctx = NULL;
+#endif
+}
+
+/**
+ * decompress_data - decompress a data block.
+ * @in_buf: compressed data
+ * @in_len: length of the compressed data
+ * @out_buf: output buffer
+ * @out_len: output buffer length is passed and decompressed length returned
+ * @compr_type: UBIFS compression type of the data
+ *
+ * 'init_decompression_thread()' has to be called first. Returns zero in case
+ * of success and %-1 in case of failure.
+ */
+int decompress_data(const void *in_buf, size_t in_len, void *out_buf,
+		    size_t *out_len, int compr_type)
+{
+	switch (compr_type) {
+	case MKFS_UBIFS_COMPR_NONE:
+		if (in_len > *out_len)
+			return -1;
+		memcpy(out_buf, in_buf, in_len);
+		*out_len = in_len;
+		return 0;
+#ifndef WITHOUT_LZO
+	case MKFS_UBIFS_COMPR_LZO:
+	{
+		lzo_uint len = *out_len;
+
+		if (lzo1x_decompress_safe(in_buf, in_len, out_buf, &len,
+					  NULL) != LZO_E_OK)
+			return -1;
+		*out_len = len;
+		return 0;
+	}
+#endif
+	case MKFS_UBIFS_COMPR_ZLIB:
+		if (inflateReset(istrm) != Z_OK)
+			return -1;
+		istrm->next_in = (void *)in_buf;
+		istrm->avail_in = in_len;
+		istrm->next_out = out_buf;
+		istrm->avail_out = *out_len;
+		if (inflate(istrm, Z_FINISH) != Z_STREAM_END)
+			return -1;
+		*out_len = istrm->total_out;
+		return 0;
+#ifndef WITHOUT_ZSTD
+	case MKFS_UBIFS_COMPR_ZSTD:
+	{
+		size_t ret;
+
+		ret = ZSTD_decompressDCtx(dctx, out_buf, *out_len, in_buf,
+					  in_len);
+		if (ZSTD_isError(ret))
+			return -1;
+		*out_len = ret;
+		return 0;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+/**
+ * compr_max_level - highest compression level of a compressor.
+ * @type: compression type
+ *
+ * Returns zero if the compressor does not have compression levels.
+ */
+int compr_max_level(int type)
+{
+	switch (type) {
+	case MKFS_UBIFS_COMPR_ZLIB:
+		return Z_BEST_COMPRESSION;
+#ifndef WITHOUT_ZSTD
+	case MKFS_UBIFS_COMPR_ZSTD:
+		return ZSTD_maxCLevel();
+#endif
+	default:
+		return 0;
+	}
+}
+
+/**
+ * init_compression_thread - allocate compressor work memory.
+ *
+ * This function has to be called by every thread which is going to call
+ * 'compress_data()'. Returns zero in case of success and %-1 in case of
+ * failure.
+ */
+int init_compression_thread(void)
 {
 #ifdef WITHOUT_LZO
 	lzo_mem = NULL;
@@ -248,6 +549,9 @@ int init_compression(void)
 	if (!zlib_buf)
 		goto err;
 
+	if (zlib_init())
+		goto err;
+
 #ifndef WITHOUT_ZSTD
 	zctx = ZSTD_createCCtx();
 	if (!zctx)
@@ -256,18 +560,46 @@ int init_compression(void)
 
 	return 0;
 err:
+	zlib_exit();
 	free(zlib_buf);
 	free(lzo_mem);
 	return -1;
 }
 
-void destroy_compression(void)
+/**
+ * destroy_compression_thread - free compressor work memory of this thread.
+ */
+void destroy_compression_thread(void)
 {
+	destroy_decompression_thread();
+	zlib_exit();
 	free(zlib_buf);
 	free(lzo_mem);
 #ifndef WITHOUT_ZSTD
 	ZSTD_freeCCtx(zctx);
 #endif
+}
+
+int init_compression(void)
+{
+	return init_compression_thread();
+}
+
+void destroy_compression(void)
+{
+	destroy_compression_thread();
+	stats_add_count(STATS_PRECHECK_SKIPPED, precheck_skipped);
+	stats_add_count(STATS_PRECHECK_VERIFIED, precheck_verified);
+	stats_add_count(STATS_PRECHECK_VERIFIED_RIGHT, precheck_verified_right);
+	stats_add_count(STATS_PRECHECK_PASSED, precheck_passed);
+	stats_add_count(STATS_PRECHECK_PASSED_WRONG, precheck_passed_wrong);
+	if (c->compr_precheck && verbose) {
+		printf("compression pre-check: skipped %llu blocks, %llu of %llu verified skips were right\n",
+		       precheck_skipped, precheck_verified_right,
+		       precheck_verified);
+		printf("compression pre-check: %llu of %llu compressed blocks did not shrink\n",
+		       precheck_passed_wrong, precheck_passed);
+	}
 	if (errcnt)
 		fprintf(stderr, "%llu compression errors occurred\n", errcnt);
 }
@@ -39,9 +39,38 @@ enum compression_type
 	MKFS_UBIFS_COMPR_ZSTD,
 };
 
+/*
+ * The compressor passed to 'compress_data()' is one of the compression types
+ * above, optionally combined with a compression level for zlib and zstd (zero
+ * means the default level) and with the favor LZO flag, which makes LZO and
+ * zlib compete for each block.
+ */
+#define MKFS_UBIFS_COMPR_TYPE_MASK   0xff
+#define MKFS_UBIFS_COMPR_LEVEL_SHIFT 8
+#define MKFS_UBIFS_COMPR_LEVEL_MASK  0x1f
+#define MKFS_UBIFS_COMPR_FAVOR_LZO   0x2000
+
+#define MKFS_UBIFS_COMPR(type, level) \
+	((type) | ((level) << MKFS_UBIFS_COMPR_LEVEL_SHIFT))
+#define MKFS_UBIFS_COMPR_LEVEL(compr) \
+	(((compr) >> MKFS_UBIFS_COMPR_LEVEL_SHIFT) & MKFS_UBIFS_COMPR_LEVEL_MASK)
+
 int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 		  int type);
+int decompress_data(const void *in_buf, size_t in_len, void *out_buf,
+		    size_t *out_len, int compr_type);
+int compr_max_level(int type);
 int init_compression(void);
 void destroy_compression(void);
+int init_compression_thread(void);
+int init_decompression_thread(void);
+void destroy_compression_thread(void);
+
+int parse_compr_policy(const char *file);
+int compr_policy_find(const char *path);
+int compr_policy_compr(int rule);
+int compr_policy_rule_cnt(void);
+const char *compr_policy_rule_desc(int rule);
+void free_compr_policy(void);
 
 #endif
@@ -0,0 +1,248 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements the compression policy file of the --compr-policy
+ * option. Like the device table, it is a text file with one entry per line:
+ * <pattern>             <compressor>[:<level>]
+ * /usr/lib/lib*.so*     lzo
+ * /usr/share/doc*       zstd:19
+ * *.jpg                 none
+ *
+ * A pattern which contains a '/' is matched against the whole path name of a
+ * file in the file system, which starts with a '/', and a '*' in it also
+ * matches '/' characters. Other patterns are matched against the file name
+ * only. The first rule which matches a file decides how its data blocks are
+ * compressed, files which no rule matches get the default compressor.
+ *
+ * The compressor is one of "none", "lzo", "favor_lzo", "zlib" and "zstd".
+ * zlib and zstd take an optional compression level.
+ */
+
+#include <fnmatch.h>
+
+#include "mkfs.ubifs.h"
+
+/**
+ * struct compr_rule - a rule of the compression policy file.
+ * @pattern: glob pattern file names or path names are matched against
+ * @desc: the rule as written in the policy file, for the statistics
+ * @compr: compressor for 'compress_data()'
+ * @path: whether @pattern is matched against the whole path name
+ */
+struct compr_rule {
+	char *pattern;
+	char *desc;
+	int compr;
+	int path;
+};
+
+static struct compr_rule *rules;
+static int rule_cnt;
+
+/*
+ * Parse "<compressor>[:<level>]" of a policy file line. Returns the
+ * compressor for 'compress_data()' or %-1 if it is not valid.
+ */
+static int parse_compr(const char *file, int line_no, char *str)
+{
+	char *level_str, *endp;
+	int type, level = 0;
+
+	level_str = strchr(str, ':');
+	if (level_str)
+		*level_str++ = '\0';
+
+	if (!strcmp(str, "none"))
+		type = MKFS_UBIFS_COMPR_NONE;
+	else if (!strcmp(str, "zlib"))
+		type = MKFS_UBIFS_COMPR_ZLIB;
+#ifndef WITHOUT_ZSTD
+	else if (!strcmp(str, "zstd"))
+		type = MKFS_UBIFS_COMPR_ZSTD;
+#endif
+#ifndef WITHOUT_LZO
+	else if (!strcmp(str, "lzo"))
+		type = MKFS_UBIFS_COMPR_LZO;
+	else if (!strcmp(str, "favor_lzo"))
+		type = MKFS_UBIFS_COMPR_LZO | MKFS_UBIFS_COMPR_FAVOR_LZO;
+#endif
+	else
+		return err_msg("%s:%d: bad compressor name '%s'",
+			       file, line_no, str);
+
+	if (!level_str)
+		return type;
+
+	if (type & MKFS_UBIFS_COMPR_FAVOR_LZO || !compr_max_level(type))
+		return err_msg("%s:%d: compressor '%s' has no compression levels",
+			       file, line_no, str);
+
+	level = strtol(level_str, &endp, 0);
+	if (*endp != '\0' || endp == level_str || level < 1 ||
+	    level > compr_max_level(type))
+		return err_msg("%s:%d: bad %s compression level '%s' (1-%d)",
+			       file, line_no, str, level_str,
+			       compr_max_level(type));
+
+	return MKFS_UBIFS_COMPR(type, level);
+}
+
+static int interpret_rule(const char *file, int line_no, char *line)
+{
+	char *pattern, *compr_str, *extra, *desc, *saveptr;
+	int compr;
+
+	pattern = strtok_r(line, " \t", &saveptr);
+	compr_str = strtok_r(NULL, " \t", &saveptr);
+	extra = strtok_r(NULL, " \t", &saveptr);
+	if (!pattern || !compr_str || extra)
+		return err_msg("%s:%d: expected a pattern and a compressor",
+			       file, line_no);
+
+	if (strchr(pattern, '/') && pattern[0] != '/')
+		return err_msg("%s:%d: path pattern '%s' does not start with '/'",
+			       file, line_no, pattern);
+
+	xasprintf(&desc, "%s %s", pattern, compr_str);
+	compr = parse_compr(file, line_no, compr_str);
+	if (compr == -1) {
+		free(desc);
+		return -1;
+	}
+
+	rules = xrealloc(rules, (rule_cnt + 1) * sizeof(struct compr_rule));
+	rules[rule_cnt].pattern = xstrdup(pattern);
+	rules[rule_cnt].desc = desc;
+	rules[rule_cnt].compr = compr;
+	rules[rule_cnt].path = !!strchr(pattern, '/');
+	rule_cnt += 1;
+	return 0;
+}
+
+/**
+ * parse_compr_policy - parse the compression policy file.
+ * @file: the policy file
+ *
+ * Returns zero in case of success and %-1 in case of failure.
+ */
+int parse_compr_policy(const char *file)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int line_no = 0, err = 0;
+	FILE *f;
+
+	dbg_msg(1, "parsing compression policy file '%s'", file);
+
+	f = fopen(file, "r");
+	if (!f)
+		return sys_err_msg("cannot open '%s'", file);
+
+	while (getline(&line, &len, f) != -1) {
+		char *p = line;
+		size_t n;
+
+		line_no += 1;
+
+		/* Trim white-space at both ends */
+		n = strlen(p);
+		while (n > 0 && isspace(p[n - 1]))
+			p[--n] = '\0';
+		p += strspn(p, " \t\v");
+
+		if (!*p || *p == '#')
+			continue;
+
+		err = interpret_rule(file, line_no, p);
+		if (err)
+			break;
+	}
+
+	if (!err && ferror(f))
+		err = sys_err_msg("cannot read '%s'", file);
+
+	free(line);
+	fclose(f);
+	if (err) {
+		free_compr_policy();
+		return -1;
+	}
+
+	dbg_msg(1, "%d compression policy rules", rule_cnt);
+	return 0;
+}
+
+/**
+ * compr_policy_find - find the policy rule of a file.
+ * @path: path name of the file in the file system (starting with '/')
+ *
+ * Returns the index of the first rule which matches @path, or %-1 if none
+ * does.
+ */
+int compr_policy_find(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	int i;
+
+	name = name ? name + 1 : path;
+	for (i = 0; i < rule_cnt; i++)
+		if (!fnmatch(rules[i].pattern, rules[i].path ? path : name, 0))
+			return i;
+
+	return -1;
+}
+
+/**
+ * compr_policy_compr - get the compressor of a policy rule.
+ * @rule: index of the rule
+ */
+int compr_policy_compr(int rule)
+{
+	return rules[rule].compr;
+}
+
+/**
+ * compr_policy_rule_cnt - get the number of policy rules.
+ */
+int compr_policy_rule_cnt(void)
+{
+	return rule_cnt;
+}
+
+/**
+ * compr_policy_rule_desc - get a policy rule as written in the policy file.
+ * @rule: index of the rule
+ */
+const char *compr_policy_rule_desc(int rule)
+{
+	return rules[rule].desc;
+}
+
+/**
+ * free_compr_policy - free the compression policy.
+ */
+void free_compr_policy(void)
+{
+	int i;
+
+	for (i = 0; i < rule_cnt; i++) {
+		free(rules[i].pattern);
+		free(rules[i].desc);
+	}
+	free(rules);
+	rules = NULL;
+	rule_cnt = 0;
+}
@@ -20,6 +20,7 @@
 #define PROGRAM_NAME "mkfs.ubifs"
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/sha.h>
 #include <string.h>
 #include <assert.h>
 
@@ -66,6 +67,79 @@ static int check_iv_key_size(const EVP_CIPHER *cipher, size_t key_len,
 	return 0;
 }
 
+/*
+ * Setting up a cipher context expands the key, which costs more than
+ * encrypting a data block. So every thread keeps a context for each cipher it
+ * uses, together with the key the context is set up with, and only sets the
+ * key again when it changes. Between the operations, only the IV is reset.
+ */
+#define CIPHER_CTX_CNT 4
+
+/**
+ * struct cipher_ctx - a cached cipher context.
+ * @ctx: OpenSSL cipher context
+ * @cipher: the cipher @ctx is set up for, %NULL if it is not set up
+ * @key: the key @ctx is set up with
+ */
+struct cipher_ctx {
+	EVP_CIPHER_CTX *ctx;
+	const EVP_CIPHER *cipher;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+};
+
+static __thread struct cipher_ctx cipher_ctxs[CIPHER_CTX_CNT];
+static __thread int cipher_ctx_victim;
+
+/* The ESSIV key of this thread and the data key it was computed from */
+static __thread unsigned char essiv_data_key[EVP_MAX_KEY_LENGTH];
+static __thread unsigned char essiv_key[SHA256_DIGEST_LENGTH];
+static __thread int essiv_valid;
+
+/**
+ * get_cipher_ctx - get a cipher context of this thread set up with a key.
+ * @cipher: the cipher
+ * @key: the key
+ * @key_len: length of @key
+ *
+ * Returns the context or %NULL in case of failure.
+ */
+static EVP_CIPHER_CTX *get_cipher_ctx(const EVP_CIPHER *cipher,
+				      const void *key, size_t key_len)
+{
+	struct cipher_ctx *cc = NULL;
+	int i;
+
+	for (i = 0; i < CIPHER_CTX_CNT; i++) {
+		if (cipher_ctxs[i].cipher == cipher) {
+			cc = &cipher_ctxs[i];
+			if (!memcmp(cc->key, key, key_len))
+				return cc->ctx;
+			break;
+		}
+		if (!cc && !cipher_ctxs[i].cipher)
+			cc = &cipher_ctxs[i];
+	}
+
+	if (!cc) {
+		cc = &cipher_ctxs[cipher_ctx_victim];
+		cipher_ctx_victim = (cipher_ctx_victim + 1) % CIPHER_CTX_CNT;
+	}
+
+	if (!cc->ctx) {
+		cc->ctx = EVP_CIPHER_CTX_new();
+		if (!cc->ctx)
+			return NULL;
+	}
+
+	cc->cipher = NULL;
+	if (EVP_EncryptInit_ex(cc->ctx, cipher, NULL, key, NULL) != 1)
+		return NULL;
+	EVP_CIPHER_CTX_set_padding(cc->ctx, 0);
+	cc->cipher = cipher;
+	memcpy(cc->key, key, key_len);
+	return cc->ctx;
+}
+
 static ssize_t do_encrypt(const EVP_CIPHER *cipher,
 				const void *plaintext, size_t size,
 				const void *key, size_t key_len,
@@ -78,32 +152,26 @@ static ssize_t do_encrypt(const EVP_CIPHER *cipher,
 	if (check_iv_key_size(cipher, key_len, iv_len))
 		return -1;
 
-	if (!(ctx = EVP_CIPHER_CTX_new()))
+	if (!(ctx = get_cipher_ctx(cipher, key, key_len)))
 		goto fail;
 
-	EVP_CIPHER_CTX_set_padding(ctx, 0);
-
-	if (EVP_EncryptInit_ex(ctx, cipher, NULL, key, iv) != 1)
-		goto fail_ctx;
+	/* Start a new operation with the key which is already set up */
+	if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1)
+		goto fail;
 
 	if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, size) != 1)
-		goto fail_ctx;
+		goto fail;
 
 	ciphertext_len = len;
 
 	if (cipher == EVP_aes_256_xts()) {
 		if (EVP_EncryptFinal(ctx, ciphertext + ciphertext_len, &len) != 1)
-			goto fail_ctx;
+			goto fail;
 
 		ciphertext_len += len;
 	}
 
-	EVP_CIPHER_CTX_free(ctx);
 	return ciphertext_len;
-fail_ctx:
-	ERR_print_errors_fp(stderr);
-	EVP_CIPHER_CTX_free(ctx);
-	return -1;
 fail:
 	ERR_print_errors_fp(stderr);
 	return -1;
@@ -113,31 +181,31 @@ static ssize_t gen_essiv_salt(const void *iv, size_t iv_len, const void *key, si
 {
 	size_t ret;
 	const EVP_CIPHER *cipher;
-	void *sha256 = xzalloc(EVP_MD_size(EVP_sha256()));
 
 	cipher = EVP_aes_256_ecb();
 	if (!cipher) {
 		errmsg("OpenSSL: Cipher AES-256-ECB is not supported");
-		goto fail;
+		return -1;
 	}
 
-	if (do_hash(EVP_sha256(), key, key_len, sha256) != 0) {
-		errmsg("sha256 failed");
-		goto fail;
+	/* The ESSIV key only changes with the data key */
+	if (!essiv_valid || memcmp(essiv_data_key, key, key_len)) {
+		essiv_valid = 0;
+		if (do_hash(EVP_sha256(), key, key_len, essiv_key) != 0) {
+			errmsg("sha256 failed");
+			return -1;
+		}
+		memcpy(essiv_data_key, key, key_len);
+		essiv_valid = 1;
 	}
 
-	ret = do_encrypt(cipher, iv, iv_len, sha256, EVP_MD_size(EVP_sha256()), NULL, 0, salt);
+	ret = do_encrypt(cipher, iv, iv_len, essiv_key, sizeof(essiv_key), NULL, 0, salt);
 	if (ret != iv_len) {
 		errmsg("Unable to compute ESSIV salt, return value %zi instead of %zi", ret, iv_len);
-		goto fail;
+		return -1;
 	}
 
-	free(sha256);
-
 	return ret;
-fail:
-	free(sha256);
-	return -1;
 }
 
 static ssize_t encrypt_block(const void *plaintext, size_t size,
@@ -169,6 +237,23 @@ static ssize_t encrypt_block(const void *plaintext, size_t size,
 			  ivsize, ciphertext);
 }
 
+static int encrypt_blocks(struct crypto_block *blocks, int count,
+			  const void *key, const EVP_CIPHER *cipher)
+{
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		ret = encrypt_block(blocks[i].plaintext, blocks[i].size, key,
+				    blocks[i].index, blocks[i].ciphertext,
+				    cipher);
+		if (ret != (ssize_t)blocks[i].size)
+			return -1;
+	}
+
+	return 0;
+}
+
 static ssize_t encrypt_block_aes128_cbc(const void *plaintext, size_t size,
 					const void *key, uint64_t block_index,
 					void *ciphertext)
@@ -183,6 +268,18 @@ static ssize_t encrypt_block_aes128_cbc(const void *plaintext, size_t size,
 			     ciphertext, cipher);
 }
 
+static int encrypt_blocks_aes128_cbc(struct crypto_block *blocks, int count,
+				     const void *key)
+{
+	const EVP_CIPHER *cipher = EVP_aes_128_cbc();
+
+	if (!cipher) {
+		errmsg("OpenSSL: Cipher AES-128-CBC is not supported");
+		return -1;
+	}
+	return encrypt_blocks(blocks, count, key, cipher);
+}
+
 static ssize_t encrypt_block_aes256_xts(const void *plaintext, size_t size,
 					const void *key, uint64_t block_index,
 					void *ciphertext)
@@ -197,6 +294,18 @@ static ssize_t encrypt_block_aes256_xts(const void *plaintext, size_t size,
 			     ciphertext, cipher);
 }
 
+static int encrypt_blocks_aes256_xts(struct crypto_block *blocks, int count,
+				     const void *key)
+{
+	const EVP_CIPHER *cipher = EVP_aes_256_xts();
+
+	if (!cipher) {
+		errmsg("OpenSSL: Cipher AES-256-XTS is not supported");
+		return -1;
+	}
+	return encrypt_blocks(blocks, count, key, cipher);
+}
+
 static void block_swap(uint8_t *ciphertext, size_t i0, size_t i1,
 			size_t size)
 {
@@ -320,6 +429,7 @@ static struct cipher ciphers[] = {
 		.name = "AES-128-CBC",
 		.key_length = 16,
 		.encrypt_block = encrypt_block_aes128_cbc,
+		.encrypt_blocks = encrypt_blocks_aes128_cbc,
 		.encrypt_fname = encrypt_aes128_cbc_cts,
 		.fscrypt_block_mode = FS_ENCRYPTION_MODE_AES_128_CBC,
 		.fscrypt_fname_mode = FS_ENCRYPTION_MODE_AES_128_CTS,
@@ -327,6 +437,7 @@ static struct cipher ciphers[] = {
 		.name = "AES-256-XTS",
 		.key_length = 64,
 		.encrypt_block = encrypt_block_aes256_xts,
+		.encrypt_blocks = encrypt_blocks_aes256_xts,
 		.encrypt_fname = encrypt_aes256_cbc_cts,
 		.fscrypt_block_mode = FS_ENCRYPTION_MODE_AES_256_XTS,
 		.fscrypt_fname_mode = FS_ENCRYPTION_MODE_AES_256_CTS,
@@ -340,8 +451,31 @@ int crypto_init(void)
 	return 0;
 }
 
+/**
+ * crypto_thread_cleanup - free the cipher contexts and wipe the cached keys
+ * of this thread.
+ *
+ * Every thread which has encrypted something has to call this before it
+ * exits.
+ */
+void crypto_thread_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < CIPHER_CTX_CNT; i++) {
+		EVP_CIPHER_CTX_free(cipher_ctxs[i].ctx);
+		cipher_ctxs[i].ctx = NULL;
+		cipher_ctxs[i].cipher = NULL;
+		OPENSSL_cleanse(cipher_ctxs[i].key, sizeof(cipher_ctxs[i].key));
+	}
+	OPENSSL_cleanse(essiv_data_key, sizeof(essiv_data_key));
+	OPENSSL_cleanse(essiv_key, sizeof(essiv_key));
+	essiv_valid = 0;
+}
+
 void crypto_cleanup(void)
 {
+	crypto_thread_cleanup();
 	EVP_cleanup();
 	ERR_free_strings();
 }
@@ -25,6 +25,16 @@
 #include <stdint.h>
 #include <stdio.h>
 
+/*
+ * A block for the encrypt_blocks() cipher operation. The ciphertext buffer
+ * may be the same as the plaintext one.
+ */
+struct crypto_block {
+	const void *plaintext;
+	void *ciphertext;
+	size_t size;
+	uint64_t index;
+};
 
 struct cipher {
 	const char *name;
@@ -34,6 +44,9 @@ struct cipher {
 				 const void *key, uint64_t block_index,
 				 void *ciphertext);
 
+	int (*encrypt_blocks)(struct crypto_block *blocks, int count,
+			      const void *key);
+
 	ssize_t (*encrypt_fname)(const void *plaintext, size_t size,
 				 const void *key, void *ciphertext);
 
@@ -44,6 +57,7 @@ struct cipher {
 #ifdef WITH_CRYPTO
 int crypto_init(void);
 void crypto_cleanup(void);
+void crypto_thread_cleanup(void);
 ssize_t derive_key_aes(const void *deriving_key, const void *source_key,
 		       size_t source_key_len, void *derived_key);
 int derive_key_descriptor(const void *source_key, void *descriptor);
@@ -52,6 +66,7 @@ void list_ciphers(FILE *fp);
 #else
 static inline int crypto_init(void) { return 0;}
 static inline void crypto_cleanup(void) {}
+static inline void crypto_thread_cleanup(void) {}
 #endif /* WITH_CRYPTO */
 
 #endif /* UBIFS_CRYPTO_H */
@@ -125,43 +125,59 @@ int encrypt_path(void **outbuf, void *data, unsigned int data_len,
 	return cryptlen;
 }
 
-int encrypt_data_node(struct fscrypt_context *fctx, unsigned int block_no,
-		      struct ubifs_data_node *dn, size_t length)
+/*
+ * Encrypt the data of data nodes of a file in place. The data is padded to
+ * the crypto block size, so the node buffers must have room for the padding.
+ * On input, @lens holds the lengths of the data, on output, the lengths of
+ * the encrypted data.
+ */
+int encrypt_data_nodes(struct fscrypt_context *fctx,
+		       struct ubifs_data_node **dns,
+		       const unsigned int *block_nos, int *lens, int count)
 {
-	void *inbuf, *outbuf, *crypt_key;
-	size_t ret, pad_len = round_up(length, FS_CRYPTO_BLOCK_SIZE);
-
-	dn->compr_size = cpu_to_le16(length);
-
-	inbuf = xzalloc(pad_len);
-	outbuf = xzalloc(pad_len);
+	struct crypto_block *blocks;
+	void *crypt_key;
+	size_t pad_len;
+	int i, ret;
 
-	memcpy(inbuf, &dn->data, length);
+	/* All the nodes of a batch may have failed to compress */
+	if (count <= 0)
+		return 0;
 
 	crypt_key = calc_fscrypt_subkey(fctx);
-	if (!crypt_key) {
-		free(inbuf);
-		free(outbuf);
+	if (!crypt_key)
 		return err_msg("could not compute subkey");
-	}
 
-	ret = fscrypt_cipher->encrypt_block(inbuf, pad_len,
-					    crypt_key, block_no,
-					    outbuf);
-	if (ret != pad_len) {
-		free(inbuf);
-		free(outbuf);
-		free(crypt_key);
-		return err_msg("encrypt_block returned %zi "
-				"instead of %zi", ret, pad_len);
-	}
+	blocks = xmalloc(count * sizeof(struct crypto_block));
 
-	memcpy(&dn->data, outbuf, pad_len);
+	for (i = 0; i < count; i++) {
+		pad_len = round_up(lens[i], FS_CRYPTO_BLOCK_SIZE);
+		dns[i]->compr_size = cpu_to_le16(lens[i]);
+		memset(dns[i]->data + lens[i], 0, pad_len - lens[i]);
 
-	free(inbuf);
-	free(outbuf);
+		blocks[i].plaintext = dns[i]->data;
+		blocks[i].ciphertext = dns[i]->data;
+		blocks[i].size = pad_len;
+		blocks[i].index = block_nos[i];
+		lens[i] = pad_len;
+	}
+
+	ret = fscrypt_cipher->encrypt_blocks(blocks, count, crypt_key);
+	free(blocks);
 	free(crypt_key);
-	return pad_len;
+	if (ret)
+		return err_msg("could not encrypt data");
+	return 0;
+}
+
+int encrypt_data_node(struct fscrypt_context *fctx, unsigned int block_no,
+		      struct ubifs_data_node *dn, size_t length)
+{
+	int len = length;
+
+	if (encrypt_data_nodes(fctx, &dn, &block_no, &len, 1))
+		return -1;
+	return len;
 }
 
 static int xdigit(int x)
@@ -107,6 +107,9 @@ int encrypt_path(void **outbuf, void *data, unsigned int data_len,
 		 unsigned int max_namelen, struct fscrypt_context *fctx);
 int encrypt_data_node(struct fscrypt_context *fctx, unsigned int block_no,
 		      struct ubifs_data_node *dn, size_t length);
+int encrypt_data_nodes(struct fscrypt_context *fctx,
+		       struct ubifs_data_node **dns,
+		       const unsigned int *block_nos, int *lens, int count);
 struct fscrypt_context *init_fscrypt_context(const char *cipher_name,
 					     unsigned int flags,
 					     const char *key_file,
@@ -159,6 +162,21 @@ static inline int encrypt_data_node(struct fscrypt_context *fctx, unsigned int b
 	return -1;
 }
 
+static inline int encrypt_data_nodes(struct fscrypt_context *fctx,
+				     struct ubifs_data_node **dns,
+				     const unsigned int *block_nos, int *lens,
+				     int count)
+{
+	(void)fctx;
+	(void)dns;
+	(void)block_nos;
+	(void)lens;
+	(void)count;
+
+	assert(0);
+	return -1;
+}
+
 static inline struct fscrypt_context *inherit_fscrypt_context(struct fscrypt_context *fctx)
 {
 	(void)fctx;
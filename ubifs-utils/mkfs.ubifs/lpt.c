@@ -168,47 +168,79 @@ int calc_dflt_lpt_geom(struct ubifs_info *c, int *main_lebs, int *big_lpt)
 }
 
 /**
- * pack_bits - pack bit fields end-to-end.
- * @addr: address at which to pack (passed and next address returned)
- * @pos: bit position at which to pack (passed and next position returned)
+ * struct bit_writer - buffered little-endian bit stream writer.
+ * @p: next byte to write
+ * @acc: bits which have not been written yet, the oldest in the lowest bits
+ * @bits: number of valid bits in @acc
+ *
+ * LPT nodes are bit fields packed end-to-end, the first field in the lowest
+ * bits of the first byte. Instead of merging every field into memory a byte at
+ * a time, the fields are collected in a 64-bit accumulator which is stored 32
+ * bits at a time.
+ */
+struct bit_writer {
+	uint8_t *p;
+	uint64_t acc;
+	int bits;
+};
+
+static inline void bw_init(struct bit_writer *bw, void *buf)
+{
+	bw->p = buf;
+	bw->acc = 0;
+	bw->bits = 0;
+}
+
+/**
+ * bw_put - add a bit field to a bit stream.
+ * @bw: the bit stream
  * @val: value to pack
  * @nrbits: number of bits of value to pack (1-32)
  */
-static void pack_bits(uint8_t **addr, int *pos, uint32_t val, int nrbits)
+static inline void bw_put(struct bit_writer *bw, uint32_t val, int nrbits)
 {
-	uint8_t *p = *addr;
-	int b = *pos;
-
-	if (b) {
-		*p |= ((uint8_t)val) << b;
-		nrbits += b;
-		if (nrbits > 8) {
-			*++p = (uint8_t)(val >>= (8 - b));
-			if (nrbits > 16) {
-				*++p = (uint8_t)(val >>= 8);
-				if (nrbits > 24) {
-					*++p = (uint8_t)(val >>= 8);
-					if (nrbits > 32)
-						*++p = (uint8_t)(val >>= 8);
-				}
-			}
-		}
-	} else {
-		*p = (uint8_t)val;
-		if (nrbits > 8) {
-			*++p = (uint8_t)(val >>= 8);
-			if (nrbits > 16) {
-				*++p = (uint8_t)(val >>= 8);
-				if (nrbits > 24)
-					*++p = (uint8_t)(val >>= 8);
-			}
-		}
+	val &= 0xffffffffU >> (32 - nrbits);
+	bw->acc |= (uint64_t)val << bw->bits;
+	bw->bits += nrbits;
+	if (bw->bits >= 32) {
+		uint32_t w = htole32((uint32_t)bw->acc);
+
+		memcpy(bw->p, &w, 4);
+		bw->p += 4;
+		bw->acc >>= 32;
+		bw->bits -= 32;
+	}
+}
+
+/**
+ * bw_flush - write out the remaining bits of a bit stream.
+ * @bw: the bit stream
+ *
+ * The unused high bits of the last byte are zero.
+ */
+static inline void bw_flush(struct bit_writer *bw)
+{
+	while (bw->bits > 0) {
+		*bw->p++ = (uint8_t)bw->acc;
+		bw->acc >>= 8;
+		bw->bits -= 8;
 	}
-	b = nrbits & 7;
-	if (b == 0)
-		p++;
-	*addr = p;
-	*pos = b;
+	bw->bits = 0;
+}
+
+/**
+ * set_lpt_crc - store the CRC of a packed LPT node.
+ * @buf: the node
+ * @len: length of the node
+ */
+static void set_lpt_crc(void *buf, int len)
+{
+	uint8_t *p = buf;
+	uint16_t crc;
+
+	crc = crc16(-1, p + UBIFS_LPT_CRC_BYTES, len - UBIFS_LPT_CRC_BYTES);
+	p[0] = (uint8_t)crc;
+	p[1] = (uint8_t)(crc >> 8);
 }
 
 /**
@@ -220,28 +252,23 @@ static void pack_bits(uint8_t **addr, int *pos, uint32_t val, int nrbits)
 static void pack_pnode(struct ubifs_info *c, void *buf,
 		       struct ubifs_pnode *pnode)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_PNODE, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_PNODE, UBIFS_LPT_TYPE_BITS);
 	if (c->big_lpt)
-		pack_bits(&addr, &pos, pnode->num, c->pcnt_bits);
+		bw_put(&bw, pnode->num, c->pcnt_bits);
 	for (i = 0; i < UBIFS_LPT_FANOUT; i++) {
-		pack_bits(&addr, &pos, pnode->lprops[i].free >> 3,
-			  c->space_bits);
-		pack_bits(&addr, &pos, pnode->lprops[i].dirty >> 3,
-			  c->space_bits);
+		bw_put(&bw, pnode->lprops[i].free >> 3, c->space_bits);
+		bw_put(&bw, pnode->lprops[i].dirty >> 3, c->space_bits);
 		if (pnode->lprops[i].flags & LPROPS_INDEX)
-			pack_bits(&addr, &pos, 1, 1);
+			bw_put(&bw, 1, 1);
 		else
-			pack_bits(&addr, &pos, 0, 1);
+			bw_put(&bw, 0, 1);
 	}
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->pnode_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+	bw_flush(&bw);
+	set_lpt_crc(buf, c->pnode_sz);
 }
 
 /**
@@ -253,27 +280,23 @@ static void pack_pnode(struct ubifs_info *c, void *buf,
 static void pack_nnode(struct ubifs_info *c, void *buf,
 		       struct ubifs_nnode *nnode)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_NNODE, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_NNODE, UBIFS_LPT_TYPE_BITS);
 	if (c->big_lpt)
-		pack_bits(&addr, &pos, nnode->num, c->pcnt_bits);
+		bw_put(&bw, nnode->num, c->pcnt_bits);
 	for (i = 0; i < UBIFS_LPT_FANOUT; i++) {
 		int lnum = nnode->nbranch[i].lnum;
 
 		if (lnum == 0)
 			lnum = c->lpt_last + 1;
-		pack_bits(&addr, &pos, lnum - c->lpt_first, c->lpt_lnum_bits);
-		pack_bits(&addr, &pos, nnode->nbranch[i].offs,
-			  c->lpt_offs_bits);
+		bw_put(&bw, lnum - c->lpt_first, c->lpt_lnum_bits);
+		bw_put(&bw, nnode->nbranch[i].offs, c->lpt_offs_bits);
 	}
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->nnode_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+	bw_flush(&bw);
+	set_lpt_crc(buf, c->nnode_sz);
 }
 
 /**
@@ -285,20 +308,17 @@ static void pack_nnode(struct ubifs_info *c, void *buf,
 static void pack_ltab(struct ubifs_info *c, void *buf,
 			 struct ubifs_lpt_lprops *ltab)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_LTAB, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_LTAB, UBIFS_LPT_TYPE_BITS);
 	for (i = 0; i < c->lpt_lebs; i++) {
-		pack_bits(&addr, &pos, ltab[i].free, c->lpt_spc_bits);
-		pack_bits(&addr, &pos, ltab[i].dirty, c->lpt_spc_bits);
+		bw_put(&bw, ltab[i].free, c->lpt_spc_bits);
+		bw_put(&bw, ltab[i].dirty, c->lpt_spc_bits);
 	}
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->ltab_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+	bw_flush(&bw);
+	set_lpt_crc(buf, c->ltab_sz);
 }
 
 /**
@@ -309,18 +329,15 @@ static void pack_ltab(struct ubifs_info *c, void *buf,
  */
 static void pack_lsave(struct ubifs_info *c, void *buf, int *lsave)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_LSAVE, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_LSAVE, UBIFS_LPT_TYPE_BITS);
 	for (i = 0; i < c->lsave_cnt; i++)
-		pack_bits(&addr, &pos, lsave[i], c->lnum_bits);
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->lsave_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+		bw_put(&bw, lsave[i], c->lnum_bits);
+	bw_flush(&bw);
+	set_lpt_crc(buf, c->lsave_sz);
 }
 
 /**
@@ -23,14 +23,22 @@
 #define _XOPEN_SOURCE 500 /* For realpath() */
 
 #include "mkfs.ubifs.h"
+#include "cache.h"
+#include "stats.h"
+#include "ubi_image.h"
 #include <crc32.h>
+#include <libsparseimg.h>
 #include "common.h"
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <pthread.h>
 #ifndef WITHOUT_XATTR
 #include <sys/xattr.h>
 #endif
 
 #ifdef WITH_SELINUX
+#include <time.h>
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 #endif
@@ -52,44 +60,134 @@
 /* Default time granularity in nanoseconds */
 #define DEFAULT_TIME_GRAN 1000000000
 
+/* Source files are read in chunks of this size */
+#define READ_BUF_SIZE (64 * UBIFS_BLOCK_SIZE)
+
 
 #ifdef WITH_SELINUX
 #define XATTR_NAME_SELINUX "security.selinux"
 static struct selabel_handle *sehnd;
-static char *secontext;
+
+/* Kinds of file_contexts specifications, see 'struct label_spec' */
+enum {
+	SPEC_LITERAL,
+	SPEC_TREE,
+	SPEC_REGEX,
+};
+
+/**
+ * struct label_spec - a file_contexts specification, as far as the label
+ *                     cache is concerned.
+ * @prefix: literal beginning of the path regular expression
+ * @prefix_len: length of @prefix
+ * @kind: %SPEC_LITERAL if the expression is just @prefix, %SPEC_TREE if it is
+ *        @prefix followed by "(/.*)?" or "/.*", %SPEC_REGEX otherwise
+ */
+struct label_spec {
+	char *prefix;
+	int prefix_len;
+	int kind;
+};
+
+/**
+ * struct label_dir - cached security labels of the files in a directory.
+ * @next: next directory in the same hash chain
+ * @dir: directory path as passed to 'selabel_lookup()'
+ * @uniform: no specification tells the files in the directory apart by name,
+ *           so all files of a type get the same label
+ * @labels: labels by file type (the 'S_IFMT' bits of the mode shifted down)
+ */
+struct label_dir {
+	struct label_dir *next;
+	char *dir;
+	int uniform;
+	char *labels[16];
+};
+
+static struct label_spec *label_specs;
+static int label_spec_cnt;
+static struct label_dir **label_dirs;
+static struct label_dir *last_label_dir;
 #endif
 
 /**
  * struct idx_entry - index entry.
- * @next: next index entry (NULL at end of list)
- * @prev: previous index entry (NULL at beginning of list)
  * @key: key
- * @name: directory entry name used for sorting colliding keys by name
+ * @name_offs: offset of the directory entry name in 'idx_names', the name is
+ *             used for sorting colliding keys by name
+ * @name_len: length of the name (zero if the node has no name)
  * @lnum: LEB number
  * @offs: offset
  * @len: length
- * @hash: hash of the node
  *
- * The index is recorded as a linked list which is sorted and used to create
- * the bottom level of the on-flash index tree. The remaining levels of the
- * index tree are each built from the level below.
+ * The index is recorded in the 'idx_entries' array in the order the nodes are
+ * written, and the hashes of the nodes are kept in the 'idx_hashes' array.
+ * The entries are sorted and used to create the bottom level of the on-flash
+ * index tree. The remaining levels of the index tree are each built from the
+ * level below.
+ *
+ * If the index would use more memory than the index memory limit, the entries
+ * recorded so far are sorted and spilled to a run in a temporary file, and the
+ * arrays are reused for the following entries. The runs are then merged when
+ * the bottom level of the index tree is created.
  */
 struct idx_entry {
-	struct idx_entry *next;
-	struct idx_entry *prev;
 	union ubifs_key key;
-	char *name;
+	size_t name_offs;
 	int name_len;
 	int lnum;
 	int offs;
 	int len;
+};
+
+/**
+ * struct idx_sort_rec - index entry sort record.
+ * @key: the key of the index entry as a 64-bit number
+ * @n: index entry number
+ */
+struct idx_sort_rec {
+	uint64_t key;
+	size_t n;
+};
+
+/**
+ * struct idx_run_rec - an index entry in a spilled run.
+ * @key: key
+ * @lnum: LEB number
+ * @offs: offset
+ * @len: length
+ * @name_len: length of the name which follows the record (and the hash)
+ */
+struct idx_run_rec {
+	union ubifs_key key;
+	int lnum;
+	int offs;
+	int len;
+	int name_len;
+};
+
+/**
+ * struct idx_run - a spilled run of index entries being merged.
+ * @fp: the file the run was spilled to
+ * @n: run number, entries of earlier runs go first if all else is equal
+ * @left: number of entries left in the run
+ * @sort_key: the key of @rec as a 64-bit number
+ * @rec: the current entry
+ * @hash: hash of the current entry
+ * @name: name of the current entry
+ */
+struct idx_run {
+	FILE *fp;
+	int n;
+	size_t left;
+	uint64_t sort_key;
+	struct idx_run_rec rec;
 	uint8_t hash[UBIFS_MAX_HASH_LEN];
+	char name[UBIFS_MAX_NLEN];
 };
 
 /**
  * struct inum_mapping - inode number mapping for link counting.
- * @next: next inum_mapping (NULL at end of list)
- * @prev: previous inum_mapping (NULL at beginning of list)
  * @dev: source device on which the source inode number resides
  * @inum: source inode number of the file
  * @use_inum: target inode number of the file
@@ -104,11 +202,11 @@ struct idx_entry {
  * possibility that the file is linked from outside the source directory
  * hierarchy.
  *
- * The inum_mappings are stored in a hash_table of linked lists.
+ * The inum_mappings are stored in one growing array, in the order the files
+ * were found, and are looked up with an open addressing hash table of indexes
+ * into that array (see 'lookup_inum_mapping()').
  */
 struct inum_mapping {
-	struct inum_mapping *next;
-	struct inum_mapping *prev;
 	dev_t dev;
 	ino_t inum;
 	ino_t use_inum;
@@ -117,6 +215,36 @@ struct inum_mapping {
 	struct stat st;
 };
 
+/**
+ * struct ordered_file - a file listed in the order file.
+ * @dev: source device on which the source inode number resides
+ * @ino: source inode number of the file
+ * @inum: target inode number of the file
+ * @creat_sqnum: creation sequence number of the file
+ * @flags: source inode flags
+ * @rule: compression policy rule of the file, %-1 if none
+ * @fctx: encryption context or %NULL if the file is not encrypted
+ * @block_cnt: number of data blocks of the file
+ * @written: bitmap of the data blocks which have been written
+ * @ino_written: the inode node has been written
+ *
+ * Files listed in the order file get their inode numbers and have (some of)
+ * their data written before the directory tree is walked. When the tree walk
+ * gets to such a file, it only writes what is left.
+ */
+struct ordered_file {
+	dev_t dev;
+	ino_t ino;
+	ino_t inum;
+	unsigned long long creat_sqnum;
+	int flags;
+	int rule;
+	struct fscrypt_context *fctx;
+	unsigned long long block_cnt;
+	uint8_t *written;
+	int ino_written;
+};
+
 /*
  * Because we copy functions from the kernel, we use a subset of the UBIFS
  * file-system description object struct ubifs_info.
@@ -132,11 +260,19 @@ int yes;
 
 static char *root;
 static int root_len;
+static const char *archive;
+static int archive_format;
 static struct fscrypt_context *root_fctx;
 static struct stat root_st;
 static char *output;
 static int out_fd;
 static int out_ubi;
+static int out_sparse;
+static struct sparse_img sparse;
+static struct ubi_image_params ubinize = {
+	.subpage_size = -1,
+	.image_seq = -1,
+};
 static int squash_owner;
 static int do_create_inum_attr;
 static char *context;
@@ -148,28 +284,81 @@ static int head_lnum;
 static int head_offs;
 static int head_flags;
 
-/* The index list */
-static struct idx_entry *idx_list_first;
-static struct idx_entry *idx_list_last;
+/* The index entries, their names and hashes */
+static struct idx_entry *idx_entries;
 static size_t idx_cnt;
+static size_t idx_max;
+static char *idx_names;
+static size_t idx_names_sz;
+static size_t idx_names_max;
+static uint8_t *idx_hashes;
+
+/* Index memory limit (zero if there is no limit) and the spilled runs */
+static long long idx_mem_limit;
+static struct idx_run *idx_runs;
+static int idx_run_cnt;
+static size_t idx_spilled_cnt;
+
+/* File the --stats report is written to (standard output if %NULL) */
+static const char *stats_file;
 
 /* Global buffers */
 static void *leb_buf;
 static void *node_buf;
 static void *block_buf;
+static void *read_buf;
+
+/* Inode mappings for link counting and the hash table to look them up */
+static struct inum_mapping *inum_maps;
+static unsigned int inum_map_cnt;
+static unsigned int inum_map_sz;
+static unsigned int *inum_slots;
+static unsigned int inum_slot_cnt;
 
-/* Hash table for inode link counting */
-static struct inum_mapping **hash_table;
+/* Compression policy file */
+static const char *compr_policy_file;
+
+/* Order file and the hash table of the files listed in it */
+static const char *order_file;
+static struct ordered_file **ordered_slots;
+static unsigned int ordered_slot_cnt;
+static unsigned int ordered_cnt;
 
 /* Inode creation sequence number */
 static unsigned long long creat_sqnum;
 
+/* Number of threads used to compress and encrypt data blocks */
+static int jobs = 1;
+
+/* Build cache directory (%NULL if there is no build cache) and size limit */
+static const char *cache_dir;
+static long long cache_size = 1024LL * 1024 * 1024;
+
 static const char *optstring = "d:r:m:o:D:yh?vVe:c:g:f:Fp:k:x:X:j:R:l:j:UQqaK:b:P:C:";
 
 enum {
 	HASH_ALGO_OPTION = CHAR_MAX + 1,
 	AUTH_KEY_OPTION,
 	AUTH_CERT_OPTION,
+	JOBS_OPTION,
+	COMPR_PRECHECK_OPTION,
+	SPARSE_OPTION,
+	CACHE_DIR_OPTION,
+	CACHE_SIZE_OPTION,
+	TAR_OPTION,
+	CPIO_OPTION,
+	ORDER_FILE_OPTION,
+	MEM_LIMIT_OPTION,
+	STATS_OPTION,
+	STATS_FILE_OPTION,
+	UBINIZE_OPTION,
+	UBINIZE_VOL_OPTION,
+	PEB_SIZE_OPTION,
+	SUB_PAGE_SIZE_OPTION,
+	VID_HDR_OFFSET_OPTION,
+	ERASE_COUNTER_OPTION,
+	IMAGE_SEQ_OPTION,
+	COMPR_POLICY_OPTION,
 };
 
 static const struct option longopts[] = {
@@ -203,6 +392,25 @@ static const struct option longopts[] = {
 	{"hash-algo",          1, NULL, HASH_ALGO_OPTION},
 	{"auth-key",           1, NULL, AUTH_KEY_OPTION},
 	{"auth-cert",          1, NULL, AUTH_CERT_OPTION},
+	{"jobs",               1, NULL, JOBS_OPTION},
+	{"compr-precheck",     0, NULL, COMPR_PRECHECK_OPTION},
+	{"compr-policy",       1, NULL, COMPR_POLICY_OPTION},
+	{"sparse",             0, NULL, SPARSE_OPTION},
+	{"cache-dir",          1, NULL, CACHE_DIR_OPTION},
+	{"cache-size",         1, NULL, CACHE_SIZE_OPTION},
+	{"tar",                1, NULL, TAR_OPTION},
+	{"cpio",               1, NULL, CPIO_OPTION},
+	{"order-file",         1, NULL, ORDER_FILE_OPTION},
+	{"mem-limit",          1, NULL, MEM_LIMIT_OPTION},
+	{"stats",              1, NULL, STATS_OPTION},
+	{"stats-file",         1, NULL, STATS_FILE_OPTION},
+	{"ubinize",            1, NULL, UBINIZE_OPTION},
+	{"ubinize-vol",        1, NULL, UBINIZE_VOL_OPTION},
+	{"peb-size",           1, NULL, PEB_SIZE_OPTION},
+	{"sub-page-size",      1, NULL, SUB_PAGE_SIZE_OPTION},
+	{"vid-hdr-offset",     1, NULL, VID_HDR_OFFSET_OPTION},
+	{"erase-counter",      1, NULL, ERASE_COUNTER_OPTION},
+	{"image-seq",          1, NULL, IMAGE_SEQ_OPTION},
 	{NULL, 0, NULL, 0}
 };
 
@@ -218,6 +426,10 @@ static const char *helptext =
 "\tmkfs.ubifs /dev/ubi0_0\n\n"
 "Options:\n"
 "-r, -d, --root=DIR       build file system from directory DIR\n"
+"    --tar=FILE           build file system from tar archive FILE (\"-\" for\n"
+"                         the standard input) instead of a directory\n"
+"    --cpio=FILE          build file system from cpio archive FILE (\"newc\"\n"
+"                         format, \"-\" for the standard input)\n"
 "-m, --min-io-size=SIZE   minimum I/O unit size\n"
 "-e, --leb-size=SIZE      logical erase block size\n"
 "-c, --max-leb-cnt=COUNT  maximum logical erase block count\n"
@@ -229,12 +441,20 @@ static const char *helptext =
 "-X, --favor-percent      may only be used with favor LZO compression and defines\n"
 "                         how many percent better zlib should compress to make\n"
 "                         mkfs.ubifs use zlib instead of LZO (default 20%)\n"
+"    --compr-precheck     do not try to compress blocks which look incompressible\n"
+"                         (e.g. already compressed data) and, with --verbose,\n"
+"                         report how often this guess was right\n"
+"    --compr-policy=FILE  choose the compressor and compression level of each\n"
+"                         file by the glob patterns in FILE\n"
 "-f, --fanout=NUM         fanout NUM (default: 8)\n"
 "-F, --space-fixup        file-system free space has to be fixed up on first mount\n"
 "                         (requires kernel version 3.0 or greater)\n"
 "-k, --keyhash=TYPE       key hash type - \"r5\" or \"test\" (default: \"r5\")\n"
 "-p, --orph-lebs=COUNT    count of erase blocks for orphans (default: 1)\n"
 "-D, --devtable=FILE      use device table FILE\n"
+"    --order-file=FILE    write the files listed in FILE (and optionally only\n"
+"                         the block ranges listed after a tab on the line)\n"
+"                         first, in the listed order\n"
 "-U, --squash-uids        squash owners making all files owned by root\n"
 "-l, --log-lebs=COUNT     count of erase blocks for the log (used only for\n"
 "                         debugging)\n"
@@ -259,6 +479,35 @@ static const char *helptext =
 "                         for signing\n"
 "    --auth-cert=FILE     Authentication certificate filename for signing. Unused\n"
 "                         when certificate is provided via PKCS #11\n"
+"    --cache-dir=DIR      keep compressed data blocks in the build cache in DIR\n"
+"                         and reuse them in later runs\n"
+"    --cache-size=SIZE    maximum size of the build cache (default: 1GiB)\n"
+"    --jobs=NUM           number of threads used to read directories ahead,\n"
+"                         and to compress and encrypt data\n"
+"                         (default: 1)\n"
+"    --sparse             write a sparse image, which leaves out the unused space\n"
+"                         of LEBs (only supported by ubinize)\n"
+"    --ubinize=FILE       write a UBI image with the volumes described by the\n"
+"                         ubinize configuration FILE, like ubinize would, the\n"
+"                         file system goes to the --ubinize-vol volume\n"
+"    --ubinize-vol=NAME   section of the --ubinize configuration describing the\n"
+"                         file system volume, its image is ignored (default:\n"
+"                         the only UBI volume section without an image)\n"
+"    --peb-size=SIZE      physical eraseblock size for --ubinize, the LEB size\n"
+"                         and count are taken from the volume if not specified\n"
+"    --sub-page-size=SIZE sub-page size for --ubinize (default: min. I/O size)\n"
+"    --vid-hdr-offset=NUM VID header offset for --ubinize\n"
+"    --erase-counter=NUM  erase counter for --ubinize (default: 0)\n"
+"    --image-seq=NUM      UBI image sequence number for --ubinize (default:\n"
+"                         random)\n"
+"    --mem-limit=SIZE     memory the index may use, beyond that it is spilled to\n"
+"                         temporary files in $TMPDIR (default: no limit)\n"
+"    --stats=FORMAT       report time, CPU time, bytes and peak memory of each\n"
+"                         build stage, compression ratios, node counts and\n"
+"                         other event counts;\n"
+"                         FORMAT is \"text\" or \"json\"\n"
+"    --stats-file=FILE    write the --stats report to FILE instead of the\n"
+"                         standard output\n"
 "-h, --help               display this help text\n\n"
 "Note, SIZE is specified in bytes, but it may also be specified in Kilobytes,\n"
 "Megabytes, and Gigabytes if a KiB, MiB, or GiB suffix is used.\n\n"
@@ -270,6 +519,12 @@ static const char *helptext =
 "or more percent better than \"lzo\", mkfs.ubifs chooses \"zlib\", otherwise it chooses\n"
 "\"lzo\". The \"--favor-percent\" may specify arbitrary threshold instead of the\n"
 "default 20%.\n\n"
+"The --compr-policy file has a glob pattern and a compressor per line, e.g.\n"
+"\"/usr/bin/* lzo\", \"/usr/share/* zstd:19\" or \"*.jpg none\". Patterns with a\n"
+"'/' are matched against the path name in the file system, others against the\n"
+"file name. The first matching rule wins, other files get the -x compressor.\n"
+"zlib and zstd take a compression level after a ':'. With --stats, the size\n"
+"and the decompression speed of the files of each rule are reported.\n\n"
 "The -F parameter is used to set the \"fix up free space\" flag in the superblock,\n"
 "which forces UBIFS to \"fixup\" all the free space which it is going to use. This\n"
 "option is useful to work-around the problem of double free space programming: if the\n"
@@ -555,7 +810,7 @@ static int get_options(int argc, char**argv)
 	struct stat st;
 	char *endp;
 #ifdef WITH_CRYPTO
-	const char *cipher_name;
+	const char *cipher_name = NULL;
 #endif
 
 	c->fanout = 8;
@@ -732,7 +987,7 @@ static int get_options(int argc, char**argv)
 			context = (char *) xmalloc(context_len + 1);
 			if (!context)
 				return err_msg("xmalloc failed\n");
-			memcpy(context, optarg, context_len);
+			memcpy(context, optarg, context_len + 1);
 
 			/* Make sure root directory exists */
 			if (stat(context, &context_st))
@@ -793,24 +1048,157 @@ static int get_options(int argc, char**argv)
 		case AUTH_CERT_OPTION:
 			c->auth_cert_filename = xstrdup(optarg);
 			break;
+		case CACHE_DIR_OPTION:
+			cache_dir = optarg;
+			break;
+		case CACHE_SIZE_OPTION:
+			cache_size = get_bytes(optarg);
+			if (cache_size <= 0)
+				return err_msg("bad build cache size");
+			break;
 #else
 		case 'C':
 		case HASH_ALGO_OPTION:
 		case AUTH_KEY_OPTION:
 		case AUTH_CERT_OPTION:
+		case CACHE_DIR_OPTION:
+		case CACHE_SIZE_OPTION:
 			return err_msg("mkfs.ubifs was built without crypto support.");
 #endif
+		case COMPR_PRECHECK_OPTION:
+			c->compr_precheck = 1;
+			break;
+		case SPARSE_OPTION:
+			out_sparse = 1;
+			break;
+		case TAR_OPTION:
+		case CPIO_OPTION:
+			if (archive)
+				return err_msg("more than one archive specified");
+			archive = optarg;
+			archive_format = opt == TAR_OPTION ? ARCHIVE_TAR :
+							     ARCHIVE_CPIO;
+			break;
+		case COMPR_POLICY_OPTION:
+			compr_policy_file = optarg;
+			break;
+		case ORDER_FILE_OPTION:
+			order_file = optarg;
+			if (stat(order_file, &st) < 0)
+				return sys_err_msg("bad order file '%s'",
+						   order_file);
+			break;
+		case MEM_LIMIT_OPTION:
+			idx_mem_limit = get_bytes(optarg);
+			if (idx_mem_limit <= 0)
+				return err_msg("bad memory limit");
+			break;
+		case STATS_OPTION:
+			if (!strcmp(optarg, "text"))
+				stats_format = STATS_TEXT;
+			else if (!strcmp(optarg, "json"))
+				stats_format = STATS_JSON;
+			else
+				return err_msg("bad statistics format '%s'",
+					       optarg);
+			break;
+		case STATS_FILE_OPTION:
+			stats_file = optarg;
+			break;
+		case UBINIZE_OPTION:
+			ubinize.ini = optarg;
+			break;
+		case UBINIZE_VOL_OPTION:
+			ubinize.section = optarg;
+			break;
+		case PEB_SIZE_OPTION:
+			ubinize.peb_size = get_bytes(optarg);
+			if (ubinize.peb_size <= 0)
+				return err_msg("bad physical eraseblock size '%s'",
+					       optarg);
+			break;
+		case SUB_PAGE_SIZE_OPTION:
+			ubinize.subpage_size = get_bytes(optarg);
+			if (ubinize.subpage_size <= 0)
+				return err_msg("bad sub-page size '%s'", optarg);
+			break;
+		case VID_HDR_OFFSET_OPTION:
+			ubinize.vid_hdr_offs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg ||
+			    ubinize.vid_hdr_offs < 0)
+				return err_msg("bad VID header offset '%s'",
+					       optarg);
+			break;
+		case ERASE_COUNTER_OPTION:
+			ubinize.ec = strtoll(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || ubinize.ec < 0)
+				return err_msg("bad erase counter value '%s'",
+					       optarg);
+			break;
+		case IMAGE_SEQ_OPTION:
+			ubinize.image_seq = strtoll(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg ||
+			    ubinize.image_seq < 0 ||
+			    ubinize.image_seq > 0xFFFFFFFF)
+				return err_msg("bad UBI image sequence number '%s'",
+					       optarg);
+			break;
+		case JOBS_OPTION:
+			jobs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || jobs <= 0)
+				return err_msg("bad number of jobs '%s'", optarg);
+			break;
 		}
 	}
 
 	if (optind != argc && !output)
 		output = xstrdup(argv[optind]);
 
+	if (order_file && !root)
+		return err_msg("an order file can only be used with a root directory");
+
+	if (archive) {
+		if (root)
+			return err_msg("an archive cannot be used together with a root directory");
+		if (tbl_file)
+			return err_msg("device tables are not supported with archives");
+		if (context)
+			return err_msg("selinux contexts are not supported with archives");
+		if (do_create_inum_attr)
+			return err_msg("--set-inode-attr is not supported with archives");
+	}
+
 	if (!output)
 		return err_msg("not output device or file specified");
 
 	out_ubi = !open_ubi(output);
 
+	if (out_ubi && out_sparse)
+		return err_msg("sparse output is only supported for image files");
+
+	if (ubinize.ini) {
+		int leb_size, max_leb_cnt;
+
+		if (out_ubi || out_sparse)
+			return err_msg("UBI images can only be written to plain image files");
+
+		ubinize.min_io_size = c->min_io_size;
+		ubinize.verbose = verbose;
+		if (ubi_image_open(&ubinize, &leb_size, &max_leb_cnt))
+			return -1;
+
+		if (c->leb_size == -1)
+			c->leb_size = leb_size;
+		else if (c->leb_size != leb_size)
+			return err_msg("LEB size %d does not match the LEB size %d of the UBI volume",
+				       c->leb_size, leb_size);
+		if (c->max_leb_cnt == -1)
+			c->max_leb_cnt = max_leb_cnt;
+	} else if (ubinize.section || ubinize.peb_size ||
+		   ubinize.subpage_size != -1 || ubinize.vid_hdr_offs ||
+		   ubinize.ec || ubinize.image_seq != -1)
+		return err_msg("UBI image options require --ubinize");
+
 	if (out_ubi) {
 		c->min_io_size = c->di.min_io_size;
 		c->leb_size = c->vi.leb_size;
@@ -886,6 +1274,8 @@ static int get_options(int argc, char**argv)
 	if (verbose) {
 		printf("mkfs.ubifs\n");
 		printf("\troot:         %s\n", root);
+		if (archive)
+			printf("\tarchive:      %s\n", archive);
 		printf("\tmin_io_size:  %d\n", c->min_io_size);
 		printf("\tleb_size:     %d\n", c->leb_size);
 		printf("\tmax_leb_cnt:  %d\n", c->max_leb_cnt);
@@ -909,6 +1299,7 @@ static int get_options(int argc, char**argv)
 		printf("\torph_lebs:    %d\n", c->orph_lebs);
 		printf("\tspace_fixup:  %d\n", c->space_fixup);
 		printf("\tselinux file: %s\n", context);
+		printf("\tjobs:         %d\n", jobs);
 	}
 
 	if (validate_options())
@@ -917,15 +1308,20 @@ static int get_options(int argc, char**argv)
 	if (tbl_file && parse_devtable(tbl_file))
 		return err_msg("cannot parse device table file '%s'", tbl_file);
 
+	if (compr_policy_file && parse_compr_policy(compr_policy_file))
+		return err_msg("cannot parse compression policy file '%s'",
+			       compr_policy_file);
+
 	return 0;
 }
 
 /**
- * prepare_node - fill in the common header.
+ * do_prepare_node - fill in the common header using a given sequence number.
  * @node: node
  * @len: node length
+ * @sqnum: sequence number of the node
  */
-static void prepare_node(void *node, int len)
+static void do_prepare_node(void *node, int len, unsigned long long sqnum)
 {
 	uint32_t crc;
 	struct ubifs_ch *ch = node;
@@ -933,34 +1329,284 @@ static void prepare_node(void *node, int len)
 	ch->magic = cpu_to_le32(UBIFS_NODE_MAGIC);
 	ch->len = cpu_to_le32(len);
 	ch->group_type = UBIFS_NO_NODE_GROUP;
-	ch->sqnum = cpu_to_le64(++c->max_sqnum);
+	ch->sqnum = cpu_to_le64(sqnum);
 	ch->padding[0] = ch->padding[1] = 0;
 	crc = mtd_crc32(UBIFS_CRC32_INIT, node + 8, len - 8);
 	ch->crc = cpu_to_le32(crc);
 }
 
 /**
- * write_leb - copy the image of a LEB to the output target.
+ * prepare_node - fill in the common header.
+ * @node: node
+ * @len: node length
+ */
+static void prepare_node(void *node, int len)
+{
+	do_prepare_node(node, len, ++c->max_sqnum);
+}
+
+/**
+ * do_write_leb - write the image of a LEB to the output target.
  * @lnum: LEB number
- * @len: length of data in the buffer
+ * @len: length of data in the buffer, the rest of the LEB is 0xFF bytes
  * @buf: buffer (must be at least c->leb_size bytes)
+ *
+ * The free space at the end of the LEB is not written to UBI volumes, an
+ * atomic LEB change leaves it erased anyway.
  */
-int write_leb(int lnum, int len, void *buf)
+static int do_write_leb(int lnum, int len, void *buf)
 {
 	off_t pos = (off_t)lnum * c->leb_size;
+	int wlen = c->leb_size;
+	struct stats_timer t;
+	int err;
 
-	dbg_msg(3, "LEB %d len %d", lnum, len);
-	memset(buf + len, 0xff, c->leb_size - len);
-	if (out_ubi)
-		if (ubi_leb_change_start(ubi, out_fd, lnum, c->leb_size))
+	stats_start(&t);
+
+	if (out_sparse) {
+		err = sparse_img_write(&sparse, lnum, buf, len);
+		wlen = len;
+		goto out;
+	}
+
+	if (ubinize.ini) {
+		err = ubi_image_write_leb(out_fd, lnum, buf);
+		goto out;
+	}
+
+	if (out_ubi) {
+		wlen = ALIGN(len, c->min_io_size);
+		if (ubi_leb_change_start(ubi, out_fd, lnum, wlen))
 			return sys_err_msg("ubi_leb_change_start failed");
+		if (!wlen) {
+			err = 0;
+			goto out;
+		}
+	}
 
 	if (lseek(out_fd, pos, SEEK_SET) != pos)
 		return sys_err_msg("lseek failed seeking %lld", (long long)pos);
 
-	if (write(out_fd, buf, c->leb_size) != c->leb_size)
+	if (write(out_fd, buf, wlen) != wlen)
 		return sys_err_msg("write failed writing %d bytes at pos %lld",
-				   c->leb_size, (long long)pos);
+				   wlen, (long long)pos);
+
+	err = 0;
+out:
+	stats_stop(STATS_WRITE, &t);
+	stats_add_bytes(STATS_WRITE, len, wlen);
+	return err;
+}
+
+/*
+ * The LEB writer.
+ *
+ * 'write_leb()' does not write LEBs to the output target itself. Instead, it
+ * copies them to a ring of buffers, and a writer thread writes them out in
+ * the order they were queued, so that building the file-system overlaps with
+ * writing it. When the output is a plain image file, LEBs which follow each
+ * other in the image are merged into a single 'pwritev()' call.
+ */
+#define WRITER_BUFS 16
+
+/**
+ * struct leb_writer - the LEB writer.
+ * @lock: protects the positions and the fields below
+ * @cond: signalled when a LEB is queued or written, or the writer stops
+ * @lnums: LEB number of each buffer
+ * @lens: length of data in each buffer
+ * @bufs: the ring of LEB buffers
+ * @head: position of the next buffer to fill
+ * @tail: position of the next buffer to write
+ * @stop: no more LEBs will be queued and the writer thread has to exit
+ * @err: first error which happened while writing
+ * @thread: writer thread
+ * @active: the writer is running
+ */
+struct leb_writer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int lnums[WRITER_BUFS];
+	int lens[WRITER_BUFS];
+	void *bufs[WRITER_BUFS];
+	unsigned long head;
+	unsigned long tail;
+	int stop;
+	int err;
+	pthread_t thread;
+	int active;
+};
+
+static struct leb_writer wr = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * writer_batch - write a run of consecutive LEBs to an image file.
+ * @first: position of the first LEB of the run in the ring
+ * @cnt: number of LEBs in the run
+ */
+static int writer_batch(unsigned long first, int cnt)
+{
+	struct iovec iov[WRITER_BUFS];
+	int i, lnum = wr.lnums[first % WRITER_BUFS];
+	off_t pos = (off_t)lnum * c->leb_size;
+	ssize_t len = (ssize_t)cnt * c->leb_size, ret;
+	unsigned long long used = 0;
+	struct stats_timer t;
+
+	for (i = 0; i < cnt; i++) {
+		iov[i].iov_base = wr.bufs[(first + i) % WRITER_BUFS];
+		iov[i].iov_len = c->leb_size;
+		used += wr.lens[(first + i) % WRITER_BUFS];
+	}
+
+	stats_start(&t);
+	ret = pwritev(out_fd, iov, cnt, pos);
+	if (ret != len)
+		return sys_err_msg("write failed writing %zd bytes at pos %lld",
+				   len, (long long)pos);
+	stats_stop(STATS_WRITE, &t);
+	stats_add_bytes(STATS_WRITE, used, len);
+
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	unsigned long first;
+	int cnt, err = 0;
+
+	(void)arg;
+
+	pthread_mutex_lock(&wr.lock);
+	while (1) {
+		if (wr.tail == wr.head) {
+			if (wr.stop)
+				break;
+			pthread_cond_wait(&wr.cond, &wr.lock);
+			continue;
+		}
+
+		/* Take all the queued LEBs which follow the first one */
+		first = wr.tail;
+		cnt = 1;
+		if (!out_ubi && !out_sparse && !ubinize.ini)
+			while (first + cnt != wr.head &&
+			       wr.lnums[(first + cnt) % WRITER_BUFS] ==
+			       wr.lnums[first % WRITER_BUFS] + cnt)
+				cnt += 1;
+		pthread_mutex_unlock(&wr.lock);
+
+		/* After an error, LEBs are only taken off the ring */
+		if (!err) {
+			if (out_ubi || out_sparse || ubinize.ini)
+				err = do_write_leb(wr.lnums[first % WRITER_BUFS],
+						   wr.lens[first % WRITER_BUFS],
+						   wr.bufs[first % WRITER_BUFS]);
+			else
+				err = writer_batch(first, cnt);
+		}
+
+		pthread_mutex_lock(&wr.lock);
+		if (err && !wr.err)
+			wr.err = err;
+		wr.tail += cnt;
+		pthread_cond_broadcast(&wr.cond);
+	}
+	pthread_mutex_unlock(&wr.lock);
+
+	return NULL;
+}
+
+/**
+ * start_writer - start the LEB writer thread.
+ */
+static int start_writer(void)
+{
+	int i, err;
+
+	for (i = 0; i < WRITER_BUFS; i++)
+		wr.bufs[i] = xmalloc(c->leb_size);
+	wr.head = wr.tail = 0;
+	wr.stop = wr.err = 0;
+
+	err = pthread_create(&wr.thread, NULL, writer_thread, NULL);
+	if (err) {
+		errno = err;
+		return sys_err_msg("cannot create writer thread");
+	}
+
+	wr.active = 1;
+	return 0;
+}
+
+/**
+ * stop_writer - write all queued LEBs and stop the LEB writer thread.
+ *
+ * Returns the first error which happened while writing or zero.
+ */
+static int stop_writer(void)
+{
+	int i;
+
+	if (!wr.active)
+		return 0;
+
+	pthread_mutex_lock(&wr.lock);
+	wr.stop = 1;
+	pthread_cond_broadcast(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
+
+	pthread_join(wr.thread, NULL);
+	wr.active = 0;
+
+	for (i = 0; i < WRITER_BUFS; i++) {
+		free(wr.bufs[i]);
+		wr.bufs[i] = NULL;
+	}
+
+	return wr.err;
+}
+
+/**
+ * write_leb - copy the image of a LEB to the output target.
+ * @lnum: LEB number
+ * @len: length of data in the buffer
+ * @buf: buffer (must be at least c->leb_size bytes)
+ *
+ * The LEB is queued to the LEB writer, so an error may also be the result of
+ * writing a LEB which was queued earlier.
+ */
+int write_leb(int lnum, int len, void *buf)
+{
+	unsigned long n;
+	int err;
+
+	dbg_msg(3, "LEB %d len %d", lnum, len);
+	memset(buf + len, 0xff, c->leb_size - len);
+	if (!wr.active)
+		return do_write_leb(lnum, len, buf);
+
+	pthread_mutex_lock(&wr.lock);
+	while (wr.head - wr.tail == WRITER_BUFS && !wr.err)
+		pthread_cond_wait(&wr.cond, &wr.lock);
+	err = wr.err;
+	pthread_mutex_unlock(&wr.lock);
+	if (err)
+		return err;
+
+	/* The buffer at the head is not used by the writer thread */
+	n = wr.head % WRITER_BUFS;
+	memcpy(wr.bufs[n], buf, c->leb_size);
+	wr.lnums[n] = lnum;
+	wr.lens[n] = len;
+
+	pthread_mutex_lock(&wr.lock);
+	wr.head += 1;
+	pthread_cond_broadcast(&wr.cond);
+	pthread_mutex_unlock(&wr.lock);
 
 	return 0;
 }
@@ -1005,6 +1651,7 @@ static int do_pad(void *buf, int len)
 		crc = mtd_crc32(UBIFS_CRC32_INIT, buf + 8,
 				  UBIFS_PAD_NODE_SZ - 8);
 		ch->crc = cpu_to_le32(crc);
+		stats_add_node(ch);
 
 		memset(buf + UBIFS_PAD_NODE_SZ, 0, pad_len);
 	} else if (pad_len > 0)
@@ -1025,6 +1672,7 @@ static int write_node(void *node, int len, int lnum)
 
 	memcpy(leb_buf, node, len);
 
+	stats_add_node(leb_buf);
 	len = do_pad(leb_buf, len);
 
 	return write_leb(lnum, len, leb_buf);
@@ -1097,9 +1745,110 @@ static void set_lprops(int lnum, int offs, int flags)
 	}
 }
 
+static struct idx_sort_rec *sort_index(void);
+
+/* Memory used by each index entry, including the memory needed to sort it */
+static size_t idx_entry_mem(void)
+{
+	return sizeof(struct idx_entry) + c->hash_len +
+	       2 * sizeof(struct idx_sort_rec);
+}
+
+/**
+ * create_tmp_file - create an anonymous temporary file.
+ *
+ * The file is created in the directory given by the TMPDIR environment
+ * variable, or in '/tmp', and it is removed right away.
+ */
+static FILE *create_tmp_file(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *name;
+	FILE *fp;
+	int fd;
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+
+	xasprintf(&name, "%s/mkfs.ubifs.XXXXXX", dir);
+	fd = mkstemp(name);
+	if (fd == -1) {
+		sys_err_msg("cannot create a temporary file in '%s'", dir);
+		free(name);
+		return NULL;
+	}
+	unlink(name);
+	free(name);
+
+	fp = fdopen(fd, "w+");
+	if (!fp) {
+		sys_err_msg("cannot open a temporary file");
+		close(fd);
+	}
+	return fp;
+}
+
+/**
+ * spill_index - spill the index entries in memory to a sorted run.
+ */
+static int spill_index(void)
+{
+	struct idx_sort_rec *recs;
+	struct idx_run_rec rr;
+	struct idx_entry *e;
+	struct idx_run *run;
+	size_t i;
+	FILE *fp;
+
+	fp = create_tmp_file();
+	if (!fp)
+		return -1;
+
+	recs = sort_index();
+	for (i = 0; i < idx_cnt; i++) {
+		e = &idx_entries[recs[i].n];
+		memset(&rr, 0, sizeof(struct idx_run_rec));
+		rr.key = e->key;
+		rr.lnum = e->lnum;
+		rr.offs = e->offs;
+		rr.len = e->len;
+		rr.name_len = e->name_len;
+		fwrite(&rr, sizeof(struct idx_run_rec), 1, fp);
+		fwrite(idx_hashes + recs[i].n * c->hash_len, 1, c->hash_len,
+		       fp);
+		fwrite(idx_names + e->name_offs, 1, e->name_len, fp);
+	}
+	free(recs);
+
+	if (fflush(fp) || ferror(fp)) {
+		sys_err_msg("cannot write index run");
+		fclose(fp);
+		return -1;
+	}
+	rewind(fp);
+
+	idx_runs = xrealloc(idx_runs, (idx_run_cnt + 1) *
+				      sizeof(struct idx_run));
+	run = &idx_runs[idx_run_cnt];
+	memset(run, 0, sizeof(struct idx_run));
+	run->fp = fp;
+	run->n = idx_run_cnt++;
+	run->left = idx_cnt;
+
+	dbg_msg(1, "spilled %zu index entries to run %d", idx_cnt, run->n);
+
+	idx_spilled_cnt += idx_cnt;
+	idx_cnt = 0;
+	idx_names_sz = 0;
+	return 0;
+}
+
 /**
  * add_to_index - add a node key and position to the index.
  * @key: node key
+ * @name: directory entry name (dent and xent nodes only), it is copied to the
+ *        index and freed
+ * @name_len: length of @name
  * @lnum: node LEB number
  * @offs: node offset
  * @len: node length
@@ -1111,22 +1860,65 @@ static int add_to_index(union ubifs_key *key, char *name, int name_len,
 	struct idx_entry *e;
 
 	dbg_msg(3, "LEB %d offs %d len %d", lnum, offs, len);
-	e = xmalloc(sizeof(struct idx_entry));
-	e->next = NULL;
-	e->prev = idx_list_last;
+	if (idx_mem_limit && idx_cnt &&
+	    (idx_cnt + 1) * idx_entry_mem() + idx_names_sz + name_len >
+	    (unsigned long long)idx_mem_limit) {
+		int err = spill_index();
+
+		if (err) {
+			free(name);
+			return err;
+		}
+	}
+
+	if (idx_cnt == idx_max) {
+		size_t max = idx_max ? idx_max * 2 : 1024;
+
+		/* Do not grow beyond what the memory limit allows */
+		if (idx_mem_limit && max > idx_mem_limit / idx_entry_mem())
+			max = max_t(size_t, idx_mem_limit / idx_entry_mem(),
+				    idx_cnt + 1);
+
+		if (max * sizeof(struct idx_entry) / max !=
+		    sizeof(struct idx_entry)) {
+			free(name);
+			return err_msg("index is too big (%zu entries)",
+				       idx_cnt);
+		}
+		idx_entries = xrealloc(idx_entries,
+				       max * sizeof(struct idx_entry));
+		if (c->hash_len)
+			idx_hashes = xrealloc(idx_hashes, max * c->hash_len);
+		idx_max = max;
+	}
+
+	if (idx_names_sz + name_len > idx_names_max) {
+		size_t max = idx_names_max ? idx_names_max : 65536;
+
+		while (idx_names_sz + name_len > max)
+			max *= 2;
+		if (idx_mem_limit && max > (unsigned long long)idx_mem_limit)
+			max = max_t(size_t, idx_mem_limit,
+				    idx_names_sz + name_len);
+		idx_names = xrealloc(idx_names, max);
+		idx_names_max = max;
+	}
+
+	e = &idx_entries[idx_cnt];
 	e->key = *key;
-	e->name = name;
+	e->name_offs = idx_names_sz;
 	e->name_len = name_len;
 	e->lnum = lnum;
 	e->offs = offs;
 	e->len = len;
-	memcpy(e->hash, hash, c->hash_len);
+	if (c->hash_len)
+		memcpy(idx_hashes + idx_cnt * c->hash_len, hash, c->hash_len);
+
+	if (name_len)
+		memcpy(idx_names + idx_names_sz, name, name_len);
+	idx_names_sz += name_len;
+	free(name);
 
-	if (!idx_list_first)
-		idx_list_first = e;
-	if (idx_list_last)
-		idx_list_last->next = e;
-	idx_list_last = e;
 	idx_cnt += 1;
 	return 0;
 }
@@ -1171,16 +1963,564 @@ static int reserve_space(int len, int *lnum, int *offs)
 	return 0;
 }
 
+/**
+ * commit_node - place a prepared node on the head and add it to the index.
+ * @key: node key
+ * @name: directory entry name (dent and xent nodes only)
+ * @name_len: length of @name
+ * @node: node with the common header already filled in
+ * @len: node length
+ * @hash: hash of the node, or %NULL to calculate it here
+ */
+static int commit_node(union ubifs_key *key, char *name, int name_len,
+		       void *node, int len, const uint8_t *hash)
+{
+	int err, lnum, offs;
+	uint8_t node_hash[UBIFS_MAX_HASH_LEN];
+
+	err = reserve_space(len, &lnum, &offs);
+	if (err)
+		return err;
+
+	memcpy(leb_buf + offs, node, len);
+	memset(leb_buf + offs + len, 0xff, ALIGN(len, 8) - len);
+	stats_add_node(node);
+
+	if (!hash) {
+		ubifs_node_calc_hash(node, node_hash);
+		hash = node_hash;
+	}
+
+	return add_to_index(key, name, name_len, lnum, offs, len, hash);
+}
+
+/**
+ * make_data_node - build a data node from a block of file data.
+ * @dn: node buffer (must be at least %NODE_BUFFER_SIZE bytes)
+ * @key: data node key
+ * @buf: file data
+ * @len: amount of file data in @buf
+ * @block_no: block number of the data
+ * @compr: compressor to use
+ * @rule: compression policy rule of the file, %-1 if none
+ * @fctx: encryption context or %NULL if the file is not encrypted
+ *
+ * This function compresses (and encrypts) @buf into the data node @dn, but
+ * does not fill in the common header. Returns the node length in case of
+ * success and a negative error code in case of failure. It may be called by
+ * several threads at the same time.
+ */
+static int make_data_node(struct ubifs_data_node *dn, union ubifs_key *key,
+			  void *buf, int len, unsigned int block_no, int compr,
+			  int rule, struct fscrypt_context *fctx)
+{
+	struct stats_timer t;
+	size_t out_len;
+	int compr_type, ret;
+
+	memset(dn, 0, UBIFS_DATA_NODE_SZ);
+	dn->ch.node_type = UBIFS_DATA_NODE;
+	key_write(key, &dn->key);
+	out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
+	stats_start(&t);
+	compr_type = cached_compress_data(buf, len, &dn->data, &out_len, compr);
+	stats_stop(STATS_COMPRESS, &t);
+	stats_add_bytes(STATS_COMPRESS, len, out_len);
+	stats_add_compr(compr_type, len, out_len);
+	stats_add_rule(rule, compr_type, &dn->data, len, out_len);
+	dn->compr_type = cpu_to_le16(compr_type);
+	dn->size = cpu_to_le32(len);
+
+	if (!fctx) {
+		dn->compr_size = 0;
+	} else {
+		stats_start(&t);
+		ret = encrypt_data_node(fctx, block_no, dn, out_len);
+		stats_stop(STATS_ENCRYPT, &t);
+		if (ret < 0)
+			return ret;
+		stats_add_bytes(STATS_ENCRYPT, out_len, ret);
+		out_len = ret;
+	}
+
+	return UBIFS_DATA_NODE_SZ + out_len;
+}
+
+/*
+ * The node pipeline.
+ *
+ * When more than one job is requested, add_node() does not place nodes on the
+ * head itself. Instead, the nodes are queued to a ring of slots in the order
+ * they are added, and the sequence number of each node is reserved at that
+ * time. Data blocks are queued uncompressed and a pool of worker threads turns
+ * them into finished data nodes. A single committer thread takes the slots off
+ * the ring strictly in order and commits them to the head, so the resulting
+ * image is the same as the one produced by a single thread. For authenticated
+ * images, the node hashes are calculated before the nodes reach the committer.
+ */
+enum {
+	SLOT_FREE,
+	SLOT_PENDING,
+	SLOT_BUSY,
+	SLOT_READY,
+};
+
+/**
+ * struct node_slot - a node in the node pipeline.
+ * @state: %SLOT_FREE, %SLOT_PENDING, %SLOT_BUSY or %SLOT_READY
+ * @key: node key
+ * @name: directory entry name (dent and xent nodes only)
+ * @name_len: length of @name
+ * @sqnum: sequence number reserved for the node
+ * @len: node length (valid in the %SLOT_READY state)
+ * @err: error code if the node could not be made
+ * @block_no: block number (data nodes only)
+ * @block_len: amount of data in @block
+ * @compr: compressor to use for @block
+ * @rule: compression policy rule of the file of @block
+ * @encrypted: whether @fctx is valid and the data node has to be encrypted
+ * @fctx: copy of the encryption context of the file
+ * @block: uncompressed data block (%UBIFS_BLOCK_SIZE bytes)
+ * @node: node buffer (%NODE_BUFFER_SIZE bytes)
+ * @hash: node hash (authenticated images only)
+ */
+struct node_slot {
+	int state;
+	union ubifs_key key;
+	char *name;
+	int name_len;
+	unsigned long long sqnum;
+	int len;
+	int err;
+	unsigned int block_no;
+	int block_len;
+	int compr;
+	int rule;
+	int encrypted;
+	struct fscrypt_context fctx;
+	void *block;
+	void *node;
+	uint8_t hash[UBIFS_MAX_HASH_LEN];
+};
+
+/**
+ * struct node_pipeline - the node pipeline.
+ * @lock: protects the slot states and the positions below
+ * @work_cond: signalled when a slot becomes pending or the pipeline stops
+ * @ready_cond: signalled when a slot becomes ready
+ * @free_cond: signalled when a slot is freed
+ * @slots: the ring of slots
+ * @slot_cnt: number of slots in the ring
+ * @head: position of the next slot to fill
+ * @work: position of the next slot workers look at
+ * @tail: position of the next slot to commit
+ * @stop: the producer has finished and the threads have to exit
+ * @err: first error which happened in the pipeline
+ * @workers: worker threads
+ * @committer: committer thread
+ * @active: the pipeline is running
+ */
+struct node_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t ready_cond;
+	pthread_cond_t free_cond;
+	struct node_slot *slots;
+	unsigned long slot_cnt;
+	unsigned long head;
+	unsigned long work;
+	unsigned long tail;
+	int stop;
+	int err;
+	pthread_t *workers;
+	pthread_t committer;
+	int active;
+};
+
+static struct node_pipeline pl = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.ready_cond = PTHREAD_COND_INITIALIZER,
+	.free_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Number of slots per job in the node pipeline */
+#define SLOTS_PER_JOB 8
+
+/* Maximum number of data blocks a worker takes off the ring at once */
+#define WORKER_BATCH 4
+
+static int same_encryption(const struct node_slot *s1,
+			   const struct node_slot *s2)
+{
+	if (!s1->encrypted || !s2->encrypted)
+		return s1->encrypted == s2->encrypted;
+	return !memcmp(&s1->fctx, &s2->fctx, sizeof(struct fscrypt_context));
+}
+
+/**
+ * make_slot_nodes - turn a batch of pipeline slots into data nodes.
+ * @batch: the slots
+ * @cnt: number of slots in @batch
+ *
+ * The blocks are compressed one by one, then the data nodes of the same file
+ * are encrypted together, so that the cipher is set up once per batch.
+ */
+static void make_slot_nodes(struct node_slot **batch, int cnt)
+{
+	struct ubifs_data_node *dns[WORKER_BATCH];
+	unsigned int block_nos[WORKER_BATCH];
+	int lens[WORKER_BATCH];
+	unsigned long long in, out;
+	struct stats_timer t;
+	int i, j, k, n, ret;
+
+	for (i = 0; i < cnt; i++) {
+		ret = make_data_node(batch[i]->node, &batch[i]->key,
+				     batch[i]->block, batch[i]->block_len,
+				     batch[i]->block_no, batch[i]->compr,
+				     batch[i]->rule, NULL);
+		if (ret < 0)
+			batch[i]->err = ret;
+		else
+			batch[i]->len = ret;
+	}
+
+	for (i = 0; i < cnt; i = j) {
+		for (j = i + 1; j < cnt; j++)
+			if (!same_encryption(batch[i], batch[j]))
+				break;
+		if (!batch[i]->encrypted)
+			continue;
+
+		for (k = i, n = 0, in = 0; k < j; k++) {
+			if (batch[k]->err)
+				continue;
+			dns[n] = batch[k]->node;
+			block_nos[n] = batch[k]->block_no;
+			lens[n] = batch[k]->len - UBIFS_DATA_NODE_SZ;
+			in += lens[n++];
+		}
+		stats_start(&t);
+		ret = encrypt_data_nodes(&batch[i]->fctx, dns, block_nos, lens,
+					 n);
+		stats_stop(STATS_ENCRYPT, &t);
+		for (k = i, n = 0, out = 0; k < j; k++) {
+			if (batch[k]->err)
+				continue;
+			if (ret) {
+				batch[k]->err = ret;
+			} else {
+				batch[k]->len = UBIFS_DATA_NODE_SZ + lens[n];
+				out += lens[n++];
+			}
+		}
+		stats_add_bytes(STATS_ENCRYPT, in, out);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (batch[i]->err)
+			continue;
+		do_prepare_node(batch[i]->node, batch[i]->len,
+				batch[i]->sqnum);
+		ubifs_node_calc_hash(batch[i]->node, batch[i]->hash);
+	}
+}
+
+static void *pipeline_worker(__attribute__((unused)) void *arg)
+{
+	struct node_slot *slot, *batch[WORKER_BATCH];
+	int i, cnt, err;
+
+	err = init_compression_thread();
+	if (err)
+		err_msg("cannot initialize compressors");
+
+	pthread_mutex_lock(&pl.lock);
+	while (1) {
+		if (pl.work < pl.tail)
+			pl.work = pl.tail;
+		cnt = 0;
+		while (pl.work != pl.head && cnt < WORKER_BATCH) {
+			slot = &pl.slots[pl.work++ % pl.slot_cnt];
+			if (slot->state != SLOT_PENDING)
+				continue;
+			slot->state = SLOT_BUSY;
+			batch[cnt++] = slot;
+		}
+		if (!cnt) {
+			if (pl.stop)
+				break;
+			pthread_cond_wait(&pl.work_cond, &pl.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pl.lock);
+
+		if (err)
+			for (i = 0; i < cnt; i++)
+				batch[i]->err = -ENOMEM;
+		else
+			make_slot_nodes(batch, cnt);
+
+		pthread_mutex_lock(&pl.lock);
+		for (i = 0; i < cnt; i++)
+			batch[i]->state = SLOT_READY;
+		pthread_cond_signal(&pl.ready_cond);
+	}
+	pthread_mutex_unlock(&pl.lock);
+
+	if (!err)
+		destroy_compression_thread();
+	crypto_thread_cleanup();
+	node_hash_thread_cleanup();
+	return NULL;
+}
+
+static void *pipeline_committer(__attribute__((unused)) void *arg)
+{
+	struct node_slot *slot;
+	int err = 0;
+
+	pthread_mutex_lock(&pl.lock);
+	while (1) {
+		if (pl.tail == pl.head) {
+			if (pl.stop)
+				break;
+			pthread_cond_wait(&pl.ready_cond, &pl.lock);
+			continue;
+		}
+
+		slot = &pl.slots[pl.tail % pl.slot_cnt];
+		if (slot->state != SLOT_READY) {
+			pthread_cond_wait(&pl.ready_cond, &pl.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pl.lock);
+
+		/* After an error, nodes are only taken off the ring */
+		if (!err && slot->err)
+			err = slot->err;
+		if (!err)
+			err = commit_node(&slot->key, slot->name,
+					  slot->name_len, slot->node,
+					  slot->len, slot->hash);
+		else
+			free(slot->name);
+
+		pthread_mutex_lock(&pl.lock);
+		if (err && !pl.err)
+			pl.err = err;
+		slot->state = SLOT_FREE;
+		pl.tail += 1;
+		pthread_cond_signal(&pl.free_cond);
+	}
+	pthread_mutex_unlock(&pl.lock);
+
+	return NULL;
+}
+
+/**
+ * start_pipeline - start the node pipeline threads.
+ *
+ * This function does nothing if only one job was requested.
+ */
+static int start_pipeline(void)
+{
+	unsigned long i;
+	int err;
+
+	if (jobs < 2)
+		return 0;
+
+	pl.slot_cnt = jobs * SLOTS_PER_JOB;
+	pl.slots = xzalloc(pl.slot_cnt * sizeof(struct node_slot));
+	for (i = 0; i < pl.slot_cnt; i++) {
+		pl.slots[i].block = xmalloc(UBIFS_BLOCK_SIZE);
+		pl.slots[i].node = xmalloc(NODE_BUFFER_SIZE);
+	}
+	pl.head = pl.work = pl.tail = 0;
+	pl.stop = pl.err = 0;
+
+	pl.workers = xzalloc(jobs * sizeof(pthread_t));
+	for (i = 0; i < (unsigned long)jobs; i++) {
+		err = pthread_create(&pl.workers[i], NULL, pipeline_worker,
+				     NULL);
+		if (err) {
+			errno = err;
+			return sys_err_msg("cannot create worker thread");
+		}
+	}
+
+	err = pthread_create(&pl.committer, NULL, pipeline_committer, NULL);
+	if (err) {
+		errno = err;
+		return sys_err_msg("cannot create committer thread");
+	}
+
+	pl.active = 1;
+	dbg_msg(1, "started %d compression jobs", jobs);
+	return 0;
+}
+
+/**
+ * stop_pipeline - commit all queued nodes and stop the node pipeline.
+ *
+ * Returns the first error which happened in the pipeline or zero.
+ */
+static int stop_pipeline(void)
+{
+	unsigned long i;
+
+	if (!pl.workers)
+		return 0;
+
+	pthread_mutex_lock(&pl.lock);
+	pl.stop = 1;
+	pthread_cond_broadcast(&pl.work_cond);
+	pthread_cond_broadcast(&pl.ready_cond);
+	pthread_mutex_unlock(&pl.lock);
+
+	for (i = 0; i < (unsigned long)jobs; i++)
+		if (pl.workers[i])
+			pthread_join(pl.workers[i], NULL);
+	if (pl.active)
+		pthread_join(pl.committer, NULL);
+	pl.active = 0;
+
+	for (i = 0; i < pl.slot_cnt; i++) {
+		free(pl.slots[i].block);
+		free(pl.slots[i].node);
+	}
+	free(pl.slots);
+	free(pl.workers);
+	pl.slots = NULL;
+	pl.workers = NULL;
+
+	return pl.err;
+}
+
+/**
+ * get_free_slot - get the next free slot of the node pipeline.
+ * @slot: the slot is returned here
+ *
+ * Waits until the slot at the head of the ring is committed. Returns zero in
+ * case of success and the pipeline error if something went wrong with one of
+ * the nodes queued earlier.
+ */
+static int get_free_slot(struct node_slot **slot)
+{
+	struct node_slot *s;
+	int err;
+
+	pthread_mutex_lock(&pl.lock);
+	s = &pl.slots[pl.head % pl.slot_cnt];
+	while (s->state != SLOT_FREE)
+		pthread_cond_wait(&pl.free_cond, &pl.lock);
+	err = pl.err;
+	pthread_mutex_unlock(&pl.lock);
+
+	s->name = NULL;
+	s->name_len = 0;
+	s->err = 0;
+	*slot = s;
+	return err;
+}
+
+/**
+ * put_slot - hand a filled slot over to the node pipeline.
+ * @slot: slot returned by 'get_free_slot()'
+ * @state: %SLOT_PENDING for data blocks, %SLOT_READY for finished nodes
+ */
+static void put_slot(struct node_slot *slot, int state)
+{
+	pthread_mutex_lock(&pl.lock);
+	slot->state = state;
+	pl.head += 1;
+	if (state == SLOT_PENDING)
+		pthread_cond_signal(&pl.work_cond);
+	else
+		pthread_cond_signal(&pl.ready_cond);
+	pthread_mutex_unlock(&pl.lock);
+}
+
+/**
+ * queue_node - queue a finished node to the node pipeline.
+ * @key: node key
+ * @name: directory entry name (dent and xent nodes only)
+ * @name_len: length of @name
+ * @node: node
+ * @len: node length
+ */
+static int queue_node(union ubifs_key *key, char *name, int name_len,
+		      void *node, int len)
+{
+	struct node_slot *slot;
+	int err;
+
+	if (len > NODE_BUFFER_SIZE)
+		return err_msg("node too long (%d bytes)", len);
+
+	err = get_free_slot(&slot);
+	if (err)
+		return err;
+
+	slot->key = *key;
+	slot->name = name;
+	slot->name_len = name_len;
+	slot->len = len;
+	memcpy(slot->node, node, len);
+	prepare_node(slot->node, len);
+	ubifs_node_calc_hash(slot->node, slot->hash);
+	put_slot(slot, SLOT_READY);
+	return 0;
+}
+
+/**
+ * queue_data_block - queue a block of file data to the node pipeline.
+ * @key: data node key
+ * @buf: file data
+ * @len: amount of data in @buf
+ * @block_no: block number
+ * @compr: compressor to use
+ * @rule: compression policy rule of the file, %-1 if none
+ * @fctx: encryption context or %NULL if the file is not encrypted
+ */
+static int queue_data_block(union ubifs_key *key, void *buf, int len,
+			    unsigned int block_no, int compr, int rule,
+			    struct fscrypt_context *fctx)
+{
+	struct node_slot *slot;
+	int err;
+
+	err = get_free_slot(&slot);
+	if (err)
+		return err;
+
+	slot->key = *key;
+	slot->sqnum = ++c->max_sqnum;
+	slot->block_no = block_no;
+	slot->block_len = len;
+	slot->compr = compr;
+	slot->rule = rule;
+	slot->encrypted = !!fctx;
+	if (fctx)
+		slot->fctx = *fctx;
+	memcpy(slot->block, buf, len);
+	put_slot(slot, SLOT_PENDING);
+	return 0;
+}
+
 /**
  * add_node - write a node to the head.
  * @key: node key
+ * @name: directory entry name (dent and xent nodes only)
+ * @name_len: length of @name
  * @node: node
  * @len: node length
  */
 static int add_node(union ubifs_key *key, char *name, int name_len, void *node, int len)
 {
-	int err, lnum, offs, type = key_type(key);
-	uint8_t hash[UBIFS_MAX_HASH_LEN];
+	int type = key_type(key);
 
 	if (type == UBIFS_DENT_KEY || type == UBIFS_XENT_KEY) {
 		if (!name)
@@ -1191,20 +2531,12 @@ static int add_node(union ubifs_key *key, char *name, int name_len, void *node,
 			return err_msg("Name given for non dir/xattr node!");
 	}
 
-	prepare_node(node, len);
-
-	err = reserve_space(len, &lnum, &offs);
-	if (err)
-		return err;
-
-	memcpy(leb_buf + offs, node, len);
-	memset(leb_buf + offs + len, 0xff, ALIGN(len, 8) - len);
-
-	ubifs_node_calc_hash(node, hash);
+	if (pl.active)
+		return queue_node(key, name, name_len, node, len);
 
-	add_to_index(key, name, name_len, lnum, offs, len, hash);
+	prepare_node(node, len);
 
-	return 0;
+	return commit_node(key, name, name_len, node, len, NULL);
 }
 
 static int add_xattr(struct ubifs_ino_node *host_ino, struct stat *st,
@@ -1328,34 +2660,42 @@ static int create_inum_attr(ino_t inum, const char *name)
 	return ret;
 }
 
+/* Buffer for the names of the extended attributes, reused for all files */
+static char *xattr_list;
+static size_t xattr_list_sz;
+
 static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 			   const char *path_name, struct stat *st, ino_t inum)
 {
 	int ret;
-	void *buf = NULL;
+	char *buf;
 	ssize_t len;
 	ssize_t pos = 0;
 
-	len = llistxattr(path_name, NULL, 0);
-	if (len < 0) {
-		if (errno == ENOENT || errno == EOPNOTSUPP)
-			return 0;
-
-		sys_err_msg("llistxattr failed on %s", path_name);
-
-		return len;
-	}
-
-	if (len == 0)
-		goto noxattr;
-
-	buf = xmalloc(len);
-
-	len = llistxattr(path_name, buf, len);
-	if (len < 0) {
-		sys_err_msg("llistxattr failed on %s", path_name);
-		goto out_free;
+	/*
+	 * Most files have no or only a few extended attributes, so try the
+	 * buffer we already have before asking for the size of the list.
+	 */
+	while (1) {
+		len = llistxattr(path_name, xattr_list, xattr_list_sz);
+		if (len == 0 || (len > 0 && xattr_list_sz))
+			break;
+		if (len < 0) {
+			if (errno == ENOENT || errno == EOPNOTSUPP)
+				return 0;
+			if (errno != ERANGE)
+				return sys_err_msg("llistxattr failed on %s",
+						   path_name);
+
+			len = llistxattr(path_name, NULL, 0);
+			if (len < 0)
+				return sys_err_msg("llistxattr failed on %s",
+						   path_name);
+		}
+		xattr_list_sz = len > 256 ? len : 256;
+		xattr_list = xrealloc(xattr_list, xattr_list_sz);
 	}
+	buf = xattr_list;
 
 	while (pos < len) {
 		char attrbuf[1024] = { };
@@ -1368,7 +2708,7 @@ static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 		attrsize = lgetxattr(path_name, name, attrbuf, sizeof(attrbuf) - 1);
 		if (attrsize < 0) {
 			sys_err_msg("lgetxattr failed on %s", path_name);
-			goto out_free;
+			return -1;
 		}
 
 		if (!strcmp(name, "user.image-inode-number")) {
@@ -1382,7 +2722,7 @@ static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 					    (unsigned long long)inum_from_xattr,
 					    attrsize,
 					    path_name);
-				goto out_free;
+				return -1;
 			}
 
 			continue;
@@ -1390,68 +2730,322 @@ static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 
 		ret = add_xattr(host_ino, st, inum, name, attrbuf, attrsize);
 		if (ret < 0)
-			goto out_free;
+			return -1;
 	}
 
-noxattr:
-	free(buf);
 	return 0;
-
-out_free:
-	free(buf);
-
-	return -1;
 }
 #endif
 
 #ifdef WITH_SELINUX
-static int inode_add_selinux_xattr(struct ubifs_ino_node *host_ino,
-			   const char *path_name, struct stat *st, ino_t inum)
+/**
+ * parse_label_spec - parse the path expression of a file_contexts line.
+ * @regex: the path regular expression
+ * @spec: the specification to fill in
+ *
+ * The literal beginning of the expression is stored unescaped. A character
+ * followed by a quantifier is not part of it, and an expression with an
+ * alternation has no literal beginning at all.
+ */
+static void parse_label_spec(const char *regex, struct label_spec *spec)
 {
-	int ret;
-	char *sepath = NULL;
-	char *name;
-	struct qstr nm;
-	unsigned int con_size;
+	const char *p;
+	char *q;
+	int depth = 0;
+
+	spec->prefix = q = xmalloc(strlen(regex) + 1);
+	spec->kind = SPEC_REGEX;
+
+	for (p = regex; *p; p++) {
+		if (*p == '\\' && p[1]) {
+			p++;
+		} else if (*p == '(') {
+			depth += 1;
+		} else if (*p == ')') {
+			depth -= 1;
+		} else if (*p == '|' && depth <= 0) {
+			*q = '\0';
+			spec->prefix_len = 0;
+			return;
+		}
+	}
 
-	if (!context || !sehnd) {
-		secontext = NULL;
-		con_size = 0;
-		return 0;
+	for (p = regex; *p; p++) {
+		if (*p == '\\' && p[1] && !isalnum(p[1])) {
+			*q++ = *++p;
+			continue;
+		}
+		if (strchr(".^$?*+|[](){}\\", *p))
+			break;
+		*q++ = *p;
 	}
 
-	if (path_name[strlen(root)] == '/')
-		sepath = strdup(&path_name[strlen(root)]);
+	if (q > spec->prefix && (*p == '?' || *p == '*' || *p == '{'))
+		q -= 1;
+	else if (!*p)
+		spec->kind = SPEC_LITERAL;
+	else if (!strcmp(p, "(/.*)?"))
+		spec->kind = SPEC_TREE;
+	else if (!strcmp(p, ".*") && q > spec->prefix && q[-1] == '/') {
+		q -= 1;
+		spec->kind = SPEC_TREE;
+	}
 
-	else if (asprintf(&sepath, "/%s", &path_name[strlen(root)]) < 0)
-		sepath = NULL;
+	*q = '\0';
+	spec->prefix_len = q - spec->prefix;
+}
 
-	if (!sepath)
-		return sys_err_msg("could not get sepath\n");
+/**
+ * read_label_specs - read the path expressions of a file_contexts file.
+ * @path: file name
+ * @must_exist: fail if the file does not exist
+ *
+ * Returns %0 on success and %-1 if the file cannot be used for the label
+ * cache, e.g. because it is a compiled file_contexts.bin.
+ */
+static int read_label_specs(const char *path, int must_exist)
+{
+	char *line = NULL, *regex;
+	size_t line_sz = 0;
+	ssize_t len;
+	FILE *fp;
+	int err = 0;
 
-	if (selabel_lookup(sehnd, &secontext, sepath, st->st_mode) < 0) {
-		/* Failed to lookup context, assume unlabeled */
-		secontext = strdup("system_u:object_r:unlabeled_t:s0");
-		dbg_msg(2, "missing context: %s\t%s\t%d\n", secontext, sepath,
-				st->st_mode);
-	}
+	fp = fopen(path, "r");
+	if (!fp)
+		return errno == ENOENT && !must_exist ? 0 : -1;
 
-	dbg_msg(2, "appling selinux context on sepath=%s, secontext=%s\n",
-			sepath, secontext);
-	free(sepath);
-	con_size = strlen(secontext) + 1;
-	name = strdup(XATTR_NAME_SELINUX);
+	while ((len = getline(&line, &line_sz, fp)) != -1) {
+		if ((size_t)len != strlen(line)) {
+			err = -1;
+			break;
+		}
 
-	nm.name = name;
-	nm.len = strlen(name);
-	host_ino->xattr_cnt++;
-	host_ino->xattr_size += CALC_DENT_SIZE(nm.len);
-	host_ino->xattr_size += CALC_XATTR_BYTES(con_size);
-	host_ino->xattr_names += nm.len;
+		regex = strtok(line, " \t\n");
+		if (!regex || *regex == '#')
+			continue;
+
+		label_specs = xrealloc(label_specs, (label_spec_cnt + 1) *
+				       sizeof(struct label_spec));
+		parse_label_spec(regex, &label_specs[label_spec_cnt++]);
+	}
+
+	if (ferror(fp))
+		err = -1;
+	free(line);
+	fclose(fp);
+	return err;
+}
+
+static void free_label_cache(void)
+{
+	struct label_dir *ld, *q;
+	int i, j;
+
+	for (i = 0; i < label_spec_cnt; i++)
+		free(label_specs[i].prefix);
+	free(label_specs);
+	label_specs = NULL;
+	label_spec_cnt = 0;
+
+	if (!label_dirs)
+		return;
+
+	for (i = 0; i < HASH_TABLE_SIZE; i++) {
+		for (ld = label_dirs[i]; ld; ) {
+			q = ld;
+			ld = ld->next;
+			for (j = 0; j < 16; j++)
+				freecon(q->labels[j]);
+			free(q->dir);
+			free(q);
+		}
+	}
+	free(label_dirs);
+	label_dirs = NULL;
+	last_label_dir = NULL;
+}
+
+/**
+ * init_label_cache - prepare caching of the security labels.
+ *
+ * 'selabel_lookup()' matches the path against the regular expressions of all
+ * the specifications, which is expensive with large policies. But in most
+ * directories no specification tells the files apart by name, and then the
+ * label only depends on the directory and the file type. To find these
+ * directories, the path expressions are read from the same files the
+ * file_contexts backend of libselinux loads. Path substitutions are not
+ * modelled, so the cache is not used when there are any.
+ */
+static void init_label_cache(void)
+{
+	static const char * const subs[] = { ".subs", ".subs_dist" };
+	static const char * const extra[] = { ".homedirs", ".local" };
+	struct stat st;
+	char *path;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(subs); i++) {
+		xasprintf(&path, "%s%s", context, subs[i]);
+		err = stat(path, &st);
+		free(path);
+		if (!err)
+			goto out_nocache;
+	}
+
+	if (read_label_specs(context, 1))
+		goto out_nocache;
+
+	for (i = 0; i < ARRAY_SIZE(extra); i++) {
+		xasprintf(&path, "%s%s", context, extra[i]);
+		err = read_label_specs(path, 0);
+		free(path);
+		if (err)
+			goto out_nocache;
+	}
+
+	label_dirs = xzalloc(sizeof(struct label_dir *) * HASH_TABLE_SIZE);
+	return;
 
-	ret = add_xattr(st, inum, secontext, con_size, &nm);
+out_nocache:
+	dbg_msg(1, "not caching selinux labels");
+	free_label_cache();
+}
+
+/**
+ * spec_splits_dir - check if a specification tells files in a directory apart.
+ * @spec: the specification
+ * @dir: the directory, without the trailing slash
+ * @dir_len: length of @dir
+ *
+ * Returns non-zero if @spec might match some, but not all, of the paths
+ * "@dir/NAME", where NAME is any name without a slash.
+ */
+static int spec_splits_dir(const struct label_spec *spec, const char *dir,
+			   int dir_len)
+{
+	if (spec->prefix_len > dir_len) {
+		/* Only paths starting with the prefix can match */
+		if (strncmp(spec->prefix, dir, dir_len) ||
+		    spec->prefix[dir_len] != '/')
+			return 0;
+		/* Matches only deeper down the tree */
+		if (strchr(spec->prefix + dir_len + 1, '/'))
+			return 0;
+		return 1;
+	}
+
+	if (strncmp(spec->prefix, dir, spec->prefix_len))
+		return 0;
+
+	/*
+	 * A literal path of this length is @dir or above it, and a tree either
+	 * contains all of @dir or none of it.
+	 */
+	return spec->kind == SPEC_REGEX;
+}
+
+/**
+ * lookup_label_dir - find or add the label cache entry of a directory.
+ * @sepath: path of a file in the directory, as passed to 'selabel_lookup()'
+ *
+ * Returns %NULL if labels are not cached.
+ */
+static struct label_dir *lookup_label_dir(const char *sepath)
+{
+	const char *base = strrchr(sepath, '/');
+	struct label_dir *ld;
+	unsigned int k = 0;
+	int i, dir_len;
+
+	if (!label_dirs || !base || !base[1])
+		return NULL;
+	dir_len = base - sepath;
+
+	if (last_label_dir && !strncmp(last_label_dir->dir, sepath, dir_len) &&
+	    last_label_dir->dir[dir_len] == '\0')
+		return last_label_dir;
+
+	for (i = 0; i < dir_len; i++)
+		k = k * 31 + (unsigned char)sepath[i];
+	k %= HASH_TABLE_SIZE;
+
+	for (ld = label_dirs[k]; ld; ld = ld->next)
+		if (!strncmp(ld->dir, sepath, dir_len) &&
+		    ld->dir[dir_len] == '\0')
+			goto out;
+
+	ld = xzalloc(sizeof(struct label_dir));
+	xasprintf(&ld->dir, "%.*s", dir_len, sepath);
+	ld->uniform = 1;
+	for (i = 0; i < label_spec_cnt; i++) {
+		if (spec_splits_dir(&label_specs[i], ld->dir, dir_len)) {
+			ld->uniform = 0;
+			break;
+		}
+	}
+	ld->next = label_dirs[k];
+	label_dirs[k] = ld;
+
+out:
+	last_label_dir = ld;
+	return ld;
+}
+
+static int inode_add_selinux_xattr(struct ubifs_ino_node *host_ino,
+			   const char *path_name, struct stat *st, ino_t inum)
+{
+	char name[] = XATTR_NAME_SELINUX;
+	int type = (st->st_mode & S_IFMT) >> 12;
+	char *sepath = NULL, *con = NULL, *label;
+	struct stats_timer t;
+	struct label_dir *ld;
+	int ret;
+
+	if (!context || !sehnd)
+		return 0;
+
+	stats_start(&t);
+
+	if (path_name[strlen(root)] == '/')
+		sepath = strdup(&path_name[strlen(root)]);
+
+	else if (asprintf(&sepath, "/%s", &path_name[strlen(root)]) < 0)
+		sepath = NULL;
+
+	if (!sepath)
+		return sys_err_msg("could not get sepath\n");
+
+	ld = lookup_label_dir(sepath);
+	if (ld && ld->uniform && ld->labels[type]) {
+		label = ld->labels[type];
+		stats_add_count(STATS_LABEL_CACHED, 1);
+	} else {
+		if (selabel_lookup(sehnd, &con, sepath, st->st_mode) < 0) {
+			/* Failed to lookup context, assume unlabeled */
+			con = xstrdup("system_u:object_r:unlabeled_t:s0");
+			dbg_msg(2, "missing context: %s\t%s\t%d\n", con,
+				sepath, st->st_mode);
+		}
+		stats_add_count(STATS_LABEL_LOOKUPS, 1);
+		label = con;
+		if (ld && ld->uniform) {
+			ld->labels[type] = con;
+			con = NULL;
+		}
+	}
+
+	stats_stop(STATS_LABEL, &t);
+
+	dbg_msg(2, "appling selinux context on sepath=%s, secontext=%s\n",
+			sepath, label);
+	free(sepath);
+
+	ret = add_xattr(host_ino, st, inum, name, label, strlen(label) + 1);
 	if (ret < 0)
 		dbg_msg(2, "add_xattr failed %d\n", ret);
+	freecon(con);
 	return ret;
 }
 
@@ -1538,9 +3132,13 @@ static int encrypt_symlink(void *dst, void *data, unsigned int data_len,
  * @data: inode data (for special inodes e.g. symlink path etc)
  * @data_len: inode data length
  * @flags: source inode flags
+ * @xattr_path: host file to copy extended attributes from, or %NULL
+ * @xattrs: extended attributes read from an archive, or %NULL
+ * @fctx: encryption context or %NULL if the inode is not encrypted
  */
 static int add_inode(struct stat *st, ino_t inum, void *data,
 		     unsigned int data_len, int flags, const char *xattr_path,
+		     const struct archive_xattr *xattrs,
 		     struct fscrypt_context *fctx)
 {
 	struct ubifs_ino_node *ino = node_buf;
@@ -1611,6 +3209,13 @@ static int add_inode(struct stat *st, ino_t inum, void *data,
 			return ret;
 	}
 
+	for (; xattrs; xattrs = xattrs->next) {
+		ret = add_xattr(ino, st, inum, xattrs->name, xattrs->value,
+				xattrs->len);
+		if (ret < 0)
+			return ret;
+	}
+
 	if (fctx) {
 		ret = set_fscrypt_context(ino, inum, st, fctx);
 		if (ret < 0)
@@ -1622,35 +3227,26 @@ static int add_inode(struct stat *st, ino_t inum, void *data,
 
 /**
  * add_dir_inode - write an inode for a directory.
- * @dir: source directory
+ * @path_name: source directory path name
+ * @flags: source inode flags
  * @inum: target inode number
  * @size: target directory size
  * @nlink: target directory link count
  * @st: struct stat object describing attributes (except size and nlink) of the
  *      target inode to create
  *
- * Note, this function may be called with %NULL @dir, when the directory which
- * is being created does not exist at the host file system, but is defined by
- * the device table.
+ * Note, this function may be called with %NULL @path_name, when the directory
+ * which is being created does not exist at the host file system, but is defined
+ * by the device table.
  */
-static int add_dir_inode(const char *path_name, DIR *dir, ino_t inum, loff_t size,
-			 unsigned int nlink, struct stat *st,
+static int add_dir_inode(const char *path_name, int flags, ino_t inum,
+			 loff_t size, unsigned int nlink, struct stat *st,
 			 struct fscrypt_context *fctx)
 {
-	int fd, flags = 0;
-
 	st->st_size = size;
 	st->st_nlink = nlink;
 
-	if (dir) {
-		fd = dirfd(dir);
-		if (fd == -1)
-			return sys_err_msg("dirfd failed");
-		if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == -1)
-			flags = 0;
-	}
-
-	return add_inode(st, inum, NULL, 0, flags, path_name, fctx);
+	return add_inode(st, inum, NULL, 0, flags, path_name, NULL, fctx);
 }
 
 /**
@@ -1664,7 +3260,7 @@ static int add_dev_inode(const char *path_name, struct stat *st, ino_t inum, int
 	union ubifs_dev_desc dev;
 
 	dev.huge = cpu_to_le64(makedev(major(st->st_rdev), minor(st->st_rdev)));
-	return add_inode(st, inum, &dev, 8, flags, path_name, NULL);
+	return add_inode(st, inum, &dev, 8, flags, path_name, NULL, NULL);
 }
 
 /**
@@ -1687,7 +3283,7 @@ static int add_symlink_inode(const char *path_name, struct stat *st, ino_t inum,
 	if (len > UBIFS_MAX_INO_DATA)
 		return err_msg("symlink too long for %s", path_name);
 
-	return add_inode(st, inum, buf, len, flags, path_name, fctx);
+	return add_inode(st, inum, buf, len, flags, path_name, NULL, fctx);
 }
 
 static void set_dent_cookie(struct ubifs_dent_node *dent)
@@ -1762,33 +3358,87 @@ static int add_dent_node(ino_t dir_inum, const char *name, ino_t inum,
 	return add_node(&key, kname, kname_len, dent, len);
 }
 
+/**
+ * inode_hash - hash a source inode.
+ * @dev: source device on which source inode number resides
+ * @inum: source inode number
+ */
+static unsigned int inode_hash(dev_t dev, ino_t inum)
+{
+	uint64_t h = ((uint64_t)inum ^ ((uint64_t)dev << 32) ^ (uint64_t)dev) *
+		     0x9e3779b97f4a7c15ULL;
+
+	return h >> 32;
+}
+
+/**
+ * inum_slot - find the first hash table slot to probe for an inode.
+ * @dev: source device on which source inode number resides
+ * @inum: source inode number
+ */
+static unsigned int inum_slot(dev_t dev, ino_t inum)
+{
+	return inode_hash(dev, inum) & (inum_slot_cnt - 1);
+}
+
+/**
+ * grow_inum_slots - double the size of the inode mapping hash table.
+ *
+ * The slots hold the index of the mapping in @inum_maps plus one, zero means
+ * the slot is free. The table is kept at most half full so that the linear
+ * probe sequences stay short.
+ */
+static void grow_inum_slots(void)
+{
+	unsigned int i, k;
+
+	free(inum_slots);
+	inum_slot_cnt = inum_slot_cnt ? inum_slot_cnt * 2 : 1024;
+	inum_slots = xzalloc(inum_slot_cnt * sizeof(unsigned int));
+
+	for (i = 0; i < inum_map_cnt; i++) {
+		k = inum_slot(inum_maps[i].dev, inum_maps[i].inum);
+		while (inum_slots[k])
+			k = (k + 1) & (inum_slot_cnt - 1);
+		inum_slots[k] = i + 1;
+	}
+}
+
 /**
  * lookup_inum_mapping - add an inode mapping for link counting.
  * @dev: source device on which source inode number resides
  * @inum: source inode number
+ *
+ * The returned pointer is only valid until the next call, because adding a
+ * mapping may move the @inum_maps array.
  */
 static struct inum_mapping *lookup_inum_mapping(dev_t dev, ino_t inum)
 {
 	struct inum_mapping *im;
 	unsigned int k;
 
-	k = inum % HASH_TABLE_SIZE;
-	im = hash_table[k];
-	while (im) {
+	if (2 * (inum_map_cnt + 1) > inum_slot_cnt)
+		grow_inum_slots();
+
+	k = inum_slot(dev, inum);
+	while (inum_slots[k]) {
+		im = &inum_maps[inum_slots[k] - 1];
 		if (im->dev == dev && im->inum == inum)
 			return im;
-		im = im->next;
+		k = (k + 1) & (inum_slot_cnt - 1);
 	}
-	im = xmalloc(sizeof(struct inum_mapping));
-	im->next = hash_table[k];
-	im->prev = NULL;
+
+	if (inum_map_cnt == inum_map_sz) {
+		inum_map_sz = inum_map_sz ? inum_map_sz * 2 : 1024;
+		inum_maps = xrealloc(inum_maps,
+				     inum_map_sz * sizeof(struct inum_mapping));
+	}
+	im = &inum_maps[inum_map_cnt++];
+	inum_slots[k] = inum_map_cnt;
 	im->dev = dev;
 	im->inum = inum;
 	im->use_inum = 0;
 	im->use_nlink = 0;
-	if (hash_table[k])
-		hash_table[k]->prev = im;
-	hash_table[k] = im;
 	return im;
 }
 
@@ -1800,11 +3450,200 @@ static struct inum_mapping *lookup_inum_mapping(dev_t dev, ino_t inum)
 static int all_zero(void *buf, int len)
 {
 	unsigned char *p = buf;
+	int i;
 
-	while (len--)
-		if (*p++ != 0)
+	if (len < 16) {
+		while (len--)
+			if (*p++ != 0)
+				return 0;
+		return 1;
+	}
+
+	/*
+	 * If the first 16 bytes are zero and every byte equals the one 16
+	 * bytes further on, all bytes are zero. This lets the vectorised
+	 * 'memcmp()' of the C library do the work.
+	 */
+	for (i = 0; i < 16; i++)
+		if (p[i] != 0)
 			return 0;
-	return 1;
+	return !memcmp(p, p + 16, len - 16);
+}
+
+/**
+ * add_data_block - write a block of file data.
+ * @inum: target inode number
+ * @buf: file data
+ * @len: amount of file data in @buf
+ * @block_no: block number of the data
+ * @flags: source inode flags
+ * @rule: compression policy rule of the file, %-1 if none
+ * @fctx: encryption context or %NULL if the file is not encrypted
+ *
+ * Blocks which contain only zero bytes are holes, they are not written. The
+ * compressor is chosen by the compression policy rule if there is one.
+ */
+static int add_data_block(ino_t inum, void *buf, int len,
+			  unsigned int block_no, int flags, int rule,
+			  struct fscrypt_context *fctx)
+{
+	struct ubifs_data_node *dn = node_buf;
+	union ubifs_key key;
+	int dn_len, use_compr;
+
+	stats_add_bytes(STATS_TRAVERSE, len, 0);
+
+	/* Skip holes */
+	if (all_zero(buf, len))
+		return 0;
+
+	data_key_init(&key, inum, block_no);
+	if (rule >= 0)
+		use_compr = compr_policy_compr(rule);
+	else if (c->default_compr == UBIFS_COMPR_NONE &&
+		 !c->encrypted && (flags & FS_COMPR_FL))
+#ifdef WITHOUT_LZO
+		use_compr = UBIFS_COMPR_ZLIB;
+#else
+		use_compr = UBIFS_COMPR_LZO;
+#endif
+	else if (c->favor_lzo)
+		use_compr = c->default_compr | MKFS_UBIFS_COMPR_FAVOR_LZO;
+	else
+		use_compr = c->default_compr;
+
+	/* Let the node pipeline make the data node */
+	if (pl.active)
+		return queue_data_block(&key, buf, len, block_no, use_compr,
+					rule, fctx);
+
+	/* Make data node */
+	dn_len = make_data_node(dn, &key, buf, len, block_no, use_compr, rule,
+				fctx);
+	if (dn_len < 0)
+		return dn_len;
+
+	/* Add data node to file system */
+	return add_node(&key, NULL, 0, dn, dn_len);
+}
+
+/**
+ * find_ordered_file - find a file in the order file.
+ * @dev: source device on which source inode number resides
+ * @ino: source inode number
+ */
+static struct ordered_file *find_ordered_file(dev_t dev, ino_t ino)
+{
+	struct ordered_file *of;
+	unsigned int k;
+
+	if (!ordered_slots)
+		return NULL;
+
+	k = inode_hash(dev, ino) & (ordered_slot_cnt - 1);
+	while ((of = ordered_slots[k])) {
+		if (of->dev == dev && of->ino == ino)
+			return of;
+		k = (k + 1) & (ordered_slot_cnt - 1);
+	}
+
+	return NULL;
+}
+
+/**
+ * insert_ordered_file - add a file to the hash table of ordered files.
+ * @of: the file, which is not in the table yet
+ *
+ * The table is an open addressing table like the inode mapping table, and it
+ * is doubled in size when it gets half full.
+ */
+static void insert_ordered_file(struct ordered_file *of)
+{
+	unsigned int i, k;
+
+	if (2 * (ordered_cnt + 1) > ordered_slot_cnt) {
+		struct ordered_file **old = ordered_slots;
+		unsigned int old_cnt = ordered_slot_cnt;
+
+		ordered_slot_cnt = old_cnt ? old_cnt * 2 : 1024;
+		ordered_slots = xzalloc(ordered_slot_cnt *
+					sizeof(struct ordered_file *));
+		ordered_cnt = 0;
+		for (i = 0; i < old_cnt; i++)
+			if (old[i])
+				insert_ordered_file(old[i]);
+		free(old);
+	}
+
+	k = inode_hash(of->dev, of->ino) & (ordered_slot_cnt - 1);
+	while (ordered_slots[k])
+		k = (k + 1) & (ordered_slot_cnt - 1);
+	ordered_slots[k] = of;
+	ordered_cnt += 1;
+}
+
+static int block_written(const struct ordered_file *of,
+			 unsigned long long block_no)
+{
+	return of->written[block_no / 8] & (1 << (block_no % 8));
+}
+
+/**
+ * add_file_range - write the data nodes of a range of a regular file.
+ * @fd: file descriptor of the source file
+ * @path_name: source path name
+ * @inum: target inode number
+ * @flags: source inode flags
+ * @rule: compression policy rule of the file, %-1 if none
+ * @fctx: encryption context or %NULL if the file is not encrypted
+ * @of: order file entry of the file or %NULL
+ * @offs: start of the range (a multiple of %UBIFS_BLOCK_SIZE)
+ * @end: end of the range
+ *
+ * The range is read in chunks of %READ_BUF_SIZE bytes, so that big files do
+ * not cost a system call per block.
+ */
+static int add_file_range(int fd, const char *path_name, ino_t inum,
+			  int flags, int rule, struct fscrypt_context *fctx,
+			  struct ordered_file *of, loff_t offs, loff_t end)
+{
+	unsigned int block_no;
+	ssize_t ret, len, pos;
+	int blen, err;
+
+	while (offs < end) {
+		len = end - offs;
+		if (len > READ_BUF_SIZE)
+			len = READ_BUF_SIZE;
+
+		for (pos = 0; pos < len; pos += ret) {
+			ret = pread(fd, read_buf + pos, len - pos, offs + pos);
+			if (ret == -1)
+				return sys_err_msg("failed to read file '%s'",
+						   path_name);
+			if (ret == 0)
+				return err_msg("file size changed during writing file '%s'",
+					       path_name);
+		}
+
+		for (pos = 0; pos < len; pos += blen) {
+			block_no = (offs + pos) / UBIFS_BLOCK_SIZE;
+			blen = len - pos;
+			if (blen > UBIFS_BLOCK_SIZE)
+				blen = UBIFS_BLOCK_SIZE;
+			if (of && block_no < of->block_cnt &&
+			    block_written(of, block_no))
+				continue;
+			err = add_data_block(inum, read_buf + pos, blen,
+					     block_no, flags, rule, fctx);
+			if (err)
+				return err;
+		}
+
+		offs += len;
+	}
+
+	return 0;
 }
 
 /**
@@ -1813,93 +3652,363 @@ static int all_zero(void *buf, int len)
  * @st: source inode stat information
  * @inum: target inode number
  * @flags: source inode flags
+ * @fctx: encryption context or %NULL if the file is not encrypted
+ * @of: the file in the order file, or %NULL if it is not listed there
  */
 static int add_file(const char *path_name, struct stat *st, ino_t inum,
-		    int flags, struct fscrypt_context *fctx)
+		    int flags, struct fscrypt_context *fctx,
+		    struct ordered_file *of)
 {
-	struct ubifs_data_node *dn = node_buf;
-	void *buf = block_buf;
-	loff_t file_size = 0;
-	ssize_t ret, bytes_read;
-	union ubifs_key key;
-	int fd, dn_len, err, compr_type, use_compr;
-	unsigned int block_no = 0;
-	size_t out_len;
+	loff_t offs = 0, end, data, hole, size = st->st_size;
+	int fd, err = 0, sparse, rule;
+	struct stat cur_st;
+
+	rule = of ? of->rule : compr_policy_find(path_name + root_len - 1);
 
 	fd = open(path_name, O_RDONLY | O_LARGEFILE);
 	if (fd == -1)
 		return sys_err_msg("failed to open file '%s'", path_name);
-	do {
-		/* Read next block */
-		bytes_read = 0;
-		do {
-			ret = read(fd, buf + bytes_read,
-				   UBIFS_BLOCK_SIZE - bytes_read);
-			if (ret == -1) {
-				sys_err_msg("failed to read file '%s'",
-					    path_name);
-				close(fd);
-				return 1;
+
+	/* Let the kernel read ahead more aggressively */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/*
+	 * Holes are not written to the image. If the file is smaller on disk
+	 * than its size, only read the parts which have data. The rest would
+	 * be zero blocks, which are skipped anyway.
+	 */
+	sparse = (loff_t)st->st_blocks * 512 < size;
+
+	while (offs < size) {
+		end = size;
+		if (sparse) {
+			data = lseek(fd, offs, SEEK_DATA);
+			if (data == -1 && errno == ENXIO)
+				break;
+			hole = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+			if (hole == -1) {
+				/* No SEEK_DATA support, read everything */
+				sparse = 0;
+			} else {
+				data &= ~(loff_t)(UBIFS_BLOCK_SIZE - 1);
+				if (data > offs)
+					offs = data;
+				hole = ALIGN(hole, UBIFS_BLOCK_SIZE);
+				if (hole < end)
+					end = hole;
 			}
-			bytes_read += ret;
-		} while (ret != 0 && bytes_read != UBIFS_BLOCK_SIZE);
-		if (bytes_read == 0)
+		}
+
+		err = add_file_range(fd, path_name, inum, flags, rule, fctx,
+				     of, offs, end);
+		if (err)
 			break;
-		file_size += bytes_read;
-		/* Skip holes */
-		if (all_zero(buf, bytes_read)) {
-			block_no += 1;
+		offs = end;
+	}
+
+	if (!err && (fstat(fd, &cur_st) || cur_st.st_size != size))
+		err = err_msg("file size changed during writing file '%s'",
+			      path_name);
+
+	if (close(fd) == -1 && !err)
+		return sys_err_msg("failed to close file '%s'", path_name);
+	if (err)
+		return err;
+
+	if (of && of->ino_written)
+		return 0;
+
+	return add_inode(st, inum, NULL, 0, flags, path_name, NULL, fctx);
+}
+
+/**
+ * add_ordered_blocks - write blocks of a file listed in the order file.
+ * @path_name: source path name
+ * @of: the file
+ * @first: first block to write
+ * @last: last block to write
+ *
+ * Blocks which have already been written are skipped.
+ */
+static int add_ordered_blocks(const char *path_name, struct ordered_file *of,
+			      unsigned long long first,
+			      unsigned long long last)
+{
+	unsigned long long block_no;
+	ssize_t len;
+	int fd, err = 0;
+
+	if (first >= of->block_cnt)
+		return 0;
+	if (last >= of->block_cnt)
+		last = of->block_cnt - 1;
+
+	fd = open(path_name, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return sys_err_msg("failed to open file '%s'", path_name);
+
+	for (block_no = first; block_no <= last; block_no++) {
+		if (block_written(of, block_no))
 			continue;
+
+		len = pread(fd, block_buf, UBIFS_BLOCK_SIZE,
+			    block_no * UBIFS_BLOCK_SIZE);
+		if (len <= 0) {
+			err = sys_err_msg("failed to read file '%s'",
+					  path_name);
+			break;
 		}
-		/* Make data node */
-		memset(dn, 0, UBIFS_DATA_NODE_SZ);
-		data_key_init(&key, inum, block_no);
-		dn->ch.node_type = UBIFS_DATA_NODE;
-		key_write(&key, &dn->key);
-		out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
-		if (c->default_compr == UBIFS_COMPR_NONE &&
-		    !c->encrypted && (flags & FS_COMPR_FL))
-#ifdef WITHOUT_LZO
-			use_compr = UBIFS_COMPR_ZLIB;
-#else
-			use_compr = UBIFS_COMPR_LZO;
-#endif
-		else
-			use_compr = c->default_compr;
-		compr_type = compress_data(buf, bytes_read, &dn->data,
-					   &out_len, use_compr);
-		dn->compr_type = cpu_to_le16(compr_type);
-		dn->size = cpu_to_le32(bytes_read);
 
-		if (!fctx) {
-			dn->compr_size = 0;
-		} else {
-			ret = encrypt_data_node(fctx, block_no, dn, out_len);
-			if (ret < 0) {
-				close(fd);
-				return ret;
+		err = add_data_block(of->inum, block_buf, len, block_no,
+				     of->flags, of->rule, of->fctx);
+		if (err)
+			break;
+		of->written[block_no / 8] |= 1 << (block_no % 8);
+	}
+
+	close(fd);
+	return err;
+}
+
+/**
+ * lstat_ordered_file - find a file listed in the order file.
+ * @name: path name relative to the root directory
+ * @st: the attributes of the file are returned here
+ *
+ * Every component of @name is looked up with 'lstat()', so that a symbolic
+ * link in the path, e.g. an absolute one like "lib -> /usr/lib", cannot lead
+ * out of the root directory. Returns the path name of the file, or %NULL if
+ * the file is not a regular file in the root directory.
+ */
+static char *lstat_ordered_file(const char *name, struct stat *st)
+{
+	char *path_name = xmalloc(root_len + strlen(name) + 1);
+	size_t len = root_len;
+	const char *p = name;
+
+	memcpy(path_name, root, root_len + 1);
+	while (*p) {
+		size_t l = strcspn(p, "/");
+
+		if (!l || (l == 1 && *p == '.')) {
+			p += l + !!p[l];
+			continue;
+		}
+		if (l == 2 && p[0] == '.' && p[1] == '.')
+			goto out_free;
+
+		if (path_name[len - 1] != '/')
+			path_name[len++] = '/';
+		memcpy(path_name + len, p, l);
+		len += l;
+		path_name[len] = '\0';
+		p += l;
+
+		if (lstat(path_name, st) == -1)
+			goto out_free;
+		if (*p) {
+			p += 1;
+			if (!S_ISDIR(st->st_mode))
+				goto out_free;
+		}
+	}
+
+	if (len == root_len || !S_ISREG(st->st_mode))
+		goto out_free;
+	return path_name;
+
+out_free:
+	dbg_msg(1, "skipping '%s' from the order file", name);
+	free(path_name);
+	return NULL;
+}
+
+/**
+ * add_ordered_file - write (a part of) a file listed in the order file.
+ * @name: path name relative to the root directory
+ * @ranges: block ranges to write, pairs of the first and the last block
+ * @range_cnt: number of block ranges, zero to write the whole file
+ *
+ * The first time a file is listed, it gets its target inode number, and its
+ * inode node is written unless the inode has more than one link or the
+ * device table changes its attributes.
+ */
+static int add_ordered_file(const char *name, unsigned long long *ranges,
+			    int range_cnt)
+{
+	struct path_htbl_element *ph_elt;
+	struct ordered_file *of;
+	struct stat st;
+	char *path_name, *dir;
+	const char *p;
+	int i, fd, err = 0;
+
+	path_name = lstat_ordered_file(name, &st);
+	if (!path_name)
+		return 0;
+
+	of = find_ordered_file(st.st_dev, st.st_ino);
+	if (!of) {
+		of = xzalloc(sizeof(struct ordered_file));
+		of->dev = st.st_dev;
+		of->ino = st.st_ino;
+		of->inum = ++c->highest_inum;
+		of->creat_sqnum = ++c->max_sqnum;
+		of->rule = compr_policy_find(path_name + root_len - 1);
+		of->fctx = inherit_fscrypt_context(root_fctx);
+		of->block_cnt = (st.st_size + UBIFS_BLOCK_SIZE - 1) /
+				UBIFS_BLOCK_SIZE;
+		of->written = xzalloc(of->block_cnt / 8 + 1);
+		insert_ordered_file(of);
+
+		fd = open(path_name, O_RDONLY);
+		if (fd == -1) {
+			err = sys_err_msg("failed to open file '%s'",
+					  path_name);
+			goto out;
+		}
+		if (ioctl(fd, FS_IOC_GETFLAGS, &of->flags) == -1)
+			of->flags = 0;
+		close(fd);
+	}
+
+	dbg_msg(2, "%s", path_name);
+
+	if (!range_cnt)
+		err = add_ordered_blocks(path_name, of, 0, -1ULL);
+	for (i = 0; i < range_cnt && !err; i++)
+		err = add_ordered_blocks(path_name, of, ranges[2 * i],
+					 ranges[2 * i + 1]);
+	if (err || of->ino_written || st.st_nlink != 1)
+		goto out;
+
+	/* Leave files the device table changes to the tree walk */
+	p = strrchr(name, '/');
+	if (p)
+		xasprintf(&dir, "/%.*s", (int)(p - name), name);
+	else
+		dir = xstrdup("/");
+	ph_elt = devtbl_find_path(dir);
+	free(dir);
+	if (ph_elt && devtbl_find_name(ph_elt, p ? p + 1 : name))
+		goto out;
+
+	if (squash_owner)
+		st.st_uid = st.st_gid = 0;
+	creat_sqnum = of->creat_sqnum;
+	err = add_inode(&st, of->inum, NULL, 0, of->flags, path_name, NULL,
+			of->fctx);
+	of->ino_written = 1;
+
+out:
+	free(path_name);
+	return err;
+}
+
+/*
+ * Parse a block range of the order file, either a block number or the first
+ * and the last block number separated by '-'.
+ */
+static int parse_block_range(const char *str, unsigned long long *first,
+			     unsigned long long *last)
+{
+	char *endp;
+
+	if (!isdigit(*str))
+		return -1;
+	*first = *last = strtoull(str, &endp, 10);
+	if (*endp == '-') {
+		if (!isdigit(endp[1]))
+			return -1;
+		*last = strtoull(endp + 1, &endp, 10);
+	}
+	if (*endp || *last < *first)
+		return -1;
+	return 0;
+}
+
+/**
+ * add_ordered_files - write the files listed in the order file.
+ *
+ * Each line of the order file is a path name relative to the root directory,
+ * optionally followed by a tab character and block ranges separated by white
+ * space. The path name ends only at the tab or at the end of the line, so it
+ * may contain spaces and digits. A block range is a block number or two block
+ * numbers separated by '-'. Blocks are %UBIFS_BLOCK_SIZE bytes. Without block
+ * ranges, the whole file is written. Empty lines and lines starting with '#'
+ * are ignored.
+ */
+static int add_ordered_files(void)
+{
+	unsigned long long *ranges = NULL;
+	int range_cnt, range_max = 0, lineno = 0, err = 0;
+	char *line = NULL, *p, *name, *tok;
+	size_t line_sz = 0;
+	FILE *fp;
+
+	fp = fopen(order_file, "r");
+	if (!fp)
+		return sys_err_msg("cannot open order file '%s'", order_file);
+
+	while (getline(&line, &line_sz, fp) != -1) {
+		lineno += 1;
+
+		p = line + strlen(line);
+		if (p > line && p[-1] == '\n')
+			*--p = '\0';
+		if (p > line && p[-1] == '\r')
+			*--p = '\0';
+
+		name = line;
+		if (!*name || *name == '#')
+			continue;
+		while (*name == '/')
+			name++;
+
+		range_cnt = 0;
+		p = strchr(name, '\t');
+		if (p) {
+			*p++ = '\0';
+			while ((tok = strtok(p, " \t"))) {
+				unsigned long long first, last;
+
+				p = NULL;
+				if (parse_block_range(tok, &first, &last)) {
+					err = err_msg("bad block range '%s' at line %d of order file '%s'",
+						      tok, lineno, order_file);
+					goto out;
+				}
+				if (range_cnt == range_max) {
+					range_max = range_max ? range_max * 2 : 16;
+					ranges = xrealloc(ranges, range_max * 2 *
+							  sizeof(*ranges));
+				}
+				ranges[2 * range_cnt] = first;
+				ranges[2 * range_cnt + 1] = last;
+				range_cnt += 1;
 			}
-			out_len = ret;
 		}
 
-		dn_len = UBIFS_DATA_NODE_SZ + out_len;
-		/* Add data node to file system */
-		err = add_node(&key, NULL, 0, dn, dn_len);
-		if (err) {
-			close(fd);
-			return err;
+		if (!*name || !strcmp(name, "..") || !strncmp(name, "../", 3) ||
+		    strstr(name, "/../")) {
+			err = err_msg("bad path name at line %d of order file '%s'",
+				      lineno, order_file);
+			break;
 		}
 
-		block_no++;
-	} while (ret != 0);
+		err = add_ordered_file(name, ranges, range_cnt);
+		if (err)
+			break;
+	}
 
-	if (close(fd) == -1)
-		return sys_err_msg("failed to close file '%s'", path_name);
-	if (file_size != st->st_size)
-		return err_msg("file size changed during writing file '%s'",
-			       path_name);
+	if (!err && ferror(fp))
+		err = sys_err_msg("cannot read order file '%s'", order_file);
 
-	return add_inode(st, inum, NULL, 0, flags, path_name, fctx);
+out:
+	free(ranges);
+	free(line);
+	fclose(fp);
+	return err;
 }
 
 /**
@@ -1915,11 +4024,24 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 		       unsigned char *type, struct stat *st,
 		       struct fscrypt_context *fctx)
 {
+	struct ordered_file *of = NULL;
 	int fd, flags = 0;
 
 	dbg_msg(2, "%s", path_name);
 
 	if (S_ISREG(st->st_mode)) {
+		of = find_ordered_file(st->st_dev, st->st_ino);
+		if (of && !nlink) {
+			/*
+			 * The file got its inode number when the order file
+			 * was processed, return the new one.
+			 */
+			c->highest_inum -= 1;
+			*inum = of->inum;
+		}
+		if (of)
+			fctx = of->fctx;
+
 		fd = open(path_name, O_RDONLY);
 		if (fd == -1)
 			return sys_err_msg("failed to open file '%s'",
@@ -1949,7 +4071,7 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 		/*
 		 * If the number of links is greater than 1, then add this file
 		 * later when we know the number of links that we actually have.
-		 * For now, we just put the inode mapping in the hash table.
+		 * For now, we just record the inode mapping.
 		 */
 		struct inum_mapping *im;
 
@@ -1967,7 +4089,8 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 			*inum = im->use_inum;
 			im->use_nlink += 1;
 			/* Return unused inode number */
-			c->highest_inum -= 1;
+			if (!of)
+				c->highest_inum -= 1;
 		}
 
 		memcpy(&im->st, st, sizeof(struct stat));
@@ -1975,22 +4098,378 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 	} else
 		st->st_nlink = 1;
 
-	creat_sqnum = ++c->max_sqnum;
+	creat_sqnum = of ? of->creat_sqnum : ++c->max_sqnum;
+
+	if (S_ISREG(st->st_mode))
+		return add_file(path_name, st, *inum, flags, fctx, of);
+	if (S_ISCHR(st->st_mode))
+		return add_dev_inode(path_name, st, *inum, flags);
+	if (S_ISBLK(st->st_mode))
+		return add_dev_inode(path_name, st, *inum, flags);
+	if (S_ISLNK(st->st_mode))
+		return add_symlink_inode(path_name, st, *inum, flags, fctx);
+	if (S_ISSOCK(st->st_mode))
+		return add_inode(st, *inum, NULL, 0, flags, NULL, NULL, NULL);
+	if (S_ISFIFO(st->st_mode))
+		return add_inode(st, *inum, NULL, 0, flags, NULL, NULL, NULL);
+
+	return err_msg("file '%s' has unknown inode type", path_name);
+}
+
+/* Listing states */
+enum {
+	LISTING_QUEUED,
+	LISTING_BUSY,
+	LISTING_DONE,
+};
+
+/**
+ * struct dir_dent - a directory entry read ahead of the traversal.
+ * @name: entry name
+ * @st: attributes of the entry as returned by 'lstat()'
+ * @sub: contents of the entry if it is a directory
+ */
+struct dir_dent {
+	char *name;
+	struct stat st;
+	struct dir_listing *sub;
+};
+
+/**
+ * struct dir_listing - contents of a directory on the host.
+ * @path: directory path name
+ * @dents: directory entries in 'readdir()' order
+ * @cnt: number of entries in @dents
+ * @flags: inode flags of the directory
+ * @err: errno of the failure which stopped reading the directory, or zero
+ * @err_msg: error message for @err
+ * @state: %LISTING_QUEUED, %LISTING_BUSY or %LISTING_DONE
+ * @next: next listing on the prefetch stack
+ * @all: next listing in the list of all listings
+ *
+ * If reading the directory fails, @dents holds the entries read before the
+ * failure, and the error is reported once they have been added.
+ */
+struct dir_listing {
+	char *path;
+	struct dir_dent *dents;
+	unsigned long cnt;
+	int flags;
+	int err;
+	char *err_msg;
+	int state;
+	struct dir_listing *next;
+	struct dir_listing *all;
+};
+
+/**
+ * struct dir_prefetch - threads reading directories ahead of the traversal.
+ * @lock: protects the listing states and all the fields below
+ * @work_cond: signalled when there are listings to read or room for them
+ * @done_cond: signalled when a listing has been read
+ * @stack: listings waiting to be read, the most recently found on top
+ * @all: all listings, so they can be freed when the traversal is over
+ * @dents: number of entries read but not added to the file-system yet
+ * @stop: the traversal is over and the threads have to exit
+ * @threads: prefetch threads
+ * @thread_cnt: number of prefetch threads
+ *
+ * The traversal still runs depth-first on the main thread, which assigns the
+ * inode numbers and adds the entries in 'readdir()' order. The prefetch
+ * threads only do the 'opendir()', 'readdir()' and 'lstat()' calls for the
+ * directories it is going to enter next. The subdirectories found in a
+ * listing are pushed on a stack, so the threads work on the part of the tree
+ * the traversal reaches first. If the traversal gets to a directory which no
+ * thread has picked up yet, it reads the directory itself.
+ */
+struct dir_prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct dir_listing *stack;
+	struct dir_listing *all;
+	unsigned long dents;
+	int stop;
+	pthread_t *threads;
+	int thread_cnt;
+};
+
+static struct dir_prefetch pf = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Maximum number of entries the prefetch threads read ahead */
+#define PREFETCH_MAX_DENTS 65536
+
+/**
+ * new_listing - create a listing for a directory.
+ * @path: directory path name, the listing takes it over
+ */
+static struct dir_listing *new_listing(char *path)
+{
+	struct dir_listing *l;
+
+	l = xzalloc(sizeof(struct dir_listing));
+	l->path = path;
+	l->state = LISTING_QUEUED;
+	return l;
+}
+
+/**
+ * read_listing - read a directory and the attributes of its entries.
+ * @l: the listing to fill
+ *
+ * This function is called without the prefetch lock held, by the thread
+ * which moved @l to %LISTING_BUSY.
+ */
+static void read_listing(struct dir_listing *l)
+{
+	struct dirent *entry;
+	unsigned long sz = 0;
+	DIR *dir;
+	int fd;
+
+	dir = opendir(l->path);
+	if (!dir) {
+		l->err = errno;
+		xasprintf(&l->err_msg, "cannot open directory '%s'", l->path);
+		return;
+	}
+
+	fd = dirfd(dir);
+	if (ioctl(fd, FS_IOC_GETFLAGS, &l->flags) == -1)
+		l->flags = 0;
+
+	while (1) {
+		struct dir_dent *d;
+
+		errno = 0;
+		entry = readdir(dir);
+		if (!entry) {
+			if (errno) {
+				l->err = errno;
+				xasprintf(&l->err_msg,
+					  "error reading directory '%s'",
+					  l->path);
+			}
+			break;
+		}
+
+		if (strcmp(".", entry->d_name) == 0)
+			continue;
+		if (strcmp("..", entry->d_name) == 0)
+			continue;
+
+		if (l->cnt == sz) {
+			sz = sz ? sz * 2 : 16;
+			l->dents = xrealloc(l->dents,
+					    sz * sizeof(struct dir_dent));
+		}
+
+		d = &l->dents[l->cnt];
+		if (fstatat(fd, entry->d_name, &d->st,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+			char *name = make_path(l->path, entry->d_name);
+
+			l->err = errno;
+			xasprintf(&l->err_msg, "lstat failed for file '%s'",
+				  name);
+			free(name);
+			break;
+		}
+
+		d->name = xstrdup(entry->d_name);
+		d->sub = NULL;
+		if (S_ISDIR(d->st.st_mode))
+			d->sub = new_listing(make_path(l->path, d->name));
+		l->cnt += 1;
+	}
+
+	closedir(dir);
+}
+
+/**
+ * finish_listing - make a listing which has been read available.
+ * @l: the listing
+ *
+ * The subdirectories of @l are pushed on the prefetch stack with the first
+ * one on top. This function is called with the prefetch lock held.
+ */
+static void finish_listing(struct dir_listing *l)
+{
+	unsigned long i;
+	int pushed = 0;
+
+	for (i = l->cnt; i > 0; i--) {
+		struct dir_listing *sub = l->dents[i - 1].sub;
+
+		if (!sub)
+			continue;
+		sub->all = pf.all;
+		pf.all = sub;
+		if (pf.thread_cnt) {
+			sub->next = pf.stack;
+			pf.stack = sub;
+			pushed = 1;
+		}
+	}
+
+	pf.dents += l->cnt;
+	l->state = LISTING_DONE;
+	pthread_cond_broadcast(&pf.done_cond);
+	if (pushed)
+		pthread_cond_broadcast(&pf.work_cond);
+}
+
+static void *prefetch_thread(void *arg)
+{
+	struct dir_listing *l;
+
+	(void)arg;
+
+	pthread_mutex_lock(&pf.lock);
+	while (1) {
+		while (!pf.stop &&
+		       (!pf.stack || pf.dents >= PREFETCH_MAX_DENTS))
+			pthread_cond_wait(&pf.work_cond, &pf.lock);
+		if (pf.stop)
+			break;
+
+		l = pf.stack;
+		pf.stack = l->next;
+		/* The traversal may have read it already */
+		if (l->state != LISTING_QUEUED)
+			continue;
+
+		l->state = LISTING_BUSY;
+		pthread_mutex_unlock(&pf.lock);
+		read_listing(l);
+		pthread_mutex_lock(&pf.lock);
+		finish_listing(l);
+	}
+	pthread_mutex_unlock(&pf.lock);
+
+	return NULL;
+}
+
+/**
+ * start_prefetch - start reading directories ahead of the traversal.
+ * @path: path name of the root directory
+ * @root_list: the listing of the root directory is returned here
+ *
+ * The prefetch threads are only started if more than one job was requested.
+ */
+static int start_prefetch(const char *path, struct dir_listing **root_list)
+{
+	int i, err;
+
+	*root_list = new_listing(xstrdup(path));
+	pf.all = *root_list;
+	pf.stack = NULL;
+	pf.dents = 0;
+	pf.stop = 0;
+
+	if (jobs < 2)
+		return 0;
+
+	pf.threads = xzalloc(jobs * sizeof(pthread_t));
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&pf.threads[i], NULL, prefetch_thread,
+				     NULL);
+		if (err) {
+			errno = err;
+			return sys_err_msg("cannot create prefetch thread");
+		}
+		pf.thread_cnt += 1;
+	}
+
+	dbg_msg(1, "started %d directory prefetch threads", jobs);
+	return 0;
+}
+
+/**
+ * stop_prefetch - stop the prefetch threads and free all listings.
+ */
+static void stop_prefetch(void)
+{
+	struct dir_listing *l;
+	unsigned long i;
+	int j;
+
+	pthread_mutex_lock(&pf.lock);
+	pf.stop = 1;
+	pthread_cond_broadcast(&pf.work_cond);
+	pthread_mutex_unlock(&pf.lock);
+
+	for (j = 0; j < pf.thread_cnt; j++)
+		pthread_join(pf.threads[j], NULL);
+	free(pf.threads);
+	pf.threads = NULL;
+	pf.thread_cnt = 0;
+
+	while (pf.all) {
+		l = pf.all;
+		pf.all = l->all;
+		for (i = 0; i < l->cnt; i++)
+			free(l->dents[i].name);
+		free(l->dents);
+		free(l->path);
+		free(l->err_msg);
+		free(l);
+	}
+	pf.stack = NULL;
+}
 
-	if (S_ISREG(st->st_mode))
-		return add_file(path_name, st, *inum, flags, fctx);
-	if (S_ISCHR(st->st_mode))
-		return add_dev_inode(path_name, st, *inum, flags);
-	if (S_ISBLK(st->st_mode))
-		return add_dev_inode(path_name, st, *inum, flags);
-	if (S_ISLNK(st->st_mode))
-		return add_symlink_inode(path_name, st, *inum, flags, fctx);
-	if (S_ISSOCK(st->st_mode))
-		return add_inode(st, *inum, NULL, 0, flags, NULL, NULL);
-	if (S_ISFIFO(st->st_mode))
-		return add_inode(st, *inum, NULL, 0, flags, NULL, NULL);
+/**
+ * get_listing - wait until a listing has been read.
+ * @l: the listing
+ *
+ * If no prefetch thread has picked @l up yet, the directory is read by the
+ * calling thread.
+ */
+static void get_listing(struct dir_listing *l)
+{
+	pthread_mutex_lock(&pf.lock);
+	while (l->state == LISTING_BUSY)
+		pthread_cond_wait(&pf.done_cond, &pf.lock);
+	if (l->state == LISTING_QUEUED) {
+		l->state = LISTING_BUSY;
+		pthread_mutex_unlock(&pf.lock);
+		read_listing(l);
+		pthread_mutex_lock(&pf.lock);
+		finish_listing(l);
+	}
+	pthread_mutex_unlock(&pf.lock);
+}
 
-	return err_msg("file '%s' has unknown inode type", path_name);
+/**
+ * put_listing - release the contents of a listing which has been added.
+ * @l: the listing
+ *
+ * The entries, the path name and the error message are freed. Only the
+ * listing structure itself stays around until 'stop_prefetch()', as it may
+ * still be on the prefetch stack.
+ */
+static void put_listing(struct dir_listing *l)
+{
+	unsigned long i;
+
+	pthread_mutex_lock(&pf.lock);
+	pf.dents -= l->cnt;
+	pthread_cond_broadcast(&pf.work_cond);
+	pthread_mutex_unlock(&pf.lock);
+
+	for (i = 0; i < l->cnt; i++)
+		free(l->dents[i].name);
+	free(l->dents);
+	free(l->path);
+	free(l->err_msg);
+	l->dents = NULL;
+	l->cnt = 0;
+	l->path = NULL;
+	l->err_msg = NULL;
 }
 
 /**
@@ -1998,15 +4477,15 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
  * @dir_name: directory path name
  * @dir_inum: UBIFS inode number of directory
  * @st: directory inode statistics
- * @existing: zero if this function is called for a directory which
- *            does not exist on the host file-system and it is being
- *            created because it is defined in the device table file.
+ * @list: contents of the directory on the host, %NULL if this function is
+ *        called for a directory which does not exist on the host file-system
+ *        and it is being created because it is defined in the device table
+ *        file.
  */
 static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
-			 int existing, struct fscrypt_context *fctx)
+			 struct dir_listing *list, struct fscrypt_context *fctx)
 {
-	struct dirent *entry;
-	DIR *dir = NULL;
+	unsigned long i;
 	int err = 0;
 	loff_t size = UBIFS_INO_NODE_SZ;
 	char *name = NULL;
@@ -2019,12 +4498,8 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	unsigned long long dir_creat_sqnum = ++c->max_sqnum;
 
 	dbg_msg(2, "%s", dir_name);
-	if (existing) {
-		dir = opendir(dir_name);
-		if (dir == NULL)
-			return sys_err_msg("cannot open directory '%s'",
-					   dir_name);
-	}
+	if (list)
+		get_listing(list);
 
 	/*
 	 * Check whether this directory contains files which should be
@@ -2037,45 +4512,29 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	 * Before adding the directory itself, we have to iterate over all the
 	 * entries the device table adds to this directory and create them.
 	 */
-	for (; existing;) {
-		struct stat dent_st;
+	for (i = 0; list && i < list->cnt; i++) {
+		struct dir_dent *entry = &list->dents[i];
+		struct stat dent_st = entry->st;
 		struct fscrypt_context *new_fctx = NULL;
 
-		errno = 0;
-		entry = readdir(dir);
-		if (!entry) {
-			if (errno == 0)
-				break;
-			sys_err_msg("error reading directory '%s'", dir_name);
-			goto out_free;
-		}
-
-		if (strcmp(".", entry->d_name) == 0)
-			continue;
-		if (strcmp("..", entry->d_name) == 0)
-			continue;
-
 		if (ph_elt)
 			/*
 			 * This directory was referred to at the device table
 			 * file. Check if this directory entry is referred at
 			 * too.
 			 */
-			nh_elt = devtbl_find_name(ph_elt, entry->d_name);
+			nh_elt = devtbl_find_name(ph_elt, entry->name);
 
 		/*
 		 * We are going to create the file corresponding to this
-		 * directory entry (@entry->d_name). We use 'struct stat'
+		 * directory entry (@entry->name). We use 'struct stat'
 		 * object to pass information about file attributes (actually
-		 * only about UID, GID, mode, major, and minor). Get attributes
-		 * for this file from the UBIFS rootfs on the host.
+		 * only about UID, GID, mode, major, and minor). The attributes
+		 * of the file on the host were read together with the
+		 * directory.
 		 */
 		free(name);
-		name = make_path(dir_name, entry->d_name);
-		if (lstat(name, &dent_st) == -1) {
-			sys_err_msg("lstat failed for file '%s'", name);
-			goto out_free;
-		}
+		name = make_path(dir_name, entry->name);
 
 		if (squash_owner)
 			/*
@@ -2098,7 +4557,8 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			new_fctx = inherit_fscrypt_context(fctx);
 
 		if (S_ISDIR(dent_st.st_mode)) {
-			err = add_directory(name, inum, &dent_st, 1, new_fctx);
+			err = add_directory(name, inum, &dent_st, entry->sub,
+					    new_fctx);
 			if (err) {
 				free_fscrypt_context(new_fctx);
 				goto out_free;
@@ -2120,18 +4580,24 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			goto out_free;
 		}
 
-		err = add_dent_node(dir_inum, entry->d_name, inum, type, fctx);
+		err = add_dent_node(dir_inum, entry->name, inum, type, fctx);
 		if (err) {
 			free_fscrypt_context(new_fctx);
 			goto out_free;
 		}
-		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(entry->d_name) + 1,
+		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(entry->name) + 1,
 			      8);
 
 		if (new_fctx)
 			free_fscrypt_context(new_fctx);
 	}
 
+	if (list && list->err) {
+		errno = list->err;
+		sys_err_msg("%s", list->err_msg);
+		goto out_free;
+	}
+
 	/*
 	 * OK, we have created all files in this directory (recursively), let's
 	 * also create all files described in the device table. All t
@@ -2169,7 +4635,8 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		new_fctx = inherit_fscrypt_context(fctx);
 
 		if (S_ISDIR(nh_elt->mode)) {
-			err = add_directory(name, inum, &fake_st, 0, new_fctx);
+			err = add_directory(name, inum, &fake_st, NULL,
+					    new_fctx);
 			if (err) {
 				free_fscrypt_context(new_fctx);
 				goto out_free;
@@ -2206,22 +4673,21 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 
 	creat_sqnum = dir_creat_sqnum;
 
-	err = add_dir_inode(dir ? dir_name : NULL, dir, dir_inum, size,
-			    nlink, st, fctx);
+	err = add_dir_inode(list ? dir_name : NULL, list ? list->flags : 0,
+			    dir_inum, size, nlink, st, fctx);
 	if (err)
 		goto out_free;
 
 	free(name);
-	if (existing && closedir(dir) == -1)
-		return sys_err_msg("error closing directory '%s'", dir_name);
-
+	if (list)
+		put_listing(list);
 	return 0;
 
 out_free:
 	free(itr);
 	free(name);
-	if (existing)
-		closedir(dir);
+	if (list)
+		put_listing(list);
 	return -1;
 }
 
@@ -2230,21 +4696,205 @@ out_free:
  */
 static int add_multi_linked_files(void)
 {
-	int i, err;
+	unsigned int i;
+	int err;
 
-	for (i = 0; i < HASH_TABLE_SIZE; i++) {
-		struct inum_mapping *im;
+	for (i = 0; i < inum_map_cnt; i++) {
+		struct inum_mapping *im = &inum_maps[i];
 		unsigned char type = 0;
 
-		for (im = hash_table[i]; im; im = im->next) {
-			dbg_msg(2, "%s", im->path_name);
-			err = add_non_dir(im->path_name, &im->use_inum,
-					  im->use_nlink, &type, &im->st, NULL);
+		dbg_msg(2, "%s", im->path_name);
+		err = add_non_dir(im->path_name, &im->use_inum, im->use_nlink,
+				  &type, &im->st, NULL);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/**
+ * add_archive_file_data - write the data of a regular file from an archive.
+ * @ai: the file inode
+ * @path: path name of the file relative to the root directory
+ *
+ * This function is called while the archive is read, the data is read with
+ * 'read_archive_data()'.
+ */
+static int add_archive_file_data(struct archive_inode *ai, const char *path)
+{
+	void *buf = block_buf;
+	unsigned int block_no = 0;
+	ssize_t len;
+	int err, rule = -1;
+	char *p;
+
+	dbg_msg(3, "inode %lu size %lld", (unsigned long)ai->inum,
+		(long long)ai->st.st_size);
+
+	if (!ai->fctx)
+		ai->fctx = inherit_fscrypt_context(root_fctx);
+
+	if (compr_policy_rule_cnt()) {
+		xasprintf(&p, "/%s", path);
+		rule = compr_policy_find(p);
+		free(p);
+	}
+
+	while ((len = read_archive_data(buf, UBIFS_BLOCK_SIZE)) > 0) {
+		err = add_data_block(ai->inum, buf, len, block_no++, 0, rule,
+				     ai->fctx);
+		if (err)
+			return err;
+	}
+
+	return len;
+}
+
+/**
+ * archive_itype - get the UBIFS inode type of an archive inode.
+ * @mode: inode mode
+ */
+static int archive_itype(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return UBIFS_ITYPE_REG;
+	case S_IFDIR:
+		return UBIFS_ITYPE_DIR;
+	case S_IFLNK:
+		return UBIFS_ITYPE_LNK;
+	case S_IFCHR:
+		return UBIFS_ITYPE_CHR;
+	case S_IFBLK:
+		return UBIFS_ITYPE_BLK;
+	case S_IFIFO:
+		return UBIFS_ITYPE_FIFO;
+	case S_IFSOCK:
+		return UBIFS_ITYPE_SOCK;
+	}
+
+	return -1;
+}
+
+/**
+ * add_archive_inode - write the inode of a non-directory from an archive.
+ * @ai: the inode
+ */
+static int add_archive_inode(struct archive_inode *ai)
+{
+	struct stat st = ai->st;
+	union ubifs_dev_desc dev;
+	int err;
+
+	if (squash_owner)
+		st.st_uid = st.st_gid = 0;
+
+	creat_sqnum = ai->creat_sqnum;
+
+	if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+		if (!ai->fctx)
+			ai->fctx = inherit_fscrypt_context(root_fctx);
+		if (S_ISREG(st.st_mode))
+			err = add_inode(&st, ai->inum, NULL, 0, 0, NULL,
+					ai->xattrs, ai->fctx);
+		else {
+			st.st_size = strlen(ai->target);
+			err = add_inode(&st, ai->inum, ai->target, st.st_size,
+					0, NULL, ai->xattrs, ai->fctx);
+		}
+	} else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+		dev.huge = cpu_to_le64(makedev(major(st.st_rdev),
+					       minor(st.st_rdev)));
+		err = add_inode(&st, ai->inum, &dev, 8, 0, NULL, ai->xattrs,
+				NULL);
+	} else {
+		err = add_inode(&st, ai->inum, NULL, 0, 0, NULL, ai->xattrs,
+				NULL);
+	}
+
+	free_fscrypt_context(ai->fctx);
+	ai->fctx = NULL;
+	ai->written = 1;
+	return err;
+}
+
+/**
+ * add_archive_dir - write a directory tree read from an archive.
+ * @dir: the directory inode
+ *
+ * This is what 'add_directory()' does for directories on the host, except that
+ * the data of regular files has already been written while the archive was
+ * read. Multiply linked inodes are written when their first directory entry
+ * is, the link counts are known by then.
+ */
+static int add_archive_dir(struct archive_inode *dir)
+{
+	struct archive_dent *de;
+	loff_t size = UBIFS_INO_NODE_SZ;
+	unsigned int nlink = 2;
+	struct stat st;
+	int err, type;
+
+	for (de = dir->children; de; de = de->next) {
+		struct archive_inode *ai = de->inode;
+
+		type = archive_itype(ai->st.st_mode);
+		if (type < 0)
+			return err_msg("'%s' has unknown inode type", de->name);
+
+		if (S_ISDIR(ai->st.st_mode)) {
+			ai->fctx = inherit_fscrypt_context(dir->fctx);
+			err = add_archive_dir(ai);
+			free_fscrypt_context(ai->fctx);
+			ai->fctx = NULL;
+			if (err)
+				return err;
+			nlink += 1;
+		} else if (!ai->written) {
+			err = add_archive_inode(ai);
 			if (err)
 				return err;
 		}
+
+		err = add_dent_node(dir->inum, de->name, ai->inum, type,
+				    dir->fctx);
+		if (err)
+			return err;
+		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(de->name) + 1, 8);
 	}
-	return 0;
+
+	st = dir->st;
+	if (squash_owner)
+		st.st_uid = st.st_gid = 0;
+	st.st_size = size;
+	st.st_nlink = nlink;
+	creat_sqnum = dir->creat_sqnum;
+
+	return add_inode(&st, dir->inum, NULL, 0, 0, NULL, dir->xattrs,
+			 dir->fctx);
+}
+
+/**
+ * add_archive - write the files and directories from an archive.
+ */
+static int add_archive(void)
+{
+	struct archive_inode root_ai;
+	int err;
+
+	memset(&root_ai, 0, sizeof(root_ai));
+	root_ai.st = root_st;
+	root_ai.inum = UBIFS_ROOT_INO;
+	root_ai.creat_sqnum = ++c->max_sqnum;
+	root_ai.fctx = root_fctx;
+
+	err = read_archive(archive, archive_format, &root_ai,
+			   add_archive_file_data);
+	if (!err)
+		err = add_archive_dir(&root_ai);
+
+	free_archive(&root_ai);
+	return err;
 }
 
 /**
@@ -2254,6 +4904,7 @@ static int write_data(void)
 {
 	int err;
 	mode_t mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+	struct dir_listing *root_list = NULL;
 	struct path_htbl_element *ph_elt;
 	struct name_htbl_element *nh_elt;
 
@@ -2287,10 +4938,23 @@ static int write_data(void)
 	if (err)
 		return err;
 
-	err = add_directory(root, UBIFS_ROOT_INO, &root_st, !!root, root_fctx);
-	if (err)
-		return err;
-	err = add_multi_linked_files();
+	err = start_pipeline();
+	if (!err && order_file)
+		err = add_ordered_files();
+	if (!err && archive)
+		err = add_archive();
+	else if (!err) {
+		if (root)
+			err = start_prefetch(root, &root_list);
+		if (!err)
+			err = add_directory(root, UBIFS_ROOT_INO, &root_st,
+					    root_list, root_fctx);
+		stop_prefetch();
+	}
+	if (!err)
+		err = add_multi_linked_files();
+	if (stop_pipeline() && !err)
+		err = -1;
 	if (err)
 		return err;
 	return flush_nodes();
@@ -2302,22 +4966,96 @@ static int namecmp(const struct idx_entry *e1, const struct idx_entry *e2)
 	size_t clen = (len1 < len2) ? len1 : len2;
 	int cmp;
 
-	cmp = memcmp(e1->name, e2->name, clen);
+	cmp = memcmp(idx_names + e1->name_offs, idx_names + e2->name_offs,
+		     clen);
 	if (cmp)
 		return cmp;
 	return (len1 < len2) ? -1 : 1;
 }
 
-static int cmp_idx(const void *a, const void *b)
+static int cmp_idx_name(const void *a, const void *b)
 {
-	const struct idx_entry *e1 = *(const struct idx_entry **)a;
-	const struct idx_entry *e2 = *(const struct idx_entry **)b;
-	int cmp;
+	const struct idx_sort_rec *r1 = a;
+	const struct idx_sort_rec *r2 = b;
 
-	cmp = keys_cmp(&e1->key, &e2->key);
-	if (cmp)
-		return cmp;
-	return namecmp(e1, e2);
+	return namecmp(&idx_entries[r1->n], &idx_entries[r2->n]);
+}
+
+/* The index is radix sorted on digits of this many bits */
+#define IDX_RADIX_BITS 11
+#define IDX_RADIX_SIZE (1 << IDX_RADIX_BITS)
+#define IDX_RADIX_PASSES ((64 + IDX_RADIX_BITS - 1) / IDX_RADIX_BITS)
+
+/**
+ * sort_index - sort the index entries.
+ *
+ * Index keys compare like 64-bit numbers made of the two 32-bit halves of the
+ * key, so the entries are sorted by a LSD radix sort of such numbers. Digits
+ * which are the same in all keys (e.g. the upper bits of the inode numbers)
+ * are skipped. Since the sort is stable, only keys of directory entries
+ * with colliding name hashes end up unordered, and these are sorted by name
+ * afterwards. Returns the sorted array of sort records, which has to be
+ * freed by the caller.
+ */
+static struct idx_sort_rec *sort_index(void)
+{
+	struct idx_sort_rec *recs, *tmp, *t;
+	size_t *hist, i, j, n;
+	int pass;
+
+	recs = xmalloc(idx_cnt * sizeof(struct idx_sort_rec));
+	tmp = xmalloc(idx_cnt * sizeof(struct idx_sort_rec));
+	hist = xzalloc(IDX_RADIX_PASSES * IDX_RADIX_SIZE * sizeof(size_t));
+
+	/* Fill in the records and count all the digits in one go */
+	for (i = 0; i < idx_cnt; i++) {
+		const union ubifs_key *key = &idx_entries[i].key;
+		uint64_t k = ((uint64_t)key->u32[0] << 32) | key->u32[1];
+
+		recs[i].key = k;
+		recs[i].n = i;
+		for (pass = 0; pass < IDX_RADIX_PASSES; pass++) {
+			hist[pass * IDX_RADIX_SIZE +
+			     (k & (IDX_RADIX_SIZE - 1))] += 1;
+			k >>= IDX_RADIX_BITS;
+		}
+	}
+
+	for (pass = 0; pass < IDX_RADIX_PASSES && idx_cnt; pass++) {
+		size_t *h = hist + pass * IDX_RADIX_SIZE;
+		int shift = pass * IDX_RADIX_BITS;
+		size_t sum = 0;
+
+		/* Nothing to do if all the keys have the same digit */
+		if (h[(recs[0].key >> shift) & (IDX_RADIX_SIZE - 1)] == idx_cnt)
+			continue;
+
+		for (j = 0; j < IDX_RADIX_SIZE; j++) {
+			n = h[j];
+			h[j] = sum;
+			sum += n;
+		}
+		for (i = 0; i < idx_cnt; i++) {
+			j = (recs[i].key >> shift) & (IDX_RADIX_SIZE - 1);
+			tmp[h[j]++] = recs[i];
+		}
+		t = recs;
+		recs = tmp;
+		tmp = t;
+	}
+
+	/* Order entries with the same key by name */
+	for (i = 0; i < idx_cnt; i = j) {
+		for (j = i + 1; j < idx_cnt && recs[j].key == recs[i].key; j++)
+			;
+		if (j - i > 1)
+			qsort(recs + i, j - i, sizeof(struct idx_sort_rec),
+			      cmp_idx_name);
+	}
+
+	free(hist);
+	free(tmp);
+	return recs;
 }
 
 /**
@@ -2339,6 +5077,8 @@ static int add_idx_node(void *node, int child_cnt)
 
 	memcpy(leb_buf + offs, node, len);
 	memset(leb_buf + offs + len, 0xff, ALIGN(len, 8) - len);
+	stats_add_node(node);
+	stats_add_bytes(STATS_INDEX, 0, len);
 
 	c->old_idx_sz += ALIGN(len, 8);
 
@@ -2353,44 +5093,219 @@ static int add_idx_node(void *node, int child_cnt)
 	return 0;
 }
 
+/**
+ * struct idx_leaf_iter - iterator over the sorted index entries.
+ * @recs: sorted sort records of the entries in memory
+ * @pos: position in @recs
+ * @heap: heap of the spilled runs which are merged
+ * @heap_cnt: number of runs in @heap
+ * @e: the current entry, if it comes from a run
+ * @hash: the hash of @e
+ */
+struct idx_leaf_iter {
+	struct idx_sort_rec *recs;
+	size_t pos;
+	struct idx_run **heap;
+	int heap_cnt;
+	struct idx_entry e;
+	uint8_t hash[UBIFS_MAX_HASH_LEN];
+};
+
+/**
+ * read_run_entry - read the next entry of a spilled run.
+ * @run: the run
+ *
+ * Returns %1 if an entry was read, zero at the end of the run and %-1 in case
+ * of failure.
+ */
+static int read_run_entry(struct idx_run *run)
+{
+	struct idx_run_rec *rr = &run->rec;
+
+	if (!run->left)
+		return 0;
+
+	if (fread(rr, sizeof(struct idx_run_rec), 1, run->fp) != 1 ||
+	    rr->name_len < 0 || rr->name_len > UBIFS_MAX_NLEN ||
+	    fread(run->hash, 1, c->hash_len, run->fp) != (size_t)c->hash_len ||
+	    fread(run->name, 1, rr->name_len, run->fp) != (size_t)rr->name_len)
+		return err_msg("cannot read index run %d", run->n);
+
+	run->sort_key = ((uint64_t)rr->key.u32[0] << 32) | rr->key.u32[1];
+	run->left -= 1;
+	return 1;
+}
+
+/* Compare the current entries of two runs like 'sort_index()' does */
+static int cmp_idx_runs(const struct idx_run *r1, const struct idx_run *r2)
+{
+	int len1 = r1->rec.name_len, len2 = r2->rec.name_len, cmp;
+
+	if (r1->sort_key != r2->sort_key)
+		return r1->sort_key < r2->sort_key ? -1 : 1;
+	cmp = memcmp(r1->name, r2->name, len1 < len2 ? len1 : len2);
+	if (cmp)
+		return cmp;
+	if (len1 != len2)
+		return len1 < len2 ? -1 : 1;
+	return r1->n - r2->n;
+}
+
+static void sift_down_idx_runs(struct idx_run **heap, int cnt, int i)
+{
+	struct idx_run *run = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < cnt) {
+		if (child + 1 < cnt &&
+		    cmp_idx_runs(heap[child + 1], heap[child]) < 0)
+			child += 1;
+		if (cmp_idx_runs(heap[child], run) >= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = run;
+}
+
+/**
+ * init_leaf_iter - start iterating over the sorted index entries.
+ * @it: the iterator
+ *
+ * If the index was spilled, the entries still in memory are spilled too, and
+ * the iterator merges all the runs.
+ */
+static int init_leaf_iter(struct idx_leaf_iter *it)
+{
+	int i, err;
+
+	memset(it, 0, sizeof(struct idx_leaf_iter));
+	if (!idx_run_cnt) {
+		it->recs = sort_index();
+		return 0;
+	}
+
+	if (idx_cnt) {
+		err = spill_index();
+		if (err)
+			return err;
+	}
+
+	/* The entries are in the runs now */
+	free(idx_entries);
+	free(idx_names);
+	free(idx_hashes);
+	idx_entries = NULL;
+	idx_names = NULL;
+	idx_hashes = NULL;
+	idx_cnt = idx_max = idx_names_sz = idx_names_max = 0;
+
+	it->heap = xmalloc(idx_run_cnt * sizeof(struct idx_run *));
+	for (i = 0; i < idx_run_cnt; i++) {
+		err = read_run_entry(&idx_runs[i]);
+		if (err < 0)
+			return err;
+		if (err)
+			it->heap[it->heap_cnt++] = &idx_runs[i];
+	}
+	for (i = it->heap_cnt / 2 - 1; i >= 0; i--)
+		sift_down_idx_runs(it->heap, it->heap_cnt, i);
+	return 0;
+}
+
+/**
+ * next_leaf - get the next index entry in key order.
+ * @it: the iterator
+ * @e: the entry is returned here
+ * @hash: the hash of the entry is returned here
+ */
+static int next_leaf(struct idx_leaf_iter *it, struct idx_entry **e,
+		     const uint8_t **hash)
+{
+	struct idx_run *run;
+	int err;
+
+	if (!it->heap) {
+		size_t n = it->recs[it->pos++].n;
+
+		*e = &idx_entries[n];
+		*hash = idx_hashes + n * c->hash_len;
+		return 0;
+	}
+
+	/*
+	 * The entry is copied out of the run first, because reading the next
+	 * entry of the run overwrites it.
+	 */
+	run = it->heap[0];
+	it->e.key = run->rec.key;
+	it->e.lnum = run->rec.lnum;
+	it->e.offs = run->rec.offs;
+	it->e.len = run->rec.len;
+	memcpy(it->hash, run->hash, c->hash_len);
+	*e = &it->e;
+	*hash = it->hash;
+
+	err = read_run_entry(run);
+	if (err < 0)
+		return err;
+	if (!err)
+		it->heap[0] = it->heap[--it->heap_cnt];
+	if (it->heap_cnt)
+		sift_down_idx_runs(it->heap, it->heap_cnt, 0);
+	return 0;
+}
+
+static void fini_leaf_iter(struct idx_leaf_iter *it)
+{
+	int i;
+
+	free(it->recs);
+	free(it->heap);
+	for (i = 0; i < idx_run_cnt; i++)
+		fclose(idx_runs[i].fp);
+	free(idx_runs);
+	idx_runs = NULL;
+	idx_run_cnt = 0;
+}
+
 /**
  * write_index - write out the index.
  */
 static int write_index(void)
 {
-	size_t sz, i, cnt, idx_sz, pstep, bcnt;
-	struct idx_entry **idx_ptr, **p;
+	size_t i, cnt, idx_sz, bcnt, leaf_cnt;
+	struct idx_leaf_iter it;
+	struct idx_entry *e;
 	struct ubifs_idx_node *idx;
 	struct ubifs_branch *br;
+	union ubifs_key *keys;
+	const uint8_t *hash;
 	int child_cnt = 0, j, level, blnum, boffs, blen, blast_len, err;
 	uint8_t *hashes;
 
-	dbg_msg(1, "leaf node count: %zd", idx_cnt);
+	leaf_cnt = idx_spilled_cnt + idx_cnt;
+	dbg_msg(1, "leaf node count: %zd", leaf_cnt);
+	if (idx_run_cnt)
+		dbg_msg(1, "merging %d index runs", idx_run_cnt + !!idx_cnt);
 
 	/* Reset the head for the index */
 	head_flags = LPROPS_INDEX;
 	/* Allocate index node */
 	idx_sz = ubifs_idx_node_sz(c, c->fanout);
 	idx = xmalloc(idx_sz);
-	/* Make an array of pointers to sort the index list */
-	sz = idx_cnt * sizeof(struct idx_entry *);
-	if (sz / sizeof(struct idx_entry *) != idx_cnt) {
-		free(idx);
-		return err_msg("index is too big (%zu entries)", idx_cnt);
-	}
-	idx_ptr = xmalloc(sz);
-	idx_ptr[0] = idx_list_first;
-	for (i = 1; i < idx_cnt; i++)
-		idx_ptr[i] = idx_ptr[i - 1]->next;
-	qsort(idx_ptr, idx_cnt, sizeof(struct idx_entry *), cmp_idx);
+	err = init_leaf_iter(&it);
+	if (err)
+		goto out_free;
 	/* Write level 0 index nodes */
-	cnt = idx_cnt / c->fanout;
-	if (idx_cnt % c->fanout)
+	cnt = leaf_cnt / c->fanout;
+	if (leaf_cnt % c->fanout)
 		cnt += 1;
 
 	hashes = xmalloc(c->hash_len * cnt);
+	/* The keys of the first children of the index nodes of a level */
+	keys = xmalloc(cnt * sizeof(union ubifs_key));
 
-	p = idx_ptr;
 	blnum = head_lnum;
 	boffs = head_offs;
 	for (i = 0; i < cnt; i++) {
@@ -2399,7 +5314,7 @@ static int write_index(void)
 		 * except for the last index node on each row.
 		 */
 		if (i == cnt - 1) {
-			child_cnt = idx_cnt % c->fanout;
+			child_cnt = leaf_cnt % c->fanout;
 			if (child_cnt == 0)
 				child_cnt = c->fanout;
 		} else
@@ -2408,13 +5323,18 @@ static int write_index(void)
 		idx->ch.node_type = UBIFS_IDX_NODE;
 		idx->child_cnt = cpu_to_le16(child_cnt);
 		idx->level = cpu_to_le16(0);
-		for (j = 0; j < child_cnt; j++, p++) {
+		for (j = 0; j < child_cnt; j++) {
+			err = next_leaf(&it, &e, &hash);
+			if (err)
+				goto out_iter;
+			if (j == 0)
+				keys[i] = e->key;
 			br = ubifs_idx_branch(c, idx, j);
-			key_write_idx(&(*p)->key, &br->key);
-			br->lnum = cpu_to_le32((*p)->lnum);
-			br->offs = cpu_to_le32((*p)->offs);
-			br->len = cpu_to_le32((*p)->len);
-			memcpy(ubifs_branch_hash(br), (*p)->hash, c->hash_len);
+			key_write_idx(&e->key, &br->key);
+			br->lnum = cpu_to_le32(e->lnum);
+			br->offs = cpu_to_le32(e->offs);
+			br->len = cpu_to_le32(e->len);
+			memcpy(ubifs_branch_hash(br), hash, c->hash_len);
 		}
 		add_idx_node(idx, child_cnt);
 
@@ -2422,7 +5342,6 @@ static int write_index(void)
 	}
 	/* Write level 1 index nodes and above */
 	level = 0;
-	pstep = 1;
 	while (cnt > 1) {
 		/*
 		 * 'blast_len' is the length of the last index node in the level
@@ -2436,13 +5355,6 @@ static int write_index(void)
 		if (cnt == 0)
 			cnt = 1;
 		level += 1;
-		/*
-		 * The key of an index node is the same as the key of its first
-		 * child. Thus we can get the key by stepping along the bottom
-		 * level 'p' with an increasing large step 'pstep'.
-		 */
-		p = idx_ptr;
-		pstep *= c->fanout;
 		for (i = 0; i < cnt; i++) {
 			/*
 			 * Calculate the child count. All index nodes are
@@ -2482,10 +5394,12 @@ static int write_index(void)
 				}
 				/*
 				 * Fill in the branch with the key and position
-				 * of the index node from the level below.
+				 * of the index node from the level below. The
+				 * key of an index node is the same as the key
+				 * of its first child.
 				 */
 				br = ubifs_idx_branch(c, idx, j);
-				key_write_idx(&(*p)->key, &br->key);
+				key_write_idx(&keys[bn], &br->key);
 				br->lnum = cpu_to_le32(blnum);
 				br->offs = cpu_to_le32(boffs);
 				br->len = cpu_to_le32(blen);
@@ -2494,7 +5408,6 @@ static int write_index(void)
 				 * below.
 				 */
 				boffs += ALIGN(blen, 8);
-				p += pstep;
 
 				memcpy(ubifs_branch_hash(br),
 				       hashes + bn * c->hash_len,
@@ -2503,17 +5416,25 @@ static int write_index(void)
 			add_idx_node(idx, child_cnt);
 			ubifs_node_calc_hash(idx, hashes + i * c->hash_len);
 		}
+		/* Keep the keys of the index nodes of this level */
+		for (i = 0; i < cnt; i++)
+			keys[i] = keys[i * c->fanout];
 	}
 
 	memcpy(c->root_idx_hash, hashes, c->hash_len);
 
+out_iter:
 	/* Free stuff */
-	for (i = 0; i < idx_cnt; i++) {
-		free(idx_ptr[i]->name);
-		free(idx_ptr[i]);
-	}
-	free(idx_ptr);
+	fini_leaf_iter(&it);
+	free(keys);
+	free(hashes);
+out_free:
+	free(idx_entries);
+	free(idx_names);
+	free(idx_hashes);
 	free(idx);
+	if (err)
+		return err;
 
 	dbg_msg(1, "zroot is at %d:%d len %d", c->zroot.lnum, c->zroot.offs,
 		c->zroot.len);
@@ -2649,6 +5570,9 @@ static int write_super(void)
 	sig = (void *)(sup + 1);
 	prepare_node(sig, UBIFS_SIG_NODE_SZ + le32_to_cpu(sig->len));
 
+	stats_add_node(sup);
+	if (authenticated())
+		stats_add_node(sig);
 	len = do_pad(sig, UBIFS_SIG_NODE_SZ + le32_to_cpu(sig->len));
 
 	err = write_leb(UBIFS_SB_LNUM, UBIFS_SB_NODE_SZ + len, sup);
@@ -2758,6 +5682,7 @@ static int write_lpt(void)
 	err = create_lpt(c);
 	if (err)
 		return err;
+	stats_add_bytes(STATS_LPT, 0, c->lpt_sz);
 
 	lnum = c->nhead_lnum + 1;
 	while (lnum <= c->lpt_last) {
@@ -2837,21 +5762,32 @@ static int open_target(void)
 		if (out_fd == -1)
 			return sys_err_msg("cannot create output file '%s'",
 					   output);
+		if (out_sparse && sparse_img_create(&sparse, out_fd,
+						    c->leb_size,
+						    c->max_leb_cnt, 0xff, 0))
+			return -1;
 	}
-	return 0;
+	return start_writer();
 }
 
 
 /**
  * close_target - close the output target.
  *
- * Close the output target. If the target was an UBI
- * volume, also close libubi.
+ * Write out the LEBs which are still queued and close the
+ * output target. If the target was an UBI volume, also close
+ * libubi.
  *
  * Returns %0 in case of success and %-1 in case of failure.
  */
 static int close_target(void)
 {
+	if (stop_writer())
+		return -1;
+	if (out_sparse && sparse_img_finish(&sparse))
+		return err_msg("cannot write the sparse image '%s'", output);
+	if (ubinize.ini)
+		ubi_image_close();
 	if (ubi)
 		libubi_close(ubi);
 	if (out_fd >= 0 && close(out_fd) == -1)
@@ -2866,7 +5802,7 @@ static int close_target(void)
  */
 static int init(void)
 {
-	int err, i, main_lebs, big_lpt = 0, sz;
+	int err, i, main_lebs, big_lpt = 0;
 
 	c->highest_inum = UBIFS_FIRST_INO;
 
@@ -2903,14 +5839,18 @@ static int init(void)
 	leb_buf = xmalloc(c->leb_size);
 	node_buf = xmalloc(NODE_BUFFER_SIZE);
 	block_buf = xmalloc(UBIFS_BLOCK_SIZE);
-
-	sz = sizeof(struct inum_mapping *) * HASH_TABLE_SIZE;
-	hash_table = xzalloc(sz);
+	read_buf = xmalloc(READ_BUF_SIZE);
 
 	err = init_compression();
 	if (err)
 		return err;
 
+	if (cache_dir) {
+		err = open_build_cache(cache_dir, cache_size);
+		if (err)
+			return err;
+	}
+
 #ifdef WITH_SELINUX
 	if (context) {
 		struct selinux_opt seopts[] = {
@@ -2920,26 +5860,37 @@ static int init(void)
 		sehnd = selabel_open(SELABEL_CTX_FILE, seopts, 1);
 		if (!sehnd)
 			return err_msg("could not open selinux context\n");
+		init_label_cache();
 	}
 #endif
 
 	return 0;
 }
 
-static void destroy_hash_table(void)
+static void destroy_inum_mappings(void)
 {
-	int i;
+	unsigned int i;
 
-	for (i = 0; i < HASH_TABLE_SIZE; i++) {
-		struct inum_mapping *im, *q;
+	for (i = 0; i < inum_map_cnt; i++)
+		free(inum_maps[i].path_name);
+	free(inum_maps);
+	free(inum_slots);
+}
 
-		for (im = hash_table[i]; im; ) {
-			q = im;
-			im = im->next;
-			free(q->path_name);
-			free(q);
-		}
+static void free_ordered_files(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ordered_slot_cnt; i++) {
+		struct ordered_file *of = ordered_slots[i];
+
+		if (!of)
+			continue;
+		free_fscrypt_context(of->fctx);
+		free(of->written);
+		free(of);
 	}
+	free(ordered_slots);
 }
 
 /**
@@ -2951,6 +5902,7 @@ static void deinit(void)
 #ifdef WITH_SELINUX
 	if (sehnd)
 		selabel_close(sehnd);
+	free_label_cache();
 #endif
 
 	free(c->lpt);
@@ -2958,10 +5910,17 @@ static void deinit(void)
 	free(leb_buf);
 	free(node_buf);
 	free(block_buf);
-	destroy_hash_table();
-	free(hash_table);
+	free(read_buf);
+#ifndef WITHOUT_XATTR
+	free(xattr_list);
+#endif
+	free_ordered_files();
+	destroy_inum_mappings();
+	close_build_cache();
 	destroy_compression();
 	free_devtable_info();
+	free_compr_policy();
+	exit_authentication();
 }
 
 /**
@@ -2975,6 +5934,7 @@ static void deinit(void)
  */
 static int mkfs(void)
 {
+	struct stats_timer t;
 	int err = 0;
 
 	err = init();
@@ -2985,7 +5945,9 @@ static int mkfs(void)
 	if (err)
 		goto out;
 
+	stats_start(&t);
 	err = write_data();
+	stats_stop(STATS_TRAVERSE, &t);
 	if (err)
 		goto out;
 
@@ -2993,7 +5955,9 @@ static int mkfs(void)
 	if (err)
 		goto out;
 
+	stats_start(&t);
 	err = write_index();
+	stats_stop(STATS_INDEX, &t);
 	if (err)
 		goto out;
 
@@ -3001,7 +5965,9 @@ static int mkfs(void)
 	if (err)
 		goto out;
 
+	stats_start(&t);
 	err = write_lpt();
+	stats_stop(STATS_LPT, &t);
 	if (err)
 		goto out;
 
@@ -3018,6 +5984,15 @@ static int mkfs(void)
 		goto out;
 
 	err = write_orphan_area();
+	if (err)
+		goto out;
+
+	if (ubinize.ini) {
+		/* The other volumes are written after the file-system */
+		err = stop_writer();
+		if (!err)
+			err = ubi_image_finish(out_fd, c->leb_cnt);
+	}
 
 out:
 	deinit();
@@ -3035,6 +6010,8 @@ int main(int argc, char *argv[])
 	if (err)
 		return err;
 
+	stats_init();
+
 	err = open_target();
 	if (err)
 		return err;
@@ -3049,6 +6026,17 @@ int main(int argc, char *argv[])
 	if (err)
 		return err;
 
+	if (verbose) {
+		struct rusage ru;
+
+		if (!getrusage(RUSAGE_SELF, &ru))
+			printf("peak memory usage: %ld KiB\n", ru.ru_maxrss);
+	}
+
+	err = stats_report(stats_file);
+	if (err)
+		return err;
+
 	if (verbose)
 		printf("Success!\n");
 
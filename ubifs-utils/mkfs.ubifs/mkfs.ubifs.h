@@ -136,6 +136,66 @@ struct name_htbl_element {
 	dev_t dev;
 };
 
+/* Archive formats mkfs.ubifs can read the file system contents from */
+enum {
+	ARCHIVE_TAR,
+	ARCHIVE_CPIO,
+};
+
+/**
+ * struct archive_xattr - an extended attribute of an archive member.
+ * @name: attribute name
+ * @value: attribute value
+ * @len: length of @value
+ * @next: the next attribute of the same inode
+ */
+struct archive_xattr {
+	char *name;
+	void *value;
+	unsigned int len;
+	struct archive_xattr *next;
+};
+
+struct archive_dent;
+struct fscrypt_context;
+
+/**
+ * struct archive_inode - an inode read from an archive.
+ * @st: inode attributes, @st_nlink is the number of directory entries
+ *      referring to a non-directory inode
+ * @inum: target inode number
+ * @creat_sqnum: creation sequence number
+ * @target: symbolic link target
+ * @xattrs: extended attributes
+ * @children: entries of a directory, in archive order
+ * @last_child: the last entry of a directory
+ * @fctx: encryption context or %NULL if the inode is not encrypted
+ * @written: the inode node has been written
+ */
+struct archive_inode {
+	struct stat st;
+	ino_t inum;
+	unsigned long long creat_sqnum;
+	char *target;
+	struct archive_xattr *xattrs;
+	struct archive_dent *children;
+	struct archive_dent *last_child;
+	struct fscrypt_context *fctx;
+	int written;
+};
+
+/**
+ * struct archive_dent - a directory entry read from an archive.
+ * @name: entry name
+ * @inode: the inode the entry refers to
+ * @next: the next entry of the same directory
+ */
+struct archive_dent {
+	char *name;
+	struct archive_inode *inode;
+	struct archive_dent *next;
+};
+
 extern struct ubifs_info info_;
 
 struct hashtable_itr;
@@ -154,5 +214,10 @@ struct name_htbl_element *
 next_name_htbl_element(struct path_htbl_element *ph_elt,
 		       struct hashtable_itr **itr);
 void free_devtable_info(void);
+int read_archive(const char *file, int format, struct archive_inode *root,
+		 int (*add_file_data)(struct archive_inode *ai,
+				      const char *path));
+ssize_t read_archive_data(void *buf, size_t len);
+void free_archive(struct archive_inode *dir);
 
 #endif
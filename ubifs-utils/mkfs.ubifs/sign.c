@@ -19,6 +19,7 @@
 
 #include "mkfs.ubifs.h"
 #include "common.h"
+#include "stats.h"
 
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
@@ -35,6 +36,9 @@ static struct ubifs_info *c = &info_;
 EVP_MD_CTX *hash_md;
 const EVP_MD *md;
 
+/* Digest context of this thread for node hashes */
+static __thread EVP_MD_CTX *node_md;
+
 int authenticated(void)
 {
 	return c->hash_algo_name != NULL;
@@ -322,14 +326,39 @@ int sign_superblock_node(void *node)
 void ubifs_node_calc_hash(const void *node, uint8_t *hash)
 {
 	const struct ubifs_ch *ch = node;
+	struct stats_timer t;
 	unsigned int md_len;
 
 	if (!authenticated())
 		return;
 
-	EVP_DigestInit_ex(hash_md, md, NULL);
-	EVP_DigestUpdate(hash_md, node, le32_to_cpu(ch->len));
-	EVP_DigestFinal_ex(hash_md, hash, &md_len);
+	stats_start(&t);
+
+	/*
+	 * Node hashes are calculated by the pipeline workers too, so every
+	 * thread has its own digest context. Initializing a context which
+	 * was used with the same digest before only resets its state.
+	 */
+	if (!node_md) {
+		node_md = EVP_MD_CTX_create();
+		if (!node_md)
+			errmsg_die("cannot allocate a digest context");
+	}
+
+	EVP_DigestInit_ex(node_md, md, NULL);
+	EVP_DigestUpdate(node_md, node, le32_to_cpu(ch->len));
+	EVP_DigestFinal_ex(node_md, hash, &md_len);
+	stats_stop(STATS_HASH, &t);
+	stats_add_bytes(STATS_HASH, le32_to_cpu(ch->len), md_len);
+}
+
+/**
+ * node_hash_thread_cleanup - free the node digest context of this thread.
+ */
+void node_hash_thread_cleanup(void)
+{
+	EVP_MD_CTX_destroy(node_md);
+	node_md = NULL;
 }
 
 /**
@@ -392,7 +421,15 @@ int init_authentication(void)
 	OpenSSL_add_all_algorithms();
 	ERR_load_crypto_strings();
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/*
+	 * Fetch the digest once. Otherwise it is fetched from the provider
+	 * again every time a digest context is initialized with it.
+	 */
+	md = EVP_MD_fetch(NULL, c->hash_algo_name, NULL);
+#else
 	md = EVP_get_digestbyname(c->hash_algo_name);
+#endif
 	if (!md)
 		return err_msg("Unknown message digest %s", c->hash_algo_name);
 
@@ -407,3 +444,23 @@ int init_authentication(void)
 
 	return 0;
 }
+
+/**
+ * exit_authentication - free the digests of authentication.
+ *
+ * The node digest context of the calling thread is freed too, the other
+ * threads free theirs with node_hash_thread_cleanup().
+ */
+void exit_authentication(void)
+{
+	if (!md)
+		return;
+
+	node_hash_thread_cleanup();
+	EVP_MD_CTX_destroy(hash_md);
+	hash_md = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MD_free((EVP_MD *)md);
+#endif
+	md = NULL;
+}
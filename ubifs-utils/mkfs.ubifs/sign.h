@@ -24,11 +24,13 @@
 #include <openssl/evp.h>
 
 void ubifs_node_calc_hash(const void *node, uint8_t *hash);
+void node_hash_thread_cleanup(void);
 void mst_node_calc_hash(const void *node, uint8_t *hash);
 void hash_digest_init(void);
 void hash_digest_update(const void *buf, int len);
 void hash_digest_final(void *hash, unsigned int *len);
 int init_authentication(void);
+void exit_authentication(void);
 int sign_superblock_node(void *node);
 int authenticated(void);
 
@@ -41,6 +43,10 @@ static inline void ubifs_node_calc_hash(__attribute__((unused)) const void *node
 {
 }
 
+static inline void node_hash_thread_cleanup(void)
+{
+}
+
 static inline void mst_node_calc_hash(__attribute__((unused)) const void *node,
 				      __attribute__((unused)) uint8_t *hash)
 {
@@ -65,6 +71,10 @@ static inline int init_authentication(void)
 	return 0;
 }
 
+static inline void exit_authentication(void)
+{
+}
+
 static inline int sign_superblock_node(__attribute__((unused)) void *node)
 {
 	return 0;
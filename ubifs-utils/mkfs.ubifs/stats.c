@@ -0,0 +1,524 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements the build statistics of the --stats option.
+ *
+ * The time spent in each stage of the build is accumulated over all the
+ * timed sections of the stage. Compression, encryption, hashing and writing
+ * may run in several threads at the same time, so their times can add up to
+ * more than the wall clock time of the whole build. With a single job they
+ * run on the main thread and are also part of the time of the stage which
+ * uses them (traversing the source tree or writing the index).
+ */
+
+#include <sys/resource.h>
+
+#include "mkfs.ubifs.h"
+#include "stats.h"
+
+/**
+ * struct stage_stats - statistics of a build stage.
+ * @calls: number of timed sections
+ * @wall_ns: wall clock time in nanoseconds
+ * @cpu_ns: CPU time in nanoseconds
+ * @bytes_in: bytes the stage consumed
+ * @bytes_out: bytes the stage produced
+ * @peak_rss: peak resident set size in KiB at the end of the stage (only
+ *            recorded for the stages run once by the main thread)
+ */
+struct stage_stats {
+	unsigned long long calls;
+	unsigned long long wall_ns;
+	unsigned long long cpu_ns;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	long peak_rss;
+};
+
+/**
+ * struct compr_stats - statistics of a compressor.
+ * @blocks: number of data blocks the compressor was chosen for
+ * @bytes_in: uncompressed bytes
+ * @bytes_out: compressed bytes
+ */
+struct compr_stats {
+	unsigned long long blocks;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+};
+
+/**
+ * struct rule_stats - statistics of a compression policy rule.
+ * @desc: the rule as written in the policy file
+ * @blocks: number of data blocks of the files the rule matched
+ * @bytes_in: uncompressed bytes
+ * @bytes_out: compressed bytes
+ * @sampled: uncompressed bytes of the blocks decompressed for timing
+ * @decompr_ns: time it took to decompress them in nanoseconds
+ */
+struct rule_stats {
+	char *desc;
+	unsigned long long blocks;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long sampled;
+	unsigned long long decompr_ns;
+};
+
+/*
+ * Every RULE_SAMPLE_INTERVAL-th compressed block of a compression policy rule
+ * is decompressed again to measure the decompression speed.
+ */
+#define RULE_SAMPLE_INTERVAL 16
+
+/**
+ * struct node_stats - statistics of a node type.
+ * @cnt: number of nodes written
+ * @bytes: total length of the nodes
+ */
+struct node_stats {
+	unsigned long long cnt;
+	unsigned long long bytes;
+};
+
+static const struct {
+	const char *name;
+	int main_thread;
+} stage_info[STATS_STAGE_CNT] = {
+	[STATS_TRAVERSE] = { "traverse", 1 },
+	[STATS_COMPRESS] = { "compress", 0 },
+	[STATS_ENCRYPT]  = { "encrypt",  0 },
+	[STATS_HASH]     = { "hash",     0 },
+	[STATS_INDEX]    = { "index",    1 },
+	[STATS_LPT]      = { "lpt",      1 },
+	[STATS_WRITE]    = { "write",    0 },
+	[STATS_LABEL]    = { "label",    0 },
+};
+
+static const char * const counter_names[STATS_COUNTER_CNT] = {
+	[STATS_LABEL_LOOKUPS]           = "label_lookups",
+	[STATS_LABEL_CACHED]            = "label_cached",
+	[STATS_PRECHECK_SKIPPED]        = "precheck_skipped",
+	[STATS_PRECHECK_VERIFIED]       = "precheck_verified",
+	[STATS_PRECHECK_VERIFIED_RIGHT] = "precheck_verified_right",
+	[STATS_PRECHECK_PASSED]         = "precheck_passed",
+	[STATS_PRECHECK_PASSED_WRONG]   = "precheck_passed_wrong",
+	[STATS_CACHE_HITS]              = "cache_hits",
+	[STATS_CACHE_MISSES]            = "cache_misses",
+	[STATS_CACHE_FULL]              = "cache_full",
+	[STATS_CACHE_BAD]               = "cache_bad",
+};
+
+static const char * const compr_names[UBIFS_COMPR_TYPES_CNT] = {
+	[UBIFS_COMPR_NONE] = "none",
+	[UBIFS_COMPR_LZO]  = "lzo",
+	[UBIFS_COMPR_ZLIB] = "zlib",
+	[UBIFS_COMPR_ZSTD] = "zstd",
+};
+
+static const char * const node_names[UBIFS_NODE_TYPES_CNT] = {
+	[UBIFS_INO_NODE]  = "ino",
+	[UBIFS_DATA_NODE] = "data",
+	[UBIFS_DENT_NODE] = "dent",
+	[UBIFS_XENT_NODE] = "xent",
+	[UBIFS_TRUN_NODE] = "trun",
+	[UBIFS_PAD_NODE]  = "pad",
+	[UBIFS_SB_NODE]   = "sb",
+	[UBIFS_MST_NODE]  = "mst",
+	[UBIFS_REF_NODE]  = "ref",
+	[UBIFS_IDX_NODE]  = "idx",
+	[UBIFS_CS_NODE]   = "cs",
+	[UBIFS_ORPH_NODE] = "orph",
+	[UBIFS_AUTH_NODE] = "auth",
+	[UBIFS_SIG_NODE]  = "sig",
+};
+
+int stats_format;
+
+static struct stage_stats stages[STATS_STAGE_CNT];
+static struct compr_stats comprs[UBIFS_COMPR_TYPES_CNT];
+static struct node_stats nodes[UBIFS_NODE_TYPES_CNT];
+static unsigned long long counters[STATS_COUNTER_CNT];
+/* Rule %-1 (files no rule matched) is at index zero */
+static struct rule_stats *rules;
+static int rule_cnt;
+static struct timespec start_wall;
+
+static unsigned long long ts_diff_ns(const struct timespec *start,
+				     const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+	       end->tv_nsec - start->tv_nsec;
+}
+
+static long peak_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+	return ru.ru_maxrss;
+}
+
+/**
+ * stats_init - start collecting build statistics.
+ */
+void stats_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start_wall);
+
+	if (stats_format && compr_policy_rule_cnt()) {
+		int i;
+
+		/* The policy is freed before the report is printed */
+		rule_cnt = compr_policy_rule_cnt() + 1;
+		rules = xzalloc(rule_cnt * sizeof(struct rule_stats));
+		rules[0].desc = xstrdup("default");
+		for (i = 1; i < rule_cnt; i++)
+			rules[i].desc = xstrdup(compr_policy_rule_desc(i - 1));
+	}
+}
+
+/**
+ * stats_start - start a timed section of a stage.
+ * @t: the start time is stored here
+ */
+void stats_start(struct stats_timer *t)
+{
+	if (!stats_format)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t->cpu);
+}
+
+/**
+ * stats_stop - end a timed section of a stage.
+ * @stage: the stage
+ * @t: start time stored by 'stats_start()'
+ *
+ * This function may be called by several threads at the same time.
+ */
+void stats_stop(int stage, const struct stats_timer *t)
+{
+	struct stage_stats *st = &stages[stage];
+	struct timespec wall, cpu;
+
+	if (!stats_format)
+		return;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+
+	__sync_fetch_and_add(&st->calls, 1);
+	__sync_fetch_and_add(&st->wall_ns, ts_diff_ns(&t->wall, &wall));
+	__sync_fetch_and_add(&st->cpu_ns, ts_diff_ns(&t->cpu, &cpu));
+	if (stage_info[stage].main_thread)
+		st->peak_rss = peak_rss();
+}
+
+/**
+ * stats_add_bytes - account the bytes a stage consumed and produced.
+ * @stage: the stage
+ * @in: bytes consumed
+ * @out: bytes produced
+ */
+void stats_add_bytes(int stage, unsigned long long in, unsigned long long out)
+{
+	if (!stats_format)
+		return;
+
+	__sync_fetch_and_add(&stages[stage].bytes_in, in);
+	__sync_fetch_and_add(&stages[stage].bytes_out, out);
+}
+
+/**
+ * stats_add_compr - account a data block compressed by a compressor.
+ * @compr_type: UBIFS compression type which was used for the block
+ * @in: uncompressed length
+ * @out: compressed length
+ */
+void stats_add_compr(int compr_type, unsigned long long in,
+		     unsigned long long out)
+{
+	struct compr_stats *cs;
+
+	if (!stats_format || compr_type >= UBIFS_COMPR_TYPES_CNT)
+		return;
+
+	cs = &comprs[compr_type];
+	__sync_fetch_and_add(&cs->blocks, 1);
+	__sync_fetch_and_add(&cs->bytes_in, in);
+	__sync_fetch_and_add(&cs->bytes_out, out);
+}
+
+/**
+ * stats_add_rule - account a data block of a file a policy rule matched.
+ * @rule: index of the compression policy rule, %-1 if no rule matched
+ * @compr_type: UBIFS compression type which was used for the block
+ * @data: the compressed data
+ * @in: uncompressed length
+ * @out: compressed length
+ *
+ * Some of the blocks are decompressed again to measure how fast the files
+ * of each rule can be read. This function may be called by several threads
+ * at the same time.
+ */
+void stats_add_rule(int rule, int compr_type, const void *data,
+		    unsigned long long in, unsigned long long out)
+{
+	struct rule_stats *rs;
+	struct timespec start, end;
+	char buf[UBIFS_BLOCK_SIZE];
+	size_t len = sizeof(buf);
+	unsigned long long n;
+	int ret;
+
+	if (!rules)
+		return;
+
+	rs = &rules[rule + 1];
+	n = __sync_add_and_fetch(&rs->blocks, 1);
+	__sync_fetch_and_add(&rs->bytes_in, in);
+	__sync_fetch_and_add(&rs->bytes_out, out);
+
+	if (compr_type == UBIFS_COMPR_NONE ||
+	    n % RULE_SAMPLE_INTERVAL != 1 || init_decompression_thread())
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = decompress_data(data, out, buf, &len, compr_type);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret || len != in)
+		return;
+
+	__sync_fetch_and_add(&rs->sampled, in);
+	__sync_fetch_and_add(&rs->decompr_ns, ts_diff_ns(&start, &end));
+}
+
+/**
+ * stats_add_node - account a node written to the image.
+ * @node: the node, with the common header filled in
+ */
+void stats_add_node(const void *node)
+{
+	const struct ubifs_ch *ch = node;
+
+	if (!stats_format || ch->node_type >= UBIFS_NODE_TYPES_CNT)
+		return;
+
+	__sync_fetch_and_add(&nodes[ch->node_type].cnt, 1);
+	__sync_fetch_and_add(&nodes[ch->node_type].bytes, le32_to_cpu(ch->len));
+}
+
+/**
+ * stats_add_count - count events.
+ * @counter: the event counter
+ * @n: number of events
+ */
+void stats_add_count(int counter, unsigned long long n)
+{
+	if (!stats_format)
+		return;
+
+	__sync_fetch_and_add(&counters[counter], n);
+}
+
+static double ratio(unsigned long long in, unsigned long long out)
+{
+	return out ? (double)in / out : 0;
+}
+
+/* Decompression speed in MiB/s, zero if nothing was decompressed */
+static double decompr_speed(const struct rule_stats *rs)
+{
+	if (!rs->decompr_ns)
+		return 0;
+	return rs->sampled / 1048576.0 / (rs->decompr_ns / 1e9);
+}
+
+/* Print a JSON string, the policy rules may contain any characters */
+static void print_json_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void report_text(FILE *fp, unsigned long long wall_ns,
+			unsigned long long cpu_ns)
+{
+	int i;
+
+	fprintf(fp, "build statistics:\n");
+	fprintf(fp, "\ttotal:    wall %.3fs  cpu %.3fs  peak memory %ld KiB\n",
+		wall_ns / 1e9, cpu_ns / 1e9, peak_rss());
+
+	for (i = 0; i < STATS_STAGE_CNT; i++) {
+		const struct stage_stats *st = &stages[i];
+
+		if (!st->calls)
+			continue;
+		fprintf(fp, "\t%-9s wall %.3fs  cpu %.3fs  in %llu  out %llu",
+			stage_info[i].name, st->wall_ns / 1e9, st->cpu_ns / 1e9,
+			st->bytes_in, st->bytes_out);
+		if (stage_info[i].main_thread)
+			fprintf(fp, "  peak memory %ld KiB", st->peak_rss);
+		fprintf(fp, "\n");
+	}
+
+	for (i = 0; i < UBIFS_COMPR_TYPES_CNT; i++) {
+		const struct compr_stats *cs = &comprs[i];
+
+		if (!cs->blocks)
+			continue;
+		fprintf(fp, "\tcompressor %-5s %llu blocks  in %llu  out %llu  ratio %.3f\n",
+			compr_names[i], cs->blocks, cs->bytes_in, cs->bytes_out,
+			ratio(cs->bytes_in, cs->bytes_out));
+	}
+
+	for (i = 0; i < rule_cnt; i++) {
+		const struct rule_stats *rs = &rules[i];
+
+		fprintf(fp, "\tpolicy \"%s\": %llu blocks  in %llu  out %llu  ratio %.3f",
+			rs->desc, rs->blocks, rs->bytes_in, rs->bytes_out,
+			ratio(rs->bytes_in, rs->bytes_out));
+		if (rs->decompr_ns)
+			fprintf(fp, "  decompress %.1f MiB/s",
+				decompr_speed(rs));
+		fprintf(fp, "\n");
+	}
+
+	for (i = 0; i < UBIFS_NODE_TYPES_CNT; i++) {
+		if (!nodes[i].cnt)
+			continue;
+		fprintf(fp, "\tnode %-5s %llu nodes  %llu bytes\n",
+			node_names[i], nodes[i].cnt, nodes[i].bytes);
+	}
+
+	for (i = 0; i < STATS_COUNTER_CNT; i++) {
+		if (!counters[i])
+			continue;
+		fprintf(fp, "\t%-24s %llu\n", counter_names[i], counters[i]);
+	}
+}
+
+static void report_json(FILE *fp, unsigned long long wall_ns,
+			unsigned long long cpu_ns)
+{
+	int i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"total\": {\"wall\": %.6f, \"cpu\": %.6f, \"peak_rss_kib\": %ld},\n",
+		wall_ns / 1e9, cpu_ns / 1e9, peak_rss());
+
+	fprintf(fp, "  \"stages\": {\n");
+	for (i = 0; i < STATS_STAGE_CNT; i++) {
+		const struct stage_stats *st = &stages[i];
+
+		fprintf(fp, "    \"%s\": {\"calls\": %llu, \"wall\": %.6f, \"cpu\": %.6f, \"bytes_in\": %llu, \"bytes_out\": %llu",
+			stage_info[i].name, st->calls, st->wall_ns / 1e9,
+			st->cpu_ns / 1e9, st->bytes_in, st->bytes_out);
+		if (stage_info[i].main_thread)
+			fprintf(fp, ", \"peak_rss_kib\": %ld", st->peak_rss);
+		fprintf(fp, "}%s\n", i == STATS_STAGE_CNT - 1 ? "" : ",");
+	}
+	fprintf(fp, "  },\n");
+
+	fprintf(fp, "  \"compressors\": {\n");
+	for (i = 0; i < UBIFS_COMPR_TYPES_CNT; i++) {
+		const struct compr_stats *cs = &comprs[i];
+
+		fprintf(fp, "    \"%s\": {\"blocks\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, \"ratio\": %.4f}%s\n",
+			compr_names[i], cs->blocks, cs->bytes_in, cs->bytes_out,
+			ratio(cs->bytes_in, cs->bytes_out),
+			i == UBIFS_COMPR_TYPES_CNT - 1 ? "" : ",");
+	}
+	fprintf(fp, "  },\n");
+
+	if (rule_cnt) {
+		fprintf(fp, "  \"policy\": [\n");
+		for (i = 0; i < rule_cnt; i++) {
+			const struct rule_stats *rs = &rules[i];
+
+			fprintf(fp, "    {\"rule\": ");
+			print_json_str(fp, rs->desc);
+			fprintf(fp, ", \"blocks\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, \"ratio\": %.4f, \"decompress_mib_s\": %.1f}%s\n",
+				rs->blocks, rs->bytes_in,
+				rs->bytes_out, ratio(rs->bytes_in, rs->bytes_out),
+				decompr_speed(rs),
+				i == rule_cnt - 1 ? "" : ",");
+		}
+		fprintf(fp, "  ],\n");
+	}
+
+	fprintf(fp, "  \"nodes\": {\n");
+	for (i = 0; i < UBIFS_NODE_TYPES_CNT; i++)
+		fprintf(fp, "    \"%s\": {\"count\": %llu, \"bytes\": %llu}%s\n",
+			node_names[i], nodes[i].cnt, nodes[i].bytes,
+			i == UBIFS_NODE_TYPES_CNT - 1 ? "" : ",");
+	fprintf(fp, "  },\n");
+
+	fprintf(fp, "  \"counters\": {\n");
+	for (i = 0; i < STATS_COUNTER_CNT; i++)
+		fprintf(fp, "    \"%s\": %llu%s\n", counter_names[i], counters[i],
+			i == STATS_COUNTER_CNT - 1 ? "" : ",");
+	fprintf(fp, "  }\n");
+	fprintf(fp, "}\n");
+}
+
+/**
+ * stats_report - print the build statistics.
+ * @file: file to write the report to, or %NULL for the standard output
+ */
+int stats_report(const char *file)
+{
+	struct timespec wall, cpu;
+	FILE *fp = stdout;
+
+	if (!stats_format)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+	if (file) {
+		fp = fopen(file, "w");
+		if (!fp)
+			return sys_err_msg("cannot create statistics file '%s'",
+					   file);
+	}
+
+	if (stats_format == STATS_JSON)
+		report_json(fp, ts_diff_ns(&start_wall, &wall),
+			    cpu.tv_sec * 1000000000ULL + cpu.tv_nsec);
+	else
+		report_text(fp, ts_diff_ns(&start_wall, &wall),
+			    cpu.tv_sec * 1000000000ULL + cpu.tv_nsec);
+
+	if (!file)
+		fflush(stdout);
+	else if (fclose(fp))
+		return sys_err_msg("cannot write statistics file '%s'", file);
+	return 0;
+}
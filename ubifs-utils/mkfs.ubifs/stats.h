@@ -0,0 +1,82 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __UBIFS_STATS_H__
+#define __UBIFS_STATS_H__
+
+#include <stdio.h>
+#include <time.h>
+
+/* Build stages reported by the --stats option */
+enum {
+	STATS_TRAVERSE,
+	STATS_COMPRESS,
+	STATS_ENCRYPT,
+	STATS_HASH,
+	STATS_INDEX,
+	STATS_LPT,
+	STATS_WRITE,
+	STATS_LABEL,
+	STATS_STAGE_CNT,
+};
+
+/* Event counters reported by the --stats option */
+enum {
+	STATS_LABEL_LOOKUPS,
+	STATS_LABEL_CACHED,
+	STATS_PRECHECK_SKIPPED,
+	STATS_PRECHECK_VERIFIED,
+	STATS_PRECHECK_VERIFIED_RIGHT,
+	STATS_PRECHECK_PASSED,
+	STATS_PRECHECK_PASSED_WRONG,
+	STATS_CACHE_HITS,
+	STATS_CACHE_MISSES,
+	STATS_CACHE_FULL,
+	STATS_CACHE_BAD,
+	STATS_COUNTER_CNT,
+};
+
+/* Report formats */
+enum {
+	STATS_TEXT = 1,
+	STATS_JSON,
+};
+
+/**
+ * struct stats_timer - start of a timed section of a stage.
+ * @wall: wall clock time
+ * @cpu: CPU time of the calling thread
+ */
+struct stats_timer {
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+extern int stats_format;
+
+void stats_init(void);
+void stats_start(struct stats_timer *t);
+void stats_stop(int stage, const struct stats_timer *t);
+void stats_add_bytes(int stage, unsigned long long in,
+		     unsigned long long out);
+void stats_add_compr(int compr_type, unsigned long long in,
+		     unsigned long long out);
+void stats_add_rule(int rule, int compr_type, const void *data,
+		    unsigned long long in, unsigned long long out);
+void stats_add_node(const void *node);
+void stats_add_count(int counter, unsigned long long n);
+int stats_report(const char *file);
+
+#endif /* __UBIFS_STATS_H__ */
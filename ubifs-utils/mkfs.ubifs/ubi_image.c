@@ -0,0 +1,398 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements the --ubinize option, which makes mkfs.ubifs write a
+ * UBI image instead of a UBIFS image.
+ *
+ * The volumes of the image are described by a ubinize configuration file.
+ * The LEBs of the UBIFS volume are wrapped in EC and VID headers as they are
+ * written, at the position ubinize would have put them. Once the file-system
+ * is complete, the images of the other volumes and the volume table are
+ * added, so the result is the same as running ubinize on the UBIFS image.
+ */
+
+#include <sys/uio.h>
+
+#include <mtd/ubi-media.h>
+#include <libubigen.h>
+
+#include "mkfs.ubifs.h"
+#include "ubi_image.h"
+
+/**
+ * struct ubi_image - a UBI image being written.
+ * @ui: libubigen information
+ * @dict: the ubinize configuration file
+ * @vols: volumes in the order of their sections
+ * @imgs: image file of each volume, %NULL if none
+ * @img_sizes: size of the data in each image file
+ * @img_sparse: whether each image file is a sparse image
+ * @vol_cnt: number of volumes
+ * @fs_vol: index of the UBIFS volume in @vols
+ * @fs_peb: first physical eraseblock of the UBIFS volume
+ * @ec: erase counter value to put to the EC headers
+ * @hdrs: EC and VID headers of a physical eraseblock of the UBIFS volume
+ * @pad: 0xFF bytes for the data padding at the end of the eraseblocks
+ */
+struct ubi_image {
+	struct ubigen_info ui;
+	dictionary *dict;
+	struct ubigen_vol_info *vols;
+	const char **imgs;
+	long long *img_sizes;
+	int *img_sparse;
+	int vol_cnt;
+	int fs_vol;
+	int fs_peb;
+	long long ec;
+	void *hdrs;
+	void *pad;
+};
+
+static struct ubi_image ubi_img;
+
+/*
+ * Number of physical eraseblocks ubinize writes for an image of @bytes bytes
+ * in volume @vi.
+ */
+static int image_pebs(const struct ubigen_vol_info *vi, long long bytes)
+{
+	return (bytes + vi->usable_leb_size - 1) / vi->usable_leb_size;
+}
+
+static int check_params(const struct ubi_image_params *p)
+{
+	int subpage_size = p->subpage_size;
+
+	if (p->peb_size <= 0)
+		return err_msg("physical eraseblock size was not specified "
+			       "(use -h for help)");
+	if (p->peb_size > UBI_MAX_PEB_SZ)
+		return err_msg("too high physical eraseblock size %d",
+			       p->peb_size);
+	if (p->min_io_size <= 0)
+		return err_msg("min. I/O unit was not specified "
+			       "(use -h for help)");
+	if (!is_power_of_2(p->min_io_size))
+		return err_msg("min. I/O unit size should be power of 2");
+	if (subpage_size == -1)
+		subpage_size = p->min_io_size;
+	if (!is_power_of_2(subpage_size))
+		return err_msg("sub-page size should be power of 2");
+	if (subpage_size > p->min_io_size)
+		return err_msg("sub-page cannot be larger then min. I/O unit");
+	if (p->peb_size % p->min_io_size)
+		return err_msg("physical eraseblock should be multiple of min. I/O units");
+	if (p->min_io_size % subpage_size)
+		return err_msg("min. I/O unit size should be multiple of sub-page size");
+	if (p->vid_hdr_offs) {
+		if (p->vid_hdr_offs + (int)UBI_VID_HDR_SIZE >= p->peb_size)
+			return err_msg("bad VID header position");
+		if (p->vid_hdr_offs % 8)
+			return err_msg("VID header offset has to be multiple of min. I/O unit size");
+	}
+	return 0;
+}
+
+/*
+ * Read the volumes from the configuration file and find the UBIFS volume.
+ */
+static int read_volumes(const struct ubi_image_params *p)
+{
+	struct ubi_image *u = &ubi_img;
+	int sects, i, err;
+
+	sects = iniparser_getnsec(u->dict);
+	if (sects <= 0)
+		return err_msg("no sections found the ini-file \"%s\"", p->ini);
+	if (sects > u->ui.max_volumes)
+		return err_msg("too many sections (%d) in the ini-file \"%s\"",
+			       sects, p->ini);
+
+	u->vols = xcalloc(sects, sizeof(struct ubigen_vol_info));
+	u->imgs = xcalloc(sects, sizeof(const char *));
+	u->img_sizes = xcalloc(sects, sizeof(long long));
+	u->img_sparse = xcalloc(sects, sizeof(int));
+	u->fs_vol = -1;
+
+	for (i = 0; i < sects; i++) {
+		const char *sname = iniparser_getsecname(u->dict, i);
+		const char **img = &u->imgs[u->vol_cnt];
+		char key[256];
+		int is_fs;
+
+		if (!sname)
+			return err_msg("ini-file parsing error (iniparser_getsecname)");
+
+		/* The section names are case insensitive */
+		if (p->section) {
+			is_fs = !strcasecmp(sname, p->section);
+		} else {
+			snprintf(key, sizeof(key), "%s:image", sname);
+			is_fs = !iniparser_getstring(u->dict, key, NULL);
+		}
+		if (is_fs)
+			img = NULL;
+
+		err = ubigen_read_ini_section(PROGRAM_NAME, &u->ui, u->dict,
+					      sname, &u->vols[u->vol_cnt], img,
+					      &u->img_sizes[u->vol_cnt],
+					      &u->img_sparse[u->vol_cnt],
+					      p->verbose);
+		if (err == -1)
+			return -1;
+		if (err == 1)
+			continue;
+
+		if (ubigen_check_ini_volume(PROGRAM_NAME, u->vols, u->vol_cnt,
+					    sname))
+			return -1;
+
+		if (is_fs) {
+			if (u->fs_vol != -1) {
+				if (p->section)
+					return err_msg("section \"%s\" is there twice",
+						       p->section);
+				return err_msg("more than one section without an image, use --ubinize-vol");
+			}
+			if (u->vols[u->vol_cnt].type != UBI_VID_DYNAMIC)
+				return err_msg("the UBIFS volume of section \"%s\" has to be dynamic",
+					       sname);
+			u->fs_vol = u->vol_cnt;
+		}
+
+		u->vol_cnt += 1;
+	}
+
+	if (u->fs_vol == -1) {
+		if (p->section)
+			return err_msg("no UBI volume section \"%s\" in \"%s\"",
+				       p->section, p->ini);
+		return err_msg("no UBI volume section without an image in \"%s\"",
+			       p->ini);
+	}
+
+	return 0;
+}
+
+/**
+ * ubi_image_open - prepare writing a UBI image.
+ * @p: parameters of the image
+ * @leb_size: the LEB size of the UBIFS volume is returned here
+ * @max_leb_cnt: the number of LEBs of the UBIFS volume is returned here, or
+ *               %-1 if the volume size was not specified
+ */
+int ubi_image_open(const struct ubi_image_params *p, int *leb_size,
+		   int *max_leb_cnt)
+{
+	struct ubi_image *u = &ubi_img;
+	struct ubigen_vol_info *vi;
+	uint32_t image_seq = p->image_seq;
+	int i;
+
+	if (check_params(p))
+		return -1;
+
+	if (p->image_seq == -1) {
+		util_srand();
+		image_seq = rand();
+	}
+
+	ubigen_info_init(&u->ui, p->peb_size, p->min_io_size,
+			 p->subpage_size == -1 ? p->min_io_size :
+						 p->subpage_size,
+			 p->vid_hdr_offs, 1, image_seq);
+	u->ec = p->ec;
+
+	u->dict = iniparser_load(p->ini);
+	if (!u->dict)
+		return err_msg("cannot load the input ini file \"%s\"", p->ini);
+
+	if (read_volumes(p))
+		return -1;
+
+	/* The UBIFS volume follows the images of the volumes before it */
+	u->fs_peb = 2;
+	for (i = 0; i < u->fs_vol; i++)
+		if (u->imgs[i])
+			u->fs_peb += image_pebs(&u->vols[i], u->img_sizes[i]);
+
+	vi = &u->vols[u->fs_vol];
+	*leb_size = vi->usable_leb_size;
+	*max_leb_cnt = vi->bytes ? vi->bytes / vi->usable_leb_size : -1;
+
+	u->hdrs = xmalloc(u->ui.data_offs);
+	memset(u->hdrs, 0xFF, u->ui.data_offs);
+	ubigen_init_ec_hdr(&u->ui, u->hdrs, u->ec);
+	if (vi->data_pad) {
+		u->pad = xmalloc(vi->data_pad);
+		memset(u->pad, 0xFF, vi->data_pad);
+	}
+
+	if (p->verbose) {
+		printf("UBI image:\n");
+		printf("\tpeb_size:     %d\n", u->ui.peb_size);
+		printf("\tvid_hdr_offs: %d\n", u->ui.vid_hdr_offs);
+		printf("\tdata_offs:    %d\n", u->ui.data_offs);
+		printf("\timage_seq:    %u\n", u->ui.image_seq);
+		printf("\tvolume:       %s (%d)\n", vi->name, vi->id);
+	}
+
+	return 0;
+}
+
+/**
+ * ubi_image_write_leb - write a LEB of the UBIFS volume.
+ * @fd: output file descriptor
+ * @lnum: LEB number
+ * @buf: contents of the LEB (LEB size bytes)
+ *
+ * The LEB is written as a whole physical eraseblock, with the EC and VID
+ * headers in front of the data and the data padding after it.
+ */
+int ubi_image_write_leb(int fd, int lnum, const void *buf)
+{
+	struct ubi_image *u = &ubi_img;
+	struct ubigen_vol_info *vi = &u->vols[u->fs_vol];
+	off_t pos = (off_t)(u->fs_peb + lnum) * u->ui.peb_size;
+	struct iovec iov[3];
+	int cnt = 2;
+
+	ubigen_init_vid_hdr(&u->ui, vi, u->hdrs + u->ui.vid_hdr_offs, lnum,
+			    NULL, 0);
+
+	iov[0].iov_base = u->hdrs;
+	iov[0].iov_len = u->ui.data_offs;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = vi->usable_leb_size;
+	if (vi->data_pad) {
+		iov[2].iov_base = u->pad;
+		iov[2].iov_len = vi->data_pad;
+		cnt = 3;
+	}
+
+	if (pwritev(fd, iov, cnt, pos) != u->ui.peb_size)
+		return sys_err_msg("write failed writing %d bytes at pos %lld",
+				   u->ui.peb_size, (long long)pos);
+	return 0;
+}
+
+/*
+ * Write the image of volume @n after the UBIFS volume has been written.
+ */
+static int write_volume(int fd, int n, off_t pos)
+{
+	struct ubi_image *u = &ubi_img;
+	struct sparse_img si;
+	int in, err;
+
+	if (lseek(fd, pos, SEEK_SET) != pos)
+		return sys_err_msg("lseek failed seeking %lld", (long long)pos);
+
+	in = open(u->imgs[n], O_RDONLY);
+	if (in == -1)
+		return sys_err_msg("cannot open \"%s\"", u->imgs[n]);
+
+	if (u->img_sparse[n]) {
+		err = sparse_img_open(&si, in);
+		if (err == 1) {
+			err = ubigen_write_sparse_volume(&u->ui, &u->vols[n],
+							 u->ec, &si, fd);
+			sparse_img_close(&si);
+		} else {
+			err = -1;
+		}
+	} else {
+		err = ubigen_write_volume(&u->ui, &u->vols[n], u->ec,
+					  u->img_sizes[n], in, fd);
+	}
+	close(in);
+
+	if (err)
+		return err_msg("cannot write volume \"%s\"", u->vols[n].name);
+	return 0;
+}
+
+/**
+ * ubi_image_finish - write the other volumes and the volume table.
+ * @fd: output file descriptor
+ * @leb_cnt: number of LEBs the file-system uses
+ */
+int ubi_image_finish(int fd, int leb_cnt)
+{
+	struct ubi_image *u = &ubi_img;
+	struct ubigen_vol_info *vi = &u->vols[u->fs_vol];
+	struct ubi_vtbl_record *vtbl;
+	long long bytes = (long long)leb_cnt * vi->usable_leb_size;
+	off_t pos = (off_t)2 * u->ui.peb_size;
+	int i, err = -1;
+
+	/* Like ubinize, size the volume to fit the image if not specified */
+	if (!vi->bytes)
+		vi->bytes = bytes;
+	else if (bytes > vi->bytes)
+		return err_msg("the file-system is %lld bytes, which is larger than volume size %lld",
+			       bytes, vi->bytes);
+	vi->used_ebs = image_pebs(vi, vi->bytes);
+
+	vtbl = ubigen_create_empty_vtbl(&u->ui);
+	if (!vtbl)
+		return -1;
+
+	for (i = 0; i < u->vol_cnt; i++) {
+		if (ubigen_add_volume(&u->ui, &u->vols[i], vtbl)) {
+			err_msg("cannot add volume \"%s\"", u->vols[i].name);
+			goto out;
+		}
+
+		if (i == u->fs_vol) {
+			pos += (off_t)leb_cnt * u->ui.peb_size;
+			continue;
+		}
+		if (!u->imgs[i])
+			continue;
+
+		if (write_volume(fd, i, pos))
+			goto out;
+		pos += (off_t)image_pebs(&u->vols[i], u->img_sizes[i]) *
+		       u->ui.peb_size;
+	}
+
+	err = ubigen_write_layout_vol(&u->ui, 0, 1, u->ec, u->ec, vtbl, fd);
+	if (err)
+		err_msg("cannot write layout volume");
+out:
+	free(vtbl);
+	return err;
+}
+
+/**
+ * ubi_image_close - free the UBI image information.
+ */
+void ubi_image_close(void)
+{
+	struct ubi_image *u = &ubi_img;
+
+	if (u->dict)
+		iniparser_freedict(u->dict);
+	free(u->vols);
+	free(u->imgs);
+	free(u->img_sizes);
+	free(u->img_sparse);
+	free(u->hdrs);
+	free(u->pad);
+	memset(u, 0, sizeof(struct ubi_image));
+}
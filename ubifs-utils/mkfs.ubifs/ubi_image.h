@@ -0,0 +1,50 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __UBIFS_UBI_IMAGE_H__
+#define __UBIFS_UBI_IMAGE_H__
+
+/**
+ * struct ubi_image_params - parameters of a UBI image.
+ * @ini: ubinize configuration file describing the volumes
+ * @section: section of @ini describing the UBIFS volume, %NULL to use the
+ *           only UBI volume section without an image
+ * @peb_size: physical eraseblock size
+ * @min_io_size: minimum input/output unit size
+ * @subpage_size: sub-page size, %-1 if the same as @min_io_size
+ * @vid_hdr_offs: offset of the VID header, zero for the default
+ * @ec: erase counter value to put to the EC headers
+ * @image_seq: UBI image sequence number, %-1 to pick a random one
+ * @verbose: print the volume properties
+ */
+struct ubi_image_params {
+	const char *ini;
+	const char *section;
+	int peb_size;
+	int min_io_size;
+	int subpage_size;
+	int vid_hdr_offs;
+	long long ec;
+	long long image_seq;
+	int verbose;
+};
+
+int ubi_image_open(const struct ubi_image_params *p, int *leb_size,
+		   int *max_leb_cnt);
+int ubi_image_write_leb(int fd, int lnum, const void *buf);
+int ubi_image_finish(int fd, int leb_cnt);
+void ubi_image_close(void);
+
+#endif /* __UBIFS_UBI_IMAGE_H__ */
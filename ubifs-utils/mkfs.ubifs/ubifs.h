@@ -286,6 +286,7 @@ struct ubifs_znode
  * @default_compr: default compression type
  * @favor_lzo: favor LZO compression method
  * @favor_percent: lzo vs. zlib threshold used in case favor LZO
+ * @compr_precheck: skip compression of blocks which look incompressible
  *
  * @key_hash_type: type of the key hash
  * @key_hash: direntry key hash function
@@ -374,6 +375,7 @@ struct ubifs_info
 	int default_compr;
 	int favor_lzo;
 	int favor_percent;
+	int compr_precheck;
 
 	uint8_t key_hash_type;
 	uint32_t (*key_hash)(const char *str, int len);
@@ -0,0 +1,370 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Turn a page cache trace of a boot into an order file for mkfs.ubifs.
+ *
+ * UBIFS sits on an MTD device, so there is no block layer to trace. Instead,
+ * the "filemap:mm_filemap_add_to_page_cache" ftrace event records every page
+ * read into the page cache, with the device, the inode number and the offset
+ * of the page. The inode numbers are mapped to path names with an inode list
+ * produced on the traced system, e.g. by
+ *
+ *	find / -xdev -printf '%i %P\n'
+ *
+ * The output lists the files in the order their pages were first read, each
+ * followed by a tab and the 4KiB block ranges which were read.
+ */
+
+#define PROGRAM_NAME "ubifs-bootorder"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "common.h"
+
+/* mkfs.ubifs block ranges are in these units */
+#define BLOCK_SIZE 4096
+
+#define HASH_TABLE_SIZE 16384
+
+/**
+ * struct trace_inode - an inode seen in the trace or in the inode list.
+ * @next: next inode in the same hash chain
+ * @ino: inode number
+ * @path: path name from the inode list, or %NULL if unknown
+ * @blocks: bitmap of the blocks which have already been listed
+ * @max_block: number of blocks @blocks can hold
+ */
+struct trace_inode {
+	struct trace_inode *next;
+	unsigned long ino;
+	char *path;
+	unsigned char *blocks;
+	unsigned long long max_block;
+};
+
+static struct trace_inode *inodes[HASH_TABLE_SIZE];
+
+static const char *inode_list;
+static const char *trace_file;
+static int dev_major = -1, dev_minor = -1;
+static int page_size = 4096;
+
+static const char *helptext =
+"Usage: ubifs-bootorder [OPTIONS] INODE_LIST [TRACE]\n"
+"Turn a trace of the filemap:mm_filemap_add_to_page_cache event, recorded\n"
+"while booting from UBIFS, into an order file for the mkfs.ubifs\n"
+"--order-file option. INODE_LIST holds an inode number and a path name per\n"
+"line, as printed by \"find / -xdev -printf '%i %P\\n'\" on the traced file\n"
+"system. The trace is read from TRACE or from standard input.\n"
+"\n"
+"Options:\n"
+"-d, --dev=MAJOR:MINOR    only use pages of this device\n"
+"-p, --page-size=SIZE     page size of the traced system (default 4096)\n"
+"-h, --help               display this help and exit\n"
+"-V, --version            output version information and exit\n";
+
+static const struct option long_options[] = {
+	{"dev",       1, NULL, 'd'},
+	{"page-size", 1, NULL, 'p'},
+	{"help",      0, NULL, 'h'},
+	{"version",   0, NULL, 'V'},
+	{NULL, 0, NULL, 0}
+};
+
+static int get_options(int argc, char **argv)
+{
+	int opt;
+	char *endp;
+
+	while (1) {
+		opt = getopt_long(argc, argv, "d:p:hV", long_options, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%d:%d", &dev_major, &dev_minor) != 2 ||
+			    dev_major < 0 || dev_minor < 0)
+				return errmsg("bad device '%s'", optarg);
+			break;
+		case 'p':
+			page_size = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || page_size <= 0 ||
+			    page_size % BLOCK_SIZE)
+				return errmsg("bad page size '%s'", optarg);
+			break;
+		case 'h':
+			printf("%s", helptext);
+			exit(EXIT_SUCCESS);
+		case 'V':
+			common_print_version();
+			exit(EXIT_SUCCESS);
+		default:
+			fprintf(stderr, "%s", helptext);
+			return -1;
+		}
+	}
+
+	if (optind == argc)
+		return errmsg("no inode list specified (use -h for help)");
+	inode_list = argv[optind++];
+	if (optind < argc)
+		trace_file = argv[optind++];
+	if (optind != argc)
+		return errmsg("more arguments than expected (use -h for help)");
+
+	return 0;
+}
+
+static struct trace_inode *lookup_inode(unsigned long ino)
+{
+	struct trace_inode *ti;
+	unsigned int k = ino % HASH_TABLE_SIZE;
+
+	for (ti = inodes[k]; ti; ti = ti->next)
+		if (ti->ino == ino)
+			return ti;
+
+	ti = xzalloc(sizeof(struct trace_inode));
+	ti->ino = ino;
+	ti->next = inodes[k];
+	inodes[k] = ti;
+	return ti;
+}
+
+static int read_inode_list(void)
+{
+	char *line = NULL, *p;
+	size_t line_sz = 0;
+	unsigned long ino;
+	ssize_t len;
+	FILE *fp;
+	int err = 0;
+
+	fp = fopen(inode_list, "r");
+	if (!fp)
+		return sys_errmsg("cannot open inode list '%s'", inode_list);
+
+	while ((len = getline(&line, &line_sz, fp)) != -1) {
+		struct trace_inode *ti;
+
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		ino = strtoul(line, &p, 10);
+		if (p == line || !isspace(*p))
+			continue;
+		while (isspace(*p))
+			p++;
+		if (!*p)
+			continue;
+
+		/* The first path of a hard linked inode is enough */
+		ti = lookup_inode(ino);
+		if (!ti->path)
+			ti->path = xstrdup(p);
+	}
+
+	if (ferror(fp))
+		err = sys_errmsg("cannot read inode list '%s'", inode_list);
+	free(line);
+	fclose(fp);
+	return err;
+}
+
+/*
+ * Parse a line of the trace. The event looks like
+ *
+ *   ... mm_filemap_add_to_page_cache: dev 254:0 ino 1a2b page=... pfn=0x1234 ofs=8192 [order=2]
+ *
+ * where the inode number is hexadecimal and the offset is in bytes.
+ */
+static int parse_event(const char *line, unsigned long *ino,
+		       unsigned long long *offs, unsigned int *order)
+{
+	const char *p;
+	int major, minor;
+
+	p = strstr(line, "mm_filemap_add_to_page_cache:");
+	if (!p)
+		return -1;
+
+	p = strstr(p, " dev ");
+	if (!p || sscanf(p, " dev %d:%d ino %lx", &major, &minor, ino) != 3)
+		return -1;
+	if (dev_major != -1 && (major != dev_major || minor != dev_minor))
+		return -1;
+
+	p = strstr(p, " ofs=");
+	if (!p || sscanf(p, " ofs=%llu", offs) != 1)
+		return -1;
+
+	*order = 0;
+	p = strstr(p, " order=");
+	if (p && sscanf(p, " order=%u", order) != 1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Mark blocks @first to @last of an inode listed and return the number of
+ * blocks which were not listed before.
+ */
+static unsigned long long mark_blocks(struct trace_inode *ti,
+				      unsigned long long first,
+				      unsigned long long last)
+{
+	unsigned long long i, cnt = 0;
+
+	if (last >= ti->max_block) {
+		unsigned long long max = ti->max_block ? ti->max_block : 64;
+
+		while (last >= max)
+			max *= 2;
+		ti->blocks = xrealloc(ti->blocks, max / 8);
+		memset(ti->blocks + ti->max_block / 8, 0,
+		       (max - ti->max_block) / 8);
+		ti->max_block = max;
+	}
+
+	for (i = first; i <= last; i++) {
+		if (ti->blocks[i / 8] & (1 << (i % 8)))
+			continue;
+		ti->blocks[i / 8] |= 1 << (i % 8);
+		cnt += 1;
+	}
+
+	return cnt;
+}
+
+static void print_range(const struct trace_inode *ti,
+			unsigned long long first, unsigned long long last)
+{
+	if (first == last)
+		printf("%s\t%llu\n", ti->path, first);
+	else
+		printf("%s\t%llu-%llu\n", ti->path, first, last);
+}
+
+static int process_trace(void)
+{
+	struct trace_inode *cur = NULL;
+	unsigned long long cur_first = 0, cur_last = 0;
+	unsigned long long events = 0, unknown = 0;
+	char *line = NULL;
+	size_t line_sz = 0;
+	FILE *fp = stdin;
+	int err = 0;
+
+	if (trace_file) {
+		fp = fopen(trace_file, "r");
+		if (!fp)
+			return sys_errmsg("cannot open trace '%s'", trace_file);
+	}
+
+	while (getline(&line, &line_sz, fp) != -1) {
+		struct trace_inode *ti;
+		unsigned long long offs, first, last;
+		unsigned long ino;
+		unsigned int order;
+
+		if (parse_event(line, &ino, &offs, &order))
+			continue;
+		events += 1;
+
+		ti = lookup_inode(ino);
+		if (!ti->path) {
+			unknown += 1;
+			continue;
+		}
+
+		first = offs / BLOCK_SIZE;
+		last = (offs + ((unsigned long long)page_size << order) - 1) /
+		       BLOCK_SIZE;
+		if (!mark_blocks(ti, first, last))
+			continue;
+
+		/* Extend the current range if the read continues it */
+		if (ti == cur && first <= cur_last + 1 && last >= cur_first) {
+			if (first < cur_first)
+				cur_first = first;
+			if (last > cur_last)
+				cur_last = last;
+			continue;
+		}
+
+		if (cur)
+			print_range(cur, cur_first, cur_last);
+		cur = ti;
+		cur_first = first;
+		cur_last = last;
+	}
+	if (cur)
+		print_range(cur, cur_first, cur_last);
+
+	if (ferror(fp))
+		err = sys_errmsg("cannot read trace '%s'",
+				 trace_file ? trace_file : "stdin");
+	else if (!events)
+		warnmsg("no mm_filemap_add_to_page_cache events found");
+	else if (unknown)
+		warnmsg("%llu of %llu pages belong to inodes missing from the inode list",
+			unknown, events);
+
+	free(line);
+	if (trace_file)
+		fclose(fp);
+	return err;
+}
+
+static void free_inodes(void)
+{
+	int i;
+
+	for (i = 0; i < HASH_TABLE_SIZE; i++) {
+		struct trace_inode *ti, *q;
+
+		for (ti = inodes[i]; ti; ) {
+			q = ti;
+			ti = ti->next;
+			free(q->path);
+			free(q->blocks);
+			free(q);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int err;
+
+	err = get_options(argc, argv);
+	if (err)
+		return EXIT_FAILURE;
+
+	err = read_inode_list();
+	if (!err)
+		err = process_trace();
+
+	free_inodes();
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}